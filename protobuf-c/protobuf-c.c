@@ -85,6 +85,67 @@
 # define PROTOBUF_C_UNPACK_ERROR(...)
 #endif
 
+/*
+ * GCC and clang can take the address of a label, so the generic pack and
+ * unpack loops jump straight to the handler for a field's type from a table
+ * built in the function. Define PROTOBUF_C_NO_COMPUTED_GOTO to build them
+ * with a switch instead.
+ */
+#if defined(__GNUC__) && !defined(PROTOBUF_C_NO_COMPUTED_GOTO)
+# define PROTOBUF_C_COMPUTED_GOTO 1
+#else
+# define PROTOBUF_C_COMPUTED_GOTO 0
+#endif
+
+/**
+ * Declare `name`, the table of handlers `prefix`_<type> for each
+ * `ProtobufCType`, in the order of the enum. Every handler label must exist
+ * in the function, even if several of them share the same code.
+ */
+#if PROTOBUF_C_COMPUTED_GOTO
+# define TYPE_DISPATCH_TABLE(name, prefix) \
+	static const void *const name[] = { \
+		&&prefix##_int32, &&prefix##_sint32, &&prefix##_sfixed32, \
+		&&prefix##_int64, &&prefix##_sint64, &&prefix##_sfixed64, \
+		&&prefix##_uint32, &&prefix##_fixed32, &&prefix##_uint64, \
+		&&prefix##_fixed64, &&prefix##_float, &&prefix##_double, \
+		&&prefix##_bool, &&prefix##_enum, &&prefix##_string, \
+		&&prefix##_bytes, &&prefix##_message, \
+	}
+#else
+# define TYPE_DISPATCH_TABLE(name, prefix)
+#endif
+
+/**
+ * Jump to the handler in `name`, declared with TYPE_DISPATCH_TABLE(), for
+ * field type `type`.
+ */
+#if PROTOBUF_C_COMPUTED_GOTO
+# define TYPE_DISPATCH(name, prefix, type) goto *name[(type)]
+#else
+# define TYPE_DISPATCH(name, prefix, type) \
+	switch (type) { \
+	case PROTOBUF_C_TYPE_INT32: goto prefix##_int32; \
+	case PROTOBUF_C_TYPE_SINT32: goto prefix##_sint32; \
+	case PROTOBUF_C_TYPE_SFIXED32: goto prefix##_sfixed32; \
+	case PROTOBUF_C_TYPE_INT64: goto prefix##_int64; \
+	case PROTOBUF_C_TYPE_SINT64: goto prefix##_sint64; \
+	case PROTOBUF_C_TYPE_SFIXED64: goto prefix##_sfixed64; \
+	case PROTOBUF_C_TYPE_UINT32: goto prefix##_uint32; \
+	case PROTOBUF_C_TYPE_FIXED32: goto prefix##_fixed32; \
+	case PROTOBUF_C_TYPE_UINT64: goto prefix##_uint64; \
+	case PROTOBUF_C_TYPE_FIXED64: goto prefix##_fixed64; \
+	case PROTOBUF_C_TYPE_FLOAT: goto prefix##_float; \
+	case PROTOBUF_C_TYPE_DOUBLE: goto prefix##_double; \
+	case PROTOBUF_C_TYPE_BOOL: goto prefix##_bool; \
+	case PROTOBUF_C_TYPE_ENUM: goto prefix##_enum; \
+	case PROTOBUF_C_TYPE_STRING: goto prefix##_string; \
+	case PROTOBUF_C_TYPE_BYTES: goto prefix##_bytes; \
+	case PROTOBUF_C_TYPE_MESSAGE: goto prefix##_message; \
+	default: PROTOBUF_C__ASSERT_NOT_REACHED(); \
+	}
+#endif
+
 const char protobuf_c_empty_string[] = "";
 
 /**
@@ -184,6 +245,33 @@ static ProtobufCAllocator protobuf_c__allocator = {
 
 /* === buffer-simple === */
 
+/**
+ * Make room for `new_len` bytes in a `ProtobufCBufferSimple`.
+ */
+static protobuf_c_boolean
+buffer_simple_grow(ProtobufCBufferSimple *simp, size_t new_len)
+{
+	ProtobufCAllocator *allocator = simp->allocator;
+	size_t new_alloced = simp->alloced * 2;
+	uint8_t *new_data;
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	while (new_alloced < new_len)
+		new_alloced += new_alloced;
+	new_data = do_alloc(allocator, new_alloced);
+	if (!new_data)
+		return FALSE;
+	memcpy(new_data, simp->data, simp->len);
+	if (simp->must_free_data)
+		do_free(allocator, simp->data);
+	else
+		simp->must_free_data = TRUE;
+	simp->data = new_data;
+	simp->alloced = new_alloced;
+	return TRUE;
+}
+
 void
 protobuf_c_buffer_simple_append(ProtobufCBuffer *buffer,
 				size_t len, const uint8_t *data)
@@ -191,971 +279,933 @@ protobuf_c_buffer_simple_append(ProtobufCBuffer *buffer,
 	ProtobufCBufferSimple *simp = (ProtobufCBufferSimple *) buffer;
 	size_t new_len = simp->len + len;
 
-	if (new_len > simp->alloced) {
-		ProtobufCAllocator *allocator = simp->allocator;
-		size_t new_alloced = simp->alloced * 2;
-		uint8_t *new_data;
-
-		if (allocator == NULL)
-			allocator = &protobuf_c__allocator;
-		while (new_alloced < new_len)
-			new_alloced += new_alloced;
-		new_data = do_alloc(allocator, new_alloced);
-		if (!new_data)
-			return;
-		memcpy(new_data, simp->data, simp->len);
-		if (simp->must_free_data)
-			do_free(allocator, simp->data);
-		else
-			simp->must_free_data = TRUE;
-		simp->data = new_data;
-		simp->alloced = new_alloced;
-	}
+	if (new_len > simp->alloced && !buffer_simple_grow(simp, new_len))
+		return;
 	memcpy(simp->data + simp->len, data, len);
 	simp->len = new_len;
 }
 
-/**
- * \defgroup packedsz protobuf_c_message_get_packed_size() implementation
- *
- * Routines mainly used by protobuf_c_message_get_packed_size().
- *
- * \ingroup internal
- * @{
- */
+/* === buffer-direct === */
 
-/**
- * Return the number of bytes required to store the tag for the field. Includes
- * 3 bits for the wire-type, and a single bit that denotes the end-of-tag.
- *
- * \param number
- *      Field tag to encode.
- * \return
- *      Number of bytes required.
- */
-static inline size_t
-get_tag_size(uint32_t number)
+void
+protobuf_c_buffer_direct_append(ProtobufCBuffer *buffer,
+				size_t len, const uint8_t *data)
 {
-	if (number < (1UL << 4)) {
-		return 1;
-	} else if (number < (1UL << 11)) {
-		return 2;
-	} else if (number < (1UL << 18)) {
-		return 3;
-	} else if (number < (1UL << 25)) {
-		return 4;
-	} else {
-		return 5;
+	ProtobufCBufferDirect *direct = (ProtobufCBufferDirect *) buffer;
+	uint8_t *out = direct->reserve(direct, len);
+
+	if (out == NULL) {
+		direct->failed = TRUE;
+		return;
 	}
+	memcpy(out, data, len);
+	direct->commit(direct, len);
 }
 
 /**
- * Return the number of bytes required to store a variable-length unsigned
- * 32-bit integer in base-128 varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
+ * Return room for `len` contiguous bytes at the end of a virtual buffer, or
+ * NULL if the buffer can only be appended to.
  */
-static inline size_t
-uint32_size(uint32_t v)
+static inline uint8_t *
+buffer_reserve(ProtobufCBuffer *buffer, size_t len)
 {
-	if (v < (1UL << 7)) {
-		return 1;
-	} else if (v < (1UL << 14)) {
-		return 2;
-	} else if (v < (1UL << 21)) {
-		return 3;
-	} else if (v < (1UL << 28)) {
-		return 4;
-	} else {
-		return 5;
+	if (buffer->append == protobuf_c_buffer_simple_append) {
+		ProtobufCBufferSimple *simp = (ProtobufCBufferSimple *) buffer;
+
+		if (len > simp->alloced - simp->len &&
+		    !buffer_simple_grow(simp, simp->len + len))
+			return NULL;
+		return simp->data + simp->len;
+	}
+	if (buffer->append == protobuf_c_buffer_direct_append) {
+		ProtobufCBufferDirect *direct = (ProtobufCBufferDirect *) buffer;
+		return direct->reserve(direct, len);
 	}
+	return NULL;
 }
 
 /**
- * Return the number of bytes required to store a variable-length signed 32-bit
- * integer in base-128 varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
+ * Consume the first `len` bytes of the room returned by buffer_reserve().
  */
-static inline size_t
-int32_size(int32_t v)
+static inline void
+buffer_commit(ProtobufCBuffer *buffer, size_t len)
 {
-	if (v < 0) {
-		return 10;
-	} else if (v < (1L << 7)) {
-		return 1;
-	} else if (v < (1L << 14)) {
-		return 2;
-	} else if (v < (1L << 21)) {
-		return 3;
-	} else if (v < (1L << 28)) {
-		return 4;
+	if (buffer->append == protobuf_c_buffer_simple_append) {
+		((ProtobufCBufferSimple *) buffer)->len += len;
 	} else {
-		return 5;
+		ProtobufCBufferDirect *direct = (ProtobufCBufferDirect *) buffer;
+		direct->commit(direct, len);
 	}
 }
 
-/**
- * Return the ZigZag-encoded 32-bit unsigned integer form of a 32-bit signed
- * integer.
- *
- * \param v
- *      Value to encode.
- * \return
- *      ZigZag encoded integer.
- */
-static inline uint32_t
-zigzag32(int32_t v)
+/* === buffer-segmented === */
+
+/** Size of the first segment a `ProtobufCBufferSegmented` allocates. */
+#define SEGMENT_MIN_SIZE		4096
+
+/** Segment sizes stop doubling once they reach this size. */
+#define SEGMENT_MAX_SIZE		(1024 * 1024)
+
+/** Room worth carrying over past a referenced segment. */
+#define SEGMENT_MIN_CARRY		64
+
+struct ProtobufCBufferSegment {
+	/** Next segment in the chain. */
+	ProtobufCBufferSegment	*next;
+	/** First byte, following the header unless the segment is a reference. */
+	uint8_t			*data;
+	/** Number of bytes stored. */
+	size_t			len;
+	/** Number of bytes `data` has room for. `len` for references. */
+	size_t			size;
+};
+
+static ProtobufCAllocator *
+buffer_segmented_allocator(const ProtobufCBufferSegmented *seg)
 {
-	if (v < 0)
-		return (-(uint32_t)v) * 2 - 1;
+	return seg->allocator != NULL ? seg->allocator : &protobuf_c__allocator;
+}
+
+static ProtobufCBufferSegment *
+buffer_segmented_add(ProtobufCBufferSegmented *seg, size_t size)
+{
+	ProtobufCBufferSegment *segment;
+
+	if (size > SIZE_MAX - sizeof(*segment))
+		return NULL;
+	segment = do_alloc(buffer_segmented_allocator(seg),
+			   sizeof(*segment) + size);
+	if (segment == NULL)
+		return NULL;
+	segment->next = NULL;
+	segment->data = (uint8_t *) (segment + 1);
+	segment->len = 0;
+	segment->size = size;
+	if (seg->last != NULL)
+		seg->last->next = segment;
 	else
-		return (uint32_t)(v) * 2;
+		seg->first = segment;
+	seg->last = segment;
+	seg->n_segments++;
+	return segment;
 }
 
-/**
- * Return the number of bytes required to store a signed 32-bit integer,
- * converted to an unsigned 32-bit integer with ZigZag encoding, using base-128
- * varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
- */
-static inline size_t
-sint32_size(int32_t v)
+static uint8_t *
+buffer_segmented_reserve(ProtobufCBufferDirect *buffer, size_t len)
 {
-	return uint32_size(zigzag32(v));
+	ProtobufCBufferSegmented *seg = (ProtobufCBufferSegmented *) buffer;
+	ProtobufCBufferSegment *last = seg->last;
+	size_t size;
+
+	if (last != NULL && len <= last->size - last->len)
+		return last->data + last->len;
+
+	/* Start a new segment, leaving whatever is left of the last one. */
+	size = seg->next_segment_size;
+	if (size < len)
+		size = len;
+	last = buffer_segmented_add(seg, size);
+	if (last == NULL)
+		return NULL;
+	if (seg->next_segment_size < SEGMENT_MAX_SIZE)
+		seg->next_segment_size *= 2;
+	return last->data;
 }
 
 /**
- * Return the number of bytes required to store a 64-bit unsigned integer in
- * base-128 varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
+ * Append `len` bytes to a segmented buffer by reference. Whatever room is
+ * left in the last segment is carried over to a segment after the reference.
  */
-static inline size_t
-uint64_size(uint64_t v)
+static protobuf_c_boolean
+buffer_segmented_append_ref(ProtobufCBufferSegmented *seg,
+			    size_t len, const uint8_t *data)
 {
-	uint32_t upper_v = (uint32_t) (v >> 32);
+	ProtobufCBufferSegment *prev = seg->last;
+	ProtobufCBufferSegment *ref = buffer_segmented_add(seg, 0);
 
-	if (upper_v == 0) {
-		return uint32_size((uint32_t) v);
-	} else if (upper_v < (1UL << 3)) {
-		return 5;
-	} else if (upper_v < (1UL << 10)) {
-		return 6;
-	} else if (upper_v < (1UL << 17)) {
-		return 7;
-	} else if (upper_v < (1UL << 24)) {
-		return 8;
-	} else if (upper_v < (1UL << 31)) {
-		return 9;
-	} else {
-		return 10;
+	if (ref == NULL)
+		return FALSE;
+	ref->data = (uint8_t *) data;
+	ref->len = len;
+	ref->size = len;
+	seg->len += len;
+
+	if (prev != NULL && prev->size - prev->len >= SEGMENT_MIN_CARRY) {
+		ProtobufCBufferSegment *rest = buffer_segmented_add(seg, 0);
+
+		/* If this fails, the next reserve starts a fresh segment. */
+		if (rest != NULL) {
+			rest->data = prev->data + prev->len;
+			rest->size = prev->size - prev->len;
+			prev->size = prev->len;
+		}
 	}
+	return TRUE;
 }
 
 /**
- * Return the ZigZag-encoded 64-bit unsigned integer form of a 64-bit signed
- * integer.
- *
- * \param v
- *      Value to encode.
- * \return
- *      ZigZag encoded integer.
+ * Append data that the caller guarantees to outlive the buffer. Buffers that
+ * can reference data instead of copying it do so above their threshold.
  */
-static inline uint64_t
-zigzag64(int64_t v)
+static inline void
+buffer_append_data(ProtobufCBuffer *buffer, size_t len, const uint8_t *data)
 {
-	if (v < 0)
-		return (-(uint64_t)v) * 2 - 1;
-	else
-		return (uint64_t)(v) * 2;
+	if (buffer->append == protobuf_c_buffer_direct_append &&
+	    ((ProtobufCBufferDirect *) buffer)->reserve ==
+		buffer_segmented_reserve)
+	{
+		ProtobufCBufferSegmented *seg = (ProtobufCBufferSegmented *) buffer;
+
+		if (seg->ref_threshold != 0 && len >= seg->ref_threshold &&
+		    buffer_segmented_append_ref(seg, len, data))
+			return;
+	}
+	buffer->append(buffer, len, data);
 }
 
 /**
- * Return the number of bytes required to store a signed 64-bit integer,
- * converted to an unsigned 64-bit integer with ZigZag encoding, using base-128
- * varint encoding.
- *
- * \param v
- *      Value to encode.
- * \return
- *      Number of bytes required.
+ * Return the size from which a virtual buffer references data instead of
+ * copying it, or 0 if it always copies.
  */
 static inline size_t
-sint64_size(int64_t v)
+buffer_ref_threshold(const ProtobufCBuffer *buffer)
 {
-	return uint64_size(zigzag64(v));
+	if (buffer->append == protobuf_c_buffer_direct_append &&
+	    ((const ProtobufCBufferDirect *) buffer)->reserve ==
+		buffer_segmented_reserve)
+		return ((const ProtobufCBufferSegmented *) buffer)->ref_threshold;
+	return 0;
 }
 
-/**
- * Calculate the serialized size of a single required message field, including
- * the space needed by the preceding tag.
- *
- * \param field
- *      Field descriptor for member.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
- */
-static size_t
-required_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			       const void *member)
+static void
+buffer_segmented_commit(ProtobufCBufferDirect *buffer, size_t len)
 {
-	size_t rv = get_tag_size(field->id);
+	ProtobufCBufferSegmented *seg = (ProtobufCBufferSegmented *) buffer;
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SINT32:
-		return rv + sint32_size(*(const int32_t *) member);
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		return rv + int32_size(*(const int32_t *) member);
-	case PROTOBUF_C_TYPE_UINT32:
-		return rv + uint32_size(*(const uint32_t *) member);
-	case PROTOBUF_C_TYPE_SINT64:
-		return rv + sint64_size(*(const int64_t *) member);
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		return rv + uint64_size(*(const uint64_t *) member);
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-		return rv + 4;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-		return rv + 8;
-	case PROTOBUF_C_TYPE_BOOL:
-		return rv + 1;
-	case PROTOBUF_C_TYPE_FLOAT:
-		return rv + 4;
-	case PROTOBUF_C_TYPE_DOUBLE:
-		return rv + 8;
-	case PROTOBUF_C_TYPE_STRING: {
-		const char *str = *(char * const *) member;
-		size_t len = str ? strlen(str) : 0;
-		return rv + uint32_size(len) + len;
-	}
-	case PROTOBUF_C_TYPE_BYTES: {
-		size_t len = ((const ProtobufCBinaryData *) member)->len;
-		return rv + uint32_size(len) + len;
+	seg->last->len += len;
+	seg->len += len;
+}
+
+void
+protobuf_c_buffer_segmented_init(ProtobufCBufferSegmented *buffer,
+				 ProtobufCAllocator *allocator)
+{
+	buffer->base.base.append = protobuf_c_buffer_direct_append;
+	buffer->base.reserve = buffer_segmented_reserve;
+	buffer->base.commit = buffer_segmented_commit;
+	buffer->base.failed = FALSE;
+	buffer->allocator = allocator;
+	buffer->first = NULL;
+	buffer->last = NULL;
+	buffer->n_segments = 0;
+	buffer->len = 0;
+	buffer->next_segment_size = SEGMENT_MIN_SIZE;
+	buffer->ref_threshold = 0;
+}
+
+size_t
+protobuf_c_buffer_segmented_get_iovec(const ProtobufCBufferSegmented *buffer,
+				      ProtobufCIoVec *iov, size_t n_iov)
+{
+	const ProtobufCBufferSegment *segment = buffer->first;
+	size_t i;
+
+	for (i = 0; i < n_iov && segment != NULL; i++) {
+		iov[i].base = segment->data;
+		iov[i].len = segment->len;
+		segment = segment->next;
 	}
-	case PROTOBUF_C_TYPE_MESSAGE: {
-		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
-		size_t subrv = msg ? protobuf_c_message_get_packed_size(msg) : 0;
-		return rv + uint32_size(subrv) + subrv;
+	return buffer->n_segments;
+}
+
+size_t
+protobuf_c_buffer_segmented_flatten(const ProtobufCBufferSegmented *buffer,
+				    uint8_t *out)
+{
+	const ProtobufCBufferSegment *segment;
+	size_t rv = 0;
+
+	for (segment = buffer->first; segment != NULL; segment = segment->next) {
+		memcpy(out + rv, segment->data, segment->len);
+		rv += segment->len;
 	}
+	return rv;
+}
+
+void
+protobuf_c_buffer_segmented_clear(ProtobufCBufferSegmented *buffer)
+{
+	ProtobufCAllocator *allocator = buffer_segmented_allocator(buffer);
+	ProtobufCBufferSegment *segment = buffer->first;
+
+	while (segment != NULL) {
+		ProtobufCBufferSegment *next = segment->next;
+		do_free(allocator, segment);
+		segment = next;
 	}
-	PROTOBUF_C__ASSERT_NOT_REACHED();
-	return 0;
+	buffer->first = NULL;
+	buffer->last = NULL;
+	buffer->n_segments = 0;
+	buffer->len = 0;
+	buffer->next_segment_size = SEGMENT_MIN_SIZE;
 }
 
-/**
- * Calculate the serialized size of a single oneof message field, including
- * the space needed by the preceding tag. Returns 0 if the oneof field isn't
- * selected or is not set.
- *
- * \param field
- *      Field descriptor for member.
- * \param oneof_case
- *      Enum value that selects the field in the oneof.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
- */
-static size_t
-oneof_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			    uint32_t oneof_case,
-			    const void *member)
+/* === arena === */
+
+/** Size of the first block a `ProtobufCArena` requests from its parent. */
+#define ARENA_MIN_BLOCK_SIZE		4096
+
+/** Block sizes stop doubling once they reach this size. */
+#define ARENA_MAX_BLOCK_SIZE		(1024 * 1024)
+
+/** Types whose alignment every arena allocation must satisfy. */
+union arena_align {
+	uint64_t	u64;
+	double		d;
+	void		*p;
+	size_t		sz;
+};
+
+#define ARENA_ALIGNMENT			sizeof(union arena_align)
+
+#define ARENA_ALIGN(n) \
+	(((n) + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1))
+
+struct ProtobufCArenaBlock {
+	/** Next (older) block in the chain. */
+	ProtobufCArenaBlock	*next;
+	/** Number of usable bytes following the block header. */
+	size_t			size;
+};
+
+#define ARENA_BLOCK_HEADER_SIZE		ARENA_ALIGN(sizeof(ProtobufCArenaBlock))
+
+#define ARENA_BLOCK_DATA(block) \
+	((uint8_t *) (block) + ARENA_BLOCK_HEADER_SIZE)
+
+static ProtobufCArenaBlock *
+arena_new_block(ProtobufCArena *arena, size_t size)
 {
-	if (oneof_case != field->id) {
-		return 0;
+	ProtobufCAllocator *parent = arena->parent;
+	ProtobufCArenaBlock *block;
+
+	if (parent == NULL)
+		parent = &protobuf_c__allocator;
+	if (size > SIZE_MAX - ARENA_BLOCK_HEADER_SIZE)
+		return NULL;
+	block = do_alloc(parent, ARENA_BLOCK_HEADER_SIZE + size);
+	if (block == NULL)
+		return NULL;
+	block->next = NULL;
+	block->size = size;
+	return block;
+}
+
+static void
+arena_free_blocks(ProtobufCArena *arena, ProtobufCArenaBlock *block)
+{
+	ProtobufCAllocator *parent = arena->parent;
+
+	if (parent == NULL)
+		parent = &protobuf_c__allocator;
+	while (block != NULL) {
+		ProtobufCArenaBlock *next = block->next;
+		do_free(parent, block);
+		block = next;
 	}
-	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
-	    field->type == PROTOBUF_C_TYPE_STRING)
+}
+
+static void
+arena_use_initial_block(ProtobufCArena *arena)
+{
+	uintptr_t start = (uintptr_t) arena->initial_block;
+	uintptr_t aligned = ARENA_ALIGN(start);
+
+	if (arena->initial_block == NULL ||
+	    aligned - start >= arena->initial_size)
 	{
-		const void *ptr = *(const void * const *) member;
-		if (ptr == NULL || ptr == field->default_value)
-			return 0;
+		arena->pos = NULL;
+		arena->end = NULL;
+		return;
+	}
+	arena->pos = arena->initial_block + (aligned - start);
+	arena->end = arena->initial_block + arena->initial_size;
+}
+
+static void *
+arena_alloc(void *allocator_data, size_t size)
+{
+	ProtobufCArena *arena = allocator_data;
+	ProtobufCArenaBlock *block;
+	uint8_t *rv;
+
+	if (size > SIZE_MAX - ARENA_ALIGNMENT)
+		return NULL;
+	size = size == 0 ? ARENA_ALIGNMENT : ARENA_ALIGN(size);
+
+	if ((size_t) (arena->end - arena->pos) >= size) {
+		rv = arena->pos;
+		arena->pos += size;
+		return rv;
+	}
+
+	/*
+	 * Give large requests a block of their own, so that the rest of the
+	 * current block doesn't go to waste. It is linked in behind the
+	 * current block.
+	 */
+	if (size > arena->next_block_size / 4) {
+		block = arena_new_block(arena, size);
+		if (block == NULL)
+			return NULL;
+		if (arena->blocks != NULL) {
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			arena->blocks = block;
+		}
+		return ARENA_BLOCK_DATA(block);
+	}
+
+	block = arena_new_block(arena, arena->next_block_size);
+	if (block == NULL)
+		return NULL;
+	block->next = arena->blocks;
+	arena->blocks = block;
+	if (arena->next_block_size < ARENA_MAX_BLOCK_SIZE)
+		arena->next_block_size *= 2;
+
+	rv = ARENA_BLOCK_DATA(block);
+	arena->pos = rv + size;
+	arena->end = rv + block->size;
+	return rv;
+}
+
+static void
+arena_free(void *allocator_data, void *data)
+{
+	/* Arena memory is only given back by resetting the arena. */
+	(void) allocator_data;
+	(void) data;
+}
+
+void
+protobuf_c_arena_init(ProtobufCArena *arena,
+		      void *initial_block,
+		      size_t initial_size,
+		      ProtobufCAllocator *parent)
+{
+	arena->base.alloc = &arena_alloc;
+	arena->base.free = &arena_free;
+	arena->base.allocator_data = arena;
+	arena->parent = parent;
+	arena->initial_block = initial_block;
+	arena->initial_size = initial_block != NULL ? initial_size : 0;
+	arena->blocks = NULL;
+	arena->next_block_size = ARENA_MIN_BLOCK_SIZE;
+	arena_use_initial_block(arena);
+}
+
+void
+protobuf_c_arena_reset(ProtobufCArena *arena)
+{
+	ProtobufCArenaBlock *block = arena->blocks;
+
+	/*
+	 * Until the first regular block is needed, allocations are carved out
+	 * of the initial block, and the head of the chain, if any, is a block
+	 * given to a single large request. Drop it and go back to the initial
+	 * block.
+	 */
+	if (block == NULL ||
+	    arena->end != ARENA_BLOCK_DATA(block) + block->size)
+	{
+		arena_free_blocks(arena, block);
+		arena->blocks = NULL;
+		arena_use_initial_block(arena);
+		return;
 	}
-	return required_field_get_packed_size(field, member);
+
+	/* Keep the block currently being carved up for the next round. */
+	arena_free_blocks(arena, block->next);
+	block->next = NULL;
+	arena->pos = ARENA_BLOCK_DATA(block);
+	arena->end = arena->pos + block->size;
+}
+
+void
+protobuf_c_arena_destroy(ProtobufCArena *arena)
+{
+	arena_free_blocks(arena, arena->blocks);
+	arena->blocks = NULL;
+	arena->next_block_size = ARENA_MIN_BLOCK_SIZE;
+	arena_use_initial_block(arena);
 }
 
+/*
+ * Messages unpacked with PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS are preceded by a
+ * hidden header pointing to their payload arena, or NULL if they have no
+ * payload. The arena lives at the start of its own initial block, which in
+ * turn is laid out like an arena block so that it can be handed over to
+ * another message's arena when messages are merged.
+ */
+#define CONTIGUOUS_HEADER_SIZE		ARENA_ALIGN(sizeof(ProtobufCArena *))
+
+#define CONTIGUOUS_PAYLOAD(message) \
+	(*(ProtobufCArena **) ((uint8_t *) (message) - CONTIGUOUS_HEADER_SIZE))
+
+#define CONTIGUOUS_ARENA_OFFSET \
+	(ARENA_BLOCK_HEADER_SIZE + ARENA_ALIGN(sizeof(ProtobufCArena)))
+
+#define CONTIGUOUS_ARENA_BLOCK(arena) \
+	((ProtobufCArenaBlock *) ((uint8_t *) (arena) - ARENA_BLOCK_HEADER_SIZE))
+
 /**
- * Calculate the serialized size of a single optional message field, including
- * the space needed by the preceding tag. Returns 0 if the optional field isn't
- * set.
- *
- * \param field
- *      Field descriptor for member.
- * \param has
- *      True if the field exists, false if not.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
+ * Allocate a payload arena whose initial block holds exactly `size` bytes.
  */
-static size_t
-optional_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			       const protobuf_c_boolean has,
-			       const void *member)
+static ProtobufCArena *
+contiguous_payload_new(ProtobufCAllocator *allocator, size_t size)
 {
-	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
-	    field->type == PROTOBUF_C_TYPE_STRING)
-	{
-		const void *ptr = *(const void * const *) member;
-		if (ptr == NULL || ptr == field->default_value)
-			return 0;
+	ProtobufCArenaBlock *block;
+	ProtobufCArena *arena;
+
+	if (size > SIZE_MAX - CONTIGUOUS_ARENA_OFFSET)
+		return NULL;
+	block = do_alloc(allocator, CONTIGUOUS_ARENA_OFFSET + size);
+	if (block == NULL)
+		return NULL;
+	block->next = NULL;
+	block->size = CONTIGUOUS_ARENA_OFFSET - ARENA_BLOCK_HEADER_SIZE + size;
+	arena = (ProtobufCArena *) ARENA_BLOCK_DATA(block);
+	protobuf_c_arena_init(arena, (uint8_t *) block + CONTIGUOUS_ARENA_OFFSET,
+			      size, allocator);
+	return arena;
+}
+
+static void
+contiguous_payload_free(ProtobufCArena *arena)
+{
+	ProtobufCAllocator *allocator = arena->parent;
+
+	protobuf_c_arena_destroy(arena);
+	do_free(allocator, CONTIGUOUS_ARENA_BLOCK(arena));
+}
+
+/**
+ * Make `into` responsible for all the memory held by `from`, so that payloads
+ * can be moved between the two. `from` must not be used afterwards.
+ */
+static void
+contiguous_payload_splice(ProtobufCArena *into, ProtobufCArena *from)
+{
+	ProtobufCArenaBlock *head = CONTIGUOUS_ARENA_BLOCK(from);
+	ProtobufCArenaBlock *tail = head;
+
+	head->next = from->blocks;
+	while (tail->next != NULL)
+		tail = tail->next;
+
+	/* Keep the block `into` is carving up at the front. */
+	if (into->blocks != NULL) {
+		tail->next = into->blocks->next;
+		into->blocks->next = head;
 	} else {
-		if (!has)
-			return 0;
+		into->blocks = head;
 	}
-	return required_field_get_packed_size(field, member);
 }
 
-static protobuf_c_boolean
-field_is_zeroish(const ProtobufCFieldDescriptor *field,
-		 const void *member)
+/**
+ * Return the label of field `f` of `desc`, read from the hot field table if
+ * there is one.
+ */
+static inline ProtobufCLabel
+field_label(const ProtobufCMessageDescriptor *desc, unsigned f)
 {
-	protobuf_c_boolean ret = FALSE;
+	if (desc->hot_fields != NULL)
+		return (ProtobufCLabel) desc->hot_fields[f].label;
+	return desc->fields[f].label;
+}
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_BOOL:
-		ret = (0 == *(const protobuf_c_boolean *) member);
-		break;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_SINT32:
-	case PROTOBUF_C_TYPE_INT32:
-	case PROTOBUF_C_TYPE_UINT32:
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-		ret = (0 == *(const uint32_t *) member);
-		break;
-	case PROTOBUF_C_TYPE_SINT64:
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-		ret = (0 == *(const uint64_t *) member);
-		break;
-	case PROTOBUF_C_TYPE_FLOAT:
-		ret = (0 == *(const float *) member);
-		break;
-	case PROTOBUF_C_TYPE_DOUBLE:
-		ret = (0 == *(const double *) member);
-		break;
+/**
+ * Return the hot members of field `f` of `desc`: its entry in the hot field
+ * table, or a copy made in `tmp` for descriptors without one.
+ */
+static inline const ProtobufCFieldHot *
+hot_field(const ProtobufCMessageDescriptor *desc, unsigned f,
+	  ProtobufCFieldHot *tmp)
+{
+	const ProtobufCFieldDescriptor *field;
+
+	if (desc->hot_fields != NULL)
+		return desc->hot_fields + f;
+	field = desc->fields + f;
+	tmp->id = field->id;
+	tmp->offset = field->offset;
+	tmp->quantifier_offset = field->quantifier_offset;
+	tmp->label = field->label;
+	tmp->type = field->type;
+	tmp->flags = field->flags;
+	return tmp;
+}
+
+/**
+ * Return FALSE if an optional field, not part of a oneof, is certainly not
+ * packed: it is a pointer that is NULL or a value whose `has_` is not set.
+ */
+static inline protobuf_c_boolean
+hot_optional_is_set(const ProtobufCFieldHot *hot,
+		    const void *member, const void *qmember)
+{
+	if (hot->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    hot->type == PROTOBUF_C_TYPE_STRING)
+		return *(const void * const *) member != NULL;
+	return *(const protobuf_c_boolean *) qmember;
+}
+
+/**
+ * Return TRUE if freeing the message may have to free something through the
+ * field: an array, a string, bytes or a submessage.
+ */
+static inline protobuf_c_boolean
+hot_field_holds_memory(const ProtobufCFieldHot *hot,
+		       const ProtobufCMessage *message)
+{
+	if ((hot->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
+	    STRUCT_MEMBER(uint32_t, message, hot->quantifier_offset) != hot->id)
+		return FALSE;
+	if (hot->label == PROTOBUF_C_LABEL_REPEATED)
+		return STRUCT_MEMBER(void *, message, hot->offset) != NULL;
+	switch (hot->type) {
 	case PROTOBUF_C_TYPE_STRING:
-		ret = (NULL == *(const char * const *) member) ||
-		      ('\0' == **(const char * const *) member);
-		break;
-	case PROTOBUF_C_TYPE_BYTES:
 	case PROTOBUF_C_TYPE_MESSAGE:
-		ret = (NULL == *(const void * const *) member);
-		break;
+		return STRUCT_MEMBER(void *, message, hot->offset) != NULL;
+	case PROTOBUF_C_TYPE_BYTES:
+		return STRUCT_MEMBER(ProtobufCBinaryData, message,
+				     hot->offset).data != NULL;
 	default:
-		ret = TRUE;
-		break;
+		return FALSE;
 	}
-
-	return ret;
 }
 
 /**
- * Calculate the serialized size of a single unlabeled message field, including
- * the space needed by the preceding tag. Returns 0 if the field isn't set or
- * if it is set to a "zeroish" value (null pointer or 0 for numerical values).
- * Unlabeled fields are supported only in proto3.
+ * \defgroup packedsz protobuf_c_message_get_packed_size() implementation
  *
- * \param field
- *      Field descriptor for member.
- * \param member
- *      Field to encode.
- * \return
- *      Number of bytes required.
+ * Routines mainly used by protobuf_c_message_get_packed_size().
+ *
+ * \ingroup internal
+ * @{
+ */
+
+/**
+ * State of protobuf_c_message_get_packed_size_cached() while it fills a
+ * `ProtobufCSizeCache`.
  */
+typedef struct {
+	ProtobufCSizeCache *cache;	/**< Cache being filled. */
+	protobuf_c_boolean failed;	/**< The cache could not be grown. */
+} SizeRecorder;
+
 static size_t
-unlabeled_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-				const void *member)
-{
-	if (field_is_zeroish(field, member))
-		return 0;
-	return required_field_get_packed_size(field, member);
-}
+message_get_packed_size(const ProtobufCMessage *message, SizeRecorder *rec);
 
 /**
- * Calculate the serialized size of repeated message fields, which may consist
- * of any number of values (including 0). Includes the space needed by the
- * preceding tags (as needed).
+ * Reserve the next entry of the size cache for a message whose size is about
+ * to be computed. The entry is reserved before any of the message's
+ * submessages so that the sizes end up in pre-order, which is the order the
+ * packers consume them in.
  *
- * \param field
- *      Field descriptor for member.
- * \param count
- *      Number of repeated field members.
- * \param member
- *      Field to encode.
+ * \param rec
+ *      Size recorder.
  * \return
- *      Number of bytes required.
+ *      Index of the reserved entry.
  */
 static size_t
-repeated_field_get_packed_size(const ProtobufCFieldDescriptor *field,
-			       size_t count, const void *member)
+size_recorder_reserve(SizeRecorder *rec)
 {
-	size_t header_size;
-	size_t rv = 0;
-	unsigned i;
-	void *array = *(void * const *) member;
+	ProtobufCSizeCache *cache = rec->cache;
 
-	if (count == 0)
+	if (rec->failed)
 		return 0;
-	header_size = get_tag_size(field->id);
-	if (0 == (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED))
-		header_size *= count;
+	if (cache->n_sizes == cache->n_alloced) {
+		ProtobufCAllocator *allocator = cache->allocator;
+		size_t new_alloced = cache->n_alloced ? cache->n_alloced * 2 : 16;
+		size_t *sizes;
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SINT32:
-		for (i = 0; i < count; i++)
-			rv += sint32_size(((int32_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		for (i = 0; i < count; i++)
-			rv += int32_size(((int32_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_UINT32:
-		for (i = 0; i < count; i++)
-			rv += uint32_size(((uint32_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_SINT64:
-		for (i = 0; i < count; i++)
-			rv += sint64_size(((int64_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		for (i = 0; i < count; i++)
-			rv += uint64_size(((uint64_t *) array)[i]);
-		break;
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		rv += 4 * count;
-		break;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		rv += 8 * count;
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		rv += count;
-		break;
-	case PROTOBUF_C_TYPE_STRING:
-		for (i = 0; i < count; i++) {
-			size_t len = strlen(((char **) array)[i]);
-			rv += uint32_size(len) + len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_BYTES:
-		for (i = 0; i < count; i++) {
-			size_t len = ((ProtobufCBinaryData *) array)[i].len;
-			rv += uint32_size(len) + len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_MESSAGE:
-		for (i = 0; i < count; i++) {
-			size_t len = protobuf_c_message_get_packed_size(
-				((ProtobufCMessage **) array)[i]);
-			rv += uint32_size(len) + len;
+		if (allocator == NULL)
+			allocator = &protobuf_c__allocator;
+		sizes = do_alloc(allocator, new_alloced * sizeof(size_t));
+		if (sizes == NULL) {
+			rec->failed = TRUE;
+			return 0;
 		}
-		break;
+		if (cache->n_sizes != 0)
+			memcpy(sizes, cache->sizes, cache->n_sizes * sizeof(size_t));
+		do_free(allocator, cache->sizes);
+		cache->sizes = sizes;
+		cache->n_alloced = new_alloced;
 	}
-
-	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED))
-		header_size += uint32_size(rv);
-	return header_size + rv;
+	return cache->n_sizes++;
 }
 
 /**
- * Calculate the serialized size of an unknown field, i.e. one that is passed
- * through mostly uninterpreted. This is required for forward compatibility if
- * new fields are added to the message descriptor.
+ * Return the number of bytes required to store the tag for the field. Includes
+ * 3 bits for the wire-type, and a single bit that denotes the end-of-tag.
  *
- * \param field
- *      Unknown field type.
+ * \param number
+ *      Field tag to encode.
  * \return
  *      Number of bytes required.
  */
 static inline size_t
-unknown_field_get_packed_size(const ProtobufCMessageUnknownField *field)
-{
-	return get_tag_size(field->tag) + field->len;
-}
-
-/**@}*/
-
-/*
- * Calculate the serialized size of the message.
- */
-size_t protobuf_c_message_get_packed_size(const ProtobufCMessage *message)
+get_tag_size(uint32_t number)
 {
-	unsigned i;
-	size_t rv = 0;
-
-	ASSERT_IS_MESSAGE(message);
-	for (i = 0; i < message->descriptor->n_fields; i++) {
-		const ProtobufCFieldDescriptor *field =
-			message->descriptor->fields + i;
-		const void *member =
-			((const char *) message) + field->offset;
-		const void *qmember =
-			((const char *) message) + field->quantifier_offset;
-
-		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			rv += required_field_get_packed_size(field, member);
-		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
-			    field->label == PROTOBUF_C_LABEL_NONE) &&
-			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
-			rv += oneof_field_get_packed_size(
-				field,
-				*(const uint32_t *) qmember,
-				member
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
-			rv += optional_field_get_packed_size(
-				field,
-				*(protobuf_c_boolean *) qmember,
-				member
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
-			rv += unlabeled_field_get_packed_size(
-				field,
-				member
-			);
-		} else {
-			rv += repeated_field_get_packed_size(
-				field,
-				*(const size_t *) qmember,
-				member
-			);
-		}
+	if (number < (1UL << 4)) {
+		return 1;
+	} else if (number < (1UL << 11)) {
+		return 2;
+	} else if (number < (1UL << 18)) {
+		return 3;
+	} else if (number < (1UL << 25)) {
+		return 4;
+	} else {
+		return 5;
 	}
-	for (i = 0; i < message->n_unknown_fields; i++)
-		rv += unknown_field_get_packed_size(&message->unknown_fields[i]);
-	return rv;
 }
 
 /**
- * \defgroup pack protobuf_c_message_pack() implementation
- *
- * Routines mainly used by protobuf_c_message_pack().
- *
- * \ingroup internal
- * @{
- */
-
-/**
- * Pack an unsigned 32-bit integer in base-128 varint encoding and return the
- * number of bytes written, which must be 5 or less.
+ * Return the number of bytes required to store a variable-length unsigned
+ * 32-bit integer in base-128 varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-uint32_pack(uint32_t value, uint8_t *out)
+uint32_size(uint32_t v)
 {
-	unsigned rv = 0;
-
-	if (value >= 0x80) {
-		out[rv++] = value | 0x80;
-		value >>= 7;
-		if (value >= 0x80) {
-			out[rv++] = value | 0x80;
-			value >>= 7;
-			if (value >= 0x80) {
-				out[rv++] = value | 0x80;
-				value >>= 7;
-				if (value >= 0x80) {
-					out[rv++] = value | 0x80;
-					value >>= 7;
-				}
-			}
-		}
+	if (v < (1UL << 7)) {
+		return 1;
+	} else if (v < (1UL << 14)) {
+		return 2;
+	} else if (v < (1UL << 21)) {
+		return 3;
+	} else if (v < (1UL << 28)) {
+		return 4;
+	} else {
+		return 5;
 	}
-	/* assert: value<128 */
-	out[rv++] = value;
-	return rv;
 }
 
 /**
- * Pack a signed 32-bit integer and return the number of bytes written.
- * Negative numbers are encoded as two's complement 64-bit integers.
+ * Return the number of bytes required to store a variable-length signed 32-bit
+ * integer in base-128 varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-int32_pack(int32_t value, uint8_t *out)
+int32_size(int32_t v)
 {
-	if (value < 0) {
-		out[0] = value | 0x80;
-		out[1] = (value >> 7) | 0x80;
-		out[2] = (value >> 14) | 0x80;
-		out[3] = (value >> 21) | 0x80;
-		out[4] = (value >> 28) | 0x80;
-		out[5] = out[6] = out[7] = out[8] = 0xff;
-		out[9] = 0x01;
+	if (v < 0) {
 		return 10;
+	} else if (v < (1L << 7)) {
+		return 1;
+	} else if (v < (1L << 14)) {
+		return 2;
+	} else if (v < (1L << 21)) {
+		return 3;
+	} else if (v < (1L << 28)) {
+		return 4;
 	} else {
-		return uint32_pack(value, out);
+		return 5;
 	}
 }
 
 /**
- * Pack a signed 32-bit integer using ZigZag encoding and return the number of
- * bytes written.
+ * Return the ZigZag-encoded 32-bit unsigned integer form of a 32-bit signed
+ * integer.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      ZigZag encoded integer.
  */
-static inline size_t
-sint32_pack(int32_t value, uint8_t *out)
+static inline uint32_t
+zigzag32(int32_t v)
 {
-	return uint32_pack(zigzag32(value), out);
+	if (v < 0)
+		return (-(uint32_t)v) * 2 - 1;
+	else
+		return (uint32_t)(v) * 2;
 }
 
 /**
- * Pack a 64-bit unsigned integer using base-128 varint encoding and return the
- * number of bytes written.
+ * Return the number of bytes required to store a signed 32-bit integer,
+ * converted to an unsigned 32-bit integer with ZigZag encoding, using base-128
+ * varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
-static size_t
-uint64_pack(uint64_t value, uint8_t *out)
+static inline size_t
+sint32_size(int32_t v)
 {
-	uint32_t hi = (uint32_t) (value >> 32);
-	uint32_t lo = (uint32_t) value;
-	unsigned rv;
-
-	if (hi == 0)
-		return uint32_pack((uint32_t) lo, out);
-	out[0] = (lo) | 0x80;
-	out[1] = (lo >> 7) | 0x80;
-	out[2] = (lo >> 14) | 0x80;
-	out[3] = (lo >> 21) | 0x80;
-	if (hi < 8) {
-		out[4] = (hi << 4) | (lo >> 28);
-		return 5;
-	} else {
-		out[4] = ((hi & 7) << 4) | (lo >> 28) | 0x80;
-		hi >>= 3;
-	}
-	rv = 5;
-	while (hi >= 128) {
-		out[rv++] = hi | 0x80;
-		hi >>= 7;
-	}
-	out[rv++] = hi;
-	return rv;
-}
-
-/**
- * Pack a 64-bit signed integer in ZigZag encoding and return the number of
- * bytes written.
- *
- * \param value
- *      Value to encode.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
- */
-static inline size_t
-sint64_pack(int64_t value, uint8_t *out)
-{
-	return uint64_pack(zigzag64(value), out);
-}
-
-/**
- * Pack a 32-bit quantity in little-endian byte order. Used for protobuf wire
- * types fixed32, sfixed32, float. Similar to "htole32".
- *
- * \param value
- *      Value to encode.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
- */
-static inline size_t
-fixed32_pack(uint32_t value, void *out)
-{
-#if !defined(WORDS_BIGENDIAN)
-	memcpy(out, &value, 4);
-#else
-	uint8_t *buf = out;
-
-	buf[0] = value;
-	buf[1] = value >> 8;
-	buf[2] = value >> 16;
-	buf[3] = value >> 24;
-#endif
-	return 4;
-}
-
-/**
- * Pack a 64-bit quantity in little-endian byte order. Used for protobuf wire
- * types fixed64, sfixed64, double. Similar to "htole64".
- *
- * \todo The big-endian impl is really only good for 32-bit machines, a 64-bit
- * version would be appreciated, plus a way to decide to use 64-bit math where
- * convenient.
- *
- * \param value
- *      Value to encode.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
- */
-static inline size_t
-fixed64_pack(uint64_t value, void *out)
-{
-#if !defined(WORDS_BIGENDIAN)
-	memcpy(out, &value, 8);
-#else
-	fixed32_pack(value, out);
-	fixed32_pack(value >> 32, ((char *) out) + 4);
-#endif
-	return 8;
-}
+	return uint32_size(zigzag32(v));
+}
 
 /**
- * Pack a boolean value as an integer and return the number of bytes written.
- *
- * \todo Perhaps on some platforms *out = !!value would be a better impl, b/c
- * that is idiomatic C++ in some STL implementations.
+ * Return the number of bytes required to store a 64-bit unsigned integer in
+ * base-128 varint encoding.
  *
- * \param value
+ * \param v
  *      Value to encode.
- * \param[out] out
- *      Packed value.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-boolean_pack(protobuf_c_boolean value, uint8_t *out)
+uint64_size(uint64_t v)
 {
-	*out = value ? TRUE : FALSE;
-	return 1;
-}
+	uint32_t upper_v = (uint32_t) (v >> 32);
 
-/**
- * Pack a NUL-terminated C string and return the number of bytes written. The
- * output includes a length delimiter.
- *
- * The NULL pointer is treated as an empty string. This isn't really necessary,
- * but it allows people to leave required strings blank. (See Issue #13 in the
- * bug tracker for a little more explanation).
- *
- * \param str
- *      String to encode.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
- */
-static inline size_t
-string_pack(const char *str, uint8_t *out)
-{
-	if (str == NULL) {
-		out[0] = 0;
-		return 1;
+	if (upper_v == 0) {
+		return uint32_size((uint32_t) v);
+	} else if (upper_v < (1UL << 3)) {
+		return 5;
+	} else if (upper_v < (1UL << 10)) {
+		return 6;
+	} else if (upper_v < (1UL << 17)) {
+		return 7;
+	} else if (upper_v < (1UL << 24)) {
+		return 8;
+	} else if (upper_v < (1UL << 31)) {
+		return 9;
 	} else {
-		size_t len = strlen(str);
-		size_t rv = uint32_pack(len, out);
-		memcpy(out + rv, str, len);
-		return rv + len;
+		return 10;
 	}
 }
 
 /**
- * Pack a ProtobufCBinaryData and return the number of bytes written. The output
- * includes a length delimiter.
+ * Return the ZigZag-encoded 64-bit unsigned integer form of a 64-bit signed
+ * integer.
  *
- * \param bd
- *      ProtobufCBinaryData to encode.
- * \param[out] out
- *      Packed value.
+ * \param v
+ *      Value to encode.
  * \return
- *      Number of bytes written to `out`.
+ *      ZigZag encoded integer.
  */
-static inline size_t
-binary_data_pack(const ProtobufCBinaryData *bd, uint8_t *out)
+static inline uint64_t
+zigzag64(int64_t v)
 {
-	size_t len = bd->len;
-	size_t rv = uint32_pack(len, out);
-	memcpy(out + rv, bd->data, len);
-	return rv + len;
+	if (v < 0)
+		return (-(uint64_t)v) * 2 - 1;
+	else
+		return (uint64_t)(v) * 2;
 }
 
 /**
- * Pack a ProtobufCMessage and return the number of bytes written. The output
- * includes a length delimiter.
+ * Return the number of bytes required to store a signed 64-bit integer,
+ * converted to an unsigned 64-bit integer with ZigZag encoding, using base-128
+ * varint encoding.
  *
- * \param message
- *      ProtobufCMessage object to pack.
- * \param[out] out
- *      Packed message.
+ * \param v
+ *      Value to encode.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static inline size_t
-prefixed_message_pack(const ProtobufCMessage *message, uint8_t *out)
-{
-	if (message == NULL) {
-		out[0] = 0;
-		return 1;
-	} else {
-		size_t rv = protobuf_c_message_pack(message, out + 1);
-		uint32_t rv_packed_size = uint32_size(rv);
-		if (rv_packed_size != 1)
-			memmove(out + rv_packed_size, out + 1, rv);
-		return uint32_pack(rv, out) + rv;
-	}
-}
-
-/**
- * Pack a field tag.
- *
- * Wire-type will be added in required_field_pack().
- *
- * \todo Just call uint64_pack on 64-bit platforms.
- *
- * \param id
- *      Tag value to encode.
- * \param[out] out
- *      Packed value.
- * \return
- *      Number of bytes written to `out`.
- */
-static size_t
-tag_pack(uint32_t id, uint8_t *out)
+sint64_size(int64_t v)
 {
-	if (id < (1UL << (32 - 3)))
-		return uint32_pack(id << 3, out);
-	else
-		return uint64_pack(((uint64_t) id) << 3, out);
+	return uint64_size(zigzag64(v));
 }
 
 /**
- * Pack a required field and return the number of bytes written.
+ * Calculate the serialized size of a single required message field, including
+ * the space needed by the preceding tag.
  *
  * \param field
- *      Field descriptor.
+ *      Field descriptor for member.
  * \param member
- *      The field member.
- * \param[out] out
- *      Packed value.
+ *      Field to encode.
+ * \param rec
+ *      Size recorder, or NULL if sizes are not being cached.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static size_t
-required_field_pack(const ProtobufCFieldDescriptor *field,
-		    const void *member, uint8_t *out)
+required_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+			       const void *member, SizeRecorder *rec)
 {
-	size_t rv = tag_pack(field->id, out);
+	size_t rv = get_tag_size(field->id);
 
 	switch (field->type) {
 	case PROTOBUF_C_TYPE_SINT32:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + sint32_pack(*(const int32_t *) member, out + rv);
+		return rv + sint32_size(*(const int32_t *) member);
 	case PROTOBUF_C_TYPE_ENUM:
 	case PROTOBUF_C_TYPE_INT32:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + int32_pack(*(const int32_t *) member, out + rv);
+		return rv + int32_size(*(const int32_t *) member);
 	case PROTOBUF_C_TYPE_UINT32:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + uint32_pack(*(const uint32_t *) member, out + rv);
+		return rv + uint32_size(*(const uint32_t *) member);
 	case PROTOBUF_C_TYPE_SINT64:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + sint64_pack(*(const int64_t *) member, out + rv);
+		return rv + sint64_size(*(const int64_t *) member);
 	case PROTOBUF_C_TYPE_INT64:
 	case PROTOBUF_C_TYPE_UINT64:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + uint64_pack(*(const uint64_t *) member, out + rv);
+		return rv + uint64_size(*(const uint64_t *) member);
 	case PROTOBUF_C_TYPE_SFIXED32:
 	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
-		return rv + fixed32_pack(*(const uint32_t *) member, out + rv);
+		return rv + 4;
 	case PROTOBUF_C_TYPE_SFIXED64:
 	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
-		return rv + fixed64_pack(*(const uint64_t *) member, out + rv);
+		return rv + 8;
 	case PROTOBUF_C_TYPE_BOOL:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		return rv + boolean_pack(*(const protobuf_c_boolean *) member, out + rv);
-	case PROTOBUF_C_TYPE_STRING:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		return rv + string_pack(*(char *const *) member, out + rv);
-	case PROTOBUF_C_TYPE_BYTES:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		return rv + binary_data_pack((const ProtobufCBinaryData *) member, out + rv);
-	case PROTOBUF_C_TYPE_MESSAGE:
-		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		return rv + prefixed_message_pack(*(ProtobufCMessage * const *) member, out + rv);
+		return rv + 1;
+	case PROTOBUF_C_TYPE_FLOAT:
+		return rv + 4;
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return rv + 8;
+	case PROTOBUF_C_TYPE_STRING: {
+		const char *str = *(char * const *) member;
+		size_t len = str ? strlen(str) : 0;
+		return rv + uint32_size(len) + len;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		size_t len = ((const ProtobufCBinaryData *) member)->len;
+		return rv + uint32_size(len) + len;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
+		size_t subrv = msg ? message_get_packed_size(msg, rec) : 0;
+		return rv + uint32_size(subrv) + subrv;
+	}
 	}
 	PROTOBUF_C__ASSERT_NOT_REACHED();
 	return 0;
 }
 
 /**
- * Pack a oneof field and return the number of bytes written. Only packs the
- * field that is selected by the case enum.
+ * Calculate the serialized size of a single oneof message field, including
+ * the space needed by the preceding tag. Returns 0 if the oneof field isn't
+ * selected or is not set.
  *
  * \param field
- *      Field descriptor.
+ *      Field descriptor for member.
  * \param oneof_case
  *      Enum value that selects the field in the oneof.
  * \param member
- *      The field member.
- * \param[out] out
- *      Packed value.
+ *      Field to encode.
+ * \param rec
+ *      Size recorder, or NULL if sizes are not being cached.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static size_t
-oneof_field_pack(const ProtobufCFieldDescriptor *field,
-		 uint32_t oneof_case,
-		 const void *member, uint8_t *out)
+oneof_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+			    uint32_t oneof_case,
+			    const void *member, SizeRecorder *rec)
 {
 	if (oneof_case != field->id) {
 		return 0;
@@ -1167,27 +1217,29 @@ oneof_field_pack(const ProtobufCFieldDescriptor *field,
 		if (ptr == NULL || ptr == field->default_value)
 			return 0;
 	}
-	return required_field_pack(field, member, out);
+	return required_field_get_packed_size(field, member, rec);
 }
 
 /**
- * Pack an optional field and return the number of bytes written.
+ * Calculate the serialized size of a single optional message field, including
+ * the space needed by the preceding tag. Returns 0 if the optional field isn't
+ * set.
  *
  * \param field
- *      Field descriptor.
+ *      Field descriptor for member.
  * \param has
- *      Whether the field is set.
+ *      True if the field exists, false if not.
  * \param member
- *      The field member.
- * \param[out] out
- *      Packed value.
+ *      Field to encode.
+ * \param rec
+ *      Size recorder, or NULL if sizes are not being cached.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static size_t
-optional_field_pack(const ProtobufCFieldDescriptor *field,
-		    const protobuf_c_boolean has,
-		    const void *member, uint8_t *out)
+optional_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+			       const protobuf_c_boolean has,
+			       const void *member, SizeRecorder *rec)
 {
 	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
 	    field->type == PROTOBUF_C_TYPE_STRING)
@@ -1199,1010 +1251,3113 @@ optional_field_pack(const ProtobufCFieldDescriptor *field,
 		if (!has)
 			return 0;
 	}
-	return required_field_pack(field, member, out);
+	return required_field_get_packed_size(field, member, rec);
+}
+
+static protobuf_c_boolean
+field_is_zeroish(const ProtobufCFieldDescriptor *field,
+		 const void *member)
+{
+	protobuf_c_boolean ret = FALSE;
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_BOOL:
+		ret = (0 == *(const protobuf_c_boolean *) member);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+		ret = (0 == *(const uint32_t *) member);
+		break;
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+		ret = (0 == *(const uint64_t *) member);
+		break;
+	case PROTOBUF_C_TYPE_FLOAT:
+		ret = (0 == *(const float *) member);
+		break;
+	case PROTOBUF_C_TYPE_DOUBLE:
+		ret = (0 == *(const double *) member);
+		break;
+	case PROTOBUF_C_TYPE_STRING:
+		ret = (NULL == *(const char * const *) member) ||
+		      ('\0' == **(const char * const *) member);
+		break;
+	case PROTOBUF_C_TYPE_BYTES:
+	case PROTOBUF_C_TYPE_MESSAGE:
+		ret = (NULL == *(const void * const *) member);
+		break;
+	default:
+		ret = TRUE;
+		break;
+	}
+
+	return ret;
 }
 
 /**
- * Pack an unlabeled field and return the number of bytes written.
+ * Calculate the serialized size of a single unlabeled message field, including
+ * the space needed by the preceding tag. Returns 0 if the field isn't set or
+ * if it is set to a "zeroish" value (null pointer or 0 for numerical values).
+ * Unlabeled fields are supported only in proto3.
  *
  * \param field
- *      Field descriptor.
+ *      Field descriptor for member.
  * \param member
- *      The field member.
- * \param[out] out
- *      Packed value.
+ *      Field to encode.
+ * \param rec
+ *      Size recorder, or NULL if sizes are not being cached.
  * \return
- *      Number of bytes written to `out`.
+ *      Number of bytes required.
  */
 static size_t
-unlabeled_field_pack(const ProtobufCFieldDescriptor *field,
-		     const void *member, uint8_t *out)
+unlabeled_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+				const void *member, SizeRecorder *rec)
 {
 	if (field_is_zeroish(field, member))
 		return 0;
-	return required_field_pack(field, member, out);
+	return required_field_get_packed_size(field, member, rec);
 }
 
 /**
- * Given a field type, return the in-memory size.
- *
- * \todo Implement as a table lookup.
+ * Calculate the serialized size of repeated message fields, which may consist
+ * of any number of values (including 0). Includes the space needed by the
+ * preceding tags (as needed).
  *
- * \param type
- *      Field type.
+ * \param field
+ *      Field descriptor for member.
+ * \param count
+ *      Number of repeated field members.
+ * \param member
+ *      Field to encode.
+ * \param rec
+ *      Size recorder, or NULL if sizes are not being cached.
  * \return
- *      Size of the field.
+ *      Number of bytes required.
  */
-static inline size_t
-sizeof_elt_in_repeated_array(ProtobufCType type)
+static size_t
+repeated_field_get_packed_size(const ProtobufCFieldDescriptor *field,
+			       size_t count, const void *member,
+			       SizeRecorder *rec)
 {
-	switch (type) {
+	size_t header_size;
+	size_t rv = 0;
+	unsigned i;
+	void *array = *(void * const *) member;
+
+	if (count == 0)
+		return 0;
+	header_size = get_tag_size(field->id);
+	if (0 == (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED))
+		header_size *= count;
+
+	switch (field->type) {
 	case PROTOBUF_C_TYPE_SINT32:
+		for (i = 0; i < count; i++)
+			rv += sint32_size(((int32_t *) array)[i]);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
 	case PROTOBUF_C_TYPE_INT32:
+		for (i = 0; i < count; i++)
+			rv += int32_size(((int32_t *) array)[i]);
+		break;
 	case PROTOBUF_C_TYPE_UINT32:
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-	case PROTOBUF_C_TYPE_ENUM:
-		return 4;
+		for (i = 0; i < count; i++)
+			rv += uint32_size(((uint32_t *) array)[i]);
+		break;
 	case PROTOBUF_C_TYPE_SINT64:
+		for (i = 0; i < count; i++)
+			rv += sint64_size(((int64_t *) array)[i]);
+		break;
 	case PROTOBUF_C_TYPE_INT64:
 	case PROTOBUF_C_TYPE_UINT64:
+		for (i = 0; i < count; i++)
+			rv += uint64_size(((uint64_t *) array)[i]);
+		break;
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		rv += 4 * count;
+		break;
 	case PROTOBUF_C_TYPE_SFIXED64:
 	case PROTOBUF_C_TYPE_FIXED64:
 	case PROTOBUF_C_TYPE_DOUBLE:
-		return 8;
+		rv += 8 * count;
+		break;
 	case PROTOBUF_C_TYPE_BOOL:
-		return sizeof(protobuf_c_boolean);
+		rv += count;
+		break;
 	case PROTOBUF_C_TYPE_STRING:
-	case PROTOBUF_C_TYPE_MESSAGE:
-		return sizeof(void *);
+		for (i = 0; i < count; i++) {
+			size_t len = strlen(((char **) array)[i]);
+			rv += uint32_size(len) + len;
+		}
+		break;
 	case PROTOBUF_C_TYPE_BYTES:
-		return sizeof(ProtobufCBinaryData);
+		for (i = 0; i < count; i++) {
+			size_t len = ((ProtobufCBinaryData *) array)[i].len;
+			rv += uint32_size(len) + len;
+		}
+		break;
+	case PROTOBUF_C_TYPE_MESSAGE:
+		for (i = 0; i < count; i++) {
+			size_t len = message_get_packed_size(
+				((ProtobufCMessage **) array)[i], rec);
+			rv += uint32_size(len) + len;
+		}
+		break;
 	}
-	PROTOBUF_C__ASSERT_NOT_REACHED();
-	return 0;
+
+	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED))
+		header_size += uint32_size(rv);
+	return header_size + rv;
 }
 
 /**
- * Pack an array of 32-bit quantities.
+ * Calculate the serialized size of an unknown field, i.e. one that is passed
+ * through mostly uninterpreted. This is required for forward compatibility if
+ * new fields are added to the message descriptor.
  *
- * \param[out] out
- *      Destination.
- * \param[in] in
- *      Source.
- * \param[in] n
- *      Number of elements in the source array.
+ * \param field
+ *      Unknown field type.
+ * \return
+ *      Number of bytes required.
  */
-static void
-copy_to_little_endian_32(void *out, const void *in, const unsigned n)
+static inline size_t
+unknown_field_get_packed_size(const ProtobufCMessageUnknownField *field)
 {
-#if !defined(WORDS_BIGENDIAN)
-	memcpy(out, in, n * 4);
-#else
-	unsigned i;
-	const uint32_t *ini = in;
-	for (i = 0; i < n; i++)
-		fixed32_pack(ini[i], (uint32_t *) out + i);
-#endif
+	if (field->tag == 0)
+		return field->len;
+	return get_tag_size(field->tag) + field->len;
 }
 
-/**
- * Pack an array of 64-bit quantities.
- *
- * \param[out] out
- *      Destination.
- * \param[in] in
- *      Source.
- * \param[in] n
- *      Number of elements in the source array.
+/**@}*/
+
+/*
+ * Calculate the serialized size of the message, recording it and the sizes
+ * of all submessages if `rec` is not NULL.
  */
-static void
-copy_to_little_endian_64(void *out, const void *in, const unsigned n)
-{
-#if !defined(WORDS_BIGENDIAN)
-	memcpy(out, in, n * 8);
-#else
-	unsigned i;
-	const uint64_t *ini = in;
-	for (i = 0; i < n; i++)
-		fixed64_pack(ini[i], (uint64_t *) out + i);
-#endif
-}
-
-/**
- * Get the minimum number of bytes required to pack a field value of a
- * particular type.
- *
- * \param type
- *      Field type.
- * \return
- *      Number of bytes.
- */
-static unsigned
-get_type_min_size(ProtobufCType type)
-{
-	if (type == PROTOBUF_C_TYPE_SFIXED32 ||
-	    type == PROTOBUF_C_TYPE_FIXED32 ||
-	    type == PROTOBUF_C_TYPE_FLOAT)
-	{
-		return 4;
-	}
-	if (type == PROTOBUF_C_TYPE_SFIXED64 ||
-	    type == PROTOBUF_C_TYPE_FIXED64 ||
-	    type == PROTOBUF_C_TYPE_DOUBLE)
-	{
-		return 8;
-	}
-	return 1;
-}
-
-/**
- * Packs the elements of a repeated field and returns the serialised field and
- * its length.
- *
- * \param field
- *      Field descriptor.
- * \param count
- *      Number of elements in the repeated field array.
- * \param member
- *      Pointer to the elements for this repeated field.
- * \param[out] out
- *      Serialised representation of the repeated field.
- * \return
- *      Number of bytes serialised to `out`.
- */
-static size_t
-repeated_field_pack(const ProtobufCFieldDescriptor *field,
-		    size_t count, const void *member, uint8_t *out)
-{
-	void *array = *(void * const *) member;
-	unsigned i;
-
-	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
-		unsigned header_len;
-		unsigned len_start;
-		unsigned min_length;
-		unsigned payload_len;
-		unsigned length_size_min;
-		unsigned actual_length_size;
-		uint8_t *payload_at;
-
-		if (count == 0)
-			return 0;
-		header_len = tag_pack(field->id, out);
-		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		len_start = header_len;
-		min_length = get_type_min_size(field->type) * count;
-		length_size_min = uint32_size(min_length);
-		header_len += length_size_min;
-		payload_at = out + header_len;
-
-		switch (field->type) {
-		case PROTOBUF_C_TYPE_SFIXED32:
-		case PROTOBUF_C_TYPE_FIXED32:
-		case PROTOBUF_C_TYPE_FLOAT:
-			copy_to_little_endian_32(payload_at, array, count);
-			payload_at += count * 4;
-			break;
-		case PROTOBUF_C_TYPE_SFIXED64:
-		case PROTOBUF_C_TYPE_FIXED64:
-		case PROTOBUF_C_TYPE_DOUBLE:
-			copy_to_little_endian_64(payload_at, array, count);
-			payload_at += count * 8;
-			break;
-		case PROTOBUF_C_TYPE_ENUM:
-		case PROTOBUF_C_TYPE_INT32: {
-			const int32_t *arr = (const int32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += int32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_SINT32: {
-			const int32_t *arr = (const int32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += sint32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_SINT64: {
-			const int64_t *arr = (const int64_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += sint64_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_UINT32: {
-			const uint32_t *arr = (const uint32_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += uint32_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_INT64:
-		case PROTOBUF_C_TYPE_UINT64: {
-			const uint64_t *arr = (const uint64_t *) array;
-			for (i = 0; i < count; i++)
-				payload_at += uint64_pack(arr[i], payload_at);
-			break;
-		}
-		case PROTOBUF_C_TYPE_BOOL: {
-			const protobuf_c_boolean *arr = (const protobuf_c_boolean *) array;
-			for (i = 0; i < count; i++)
-				payload_at += boolean_pack(arr[i], payload_at);
-			break;
-		}
-		default:
-			PROTOBUF_C__ASSERT_NOT_REACHED();
-		}
-
-		payload_len = payload_at - (out + header_len);
-		actual_length_size = uint32_size(payload_len);
-		if (length_size_min != actual_length_size) {
-			assert(actual_length_size == length_size_min + 1);
-			memmove(out + header_len + 1, out + header_len,
-				payload_len);
-			header_len++;
-		}
-		uint32_pack(payload_len, out + len_start);
-		return header_len + payload_len;
-	} else {
-		/* not "packed" cased */
-		/* CONSIDER: optimize this case a bit (by putting the loop inside the switch) */
-		size_t rv = 0;
-		unsigned siz = sizeof_elt_in_repeated_array(field->type);
-
-		for (i = 0; i < count; i++) {
-			rv += required_field_pack(field, array, out + rv);
-			array = (char *)array + siz;
-		}
-		return rv;
-	}
-}
-
 static size_t
-unknown_field_pack(const ProtobufCMessageUnknownField *field, uint8_t *out)
-{
-	size_t rv = tag_pack(field->tag, out);
-	out[0] |= field->wire_type;
-	memcpy(out + rv, field->data, field->len);
-	return rv + field->len;
-}
-
-/**@}*/
-
-size_t
-protobuf_c_message_pack(const ProtobufCMessage *message, uint8_t *out)
+message_get_packed_size(const ProtobufCMessage *message, SizeRecorder *rec)
 {
 	unsigned i;
 	size_t rv = 0;
+	size_t slot = 0;
 
 	ASSERT_IS_MESSAGE(message);
+	/* a generated size function can't record the sizes of submessages */
+	if (rec == NULL && message->n_unknown_fields == 0 &&
+	    message->descriptor->codec != NULL &&
+	    message->descriptor->codec->get_packed_size != NULL)
+		return message->descriptor->codec->get_packed_size(message);
+	if (rec != NULL)
+		slot = size_recorder_reserve(rec);
+	/*
+	 * Walk the field descriptors rather than the hot table: the size
+	 * helpers need the descriptor anyway, and two tables to read per field
+	 * cost more than they save on messages that set most of their fields.
+	 */
 	for (i = 0; i < message->descriptor->n_fields; i++) {
 		const ProtobufCFieldDescriptor *field =
 			message->descriptor->fields + i;
-		const void *member = ((const char *) message) + field->offset;
-
-		/*
-		 * It doesn't hurt to compute qmember (a pointer to the
-		 * quantifier field of the structure), but the pointer is only
-		 * valid if the field is:
-		 *  - a repeated field, or
-		 *  - a field that is part of a oneof
-		 *  - an optional field that isn't a pointer type
-		 * (Meaning: not a message or a string).
-		 */
+		const void *member =
+			((const char *) message) + field->offset;
 		const void *qmember =
 			((const char *) message) + field->quantifier_offset;
 
 		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			rv += required_field_pack(field, member, out + rv);
+			rv += required_field_get_packed_size(field, member, rec);
 		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
 			    field->label == PROTOBUF_C_LABEL_NONE) &&
 			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
-			rv += oneof_field_pack(
+			rv += oneof_field_get_packed_size(
 				field,
 				*(const uint32_t *) qmember,
 				member,
-				out + rv
+				rec
 			);
 		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
-			rv += optional_field_pack(
+			rv += optional_field_get_packed_size(
 				field,
-				*(const protobuf_c_boolean *) qmember,
+				*(protobuf_c_boolean *) qmember,
 				member,
-				out + rv
+				rec
 			);
 		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
-			rv += unlabeled_field_pack(field, member, out + rv);
+			rv += unlabeled_field_get_packed_size(
+				field,
+				member,
+				rec
+			);
 		} else {
-			rv += repeated_field_pack(field, *(const size_t *) qmember,
-				member, out + rv);
+			rv += repeated_field_get_packed_size(
+				field,
+				*(const size_t *) qmember,
+				member,
+				rec
+			);
 		}
 	}
 	for (i = 0; i < message->n_unknown_fields; i++)
-		rv += unknown_field_pack(&message->unknown_fields[i], out + rv);
+		rv += unknown_field_get_packed_size(&message->unknown_fields[i]);
+	if (rec != NULL && !rec->failed)
+		rec->cache->sizes[slot] = rv;
+	return rv;
+}
+
+size_t
+protobuf_c_message_get_packed_size(const ProtobufCMessage *message)
+{
+	return message_get_packed_size(message, NULL);
+}
+
+size_t
+protobuf_c_message_get_packed_size_cached(const ProtobufCMessage *message,
+					  ProtobufCSizeCache *cache)
+{
+	SizeRecorder rec;
+	size_t rv;
+
+	rec.cache = cache;
+	rec.failed = FALSE;
+	cache->n_sizes = 0;
+	rv = message_get_packed_size(message, &rec);
+	if (rec.failed)
+		cache->n_sizes = 0;
 	return rv;
 }
 
+void
+protobuf_c_size_cache_clear(ProtobufCSizeCache *cache)
+{
+	ProtobufCAllocator *allocator = cache->allocator;
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	do_free(allocator, cache->sizes);
+	cache->sizes = NULL;
+	cache->n_sizes = 0;
+	cache->n_alloced = 0;
+}
+
 /**
- * \defgroup packbuf protobuf_c_message_pack_to_buffer() implementation
+ * \defgroup pack protobuf_c_message_pack() implementation
  *
- * Routines mainly used by protobuf_c_message_pack_to_buffer().
+ * Routines mainly used by protobuf_c_message_pack().
  *
  * \ingroup internal
  * @{
  */
 
 /**
- * Pack a required field to a virtual buffer.
+ * Read position in the sizes of a `ProtobufCSizeCache`. Each submessage
+ * packed consumes the next size, in the same pre-order in which
+ * message_get_packed_size() recorded them.
+ */
+typedef struct {
+	const size_t *sizes;	/**< Recorded sizes. */
+	size_t n_sizes;		/**< Number of entries in `sizes`. */
+	size_t next;		/**< Index of the next size to consume. */
+} SizeCursor;
+
+static size_t
+message_pack(const ProtobufCMessage *message, SizeCursor *cursor,
+	     uint8_t *out);
+
+static size_t
+message_pack_to_buffer(const ProtobufCMessage *message, SizeCursor *cursor,
+		       ProtobufCBuffer *buffer);
+
+/**
+ * Take the recorded size of the next submessage.
  *
- * \param field
- *      Field descriptor.
- * \param member
- *      The element to be packed.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] size
+ *      Packed size of the submessage.
  * \return
- *      Number of bytes packed.
+ *      TRUE if a size was available.
  */
-static size_t
-required_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			      const void *member, ProtobufCBuffer *buffer)
+static inline protobuf_c_boolean
+size_cursor_next(SizeCursor *cursor, size_t *size)
 {
-	size_t rv;
-	uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
+	if (cursor == NULL || cursor->next == cursor->n_sizes)
+		return FALSE;
+	*size = cursor->sizes[cursor->next++];
+	return TRUE;
+}
 
-	rv = tag_pack(field->id, scratch);
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SINT32:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += sint32_pack(*(const int32_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += int32_pack(*(const int32_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
-	case PROTOBUF_C_TYPE_UINT32:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += uint32_pack(*(const uint32_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
-	case PROTOBUF_C_TYPE_SINT64:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += sint64_pack(*(const int64_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += uint64_pack(*(const uint64_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
-		rv += fixed32_pack(*(const uint32_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
-		rv += fixed64_pack(*(const uint64_t *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
-		rv += boolean_pack(*(const protobuf_c_boolean *) member, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		break;
-	case PROTOBUF_C_TYPE_STRING: {
-		const char *str = *(char *const *) member;
-		size_t sublen = str ? strlen(str) : 0;
-
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		rv += uint32_pack(sublen, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		buffer->append(buffer, sublen, (const uint8_t *) str);
-		rv += sublen;
-		break;
-	}
-	case PROTOBUF_C_TYPE_BYTES: {
-		const ProtobufCBinaryData *bd = ((const ProtobufCBinaryData *) member);
-		size_t sublen = bd->len;
-
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		rv += uint32_pack(sublen, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		buffer->append(buffer, sublen, bd->data);
-		rv += sublen;
-		break;
-	}
-	case PROTOBUF_C_TYPE_MESSAGE: {
-		uint8_t simple_buffer_scratch[256];
-		size_t sublen;
-		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
-		ProtobufCBufferSimple simple_buffer =
-			PROTOBUF_C_BUFFER_SIMPLE_INIT(simple_buffer_scratch);
+/**
+ * Pack an unsigned 32-bit integer in base-128 varint encoding and return the
+ * number of bytes written, which must be 5 or less.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+uint32_pack(uint32_t value, uint8_t *out)
+{
+	unsigned rv = 0;
 
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		if (msg == NULL)
-			sublen = 0;
-		else
-			sublen = protobuf_c_message_pack_to_buffer(msg, &simple_buffer.base);
-		rv += uint32_pack(sublen, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		buffer->append(buffer, sublen, simple_buffer.data);
-		rv += sublen;
-		PROTOBUF_C_BUFFER_SIMPLE_CLEAR(&simple_buffer);
-		break;
-	}
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
+	if (value >= 0x80) {
+		out[rv++] = value | 0x80;
+		value >>= 7;
+		if (value >= 0x80) {
+			out[rv++] = value | 0x80;
+			value >>= 7;
+			if (value >= 0x80) {
+				out[rv++] = value | 0x80;
+				value >>= 7;
+				if (value >= 0x80) {
+					out[rv++] = value | 0x80;
+					value >>= 7;
+				}
+			}
+		}
 	}
+	/* assert: value<128 */
+	out[rv++] = value;
 	return rv;
 }
 
 /**
- * Pack a oneof field to a buffer. Only packs the field that is selected by the case enum.
+ * Pack a signed 32-bit integer and return the number of bytes written.
+ * Negative numbers are encoded as two's complement 64-bit integers.
  *
- * \param field
- *      Field descriptor.
- * \param oneof_case
- *      Enum value that selects the field in the oneof.
- * \param member
- *      The element to be packed.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
  * \return
- *      Number of bytes serialised to `buffer`.
+ *      Number of bytes written to `out`.
  */
-static size_t
-oneof_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			   uint32_t oneof_case,
-			   const void *member, ProtobufCBuffer *buffer)
+static inline size_t
+int32_pack(int32_t value, uint8_t *out)
 {
-	if (oneof_case != field->id) {
-		return 0;
-	}
-	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
-	    field->type == PROTOBUF_C_TYPE_STRING)
-	{
-		const void *ptr = *(const void *const *) member;
-		if (ptr == NULL || ptr == field->default_value)
-			return 0;
+	if (value < 0) {
+		out[0] = value | 0x80;
+		out[1] = (value >> 7) | 0x80;
+		out[2] = (value >> 14) | 0x80;
+		out[3] = (value >> 21) | 0x80;
+		out[4] = (value >> 28) | 0x80;
+		out[5] = out[6] = out[7] = out[8] = 0xff;
+		out[9] = 0x01;
+		return 10;
+	} else {
+		return uint32_pack(value, out);
 	}
-	return required_field_pack_to_buffer(field, member, buffer);
 }
 
 /**
- * Pack an optional field to a buffer.
+ * Pack a signed 32-bit integer using ZigZag encoding and return the number of
+ * bytes written.
  *
- * \param field
- *      Field descriptor.
- * \param has
- *      Whether the field is set.
- * \param member
- *      The element to be packed.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
  * \return
- *      Number of bytes serialised to `buffer`.
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+sint32_pack(int32_t value, uint8_t *out)
+{
+	return uint32_pack(zigzag32(value), out);
+}
+
+/**
+ * Pack a 64-bit unsigned integer using base-128 varint encoding and return the
+ * number of bytes written.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
  */
 static size_t
-optional_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			      const protobuf_c_boolean has,
-			      const void *member, ProtobufCBuffer *buffer)
+uint64_pack(uint64_t value, uint8_t *out)
 {
-	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
-	    field->type == PROTOBUF_C_TYPE_STRING)
-	{
-		const void *ptr = *(const void *const *) member;
-		if (ptr == NULL || ptr == field->default_value)
-			return 0;
+	uint32_t hi = (uint32_t) (value >> 32);
+	uint32_t lo = (uint32_t) value;
+	unsigned rv;
+
+	if (hi == 0)
+		return uint32_pack((uint32_t) lo, out);
+	out[0] = (lo) | 0x80;
+	out[1] = (lo >> 7) | 0x80;
+	out[2] = (lo >> 14) | 0x80;
+	out[3] = (lo >> 21) | 0x80;
+	if (hi < 8) {
+		out[4] = (hi << 4) | (lo >> 28);
+		return 5;
 	} else {
-		if (!has)
-			return 0;
+		out[4] = ((hi & 7) << 4) | (lo >> 28) | 0x80;
+		hi >>= 3;
+	}
+	rv = 5;
+	while (hi >= 128) {
+		out[rv++] = hi | 0x80;
+		hi >>= 7;
 	}
-	return required_field_pack_to_buffer(field, member, buffer);
+	out[rv++] = hi;
+	return rv;
 }
 
 /**
- * Pack an unlabeled field to a buffer.
+ * Pack a 64-bit signed integer in ZigZag encoding and return the number of
+ * bytes written.
  *
- * \param field
- *      Field descriptor.
- * \param member
- *      The element to be packed.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
  * \return
- *      Number of bytes serialised to `buffer`.
+ *      Number of bytes written to `out`.
  */
-static size_t
-unlabeled_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			       const void *member, ProtobufCBuffer *buffer)
+static inline size_t
+sint64_pack(int64_t value, uint8_t *out)
 {
-	if (field_is_zeroish(field, member))
-		return 0;
-	return required_field_pack_to_buffer(field, member, buffer);
+	return uint64_pack(zigzag64(value), out);
 }
 
 /**
- * Get the packed size of an array of same field type.
+ * Pack a 32-bit quantity in little-endian byte order. Used for protobuf wire
+ * types fixed32, sfixed32, float. Similar to "htole32".
  *
- * \param field
- *      Field descriptor.
- * \param count
- *      Number of elements of this type.
- * \param array
- *      The elements to get the size of.
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
  * \return
- *      Number of bytes required.
+ *      Number of bytes written to `out`.
  */
-static size_t
-get_packed_payload_length(const ProtobufCFieldDescriptor *field,
-			  unsigned count, const void *array)
+static inline size_t
+fixed32_pack(uint32_t value, void *out)
 {
-	unsigned rv = 0;
-	unsigned i;
+#if !defined(WORDS_BIGENDIAN)
+	memcpy(out, &value, 4);
+#else
+	uint8_t *buf = out;
 
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		return count * 4;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		return count * 8;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32: {
-		const int32_t *arr = (const int32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += int32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_SINT32: {
-		const int32_t *arr = (const int32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += sint32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_UINT32: {
-		const uint32_t *arr = (const uint32_t *) array;
-		for (i = 0; i < count; i++)
-			rv += uint32_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_SINT64: {
-		const int64_t *arr = (const int64_t *) array;
-		for (i = 0; i < count; i++)
-			rv += sint64_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64: {
-		const uint64_t *arr = (const uint64_t *) array;
-		for (i = 0; i < count; i++)
-			rv += uint64_size(arr[i]);
-		break;
-	}
-	case PROTOBUF_C_TYPE_BOOL:
-		return count;
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
-	}
-	return rv;
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+#endif
+	return 4;
 }
 
 /**
- * Pack an array of same field type to a virtual buffer.
+ * Pack a 64-bit quantity in little-endian byte order. Used for protobuf wire
+ * types fixed64, sfixed64, double. Similar to "htole64".
  *
- * \param field
- *      Field descriptor.
- * \param count
- *      Number of elements of this type.
- * \param array
- *      The elements to get the size of.
- * \param[out] buffer
- *      Virtual buffer to append data to.
+ * \todo The big-endian impl is really only good for 32-bit machines, a 64-bit
+ * version would be appreciated, plus a way to decide to use 64-bit math where
+ * convenient.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
  * \return
- *      Number of bytes packed.
+ *      Number of bytes written to `out`.
  */
-static size_t
-pack_buffer_packed_payload(const ProtobufCFieldDescriptor *field,
-			   unsigned count, const void *array,
-			   ProtobufCBuffer *buffer)
+static inline size_t
+fixed64_pack(uint64_t value, void *out)
 {
-	uint8_t scratch[16];
-	size_t rv = 0;
-	unsigned i;
-
-	switch (field->type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-#if !defined(WORDS_BIGENDIAN)
-		rv = count * 4;
-		goto no_packing_needed;
-#else
-		for (i = 0; i < count; i++) {
-			unsigned len = fixed32_pack(((uint32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-#endif
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
 #if !defined(WORDS_BIGENDIAN)
-		rv = count * 8;
-		goto no_packing_needed;
+	memcpy(out, &value, 8);
 #else
-		for (i = 0; i < count; i++) {
-			unsigned len = fixed64_pack(((uint64_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-#endif
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = int32_pack(((int32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_SINT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = sint32_pack(((int32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_UINT32:
-		for (i = 0; i < count; i++) {
-			unsigned len = uint32_pack(((uint32_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_SINT64:
-		for (i = 0; i < count; i++) {
-			unsigned len = sint64_pack(((int64_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		for (i = 0; i < count; i++) {
-			unsigned len = uint64_pack(((uint64_t *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		for (i = 0; i < count; i++) {
-			unsigned len = boolean_pack(((protobuf_c_boolean *) array)[i], scratch);
-			buffer->append(buffer, len, scratch);
-			rv += len;
-		}
-		return count;
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
-	}
-	return rv;
-
-#if !defined(WORDS_BIGENDIAN)
-no_packing_needed:
-	buffer->append(buffer, rv, array);
-	return rv;
+	fixed32_pack(value, out);
+	fixed32_pack(value >> 32, ((char *) out) + 4);
 #endif
+	return 8;
 }
 
-static size_t
-repeated_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
-			      unsigned count, const void *member,
-			      ProtobufCBuffer *buffer)
+/**
+ * Pack a boolean value as an integer and return the number of bytes written.
+ *
+ * \todo Perhaps on some platforms *out = !!value would be a better impl, b/c
+ * that is idiomatic C++ in some STL implementations.
+ *
+ * \param value
+ *      Value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+boolean_pack(protobuf_c_boolean value, uint8_t *out)
 {
-	char *array = *(char * const *) member;
-
-	if (count == 0)
-		return 0;
-	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
-		uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
-		size_t rv = tag_pack(field->id, scratch);
-		size_t payload_len = get_packed_payload_length(field, count, array);
-		size_t tmp;
+	*out = value ? TRUE : FALSE;
+	return 1;
+}
 
-		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
-		rv += uint32_pack(payload_len, scratch + rv);
-		buffer->append(buffer, rv, scratch);
-		tmp = pack_buffer_packed_payload(field, count, array, buffer);
-		assert(tmp == payload_len);
-		return rv + payload_len;
+/**
+ * Pack a NUL-terminated C string and return the number of bytes written. The
+ * output includes a length delimiter.
+ *
+ * The NULL pointer is treated as an empty string. This isn't really necessary,
+ * but it allows people to leave required strings blank. (See Issue #13 in the
+ * bug tracker for a little more explanation).
+ *
+ * \param str
+ *      String to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+string_pack(const char *str, uint8_t *out)
+{
+	if (str == NULL) {
+		out[0] = 0;
+		return 1;
 	} else {
-		size_t siz;
-		unsigned i;
-		/* CONSIDER: optimize this case a bit (by putting the loop inside the switch) */
-		unsigned rv = 0;
-
-		siz = sizeof_elt_in_repeated_array(field->type);
-		for (i = 0; i < count; i++) {
-			rv += required_field_pack_to_buffer(field, array, buffer);
-			array += siz;
-		}
-		return rv;
+		size_t len = strlen(str);
+		size_t rv = uint32_pack(len, out);
+		memcpy(out + rv, str, len);
+		return rv + len;
 	}
 }
 
-static size_t
-unknown_field_pack_to_buffer(const ProtobufCMessageUnknownField *field,
-			     ProtobufCBuffer *buffer)
+/**
+ * Pack a ProtobufCBinaryData and return the number of bytes written. The output
+ * includes a length delimiter.
+ *
+ * \param bd
+ *      ProtobufCBinaryData to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+binary_data_pack(const ProtobufCBinaryData *bd, uint8_t *out)
 {
-	uint8_t header[MAX_UINT64_ENCODED_SIZE];
-	size_t rv = tag_pack(field->tag, header);
+	size_t len = bd->len;
+	size_t rv = uint32_pack(len, out);
+	memcpy(out + rv, bd->data, len);
+	return rv + len;
+}
 
-	header[0] |= field->wire_type;
-	buffer->append(buffer, rv, header);
-	buffer->append(buffer, field->len, field->data);
-	return rv + field->len;
-}
-
-/**@}*/
-
-size_t
-protobuf_c_message_pack_to_buffer(const ProtobufCMessage *message,
-				  ProtobufCBuffer *buffer)
+/**
+ * Pack a ProtobufCMessage and return the number of bytes written. The output
+ * includes a length delimiter.
+ *
+ * If the size of the message was recorded, the length delimiter is written
+ * first. Otherwise the message is packed after a one-byte gap and moved if
+ * its length turns out to need a longer delimiter.
+ *
+ * \param message
+ *      ProtobufCMessage object to pack.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] out
+ *      Packed message.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+prefixed_message_pack(const ProtobufCMessage *message, SizeCursor *cursor,
+		      uint8_t *out)
 {
-	unsigned i;
-	size_t rv = 0;
-
-	ASSERT_IS_MESSAGE(message);
-	for (i = 0; i < message->descriptor->n_fields; i++) {
-		const ProtobufCFieldDescriptor *field =
-			message->descriptor->fields + i;
-		const void *member =
-			((const char *) message) + field->offset;
-		const void *qmember =
-			((const char *) message) + field->quantifier_offset;
+	size_t size;
 
-		if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			rv += required_field_pack_to_buffer(field, member, buffer);
-		} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
-			    field->label == PROTOBUF_C_LABEL_NONE) &&
-			   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
-			rv += oneof_field_pack_to_buffer(
-				field,
-				*(const uint32_t *) qmember,
-				member,
-				buffer
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
-			rv += optional_field_pack_to_buffer(
-				field,
-				*(const protobuf_c_boolean *) qmember,
-				member,
-				buffer
-			);
-		} else if (field->label == PROTOBUF_C_LABEL_NONE) {
-			rv += unlabeled_field_pack_to_buffer(
-				field,
-				member,
-				buffer
-			);
-		} else {
-			rv += repeated_field_pack_to_buffer(
-				field,
-				*(const size_t *) qmember,
-				member,
-				buffer
-			);
-		}
+	if (message == NULL) {
+		out[0] = 0;
+		return 1;
+	} else if (size_cursor_next(cursor, &size)) {
+		size_t rv = uint32_pack(size, out);
+		return rv + message_pack(message, cursor, out + rv);
+	} else {
+		size_t rv = message_pack(message, NULL, out + 1);
+		uint32_t rv_packed_size = uint32_size(rv);
+		if (rv_packed_size != 1)
+			memmove(out + rv_packed_size, out + 1, rv);
+		return uint32_pack(rv, out) + rv;
 	}
-	for (i = 0; i < message->n_unknown_fields; i++)
-		rv += unknown_field_pack_to_buffer(&message->unknown_fields[i], buffer);
-
-	return rv;
 }
 
 /**
- * \defgroup unpack unpacking implementation
+ * Pack a field tag.
  *
- * Routines mainly used by the unpacking functions.
+ * Wire-type will be added in required_field_pack().
  *
- * \ingroup internal
- * @{
+ * \todo Just call uint64_pack on 64-bit platforms.
+ *
+ * \param id
+ *      Tag value to encode.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
  */
+static size_t
+tag_pack(uint32_t id, uint8_t *out)
+{
+	if (id < (1UL << (32 - 3)))
+		return uint32_pack(id << 3, out);
+	else
+		return uint64_pack(((uint64_t) id) << 3, out);
+}
 
-static inline int
-int_range_lookup(unsigned n_ranges, const ProtobufCIntRange *ranges, int value)
+/**
+ * Pack the tag of a field, using the encoding precomputed by protoc-c if there
+ * is one. The wire type is left for the caller to add, as with tag_pack().
+ *
+ * \param field
+ *      Field descriptor.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static inline size_t
+field_tag_pack(const ProtobufCFieldDescriptor *field, uint8_t *out)
 {
-	unsigned n;
-	unsigned start;
+	uint32_t bytes = field->tag_bytes;
 
-	if (n_ranges == 0)
-		return -1;
-	start = 0;
-	n = n_ranges;
-	while (n > 1) {
-		unsigned mid = start + n / 2;
+	if (bytes == 0)
+		return tag_pack(field->id, out);
+	out[0] = (uint8_t) bytes;
+	if (bytes < 0x100)
+		return 1;
+	out[1] = (uint8_t) (bytes >> 8);
+	if (bytes < 0x10000)
+		return 2;
+	out[2] = (uint8_t) (bytes >> 16);
+	if (bytes < 0x1000000)
+		return 3;
+	out[3] = (uint8_t) (bytes >> 24);
+	return 4;
+}
 
-		if (value < ranges[mid].start_value) {
-			n = mid - start;
-		} else if (value >= ranges[mid].start_value +
-			   (int) (ranges[mid + 1].orig_index -
-				  ranges[mid].orig_index))
-		{
-			unsigned new_start = mid + 1;
-			n = start + n - new_start;
-			start = new_start;
-		} else
-			return (value - ranges[mid].start_value) +
-			    ranges[mid].orig_index;
-	}
-	if (n > 0) {
-		unsigned start_orig_index = ranges[start].orig_index;
-		unsigned range_size =
-			ranges[start + 1].orig_index - start_orig_index;
+/**
+ * Pack a required field and return the number of bytes written.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The field member.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+required_field_pack(const ProtobufCFieldDescriptor *field,
+		    const void *member, SizeCursor *cursor, uint8_t *out)
+{
+	size_t rv = field_tag_pack(field, out);
 
-		if (ranges[start].start_value <= value &&
-		    value < (int) (ranges[start].start_value + range_size))
-		{
-			return (value - ranges[start].start_value) +
-			    start_orig_index;
-		}
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SINT32:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + sint32_pack(*(const int32_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + int32_pack(*(const int32_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_UINT32:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + uint32_pack(*(const uint32_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_SINT64:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + sint64_pack(*(const int64_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + uint64_pack(*(const uint64_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
+		return rv + fixed32_pack(*(const uint32_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
+		return rv + fixed64_pack(*(const uint64_t *) member, out + rv);
+	case PROTOBUF_C_TYPE_BOOL:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		return rv + boolean_pack(*(const protobuf_c_boolean *) member, out + rv);
+	case PROTOBUF_C_TYPE_STRING:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		return rv + string_pack(*(char *const *) member, out + rv);
+	case PROTOBUF_C_TYPE_BYTES:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		return rv + binary_data_pack((const ProtobufCBinaryData *) member, out + rv);
+	case PROTOBUF_C_TYPE_MESSAGE:
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		return rv + prefixed_message_pack(*(ProtobufCMessage * const *) member,
+						  cursor, out + rv);
 	}
-	return -1;
+	PROTOBUF_C__ASSERT_NOT_REACHED();
+	return 0;
 }
 
+/**
+ * Pack a oneof field and return the number of bytes written. Only packs the
+ * field that is selected by the case enum.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param oneof_case
+ *      Enum value that selects the field in the oneof.
+ * \param member
+ *      The field member.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
 static size_t
-parse_tag_and_wiretype(size_t len,
-		       const uint8_t *data,
-		       uint32_t *tag_out,
-		       ProtobufCWireType *wiretype_out)
+oneof_field_pack(const ProtobufCFieldDescriptor *field,
+		 uint32_t oneof_case,
+		 const void *member, SizeCursor *cursor, uint8_t *out)
 {
-	unsigned max_rv = len > 5 ? 5 : len;
-	uint32_t tag = (data[0] & 0x7f) >> 3;
-	unsigned shift = 4;
-	unsigned rv;
-
-	*wiretype_out = data[0] & 7;
-	if ((data[0] & 0x80) == 0) {
-		*tag_out = tag;
-		return 1;
+	if (oneof_case != field->id) {
+		return 0;
 	}
-	for (rv = 1; rv < max_rv; rv++) {
-		if (data[rv] & 0x80) {
-			tag |= (data[rv] & 0x7f) << shift;
-			shift += 7;
-		} else {
-			tag |= data[rv] << shift;
-			*tag_out = tag;
-			return rv + 1;
-		}
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void * const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return 0;
 	}
-	return 0; /* error: bad header */
+	return required_field_pack(field, member, cursor, out);
 }
 
-/* sizeof(ScannedMember) must be <= (1UL<<BOUND_SIZEOF_SCANNED_MEMBER_LOG2) */
-#define BOUND_SIZEOF_SCANNED_MEMBER_LOG2 5
-typedef struct _ScannedMember ScannedMember;
-/** Field as it's being read. */
-struct _ScannedMember {
-	uint32_t tag;              /**< Field tag. */
-	uint8_t wire_type;         /**< Field type. */
-	uint8_t length_prefix_len; /**< Prefix length. */
-	const ProtobufCFieldDescriptor *field; /**< Field descriptor. */
-	size_t len;                /**< Field length. */
-	const uint8_t *data;       /**< Pointer to field data. */
-};
-
-static inline uint32_t
-scan_length_prefixed_data(size_t len, const uint8_t *data,
-			  size_t *prefix_len_out)
+/**
+ * Pack an optional field and return the number of bytes written.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param has
+ *      Whether the field is set.
+ * \param member
+ *      The field member.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
+static size_t
+optional_field_pack(const ProtobufCFieldDescriptor *field,
+		    const protobuf_c_boolean has,
+		    const void *member, SizeCursor *cursor, uint8_t *out)
 {
-	unsigned hdr_max = len < 5 ? len : 5;
-	unsigned hdr_len;
-	uint32_t val = 0;
-	unsigned i;
-	unsigned shift = 0;
-
-	for (i = 0; i < hdr_max; i++) {
-		val |= (data[i] & 0x7f) << shift;
-		shift += 7;
-		if ((data[i] & 0x80) == 0)
-			break;
-	}
-	if (i == hdr_max) {
-		PROTOBUF_C_UNPACK_ERROR("error parsing length for length-prefixed data");
-		return 0;
-	}
-	hdr_len = i + 1;
-	*prefix_len_out = hdr_len;
-	if (hdr_len + val > len) {
-		PROTOBUF_C_UNPACK_ERROR("data too short after length-prefix of %u", val);
-		return 0;
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void * const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return 0;
+	} else {
+		if (!has)
+			return 0;
 	}
-	return hdr_len + val;
+	return required_field_pack(field, member, cursor, out);
 }
 
+/**
+ * Pack an unlabeled field and return the number of bytes written.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The field member.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] out
+ *      Packed value.
+ * \return
+ *      Number of bytes written to `out`.
+ */
 static size_t
-max_b128_numbers(size_t len, const uint8_t *data)
+unlabeled_field_pack(const ProtobufCFieldDescriptor *field,
+		     const void *member, SizeCursor *cursor, uint8_t *out)
 {
-	size_t rv = 0;
-	while (len--)
-		if ((*data++ & 0x80) == 0)
-			++rv;
-	return rv;
+	if (field_is_zeroish(field, member))
+		return 0;
+	return required_field_pack(field, member, cursor, out);
 }
 
-/**@}*/
+/**
+ * Given a field type, return the in-memory size.
+ *
+ * \todo Implement as a table lookup.
+ *
+ * \param type
+ *      Field type.
+ * \return
+ *      Size of the field.
+ */
+static inline size_t
+sizeof_elt_in_repeated_array(ProtobufCType type)
+{
+	switch (type) {
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+	case PROTOBUF_C_TYPE_ENUM:
+		return 4;
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return 8;
+	case PROTOBUF_C_TYPE_BOOL:
+		return sizeof(protobuf_c_boolean);
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_MESSAGE:
+		return sizeof(void *);
+	case PROTOBUF_C_TYPE_BYTES:
+		return sizeof(ProtobufCBinaryData);
+	}
+	PROTOBUF_C__ASSERT_NOT_REACHED();
+	return 0;
+}
 
 /**
- * Merge earlier message into a latter message.
+ * Pack an array of 32-bit quantities.
  *
- * For numeric types and strings, if the same value appears multiple
- * times, the parser accepts the last value it sees. For embedded
- * message fields, the parser merges multiple instances of the same
- * field. That is, all singular scalar fields in the latter instance
- * replace those in the former, singular embedded messages are merged,
- * and repeated fields are concatenated.
+ * \param[out] out
+ *      Destination.
+ * \param[in] in
+ *      Source.
+ * \param[in] n
+ *      Number of elements in the source array.
+ */
+static void
+copy_to_little_endian_32(void *out, const void *in, const unsigned n)
+{
+#if !defined(WORDS_BIGENDIAN)
+	memcpy(out, in, n * 4);
+#else
+	unsigned i;
+	const uint32_t *ini = in;
+	for (i = 0; i < n; i++)
+		fixed32_pack(ini[i], (uint32_t *) out + i);
+#endif
+}
+
+/**
+ * Pack an array of 64-bit quantities.
  *
- * The earlier message should be freed after calling this function, as
- * some of its fields may have been reused and changed to their default
- * values during the merge.
+ * \param[out] out
+ *      Destination.
+ * \param[in] in
+ *      Source.
+ * \param[in] n
+ *      Number of elements in the source array.
  */
-static protobuf_c_boolean
-merge_messages(ProtobufCMessage *earlier_msg,
-	       ProtobufCMessage *latter_msg,
-	       ProtobufCAllocator *allocator)
+static void
+copy_to_little_endian_64(void *out, const void *in, const unsigned n)
 {
+#if !defined(WORDS_BIGENDIAN)
+	memcpy(out, in, n * 8);
+#else
 	unsigned i;
-	const ProtobufCFieldDescriptor *fields =
-		latter_msg->descriptor->fields;
-	for (i = 0; i < latter_msg->descriptor->n_fields; i++) {
-		if (fields[i].label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t *n_earlier =
-				STRUCT_MEMBER_PTR(size_t, earlier_msg,
-						  fields[i].quantifier_offset);
-			uint8_t **p_earlier =
-				STRUCT_MEMBER_PTR(uint8_t *, earlier_msg,
-						  fields[i].offset);
-			size_t *n_latter =
-				STRUCT_MEMBER_PTR(size_t, latter_msg,
-						  fields[i].quantifier_offset);
-			uint8_t **p_latter =
-				STRUCT_MEMBER_PTR(uint8_t *, latter_msg,
-						  fields[i].offset);
+	const uint64_t *ini = in;
+	for (i = 0; i < n; i++)
+		fixed64_pack(ini[i], (uint64_t *) out + i);
+#endif
+}
 
-			if (*n_earlier > 0) {
-				if (*n_latter > 0) {
-					/* Concatenate the repeated field */
-					size_t el_size =
-						sizeof_elt_in_repeated_array(fields[i].type);
-					uint8_t *new_field;
+/**
+ * Get the minimum number of bytes required to pack a field value of a
+ * particular type.
+ *
+ * \param type
+ *      Field type.
+ * \return
+ *      Number of bytes.
+ */
+static unsigned
+get_type_min_size(ProtobufCType type)
+{
+	if (type == PROTOBUF_C_TYPE_SFIXED32 ||
+	    type == PROTOBUF_C_TYPE_FIXED32 ||
+	    type == PROTOBUF_C_TYPE_FLOAT)
+	{
+		return 4;
+	}
+	if (type == PROTOBUF_C_TYPE_SFIXED64 ||
+	    type == PROTOBUF_C_TYPE_FIXED64 ||
+	    type == PROTOBUF_C_TYPE_DOUBLE)
+	{
+		return 8;
+	}
+	return 1;
+}
 
-					new_field = do_alloc(allocator,
-						(*n_earlier + *n_latter) * el_size);
-					if (!new_field)
-						return FALSE;
+/**
+ * Packs the elements of a repeated field and returns the serialised field and
+ * its length.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param count
+ *      Number of elements in the repeated field array.
+ * \param member
+ *      Pointer to the elements for this repeated field.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] out
+ *      Serialised representation of the repeated field.
+ * \return
+ *      Number of bytes serialised to `out`.
+ */
+static size_t
+repeated_field_pack(const ProtobufCFieldDescriptor *field,
+		    size_t count, const void *member, SizeCursor *cursor,
+		    uint8_t *out)
+{
+	void *array = *(void * const *) member;
+	unsigned i;
 
-					memcpy(new_field, *p_earlier,
-					       *n_earlier * el_size);
-					memcpy(new_field +
-					       *n_earlier * el_size,
-					       *p_latter,
-					       *n_latter * el_size);
+	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
+		unsigned header_len;
+		unsigned len_start;
+		unsigned min_length;
+		unsigned payload_len;
+		unsigned length_size_min;
+		unsigned actual_length_size;
+		uint8_t *payload_at;
 
-					do_free(allocator, *p_latter);
-					do_free(allocator, *p_earlier);
+		if (count == 0)
+			return 0;
+		header_len = field_tag_pack(field, out);
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		len_start = header_len;
+		min_length = get_type_min_size(field->type) * count;
+		length_size_min = uint32_size(min_length);
+		header_len += length_size_min;
+		payload_at = out + header_len;
+
+		switch (field->type) {
+		case PROTOBUF_C_TYPE_SFIXED32:
+		case PROTOBUF_C_TYPE_FIXED32:
+		case PROTOBUF_C_TYPE_FLOAT:
+			copy_to_little_endian_32(payload_at, array, count);
+			payload_at += count * 4;
+			break;
+		case PROTOBUF_C_TYPE_SFIXED64:
+		case PROTOBUF_C_TYPE_FIXED64:
+		case PROTOBUF_C_TYPE_DOUBLE:
+			copy_to_little_endian_64(payload_at, array, count);
+			payload_at += count * 8;
+			break;
+		case PROTOBUF_C_TYPE_ENUM:
+		case PROTOBUF_C_TYPE_INT32: {
+			const int32_t *arr = (const int32_t *) array;
+			for (i = 0; i < count; i++)
+				payload_at += int32_pack(arr[i], payload_at);
+			break;
+		}
+		case PROTOBUF_C_TYPE_SINT32: {
+			const int32_t *arr = (const int32_t *) array;
+			for (i = 0; i < count; i++)
+				payload_at += sint32_pack(arr[i], payload_at);
+			break;
+		}
+		case PROTOBUF_C_TYPE_SINT64: {
+			const int64_t *arr = (const int64_t *) array;
+			for (i = 0; i < count; i++)
+				payload_at += sint64_pack(arr[i], payload_at);
+			break;
+		}
+		case PROTOBUF_C_TYPE_UINT32: {
+			const uint32_t *arr = (const uint32_t *) array;
+			for (i = 0; i < count; i++)
+				payload_at += uint32_pack(arr[i], payload_at);
+			break;
+		}
+		case PROTOBUF_C_TYPE_INT64:
+		case PROTOBUF_C_TYPE_UINT64: {
+			const uint64_t *arr = (const uint64_t *) array;
+			for (i = 0; i < count; i++)
+				payload_at += uint64_pack(arr[i], payload_at);
+			break;
+		}
+		case PROTOBUF_C_TYPE_BOOL: {
+			const protobuf_c_boolean *arr = (const protobuf_c_boolean *) array;
+			for (i = 0; i < count; i++)
+				payload_at += boolean_pack(arr[i], payload_at);
+			break;
+		}
+		default:
+			PROTOBUF_C__ASSERT_NOT_REACHED();
+		}
+
+		payload_len = payload_at - (out + header_len);
+		actual_length_size = uint32_size(payload_len);
+		if (length_size_min != actual_length_size) {
+			assert(actual_length_size == length_size_min + 1);
+			memmove(out + header_len + 1, out + header_len,
+				payload_len);
+			header_len++;
+		}
+		uint32_pack(payload_len, out + len_start);
+		return header_len + payload_len;
+	} else {
+		/* not "packed" cased */
+		/* CONSIDER: optimize this case a bit (by putting the loop inside the switch) */
+		size_t rv = 0;
+		unsigned siz = sizeof_elt_in_repeated_array(field->type);
+
+		for (i = 0; i < count; i++) {
+			rv += required_field_pack(field, array, cursor, out + rv);
+			array = (char *)array + siz;
+		}
+		return rv;
+	}
+}
+
+static size_t
+unknown_field_pack(const ProtobufCMessageUnknownField *field, uint8_t *out)
+{
+	size_t rv;
+
+	if (field->tag == 0) {
+		/* a raw run of fields, tags included */
+		memcpy(out, field->data, field->len);
+		return field->len;
+	}
+	rv = tag_pack(field->tag, out);
+	out[0] |= field->wire_type;
+	memcpy(out + rv, field->data, field->len);
+	return rv + field->len;
+}
+
+/**@}*/
+
+/**
+ * Return TRUE if the value of a field that isn't repeated is to be packed,
+ * with the same rules as oneof_field_pack(), optional_field_pack() and
+ * unlabeled_field_pack().
+ */
+static inline protobuf_c_boolean
+single_field_is_packed(const ProtobufCFieldDescriptor *field,
+		       const ProtobufCFieldHot *hot,
+		       const void *member, const void *qmember)
+{
+	if (hot->label == PROTOBUF_C_LABEL_REQUIRED)
+		return TRUE;
+	if (0 != (hot->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
+		if (*(const uint32_t *) qmember != hot->id)
+			return FALSE;
+	} else if (hot->label == PROTOBUF_C_LABEL_NONE) {
+		return !field_is_zeroish(field, member);
+	}
+	if (hot->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    hot->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void * const *) member;
+		return ptr != NULL && ptr != field->default_value;
+	}
+	if (0 != (hot->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))
+		return TRUE;
+	return *(const protobuf_c_boolean *) qmember;
+}
+
+/*
+ * Pack the fields of a message one after the other. The value of a field that
+ * isn't repeated is packed by the handler for its type, which then goes on to
+ * the next field: this is required_field_pack() spread over the loop.
+ */
+static size_t
+message_pack(const ProtobufCMessage *message, SizeCursor *cursor, uint8_t *out)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	const ProtobufCFieldDescriptor *field;
+	const ProtobufCFieldHot *hot;
+	ProtobufCFieldHot tmp;
+	const void *member;
+	const void *qmember;
+	uint8_t *tag;
+	unsigned i = 0;
+	size_t rv = 0;
+	TYPE_DISPATCH_TABLE(handlers, pack);
+
+	ASSERT_IS_MESSAGE(message);
+	if (cursor == NULL && message->n_unknown_fields == 0 &&
+	    desc->codec != NULL && desc->codec->pack != NULL)
+		return desc->codec->pack(message, out);
+
+next_field:
+	if (i == desc->n_fields)
+		goto unknown_fields;
+	hot = hot_field(desc, i, &tmp);
+	field = desc->fields + i++;
+	member = ((const char *) message) + hot->offset;
+
+	/*
+	 * It doesn't hurt to compute qmember (a pointer to the quantifier
+	 * field of the structure), but the pointer is only valid if the
+	 * field is:
+	 *  - a repeated field, or
+	 *  - a field that is part of a oneof
+	 *  - an optional field that isn't a pointer type
+	 * (Meaning: not a message or a string).
+	 */
+	qmember = ((const char *) message) + hot->quantifier_offset;
+
+	/* the field descriptor is only read for fields to be packed */
+	if (hot->label == PROTOBUF_C_LABEL_REPEATED) {
+		if (*(const size_t *) qmember != 0)
+			rv += repeated_field_pack(field, *(const size_t *) qmember,
+				member, cursor, out + rv);
+		goto next_field;
+	}
+	if (!single_field_is_packed(field, hot, member, qmember))
+		goto next_field;
+	tag = out + rv;
+	rv += field_tag_pack(field, tag);
+	TYPE_DISPATCH(handlers, pack, hot->type);
+
+pack_sint32:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+	rv += sint32_pack(*(const int32_t *) member, out + rv);
+	goto next_field;
+pack_enum:
+pack_int32:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+	rv += int32_pack(*(const int32_t *) member, out + rv);
+	goto next_field;
+pack_uint32:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+	rv += uint32_pack(*(const uint32_t *) member, out + rv);
+	goto next_field;
+pack_sint64:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+	rv += sint64_pack(*(const int64_t *) member, out + rv);
+	goto next_field;
+pack_int64:
+pack_uint64:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+	rv += uint64_pack(*(const uint64_t *) member, out + rv);
+	goto next_field;
+pack_sfixed32:
+pack_fixed32:
+pack_float:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
+	rv += fixed32_pack(*(const uint32_t *) member, out + rv);
+	goto next_field;
+pack_sfixed64:
+pack_fixed64:
+pack_double:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
+	rv += fixed64_pack(*(const uint64_t *) member, out + rv);
+	goto next_field;
+pack_bool:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+	rv += boolean_pack(*(const protobuf_c_boolean *) member, out + rv);
+	goto next_field;
+pack_string:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+	rv += string_pack(*(char *const *) member, out + rv);
+	goto next_field;
+pack_bytes:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+	rv += binary_data_pack((const ProtobufCBinaryData *) member, out + rv);
+	goto next_field;
+pack_message:
+	tag[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+	rv += prefixed_message_pack(*(ProtobufCMessage * const *) member,
+				    cursor, out + rv);
+	goto next_field;
+
+unknown_fields:
+	for (i = 0; i < message->n_unknown_fields; i++)
+		rv += unknown_field_pack(&message->unknown_fields[i], out + rv);
+	return rv;
+}
+
+size_t
+protobuf_c_message_pack(const ProtobufCMessage *message, uint8_t *out)
+{
+	return message_pack(message, NULL, out);
+}
+
+size_t
+protobuf_c_message_pack_cached(const ProtobufCMessage *message,
+			       const ProtobufCSizeCache *cache,
+			       uint8_t *out)
+{
+	SizeCursor cursor;
+
+	/* sizes[0] is the size of the message itself */
+	cursor.sizes = cache->sizes;
+	cursor.n_sizes = cache->n_sizes;
+	cursor.next = cache->n_sizes != 0 ? 1 : 0;
+	return message_pack(message, &cursor, out);
+}
+
+/**
+ * \defgroup packbuf protobuf_c_message_pack_to_buffer() implementation
+ *
+ * Routines mainly used by protobuf_c_message_pack_to_buffer().
+ *
+ * \ingroup internal
+ * @{
+ */
+
+/**
+ * Pack a required field to a virtual buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The element to be packed.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes packed.
+ */
+static size_t
+required_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			      const void *member, SizeCursor *cursor,
+			      ProtobufCBuffer *buffer)
+{
+	size_t rv;
+	uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
+
+	if (field->type != PROTOBUF_C_TYPE_MESSAGE) {
+		/* write the field in place if the buffer can hand out room */
+		size_t data_len = 0;
+		size_t ref_threshold = buffer_ref_threshold(buffer);
+		size_t field_len;
+		uint8_t *out = NULL;
+
+		if (field->type == PROTOBUF_C_TYPE_STRING) {
+			const char *str = *(char * const *) member;
+			data_len = str ? strlen(str) : 0;
+			field_len = get_tag_size(field->id) +
+				uint32_size(data_len) + data_len;
+		} else if (field->type == PROTOBUF_C_TYPE_BYTES) {
+			data_len = ((const ProtobufCBinaryData *) member)->len;
+			field_len = get_tag_size(field->id) +
+				uint32_size(data_len) + data_len;
+		} else {
+			field_len = required_field_get_packed_size(field,
+								   member,
+								   NULL);
+		}
+		/* large strings and bytes are better referenced than copied */
+		if (ref_threshold == 0 || data_len < ref_threshold)
+			out = buffer_reserve(buffer, field_len);
+		if (out != NULL) {
+			rv = required_field_pack(field, member, NULL, out);
+			buffer_commit(buffer, rv);
+			return rv;
+		}
+	}
+
+	rv = field_tag_pack(field, scratch);
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SINT32:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += sint32_pack(*(const int32_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += int32_pack(*(const int32_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += uint32_pack(*(const uint32_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_SINT64:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += sint64_pack(*(const int64_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += uint64_pack(*(const uint64_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_32BIT;
+		rv += fixed32_pack(*(const uint32_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_64BIT;
+		rv += fixed64_pack(*(const uint64_t *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_VARINT;
+		rv += boolean_pack(*(const protobuf_c_boolean *) member, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		break;
+	case PROTOBUF_C_TYPE_STRING: {
+		const char *str = *(char *const *) member;
+		size_t sublen = str ? strlen(str) : 0;
+
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(sublen, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		buffer_append_data(buffer, sublen, (const uint8_t *) str);
+		rv += sublen;
+		break;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		const ProtobufCBinaryData *bd = ((const ProtobufCBinaryData *) member);
+		size_t sublen = bd->len;
+
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(sublen, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		buffer_append_data(buffer, sublen, bd->data);
+		rv += sublen;
+		break;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		uint8_t simple_buffer_scratch[256];
+		size_t sublen;
+		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
+		ProtobufCBufferSimple simple_buffer =
+			PROTOBUF_C_BUFFER_SIMPLE_INIT(simple_buffer_scratch);
+
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		if (msg != NULL && size_cursor_next(cursor, &sublen)) {
+			/* length is known up front, append msg directly */
+			rv += uint32_pack(sublen, scratch + rv);
+			buffer->append(buffer, rv, scratch);
+			rv += message_pack_to_buffer(msg, cursor, buffer);
+			break;
+		}
+		if (msg != NULL && buffer_ref_threshold(buffer) != 0) {
+			/*
+			 * Packing through a temporary buffer would copy the
+			 * data meant to be referenced; size it instead.
+			 */
+			sublen = message_get_packed_size(msg, NULL);
+			rv += uint32_pack(sublen, scratch + rv);
+			buffer->append(buffer, rv, scratch);
+			rv += message_pack_to_buffer(msg, NULL, buffer);
+			break;
+		}
+		if (msg == NULL)
+			sublen = 0;
+		else
+			sublen = message_pack_to_buffer(msg, NULL, &simple_buffer.base);
+		rv += uint32_pack(sublen, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		buffer->append(buffer, sublen, simple_buffer.data);
+		rv += sublen;
+		PROTOBUF_C_BUFFER_SIMPLE_CLEAR(&simple_buffer);
+		break;
+	}
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return rv;
+}
+
+/**
+ * Pack a oneof field to a buffer. Only packs the field that is selected by the case enum.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param oneof_case
+ *      Enum value that selects the field in the oneof.
+ * \param member
+ *      The element to be packed.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes serialised to `buffer`.
+ */
+static size_t
+oneof_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			   uint32_t oneof_case,
+			   const void *member, SizeCursor *cursor,
+			   ProtobufCBuffer *buffer)
+{
+	if (oneof_case != field->id) {
+		return 0;
+	}
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void *const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return 0;
+	}
+	return required_field_pack_to_buffer(field, member, cursor, buffer);
+}
+
+/**
+ * Pack an optional field to a buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param has
+ *      Whether the field is set.
+ * \param member
+ *      The element to be packed.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes serialised to `buffer`.
+ */
+static size_t
+optional_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			      const protobuf_c_boolean has,
+			      const void *member, SizeCursor *cursor,
+			      ProtobufCBuffer *buffer)
+{
+	if (field->type == PROTOBUF_C_TYPE_MESSAGE ||
+	    field->type == PROTOBUF_C_TYPE_STRING)
+	{
+		const void *ptr = *(const void *const *) member;
+		if (ptr == NULL || ptr == field->default_value)
+			return 0;
+	} else {
+		if (!has)
+			return 0;
+	}
+	return required_field_pack_to_buffer(field, member, cursor, buffer);
+}
+
+/**
+ * Pack an unlabeled field to a buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param member
+ *      The element to be packed.
+ * \param cursor
+ *      Size cursor, or NULL if no sizes were recorded.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes serialised to `buffer`.
+ */
+static size_t
+unlabeled_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			       const void *member, SizeCursor *cursor,
+			       ProtobufCBuffer *buffer)
+{
+	if (field_is_zeroish(field, member))
+		return 0;
+	return required_field_pack_to_buffer(field, member, cursor, buffer);
+}
+
+/**
+ * Get the packed size of an array of same field type.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param count
+ *      Number of elements of this type.
+ * \param array
+ *      The elements to get the size of.
+ * \return
+ *      Number of bytes required.
+ */
+static size_t
+get_packed_payload_length(const ProtobufCFieldDescriptor *field,
+			  unsigned count, const void *array)
+{
+	unsigned rv = 0;
+	unsigned i;
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		return count * 4;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		return count * 8;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32: {
+		const int32_t *arr = (const int32_t *) array;
+		for (i = 0; i < count; i++)
+			rv += int32_size(arr[i]);
+		break;
+	}
+	case PROTOBUF_C_TYPE_SINT32: {
+		const int32_t *arr = (const int32_t *) array;
+		for (i = 0; i < count; i++)
+			rv += sint32_size(arr[i]);
+		break;
+	}
+	case PROTOBUF_C_TYPE_UINT32: {
+		const uint32_t *arr = (const uint32_t *) array;
+		for (i = 0; i < count; i++)
+			rv += uint32_size(arr[i]);
+		break;
+	}
+	case PROTOBUF_C_TYPE_SINT64: {
+		const int64_t *arr = (const int64_t *) array;
+		for (i = 0; i < count; i++)
+			rv += sint64_size(arr[i]);
+		break;
+	}
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64: {
+		const uint64_t *arr = (const uint64_t *) array;
+		for (i = 0; i < count; i++)
+			rv += uint64_size(arr[i]);
+		break;
+	}
+	case PROTOBUF_C_TYPE_BOOL:
+		return count;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return rv;
+}
+
+/**
+ * Pack an array of same field type to a virtual buffer.
+ *
+ * \param field
+ *      Field descriptor.
+ * \param count
+ *      Number of elements of this type.
+ * \param array
+ *      The elements to get the size of.
+ * \param[out] buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes packed.
+ */
+static size_t
+pack_buffer_packed_payload(const ProtobufCFieldDescriptor *field,
+			   unsigned count, const void *array,
+			   ProtobufCBuffer *buffer)
+{
+	uint8_t scratch[16];
+	size_t rv = 0;
+	unsigned i;
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+#if !defined(WORDS_BIGENDIAN)
+		rv = count * 4;
+		goto no_packing_needed;
+#else
+		for (i = 0; i < count; i++) {
+			unsigned len = fixed32_pack(((uint32_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+#if !defined(WORDS_BIGENDIAN)
+		rv = count * 8;
+		goto no_packing_needed;
+#else
+		for (i = 0; i < count; i++) {
+			unsigned len = fixed64_pack(((uint64_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		for (i = 0; i < count; i++) {
+			unsigned len = int32_pack(((int32_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+	case PROTOBUF_C_TYPE_SINT32:
+		for (i = 0; i < count; i++) {
+			unsigned len = sint32_pack(((int32_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		for (i = 0; i < count; i++) {
+			unsigned len = uint32_pack(((uint32_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+	case PROTOBUF_C_TYPE_SINT64:
+		for (i = 0; i < count; i++) {
+			unsigned len = sint64_pack(((int64_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		for (i = 0; i < count; i++) {
+			unsigned len = uint64_pack(((uint64_t *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		for (i = 0; i < count; i++) {
+			unsigned len = boolean_pack(((protobuf_c_boolean *) array)[i], scratch);
+			buffer->append(buffer, len, scratch);
+			rv += len;
+		}
+		return count;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	return rv;
+
+#if !defined(WORDS_BIGENDIAN)
+no_packing_needed:
+	buffer->append(buffer, rv, array);
+	return rv;
+#endif
+}
+
+static size_t
+repeated_field_pack_to_buffer(const ProtobufCFieldDescriptor *field,
+			      unsigned count, const void *member,
+			      SizeCursor *cursor, ProtobufCBuffer *buffer)
+{
+	char *array = *(char * const *) member;
+
+	if (count == 0)
+		return 0;
+	if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
+		uint8_t scratch[MAX_UINT64_ENCODED_SIZE * 2];
+		size_t rv = field_tag_pack(field, scratch);
+		size_t payload_len = get_packed_payload_length(field, count, array);
+		uint8_t *out = buffer_reserve(buffer, rv + uint32_size(payload_len) +
+						      payload_len);
+		size_t tmp;
+
+		if (out != NULL) {
+			tmp = repeated_field_pack(field, count, member, NULL, out);
+			buffer_commit(buffer, tmp);
+			return tmp;
+		}
+		scratch[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(payload_len, scratch + rv);
+		buffer->append(buffer, rv, scratch);
+		tmp = pack_buffer_packed_payload(field, count, array, buffer);
+		assert(tmp == payload_len);
+		return rv + payload_len;
+	} else {
+		size_t siz;
+		unsigned i;
+		/* CONSIDER: optimize this case a bit (by putting the loop inside the switch) */
+		unsigned rv = 0;
+
+		siz = sizeof_elt_in_repeated_array(field->type);
+		for (i = 0; i < count; i++) {
+			rv += required_field_pack_to_buffer(field, array, cursor,
+							    buffer);
+			array += siz;
+		}
+		return rv;
+	}
+}
+
+static size_t
+unknown_field_pack_to_buffer(const ProtobufCMessageUnknownField *field,
+			     ProtobufCBuffer *buffer)
+{
+	uint8_t header[MAX_UINT64_ENCODED_SIZE];
+	uint8_t *out;
+	size_t rv;
+
+	if (field->tag == 0) {
+		buffer_append_data(buffer, field->len, field->data);
+		return field->len;
+	}
+	if (buffer_ref_threshold(buffer) == 0 ||
+	    field->len < buffer_ref_threshold(buffer))
+		out = buffer_reserve(buffer,
+				     unknown_field_get_packed_size(field));
+	else
+		out = NULL;
+	if (out != NULL) {
+		rv = unknown_field_pack(field, out);
+		buffer_commit(buffer, rv);
+		return rv;
+	}
+	rv = tag_pack(field->tag, header);
+	header[0] |= field->wire_type;
+	buffer->append(buffer, rv, header);
+	buffer_append_data(buffer, field->len, field->data);
+	return rv + field->len;
+}
+
+/**@}*/
+
+static size_t
+message_pack_to_buffer(const ProtobufCMessage *message, SizeCursor *cursor,
+		       ProtobufCBuffer *buffer)
+{
+	unsigned i;
+	size_t rv = 0;
+
+	ASSERT_IS_MESSAGE(message);
+	for (i = 0; i < message->descriptor->n_fields; i++) {
+		ProtobufCFieldHot tmp;
+		const ProtobufCFieldHot *hot =
+			hot_field(message->descriptor, i, &tmp);
+		const ProtobufCFieldDescriptor *field =
+			message->descriptor->fields + i;
+		const void *member =
+			((const char *) message) + hot->offset;
+		const void *qmember =
+			((const char *) message) + hot->quantifier_offset;
+
+		/* the field descriptor is only read for fields to be packed */
+		if (hot->label == PROTOBUF_C_LABEL_REQUIRED) {
+			rv += required_field_pack_to_buffer(field, member, cursor,
+							    buffer);
+		} else if ((hot->label == PROTOBUF_C_LABEL_OPTIONAL ||
+			    hot->label == PROTOBUF_C_LABEL_NONE) &&
+			   (0 != (hot->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
+			if (*(const uint32_t *) qmember == hot->id)
+				rv += oneof_field_pack_to_buffer(
+					field,
+					*(const uint32_t *) qmember,
+					member,
+					cursor,
+					buffer
+				);
+		} else if (hot->label == PROTOBUF_C_LABEL_OPTIONAL) {
+			if (hot_optional_is_set(hot, member, qmember))
+				rv += optional_field_pack_to_buffer(
+					field,
+					*(const protobuf_c_boolean *) qmember,
+					member,
+					cursor,
+					buffer
+				);
+		} else if (hot->label == PROTOBUF_C_LABEL_NONE) {
+			rv += unlabeled_field_pack_to_buffer(
+				field,
+				member,
+				cursor,
+				buffer
+			);
+		} else if (*(const size_t *) qmember != 0) {
+			rv += repeated_field_pack_to_buffer(
+				field,
+				*(const size_t *) qmember,
+				member,
+				cursor,
+				buffer
+			);
+		}
+	}
+	for (i = 0; i < message->n_unknown_fields; i++)
+		rv += unknown_field_pack_to_buffer(&message->unknown_fields[i], buffer);
+
+	return rv;
+}
+
+size_t
+protobuf_c_message_pack_to_buffer(const ProtobufCMessage *message,
+				  ProtobufCBuffer *buffer)
+{
+	return message_pack_to_buffer(message, NULL, buffer);
+}
+
+size_t
+protobuf_c_message_pack_to_buffer_cached(const ProtobufCMessage *message,
+					 const ProtobufCSizeCache *cache,
+					 ProtobufCBuffer *buffer)
+{
+	SizeCursor cursor;
+
+	/* sizes[0] is the size of the message itself */
+	cursor.sizes = cache->sizes;
+	cursor.n_sizes = cache->n_sizes;
+	cursor.next = cache->n_sizes != 0 ? 1 : 0;
+	return message_pack_to_buffer(message, &cursor, buffer);
+}
+
+/**
+ * \defgroup packrev protobuf_c_message_pack_reverse() implementation
+ *
+ * Routines mainly used by protobuf_c_message_pack_reverse() and
+ * protobuf_c_message_pack_to_reverse_buffer().
+ *
+ * \ingroup internal
+ * @{
+ */
+
+/** Size of the first block a `ProtobufCReverseBuffer` allocates. */
+#define REVERSE_MIN_BLOCK_SIZE		4096
+
+/** Block sizes stop doubling once they reach this size. */
+#define REVERSE_MAX_BLOCK_SIZE		(1024 * 1024)
+
+struct ProtobufCReverseBufferBlock {
+	/** Next block in the chain, holding the data that follows. */
+	ProtobufCReverseBufferBlock	*next;
+	/** Number of usable bytes following the block header. */
+	size_t				size;
+	/** First byte of data once the block is no longer the front-most. */
+	uint8_t				*pos;
+};
+
+#define REVERSE_BLOCK_DATA(block)	((uint8_t *) ((block) + 1))
+
+/**
+ * State of a back-to-front serialisation. Data is written downwards from the
+ * end of the current block towards `start`.
+ */
+typedef struct {
+	/** Start of the current block. */
+	uint8_t			*start;
+	/** First byte written so far. */
+	uint8_t			*pos;
+	/** Number of bytes in the message so far, written or not. */
+	size_t			len;
+	/** Chain to grow, or NULL if the buffer is fixed. */
+	ProtobufCReverseBuffer	*rb;
+	/** Set once the buffer could not be grown. */
+	protobuf_c_boolean	failed;
+} RevWriter;
+
+static ProtobufCAllocator *
+reverse_buffer_allocator(const ProtobufCReverseBuffer *rb)
+{
+	return rb->allocator != NULL ? rb->allocator : &protobuf_c__allocator;
+}
+
+static void
+reverse_buffer_free_blocks(ProtobufCReverseBuffer *rb,
+			   ProtobufCReverseBufferBlock *last)
+{
+	ProtobufCAllocator *allocator = reverse_buffer_allocator(rb);
+
+	while (rb->blocks != last) {
+		ProtobufCReverseBufferBlock *next = rb->blocks->next;
+		do_free(allocator, rb->blocks);
+		rb->blocks = next;
+	}
+}
+
+/**
+ * Start a new front-most block with room for at least `n` bytes. Called by
+ * rev_reserve() once the current block is full.
+ */
+static uint8_t *
+rev_reserve_slow(RevWriter *w, size_t n)
+{
+	ProtobufCReverseBuffer *rb = w->rb;
+	ProtobufCReverseBufferBlock *block = NULL;
+	size_t size;
+
+	if (rb != NULL && !w->failed) {
+		size = rb->next_block_size;
+		if (size < n)
+			size = n;
+		if (size <= SIZE_MAX - sizeof(*block))
+			block = do_alloc(reverse_buffer_allocator(rb),
+					 sizeof(*block) + size);
+	}
+	if (block == NULL) {
+		/* Keep counting, but write nothing more. */
+		w->failed = TRUE;
+		w->start = w->pos;
+		return NULL;
+	}
+
+	if (rb->blocks != NULL)
+		rb->blocks->pos = w->pos;
+	else
+		rb->initial_pos = w->pos;
+	block->next = rb->blocks;
+	block->size = size;
+	rb->blocks = block;
+	if (rb->next_block_size < REVERSE_MAX_BLOCK_SIZE)
+		rb->next_block_size *= 2;
+
+	w->start = REVERSE_BLOCK_DATA(block);
+	w->pos = w->start + size - n;
+	return w->pos;
+}
+
+/**
+ * Account for `n` more bytes in front of the data written so far and return
+ * where they go, or NULL if there is no room for them.
+ */
+static inline uint8_t *
+rev_reserve(RevWriter *w, size_t n)
+{
+	w->len += n;
+	if ((size_t) (w->pos - w->start) >= n) {
+		w->pos -= n;
+		return w->pos;
+	}
+	return rev_reserve_slow(w, n);
+}
+
+static void rev_message(RevWriter *w, const ProtobufCMessage *message);
+
+/**
+ * Write a length-prefixed submessage. Its body goes first, so that the length
+ * is known when the prefix is written in front of it.
+ */
+static void
+rev_message_field(RevWriter *w, const ProtobufCFieldDescriptor *field,
+		  const ProtobufCMessage *message)
+{
+	size_t len = w->len;
+	uint8_t *out;
+
+	if (message != NULL)
+		rev_message(w, message);
+	len = w->len - len;
+	out = rev_reserve(w, get_tag_size(field->id) + uint32_size(len));
+	if (out != NULL) {
+		size_t rv = field_tag_pack(field, out);
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		uint32_pack(len, out + rv);
+	}
+}
+
+static void
+rev_message_member(RevWriter *w, const ProtobufCFieldDescriptor *field,
+		   const void *member, const void *qmember)
+{
+	const ProtobufCMessage *sub = *(ProtobufCMessage * const *) member;
+
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+		rev_message_field(w, field, sub);
+	} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
+		    field->label == PROTOBUF_C_LABEL_NONE) &&
+		   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
+		if (*(const uint32_t *) qmember == field->id &&
+		    sub != NULL && sub != field->default_value)
+			rev_message_field(w, field, sub);
+	} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
+		if (sub != NULL && sub != field->default_value)
+			rev_message_field(w, field, sub);
+	} else if (field->label == PROTOBUF_C_LABEL_NONE) {
+		if (sub != NULL)
+			rev_message_field(w, field, sub);
+	} else {
+		ProtobufCMessage * const *array =
+			*(ProtobufCMessage * const * const *) member;
+		size_t i = *(const size_t *) qmember;
+
+		while (i-- > 0)
+			rev_message_field(w, field, array[i]);
+	}
+}
+
+/**
+ * Write a field that doesn't hold submessages. Its size is known up front, so
+ * it is packed front to back into the space reserved for it.
+ */
+static void
+rev_scalar_member(RevWriter *w, const ProtobufCFieldDescriptor *field,
+		  const void *member, const void *qmember)
+{
+	size_t size;
+	uint8_t *out;
+
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+		size = required_field_get_packed_size(field, member, NULL);
+	} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
+		    field->label == PROTOBUF_C_LABEL_NONE) &&
+		   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
+		size = oneof_field_get_packed_size(field,
+			*(const uint32_t *) qmember, member, NULL);
+	} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
+		size = optional_field_get_packed_size(field,
+			*(const protobuf_c_boolean *) qmember, member, NULL);
+	} else if (field->label == PROTOBUF_C_LABEL_NONE) {
+		size = unlabeled_field_get_packed_size(field, member, NULL);
+	} else {
+		size = repeated_field_get_packed_size(field,
+			*(const size_t *) qmember, member, NULL);
+	}
+	if (size == 0)
+		return;
+	out = rev_reserve(w, size);
+	if (out == NULL)
+		return;
+
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+		required_field_pack(field, member, NULL, out);
+	} else if ((field->label == PROTOBUF_C_LABEL_OPTIONAL ||
+		    field->label == PROTOBUF_C_LABEL_NONE) &&
+		   (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))) {
+		oneof_field_pack(field, *(const uint32_t *) qmember, member,
+				 NULL, out);
+	} else if (field->label == PROTOBUF_C_LABEL_OPTIONAL) {
+		optional_field_pack(field, *(const protobuf_c_boolean *) qmember,
+				    member, NULL, out);
+	} else if (field->label == PROTOBUF_C_LABEL_NONE) {
+		unlabeled_field_pack(field, member, NULL, out);
+	} else {
+		repeated_field_pack(field, *(const size_t *) qmember, member,
+				    NULL, out);
+	}
+}
+
+static void
+rev_message(RevWriter *w, const ProtobufCMessage *message)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	unsigned i;
+
+	ASSERT_IS_MESSAGE(message);
+	for (i = message->n_unknown_fields; i-- > 0; ) {
+		const ProtobufCMessageUnknownField *ufield =
+			&message->unknown_fields[i];
+		uint8_t *out;
+
+		out = rev_reserve(w, unknown_field_get_packed_size(ufield));
+		if (out != NULL)
+			unknown_field_pack(ufield, out);
+	}
+	for (i = desc->n_fields; i-- > 0; ) {
+		const ProtobufCFieldDescriptor *field = desc->fields + i;
+		const void *member =
+			((const char *) message) + field->offset;
+		const void *qmember =
+			((const char *) message) + field->quantifier_offset;
+
+		if (field->type == PROTOBUF_C_TYPE_MESSAGE)
+			rev_message_member(w, field, member, qmember);
+		else
+			rev_scalar_member(w, field, member, qmember);
+	}
+}
+
+/**@}*/
+
+size_t
+protobuf_c_message_pack_reverse(const ProtobufCMessage *message,
+				size_t len, uint8_t *out)
+{
+	RevWriter w;
+
+	w.start = out;
+	w.pos = out != NULL ? out + len : NULL;
+	w.len = 0;
+	w.rb = NULL;
+	w.failed = FALSE;
+	rev_message(&w, message);
+	return w.len;
+}
+
+protobuf_c_boolean
+protobuf_c_message_pack_to_reverse_buffer(const ProtobufCMessage *message,
+					  ProtobufCReverseBuffer *rb)
+{
+	ProtobufCReverseBufferBlock *blocks = rb->blocks;
+	size_t next_block_size = rb->next_block_size;
+	RevWriter w;
+
+	w.start = blocks != NULL ? REVERSE_BLOCK_DATA(blocks) : rb->initial_block;
+	w.pos = rb->pos;
+	w.len = 0;
+	w.rb = rb;
+	w.failed = FALSE;
+	rev_message(&w, message);
+
+	if (w.failed) {
+		reverse_buffer_free_blocks(rb, blocks);
+		rb->next_block_size = next_block_size;
+		return FALSE;
+	}
+	rb->pos = w.pos;
+	rb->len += w.len;
+	return TRUE;
+}
+
+void
+protobuf_c_reverse_buffer_init(ProtobufCReverseBuffer *rb,
+			       void *initial_block,
+			       size_t initial_size,
+			       ProtobufCAllocator *allocator)
+{
+	rb->allocator = allocator;
+	rb->initial_block = initial_block;
+	rb->initial_size = initial_block != NULL ? initial_size : 0;
+	rb->blocks = NULL;
+	protobuf_c_reverse_buffer_clear(rb);
+}
+
+size_t
+protobuf_c_reverse_buffer_to_buffer(const ProtobufCReverseBuffer *rb,
+				    ProtobufCBuffer *buffer)
+{
+	const ProtobufCReverseBufferBlock *block;
+	const uint8_t *pos = rb->pos;
+
+	for (block = rb->blocks; block != NULL; block = block->next) {
+		const uint8_t *end = REVERSE_BLOCK_DATA(block) + block->size;
+
+		buffer->append(buffer, end - pos, pos);
+		pos = block->next != NULL ? block->next->pos : rb->initial_pos;
+	}
+	if (rb->initial_block != NULL) {
+		const uint8_t *end = rb->initial_block + rb->initial_size;
+
+		buffer->append(buffer, end - pos, pos);
+	}
+	return rb->len;
+}
+
+void
+protobuf_c_reverse_buffer_clear(ProtobufCReverseBuffer *rb)
+{
+	reverse_buffer_free_blocks(rb, NULL);
+	rb->pos = rb->initial_block != NULL ?
+		rb->initial_block + rb->initial_size : NULL;
+	rb->initial_pos = rb->pos;
+	rb->len = 0;
+	rb->next_block_size = REVERSE_MIN_BLOCK_SIZE;
+}
+
+/**
+ * \defgroup packstate protobuf_c_pack_state_pack() implementation
+ *
+ * Routines mainly used by protobuf_c_pack_state_pack(). The message is walked
+ * with an explicit stack of frames, one per message being packed, so that the
+ * walk can stop whenever the output buffer is full. Each step encodes the next
+ * tag, value or length prefix, and points `state->data` at any field contents
+ * that follow. Steps are encoded straight into the output while there is room
+ * for them, and into `state->pending` otherwise.
+ *
+ * \ingroup internal
+ * @{
+ */
+
+struct ProtobufCPackFrame {
+	/** Message being packed. */
+	const ProtobufCMessage	*message;
+	/** Index of the current field, then `n_fields` + unknown field index. */
+	unsigned		field;
+	/** Elements of the current field started; 1 + elements for packed. */
+	size_t			elem;
+};
+
+static protobuf_c_boolean
+pack_state_push(ProtobufCPackState *state, const ProtobufCMessage *message)
+{
+	ProtobufCPackFrame *frame;
+
+	if (state->n_frames == state->n_alloced) {
+		ProtobufCAllocator *allocator = state->allocator;
+		size_t new_alloced = state->n_alloced ? state->n_alloced * 2 : 8;
+		ProtobufCPackFrame *frames;
+
+		if (allocator == NULL)
+			allocator = &protobuf_c__allocator;
+		frames = do_alloc(allocator, new_alloced * sizeof(*frames));
+		if (frames == NULL)
+			return FALSE;
+		if (state->n_frames != 0)
+			memcpy(frames, state->frames,
+			       state->n_frames * sizeof(*frames));
+		do_free(allocator, state->frames);
+		state->frames = frames;
+		state->n_alloced = new_alloced;
+	}
+	frame = &state->frames[state->n_frames++];
+	frame->message = message;
+	frame->field = 0;
+	frame->elem = 0;
+	return TRUE;
+}
+
+/**
+ * Whether a field that isn't repeated is serialised, following the same rules
+ * as the *_field_pack() functions.
+ */
+static protobuf_c_boolean
+pack_state_field_present(const ProtobufCFieldDescriptor *field,
+			 const void *member, const void *qmember)
+{
+	protobuf_c_boolean is_pointer =
+		field->type == PROTOBUF_C_TYPE_MESSAGE ||
+		field->type == PROTOBUF_C_TYPE_STRING;
+
+	protobuf_c_boolean is_oneof =
+		0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF);
+
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED)
+		return TRUE;
+	if (is_oneof && *(const uint32_t *) qmember != field->id)
+		return FALSE;
+	if (is_oneof || field->label == PROTOBUF_C_LABEL_OPTIONAL) {
+		if (is_pointer) {
+			const void *ptr = *(const void * const *) member;
+			return ptr != NULL && ptr != field->default_value;
+		}
+		return is_oneof || *(const protobuf_c_boolean *) qmember;
+	}
+	return !field_is_zeroish(field, member);
+}
+
+/**
+ * Start a single field value: its tag, plus its value or length prefix.
+ * Submessages are pushed onto the stack, to be packed after their prefix.
+ */
+static protobuf_c_boolean
+pack_state_element(ProtobufCPackState *state,
+		   const ProtobufCFieldDescriptor *field, const void *member,
+		   uint8_t *out)
+{
+	size_t rv;
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_STRING: {
+		const char *str = *(char * const *) member;
+		size_t len = str ? strlen(str) : 0;
+
+		rv = field_tag_pack(field, out);
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(len, out + rv);
+		state->data = (const uint8_t *) str;
+		state->data_len = len;
+		break;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		const ProtobufCBinaryData *bd = member;
+
+		rv = field_tag_pack(field, out);
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(bd->len, out + rv);
+		state->data = bd->data;
+		state->data_len = bd->len;
+		break;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		const ProtobufCMessage *msg = *(ProtobufCMessage * const *) member;
+		size_t sublen = 0;
+
+		if (msg != NULL) {
+			/* the message must be unchanged since it was sized */
+			assert(state->next_size < state->cache.n_sizes);
+			sublen = state->cache.sizes[state->next_size++];
+			if (!pack_state_push(state, msg))
+				return FALSE;
+		}
+		rv = field_tag_pack(field, out);
+		out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+		rv += uint32_pack(sublen, out + rv);
+		break;
+	}
+	default:
+		rv = required_field_pack(field, member, NULL, out);
+		break;
+	}
+	state->pending_len = rv;
+	state->pending_pos = 0;
+	return TRUE;
+}
+
+/**
+ * Continue the payload of a packed repeated field: as many elements as fit in
+ * `room` bytes at `out`, or all remaining elements at once if their in-memory
+ * representation is already the wire format.
+ */
+static void
+pack_state_packed_elements(ProtobufCPackState *state,
+			   const ProtobufCFieldDescriptor *field,
+			   size_t count, const void *array,
+			   ProtobufCPackFrame *frame,
+			   uint8_t *out, size_t room)
+{
+	size_t i = frame->elem - 1;
+	size_t rv = 0;
+
+#if !defined(WORDS_BIGENDIAN)
+	if (field->type == PROTOBUF_C_TYPE_SFIXED32 ||
+	    field->type == PROTOBUF_C_TYPE_FIXED32 ||
+	    field->type == PROTOBUF_C_TYPE_FLOAT ||
+	    field->type == PROTOBUF_C_TYPE_SFIXED64 ||
+	    field->type == PROTOBUF_C_TYPE_FIXED64 ||
+	    field->type == PROTOBUF_C_TYPE_DOUBLE)
+	{
+		size_t siz = sizeof_elt_in_repeated_array(field->type);
+
+		state->data = (const uint8_t *) array + i * siz;
+		state->data_len = (count - i) * siz;
+		state->pending_len = 0;
+		state->pending_pos = 0;
+		frame->elem = count + 1;
+		return;
+	}
+#endif
+	/* stop while there is still room for the longest element */
+	room -= MAX_UINT64_ENCODED_SIZE;
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		for (; i < count && rv <= room; i++)
+			rv += fixed32_pack(((const uint32_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		for (; i < count && rv <= room; i++)
+			rv += fixed64_pack(((const uint64_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		for (; i < count && rv <= room; i++)
+			rv += int32_pack(((const int32_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_SINT32:
+		for (; i < count && rv <= room; i++)
+			rv += sint32_pack(((const int32_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		for (; i < count && rv <= room; i++)
+			rv += uint32_pack(((const uint32_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_SINT64:
+		for (; i < count && rv <= room; i++)
+			rv += sint64_pack(((const int64_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		for (; i < count && rv <= room; i++)
+			rv += uint64_pack(((const uint64_t *) array)[i], out + rv);
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		for (; i < count && rv <= room; i++)
+			rv += boolean_pack(((const protobuf_c_boolean *) array)[i],
+					   out + rv);
+		break;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	state->pending_len = rv;
+	state->pending_pos = 0;
+	frame->elem = i + 1;
+}
+
+/**
+ * Prepare the next piece of output, encoding its first `state->pending_len`
+ * bytes at `out`.
+ *
+ * \param state
+ *      Pack state.
+ * \param[out] out
+ *      Where to encode, either `state->pending` or the output buffer.
+ * \param room
+ *      Number of bytes available at `out`, at least `sizeof(state->pending)`.
+ * \return
+ *      TRUE if there is more output. FALSE once the message is complete or
+ *      memory ran out.
+ */
+static protobuf_c_boolean
+pack_state_next(ProtobufCPackState *state, uint8_t *out, size_t room)
+{
+	while (state->n_frames != 0) {
+		ProtobufCPackFrame *frame = &state->frames[state->n_frames - 1];
+		const ProtobufCMessage *message = frame->message;
+		const ProtobufCMessageDescriptor *desc = message->descriptor;
+		const ProtobufCFieldDescriptor *field;
+		const void *member;
+		const void *qmember;
+		size_t count;
+
+		if (frame->field >= desc->n_fields) {
+			const ProtobufCMessageUnknownField *ufield;
+			size_t rv = 0;
+
+			if (frame->field - desc->n_fields ==
+			    message->n_unknown_fields)
+			{
+				state->n_frames--;
+				continue;
+			}
+			ufield = &message->unknown_fields[frame->field++ -
+							  desc->n_fields];
+			if (ufield->tag != 0) {
+				rv = tag_pack(ufield->tag, out);
+				out[0] |= ufield->wire_type;
+			}
+			state->pending_len = rv;
+			state->pending_pos = 0;
+			state->data = ufield->data;
+			state->data_len = ufield->len;
+			return TRUE;
+		}
+
+		field = desc->fields + frame->field;
+		member = (const char *) message + field->offset;
+		qmember = (const char *) message + field->quantifier_offset;
+
+		if (field->label != PROTOBUF_C_LABEL_REPEATED) {
+			if (frame->elem++ == 0 &&
+			    pack_state_field_present(field, member, qmember))
+				return pack_state_element(state, field, member,
+							  out);
+			frame->field++;
+			frame->elem = 0;
+			continue;
+		}
+
+		count = *(const size_t *) qmember;
+		if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED)) {
+			const void *array = *(const void * const *) member;
+
+			if (count != 0 && frame->elem == 0) {
+				size_t rv = field_tag_pack(field, out);
+
+				out[0] |= PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+				rv += uint32_pack(get_packed_payload_length(
+					field, count, array), out + rv);
+				state->pending_len = rv;
+				state->pending_pos = 0;
+				frame->elem = 1;
+				return TRUE;
+			}
+			if (count != 0 && frame->elem <= count) {
+				pack_state_packed_elements(state, field, count,
+							   array, frame,
+							   out, room);
+				return TRUE;
+			}
+		} else if (frame->elem < count) {
+			const char *array = *(const char * const *) member;
+			size_t siz = sizeof_elt_in_repeated_array(field->type);
+
+			return pack_state_element(state, field,
+						  array + siz * frame->elem++,
+						  out);
+		}
+		frame->field++;
+		frame->elem = 0;
+	}
+	return FALSE;
+}
+
+/**@}*/
+
+protobuf_c_boolean
+protobuf_c_pack_state_init(ProtobufCPackState *state,
+			   const ProtobufCMessage *message,
+			   ProtobufCAllocator *allocator)
+{
+	state->allocator = allocator;
+	state->cache.n_sizes = 0;
+	state->cache.n_alloced = 0;
+	state->cache.sizes = NULL;
+	state->cache.allocator = allocator;
+	state->next_size = 0;
+	state->frames = NULL;
+	state->n_frames = 0;
+	state->n_alloced = 0;
+	state->pending_len = 0;
+	state->pending_pos = 0;
+	state->data = NULL;
+	state->data_len = 0;
+	state->n_written = 0;
+	state->failed = FALSE;
+
+	state->len = protobuf_c_message_get_packed_size_cached(message,
+							       &state->cache);
+	/* sizes[0] is the size of the message itself */
+	if (state->cache.n_sizes == 0 || !pack_state_push(state, message)) {
+		state->failed = TRUE;
+		return FALSE;
+	}
+	state->next_size = 1;
+	return TRUE;
+}
+
+size_t
+protobuf_c_pack_state_pack(ProtobufCPackState *state,
+			   size_t len, uint8_t *out)
+{
+	size_t rv = 0;
+
+	while (rv < len) {
+		size_t n;
+
+		if (state->pending_pos < state->pending_len) {
+			n = state->pending_len - state->pending_pos;
+			if (n > len - rv)
+				n = len - rv;
+			memcpy(out + rv, state->pending + state->pending_pos, n);
+			state->pending_pos += n;
+		} else if (state->data_len != 0) {
+			n = state->data_len;
+			if (n > len - rv)
+				n = len - rv;
+			memcpy(out + rv, state->data, n);
+			state->data += n;
+			state->data_len -= n;
+		} else {
+			uint8_t *dst = state->pending;
+			size_t room = sizeof(state->pending);
+
+			if (len - rv >= room) {
+				dst = out + rv;
+				room = len - rv;
+			}
+			if (state->failed || !pack_state_next(state, dst, room)) {
+				if (state->n_frames != 0)
+					state->failed = TRUE;
+				break;
+			}
+			if (dst == state->pending)
+				continue;
+			n = state->pending_len;
+			state->pending_len = 0;
+		}
+		rv += n;
+	}
+	state->n_written += rv;
+	return rv;
+}
+
+void
+protobuf_c_pack_state_clear(ProtobufCPackState *state)
+{
+	ProtobufCAllocator *allocator = state->allocator;
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	protobuf_c_size_cache_clear(&state->cache);
+	do_free(allocator, state->frames);
+	state->frames = NULL;
+	state->n_frames = 0;
+	state->n_alloced = 0;
+}
+
+/**
+ * \defgroup unpack unpacking implementation
+ *
+ * Routines mainly used by the unpacking functions.
+ *
+ * \ingroup internal
+ * @{
+ */
+
+static inline int
+int_range_lookup(unsigned n_ranges, const ProtobufCIntRange *ranges, int value)
+{
+	unsigned n;
+	unsigned start;
+
+	if (n_ranges == 0)
+		return -1;
+	start = 0;
+	n = n_ranges;
+	while (n > 1) {
+		unsigned mid = start + n / 2;
+
+		if (value < ranges[mid].start_value) {
+			n = mid - start;
+		} else if (value >= ranges[mid].start_value +
+			   (int) (ranges[mid + 1].orig_index -
+				  ranges[mid].orig_index))
+		{
+			unsigned new_start = mid + 1;
+			n = start + n - new_start;
+			start = new_start;
+		} else
+			return (value - ranges[mid].start_value) +
+			    ranges[mid].orig_index;
+	}
+	if (n > 0) {
+		unsigned start_orig_index = ranges[start].orig_index;
+		unsigned range_size =
+			ranges[start + 1].orig_index - start_orig_index;
+
+		if (ranges[start].start_value <= value &&
+		    value < (int) (ranges[start].start_value + range_size))
+		{
+			return (value - ranges[start].start_value) +
+			    start_orig_index;
+		}
+	}
+	return -1;
+}
+
+static size_t
+parse_tag_and_wiretype(size_t len,
+		       const uint8_t *data,
+		       uint32_t *tag_out,
+		       ProtobufCWireType *wiretype_out)
+{
+	unsigned max_rv = len > 5 ? 5 : len;
+	uint32_t tag = (data[0] & 0x7f) >> 3;
+	unsigned shift = 4;
+	unsigned rv;
+
+	*wiretype_out = data[0] & 7;
+	if ((data[0] & 0x80) == 0) {
+		*tag_out = tag;
+		return tag != 0 ? 1 : 0; /* field number 0 is invalid */
+	}
+	for (rv = 1; rv < max_rv; rv++) {
+		if (data[rv] & 0x80) {
+			tag |= (data[rv] & 0x7f) << shift;
+			shift += 7;
+		} else {
+			tag |= data[rv] << shift;
+			*tag_out = tag;
+			return tag != 0 ? rv + 1 : 0;
+		}
+	}
+	return 0; /* error: bad header */
+}
+
+/*
+ * Internal unpack flag, set by protobuf_c_message_unpack_into(): the message
+ * being unpacked still holds the values of a previous decode, and their
+ * storage is reused wherever it is large enough.
+ */
+#define UNPACK_FLAG_REUSE	(1U << 31)
+
+static protobuf_c_boolean
+unpack_reusing(ProtobufCMessage *message,
+	       ProtobufCAllocator *allocator,
+	       unsigned flags,
+	       size_t len, const uint8_t *data);
+
+/* sizeof(ScannedMember) must be <= (1UL<<BOUND_SIZEOF_SCANNED_MEMBER_LOG2) */
+#define BOUND_SIZEOF_SCANNED_MEMBER_LOG2 5
+typedef struct _ScannedMember ScannedMember;
+/** Field as it's being read. */
+struct _ScannedMember {
+	uint32_t tag;              /**< Field tag. */
+	uint8_t wire_type;         /**< Field type. */
+	uint8_t length_prefix_len; /**< Prefix length. */
+	uint8_t reuse;             /**< Field may reuse its old value. */
+	const ProtobufCFieldDescriptor *field; /**< Field descriptor. */
+	size_t len;                /**< Field length. */
+	const uint8_t *data;       /**< Pointer to field data. */
+};
+
+static inline uint32_t
+scan_length_prefixed_data(size_t len, const uint8_t *data,
+			  size_t *prefix_len_out)
+{
+	unsigned hdr_max = len < 5 ? len : 5;
+	unsigned hdr_len;
+	uint32_t val = 0;
+	unsigned i;
+	unsigned shift = 0;
+
+	for (i = 0; i < hdr_max; i++) {
+		val |= (uint32_t) (data[i] & 0x7f) << shift;
+		shift += 7;
+		if ((data[i] & 0x80) == 0)
+			break;
+	}
+	if (i == hdr_max) {
+		PROTOBUF_C_UNPACK_ERROR("error parsing length for length-prefixed data");
+		return 0;
+	}
+	hdr_len = i + 1;
+	*prefix_len_out = hdr_len;
+	if (val > len - hdr_len) {
+		PROTOBUF_C_UNPACK_ERROR("data too short after length-prefix of %u", val);
+		return 0;
+	}
+	return hdr_len + val;
+}
+
+/* every byte of a 64-bit word set to `b` */
+#define SWAR_BYTES(b)	(UINT64_C(0x0101010101010101) * (b))
+
+/*
+ * Count the bytes without a continuation bit, eight at a time: they are moved
+ * to the low bit of their byte, and multiplying by SWAR_BYTES(1) sums all
+ * bytes into the top one.
+ */
+static size_t
+max_b128_numbers(size_t len, const uint8_t *data)
+{
+	size_t rv = 0;
+	uint64_t word;
+
+	for (; len >= 8; len -= 8, data += 8) {
+		memcpy(&word, data, 8);
+		word = (~word & SWAR_BYTES(0x80)) >> 7;
+		rv += (size_t) ((word * SWAR_BYTES(1)) >> 56);
+	}
+	while (len--)
+		if ((*data++ & 0x80) == 0)
+			++rv;
+	return rv;
+}
+
+/**
+ * Find the index in `desc->fields` of the field with the given tag, using the
+ * descriptor's hash index if it has one.
+ *
+ * \return
+ *      The field index, or -1 if there is no such field.
+ */
+static inline int
+field_index_lookup(const ProtobufCMessageDescriptor *desc, uint32_t tag)
+{
+	const ProtobufCFieldTagIndex *index = desc->field_tag_index;
+	unsigned i;
+	unsigned slot;
+
+	if (index == NULL)
+		return int_range_lookup(desc->n_field_ranges,
+					desc->field_ranges, tag);
+	for (i = tag & index->mask;
+	     (slot = index->slots[i]) != 0;
+	     i = (i + 1) & index->mask)
+	{
+		if (desc->fields[slot - 1].id == tag)
+			return slot - 1;
+	}
+	return -1;
+}
+
+/**
+ * Find the descriptor of the field with the given tag.
+ *
+ * `last_field` and `last_field_index` remember the previous match. The field
+ * looked up is very often that one again (repeated fields), or the one after
+ * it, since fields are usually serialised in tag order.
+ *
+ * \return
+ *      The field descriptor, or NULL for an unknown field.
+ */
+static inline const ProtobufCFieldDescriptor *
+lookup_scanned_field(const ProtobufCMessageDescriptor *desc,
+		     uint32_t tag,
+		     const ProtobufCFieldDescriptor **last_field,
+		     unsigned *last_field_index)
+{
+	int field_index;
+
+	if (*last_field != NULL) {
+		if ((*last_field)->id == tag)
+			return *last_field;
+		if (*last_field_index + 1 < desc->n_fields &&
+		    (*last_field)[1].id == tag)
+		{
+			++*last_field_index;
+			return ++*last_field;
+		}
+	}
+
+	field_index = field_index_lookup(desc, tag);
+	if (field_index < 0)
+		return NULL;
+	*last_field = desc->fields + field_index;
+	*last_field_index = field_index;
+	return *last_field;
+}
+
+/**
+ * Parse the tag and wire type at `at` and find the descriptor of its field.
+ *
+ * Two-byte tags, those of fields 16 to 2047, are compared as they are against
+ * the precomputed tag bytes of the fields lookup_scanned_field() would guess,
+ * which saves decoding them in the common case. Single-byte tags are as quick
+ * to decode, and longer ones are rare.
+ *
+ * \param[out] field_out
+ *      The field descriptor, or NULL for an unknown field.
+ * \return
+ *      Number of bytes used by the tag, or 0 if it is malformed.
+ */
+static inline size_t
+scan_field_tag(const ProtobufCMessageDescriptor *desc,
+	       size_t rem, const uint8_t *at,
+	       uint32_t *tag_out,
+	       ProtobufCWireType *wiretype_out,
+	       const ProtobufCFieldDescriptor **field_out,
+	       const ProtobufCFieldDescriptor **last_field,
+	       unsigned *last_field_index)
+{
+	size_t used;
+
+	if ((at[0] & 0x80) != 0 && rem >= 2 && *last_field != NULL) {
+		/* no other tag, nor a padded encoding, has the same two bytes */
+		uint32_t bytes = (at[0] & ~7) | ((uint32_t) at[1] << 8);
+		const ProtobufCFieldDescriptor *field = *last_field;
+
+		if (field->tag_bytes != bytes &&
+		    *last_field_index + 1 < desc->n_fields &&
+		    field[1].tag_bytes == bytes)
+		{
+			++*last_field_index;
+			field = ++*last_field;
+		}
+		if (field->tag_bytes == bytes) {
+			*tag_out = field->id;
+			*wiretype_out = at[0] & 7;
+			*field_out = field;
+			return 2;
+		}
+	}
+	used = parse_tag_and_wiretype(rem, at, tag_out, wiretype_out);
+	if (used != 0)
+		*field_out = lookup_scanned_field(desc, *tag_out,
+						  last_field, last_field_index);
+	return used;
+}
+
+/**
+ * Determine the extent of the field data starting at `at`, whose tag and wire
+ * type have already been stored in `scanned_member`.
+ *
+ * Fills in the `data`, `len` and `length_prefix_len` members.
+ *
+ * \param rem
+ *      Number of bytes available at `at`.
+ * \param at
+ *      Start of the field data.
+ * \param start
+ *      Start of the message, used for error reporting.
+ * \param scanned_member
+ *      Field being scanned.
+ * \return
+ *      TRUE on success, FALSE if the data is truncated or malformed.
+ */
+static inline protobuf_c_boolean
+scan_member_data(size_t rem, const uint8_t *at, const uint8_t *start,
+		 ScannedMember *scanned_member)
+{
+	/* only read by PROTOBUF_C_UNPACK_ERROR(), which may expand to nothing */
+	(void) start;
+	scanned_member->data = at;
+	scanned_member->length_prefix_len = 0;
+
+	switch (scanned_member->wire_type) {
+	case PROTOBUF_C_WIRE_TYPE_VARINT: {
+		unsigned max_len = rem < 10 ? rem : 10;
+		unsigned i;
+
+		for (i = 0; i < max_len; i++)
+			if ((at[i] & 0x80) == 0)
+				break;
+		if (i == max_len) {
+			PROTOBUF_C_UNPACK_ERROR("unterminated varint at offset %u",
+						(unsigned) (at - start));
+			return FALSE;
+		}
+		scanned_member->len = i + 1;
+		return TRUE;
+	}
+	case PROTOBUF_C_WIRE_TYPE_64BIT:
+		if (rem < 8) {
+			PROTOBUF_C_UNPACK_ERROR("too short after 64bit wiretype at offset %u",
+						(unsigned) (at - start));
+			return FALSE;
+		}
+		scanned_member->len = 8;
+		return TRUE;
+	case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED: {
+		size_t pref_len;
+
+		scanned_member->len = scan_length_prefixed_data(rem, at, &pref_len);
+		if (scanned_member->len == 0) {
+			/* NOTE: scan_length_prefixed_data calls UNPACK_ERROR */
+			return FALSE;
+		}
+		scanned_member->length_prefix_len = pref_len;
+		return TRUE;
+	}
+	case PROTOBUF_C_WIRE_TYPE_32BIT:
+		if (rem < 4) {
+			PROTOBUF_C_UNPACK_ERROR("too short after 32bit wiretype at offset %u",
+				      (unsigned) (at - start));
+			return FALSE;
+		}
+		scanned_member->len = 4;
+		return TRUE;
+	default:
+		PROTOBUF_C_UNPACK_ERROR("unsupported tag %u at offset %u",
+					scanned_member->wire_type,
+					(unsigned) (at - start));
+		return FALSE;
+	}
+}
+
+/**
+ * Return the number of payload bytes parsing a scanned member will allocate,
+ * rounded the way arena_alloc() rounds them.
+ */
+static size_t
+contiguous_member_size(const ScannedMember *scanned_member, unsigned flags)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	size_t len = scanned_member->len - scanned_member->length_prefix_len;
+
+	if (field == NULL) {
+		if (scanned_member->tag == 0 &&
+		    (flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES))
+			return 0;
+		return ARENA_ALIGN(scanned_member->len);
+	}
+	if (scanned_member->wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+		return 0;
+	if (field->type == PROTOBUF_C_TYPE_STRING &&
+	    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS))
+		return ARENA_ALIGN(len + 1);
+	if (field->type == PROTOBUF_C_TYPE_BYTES && len > 0 &&
+	    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES))
+		return ARENA_ALIGN(len);
+	return 0;
+}
+
+/**
+ * Return the allocator that nested messages should be unpacked with.
+ *
+ * With PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS, members are parsed with the payload
+ * arena of the enclosing message, but each nested message gets its own.
+ */
+static inline ProtobufCAllocator *
+message_allocator(ProtobufCAllocator *allocator, unsigned flags)
+{
+	if ((flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS) &&
+	    allocator->free == &arena_free)
+		return ((ProtobufCArena *) allocator->allocator_data)->parent;
+	return allocator;
+}
+
+/**@}*/
+
+/**
+ * Merge earlier message into a latter message.
+ *
+ * For numeric types and strings, if the same value appears multiple
+ * times, the parser accepts the last value it sees. For embedded
+ * message fields, the parser merges multiple instances of the same
+ * field. That is, all singular scalar fields in the latter instance
+ * replace those in the former, singular embedded messages are merged,
+ * and repeated fields are concatenated.
+ *
+ * The earlier message should be freed after calling this function, as
+ * some of its fields may have been reused and changed to their default
+ * values during the merge.
+ */
+static protobuf_c_boolean
+merge_messages(ProtobufCMessage *earlier_msg,
+	       ProtobufCMessage *latter_msg,
+	       ProtobufCAllocator *allocator,
+	       unsigned flags)
+{
+	unsigned i;
+	const ProtobufCFieldDescriptor *fields =
+		latter_msg->descriptor->fields;
+
+	if (flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS) {
+		/*
+		 * Payloads of the earlier message may be zero-copied into the
+		 * latter one, so the latter takes over the earlier's memory.
+		 */
+		ProtobufCArena *earlier = CONTIGUOUS_PAYLOAD(earlier_msg);
+		ProtobufCArena *latter = CONTIGUOUS_PAYLOAD(latter_msg);
+
+		if (latter == NULL) {
+			CONTIGUOUS_PAYLOAD(latter_msg) = earlier;
+			latter = earlier;
+		} else if (earlier != NULL) {
+			contiguous_payload_splice(latter, earlier);
+		}
+		CONTIGUOUS_PAYLOAD(earlier_msg) = NULL;
+		if (latter != NULL)
+			allocator = &latter->base;
+	}
+	for (i = 0; i < latter_msg->descriptor->n_fields; i++) {
+		if (fields[i].label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t *n_earlier =
+				STRUCT_MEMBER_PTR(size_t, earlier_msg,
+						  fields[i].quantifier_offset);
+			uint8_t **p_earlier =
+				STRUCT_MEMBER_PTR(uint8_t *, earlier_msg,
+						  fields[i].offset);
+			size_t *n_latter =
+				STRUCT_MEMBER_PTR(size_t, latter_msg,
+						  fields[i].quantifier_offset);
+			uint8_t **p_latter =
+				STRUCT_MEMBER_PTR(uint8_t *, latter_msg,
+						  fields[i].offset);
+
+			if (*n_earlier > 0) {
+				if (*n_latter > 0) {
+					/* Concatenate the repeated field */
+					size_t el_size =
+						sizeof_elt_in_repeated_array(fields[i].type);
+					uint8_t *new_field;
+
+					new_field = do_alloc(allocator,
+						(*n_earlier + *n_latter) * el_size);
+					if (!new_field)
+						return FALSE;
+
+					memcpy(new_field, *p_earlier,
+					       *n_earlier * el_size);
+					memcpy(new_field +
+					       *n_earlier * el_size,
+					       *p_latter,
+					       *n_latter * el_size);
+
+					do_free(allocator, *p_latter);
+					do_free(allocator, *p_earlier);
 					*p_latter = new_field;
 					*n_latter = *n_earlier + *n_latter;
 				} else {
@@ -2210,1101 +4365,3370 @@ merge_messages(ProtobufCMessage *earlier_msg,
 					*n_latter = *n_earlier;
 					*p_latter = *p_earlier;
 				}
-				/* Make sure the field does not get double freed */
-				*n_earlier = 0;
-				*p_earlier = 0;
+				/* Make sure the field does not get double freed */
+				*n_earlier = 0;
+				*p_earlier = 0;
+			}
+		} else if (fields[i].label == PROTOBUF_C_LABEL_OPTIONAL ||
+			   fields[i].label == PROTOBUF_C_LABEL_NONE) {
+			const ProtobufCFieldDescriptor *field;
+			uint32_t *earlier_case_p = STRUCT_MEMBER_PTR(uint32_t,
+								     earlier_msg,
+								     fields[i].
+								     quantifier_offset);
+			uint32_t *latter_case_p = STRUCT_MEMBER_PTR(uint32_t,
+								    latter_msg,
+								    fields[i].
+								    quantifier_offset);
+			protobuf_c_boolean need_to_merge = FALSE;
+			void *earlier_elem;
+			void *latter_elem;
+			const void *def_val;
+
+			if (fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
+				if (*earlier_case_p == 0) {
+					/* Oneof is absent from the earlier message */
+					continue;
+				} else if (*latter_case_p == 0) {
+					/* lookup correct oneof field */
+					int field_index =
+						int_range_lookup(
+							latter_msg->descriptor
+							->n_field_ranges,
+							latter_msg->descriptor
+							->field_ranges,
+							*earlier_case_p);
+					if (field_index < 0)
+						return FALSE;
+					field = latter_msg->descriptor->fields +
+						field_index;
+				} else {
+					/* Oneof is present in the latter message, move on */
+					continue;
+				}
+			} else {
+				field = &fields[i];
+			}
+
+			earlier_elem = STRUCT_MEMBER_P(earlier_msg, field->offset);
+			latter_elem = STRUCT_MEMBER_P(latter_msg, field->offset);
+			def_val = field->default_value;
+
+			switch (field->type) {
+			case PROTOBUF_C_TYPE_MESSAGE: {
+				ProtobufCMessage *em = *(ProtobufCMessage **) earlier_elem;
+				ProtobufCMessage *lm = *(ProtobufCMessage **) latter_elem;
+				if (em != NULL) {
+					if (lm != NULL) {
+						if (!merge_messages(em, lm, allocator, flags))
+							return FALSE;
+						/* Already merged */
+						need_to_merge = FALSE;
+					} else {
+						/* Zero copy the message */
+						need_to_merge = TRUE;
+					}
+				}
+				break;
+			}
+			case PROTOBUF_C_TYPE_BYTES: {
+				uint8_t *e_data =
+					((ProtobufCBinaryData *) earlier_elem)->data;
+				uint8_t *l_data =
+					((ProtobufCBinaryData *) latter_elem)->data;
+				const ProtobufCBinaryData *d_bd =
+					(ProtobufCBinaryData *) def_val;
+
+				need_to_merge =
+					(e_data != NULL &&
+					 (d_bd == NULL ||
+					  e_data != d_bd->data)) &&
+					(l_data == NULL ||
+					 (d_bd != NULL &&
+					  l_data == d_bd->data));
+				break;
+			}
+			case PROTOBUF_C_TYPE_STRING: {
+				char *e_str = *(char **) earlier_elem;
+				char *l_str = *(char **) latter_elem;
+				const char *d_str = def_val;
+
+				need_to_merge = e_str != d_str && l_str == d_str;
+				break;
+			}
+			default: {
+				/* Could be has field or case enum, the logic is
+				 * equivalent, since 0 (FALSE) means not set for
+				 * oneof */
+				need_to_merge = (*earlier_case_p != 0) &&
+						(*latter_case_p == 0);
+				break;
+			}
+			}
+
+			if (need_to_merge) {
+				size_t el_size =
+					sizeof_elt_in_repeated_array(field->type);
+				memcpy(latter_elem, earlier_elem, el_size);
+				/*
+				 * Reset the element from the old message to 0
+				 * to make sure earlier message deallocation
+				 * doesn't corrupt zero-copied data in the new
+				 * message, earlier message will be freed after
+				 * this function is called anyway
+				 */
+				memset(earlier_elem, 0, el_size);
+
+				if (field->quantifier_offset != 0) {
+					/* Set the has field or the case enum,
+					 * if applicable */
+					*latter_case_p = *earlier_case_p;
+					*earlier_case_p = 0;
+				}
+			}
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Count packed elements.
+ *
+ * Given a raw slab of packed-repeated values, determine the number of
+ * elements. This function detects certain kinds of errors but not
+ * others; the remaining error checking is done by
+ * parse_packed_repeated_member().
+ */
+static protobuf_c_boolean
+count_packed_elements(ProtobufCType type,
+		      size_t len, const uint8_t *data, size_t *count_out)
+{
+	switch (type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		if (len % 4 != 0) {
+			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 4 for fixed-length 32-bit types");
+			return FALSE;
+		}
+		*count_out = len / 4;
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if (len % 8 != 0) {
+			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 8 for fixed-length 64-bit types");
+			return FALSE;
+		}
+		*count_out = len / 8;
+		return TRUE;
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		*count_out = max_b128_numbers(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_BOOL:
+		*count_out = len;
+		return TRUE;
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_BYTES:
+	case PROTOBUF_C_TYPE_MESSAGE:
+	default:
+		PROTOBUF_C_UNPACK_ERROR("bad protobuf-c type %u for packed-repeated", type);
+		return FALSE;
+	}
+}
+
+static inline uint32_t
+parse_uint32(unsigned len, const uint8_t *data)
+{
+	uint32_t rv = data[0] & 0x7f;
+	if (len > 1) {
+		rv |= ((uint32_t) (data[1] & 0x7f) << 7);
+		if (len > 2) {
+			rv |= ((uint32_t) (data[2] & 0x7f) << 14);
+			if (len > 3) {
+				rv |= ((uint32_t) (data[3] & 0x7f) << 21);
+				if (len > 4)
+					rv |= ((uint32_t) (data[4]) << 28);
+			}
+		}
+	}
+	return rv;
+}
+
+static inline uint32_t
+parse_int32(unsigned len, const uint8_t *data)
+{
+	return parse_uint32(len, data);
+}
+
+static inline int32_t
+unzigzag32(uint32_t v)
+{
+	if (v & 1)
+		return -(v >> 1) - 1;
+	else
+		return v >> 1;
+}
+
+static inline uint32_t
+parse_fixed_uint32(const uint8_t *data)
+{
+#if !defined(WORDS_BIGENDIAN)
+	uint32_t t;
+	memcpy(&t, data, 4);
+	return t;
+#else
+	return data[0] |
+		((uint32_t) (data[1]) << 8) |
+		((uint32_t) (data[2]) << 16) |
+		((uint32_t) (data[3]) << 24);
+#endif
+}
+
+static uint64_t
+parse_uint64(unsigned len, const uint8_t *data)
+{
+	unsigned shift, i;
+	uint64_t rv;
+
+	if (len < 5)
+		return parse_uint32(len, data);
+	rv = ((uint64_t) (data[0] & 0x7f)) |
+		((uint64_t) (data[1] & 0x7f) << 7) |
+		((uint64_t) (data[2] & 0x7f) << 14) |
+		((uint64_t) (data[3] & 0x7f) << 21);
+	shift = 28;
+	for (i = 4; i < len; i++) {
+		rv |= (((uint64_t) (data[i] & 0x7f)) << shift);
+		shift += 7;
+	}
+	return rv;
+}
+
+static inline int64_t
+unzigzag64(uint64_t v)
+{
+	if (v & 1)
+		return -(v >> 1) - 1;
+	else
+		return v >> 1;
+}
+
+static inline uint64_t
+parse_fixed_uint64(const uint8_t *data)
+{
+#if !defined(WORDS_BIGENDIAN)
+	uint64_t t;
+	memcpy(&t, data, 8);
+	return t;
+#else
+	return (uint64_t) parse_fixed_uint32(data) |
+		(((uint64_t) parse_fixed_uint32(data + 4)) << 32);
+#endif
+}
+
+static protobuf_c_boolean
+parse_boolean(unsigned len, const uint8_t *data)
+{
+	unsigned i;
+	for (i = 0; i < len; i++)
+		if (data[i] & 0x7f)
+			return TRUE;
+	return FALSE;
+}
+
+static protobuf_c_boolean
+parse_required_member(ScannedMember *scanned_member,
+		      void *member,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags,
+		      protobuf_c_boolean maybe_clear)
+{
+	unsigned len = scanned_member->len;
+	const uint8_t *data = scanned_member->data;
+	ProtobufCWireType wire_type = scanned_member->wire_type;
+
+	switch (scanned_member->field->type) {
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int32_t *) member = parse_int32(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_UINT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(uint32_t *) member = parse_uint32(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_SINT32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int32_t *) member = unzigzag32(parse_uint32(len, data));
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_32BIT)
+			return FALSE;
+		*(uint32_t *) member = parse_fixed_uint32(data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(uint64_t *) member = parse_uint64(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_SINT64:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			return FALSE;
+		*(int64_t *) member = unzigzag64(parse_uint64(len, data));
+		return TRUE;
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_64BIT)
+			return FALSE;
+		*(uint64_t *) member = parse_fixed_uint64(data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_BOOL:
+		*(protobuf_c_boolean *) member = parse_boolean(len, data);
+		return TRUE;
+	case PROTOBUF_C_TYPE_STRING: {
+		char **pstr = member;
+		unsigned pref_len = scanned_member->length_prefix_len;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		if (maybe_clear && *pstr != NULL &&
+		    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS))
+		{
+			const char *def = scanned_member->field->default_value;
+			if (*pstr != NULL && *pstr != def) {
+				if ((flags & UNPACK_FLAG_REUSE) &&
+				    strlen(*pstr) >= len - pref_len)
+				{
+					memcpy(*pstr, data + pref_len,
+					       len - pref_len);
+					(*pstr)[len - pref_len] = 0;
+					return TRUE;
+				}
+				do_free(allocator, *pstr);
+			}
+		}
+		if (flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS) {
+			/*
+			 * The byte following the payload is either the tag of
+			 * a field that has already been scanned or lies past
+			 * the end of the input, so it can be overwritten.
+			 */
+			*pstr = (char *) data + pref_len;
+			(*pstr)[len - pref_len] = 0;
+			return TRUE;
+		}
+		*pstr = do_alloc(allocator, len - pref_len + 1);
+		if (*pstr == NULL)
+			return FALSE;
+		memcpy(*pstr, data + pref_len, len - pref_len);
+		(*pstr)[len - pref_len] = 0;
+		return TRUE;
+	}
+	case PROTOBUF_C_TYPE_BYTES: {
+		ProtobufCBinaryData *bd = member;
+		const ProtobufCBinaryData *def_bd;
+		unsigned pref_len = scanned_member->length_prefix_len;
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		def_bd = scanned_member->field->default_value;
+		if (maybe_clear &&
+		    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES) &&
+		    bd->data != NULL &&
+		    (def_bd == NULL || bd->data != def_bd->data))
+		{
+			if ((flags & UNPACK_FLAG_REUSE) &&
+			    len - pref_len > 0 && bd->len >= len - pref_len)
+			{
+				memcpy(bd->data, data + pref_len,
+				       len - pref_len);
+				bd->len = len - pref_len;
+				return TRUE;
+			}
+			do_free(allocator, bd->data);
+		}
+		if (len - pref_len > 0 &&
+		    (flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES))
+		{
+			bd->data = (uint8_t *) data + pref_len;
+		} else if (len - pref_len > 0) {
+			bd->data = do_alloc(allocator, len - pref_len);
+			if (bd->data == NULL)
+				return FALSE;
+			memcpy(bd->data, data + pref_len, len - pref_len);
+		} else {
+			bd->data = NULL;
+		}
+		bd->len = len - pref_len;
+		return TRUE;
+	}
+	case PROTOBUF_C_TYPE_MESSAGE: {
+		ProtobufCMessage **pmessage = member;
+		ProtobufCMessage *subm;
+		const ProtobufCMessage *def_mess;
+		protobuf_c_boolean merge_successful = TRUE;
+		unsigned pref_len = scanned_member->length_prefix_len;
+		ProtobufCAllocator *sub_allocator =
+			message_allocator(allocator, flags);
+
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+			return FALSE;
+
+		def_mess = scanned_member->field->default_value;
+		if (scanned_member->reuse &&
+		    *pmessage != NULL && *pmessage != def_mess)
+		{
+			return unpack_reusing(*pmessage, sub_allocator, flags,
+					      len - pref_len, data + pref_len);
+		}
+		subm = protobuf_c_message_unpack_ex(scanned_member->field->descriptor,
+						    sub_allocator,
+						    flags & ~UNPACK_FLAG_REUSE,
+						    len - pref_len,
+						    data + pref_len);
+
+		if (maybe_clear &&
+		    *pmessage != NULL &&
+		    *pmessage != def_mess)
+		{
+			if (subm != NULL)
+				merge_successful = merge_messages(*pmessage, subm,
+								  allocator, flags);
+			/* Delete the previous message */
+			protobuf_c_message_free_unpacked_ex(*pmessage,
+							    sub_allocator,
+							    flags);
+		}
+		*pmessage = subm;
+		if (subm == NULL || !merge_successful)
+			return FALSE;
+		return TRUE;
+	}
+	}
+	return FALSE;
+}
+
+static protobuf_c_boolean
+parse_oneof_member (ScannedMember *scanned_member,
+		    void *member,
+		    ProtobufCMessage *message,
+		    ProtobufCAllocator *allocator,
+		    unsigned flags)
+{
+	uint32_t *oneof_case = STRUCT_MEMBER_PTR(uint32_t, message,
+					       scanned_member->field->quantifier_offset);
+
+	/*
+	 * If we have already parsed a member of this oneof, free it, unless
+	 * it is the same member left over from a previous decode.
+	 */
+	if (*oneof_case != 0 &&
+	    !(scanned_member->reuse && *oneof_case == scanned_member->tag))
+	{
+		/* lookup field */
+		int field_index =
+			int_range_lookup(message->descriptor->n_field_ranges,
+					 message->descriptor->field_ranges,
+					 *oneof_case);
+		if (field_index < 0)
+			return FALSE;
+		const ProtobufCFieldDescriptor *old_field =
+			message->descriptor->fields + field_index;
+		size_t el_size = sizeof_elt_in_repeated_array(old_field->type);
+
+		switch (old_field->type) {
+	        case PROTOBUF_C_TYPE_STRING: {
+			char **pstr = member;
+			const char *def = old_field->default_value;
+			if (*pstr != NULL && *pstr != def &&
+			    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS))
+				do_free(allocator, *pstr);
+			break;
+	        }
+		case PROTOBUF_C_TYPE_BYTES: {
+			ProtobufCBinaryData *bd = member;
+			const ProtobufCBinaryData *def_bd = old_field->default_value;
+			if (bd->data != NULL &&
+			   (def_bd == NULL || bd->data != def_bd->data) &&
+			   !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES))
+			{
+				do_free(allocator, bd->data);
 			}
-		} else if (fields[i].label == PROTOBUF_C_LABEL_OPTIONAL ||
-			   fields[i].label == PROTOBUF_C_LABEL_NONE) {
-			const ProtobufCFieldDescriptor *field;
-			uint32_t *earlier_case_p = STRUCT_MEMBER_PTR(uint32_t,
-								     earlier_msg,
-								     fields[i].
-								     quantifier_offset);
-			uint32_t *latter_case_p = STRUCT_MEMBER_PTR(uint32_t,
-								    latter_msg,
-								    fields[i].
-								    quantifier_offset);
-			protobuf_c_boolean need_to_merge = FALSE;
-			void *earlier_elem;
-			void *latter_elem;
-			const void *def_val;
+			break;
+	        }
+		case PROTOBUF_C_TYPE_MESSAGE: {
+			ProtobufCMessage **pmessage = member;
+			const ProtobufCMessage *def_mess = old_field->default_value;
+			if (*pmessage != NULL && *pmessage != def_mess)
+				protobuf_c_message_free_unpacked_ex(*pmessage,
+					message_allocator(allocator, flags),
+					flags);
+			break;
+	        }
+		default:
+			break;
+		}
+
+		memset (member, 0, el_size);
+	}
+	if (!parse_required_member (scanned_member, member, allocator, flags,
+				    TRUE))
+		return FALSE;
+
+	*oneof_case = scanned_member->tag;
+	return TRUE;
+}
+
+
+static protobuf_c_boolean
+parse_optional_member(ScannedMember *scanned_member,
+		      void *member,
+		      ProtobufCMessage *message,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags)
+{
+	if (!parse_required_member(scanned_member, member, allocator, flags,
+				   TRUE))
+		return FALSE;
+	if (scanned_member->field->quantifier_offset != 0)
+		STRUCT_MEMBER(protobuf_c_boolean,
+			      message,
+			      scanned_member->field->quantifier_offset) = TRUE;
+	return TRUE;
+}
+
+static protobuf_c_boolean
+parse_repeated_member(ScannedMember *scanned_member,
+		      void *member,
+		      ProtobufCMessage *message,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	char *array = *(char **) member;
+
+	/* Reused elements may hold old values; the others are zeroed. */
+	if (!parse_required_member(scanned_member, array + siz * (*p_n),
+				   allocator, flags,
+				   (flags & UNPACK_FLAG_REUSE) != 0))
+	{
+		return FALSE;
+	}
+	*p_n += 1;
+	return TRUE;
+}
+
+static unsigned
+scan_varint(unsigned len, const uint8_t *data)
+{
+	unsigned i;
+	if (len > 10)
+		len = 10;
+	for (i = 0; i < len; i++)
+		if ((data[i] & 0x80) == 0)
+			break;
+	if (i == len)
+		return 0;
+	return i + 1;
+}
+
+#if !defined(WORDS_BIGENDIAN)
+/**
+ * Decode a varint of up to 8 bytes with word operations instead of a loop
+ * over its bytes. At least 8 bytes must be readable at `data`.
+ *
+ * \return
+ *      Length of the varint, or 0 if it is longer than 8 bytes.
+ */
+static inline unsigned
+parse_varint_word(const uint8_t *data, uint64_t *value)
+{
+	uint64_t word, stops, keep, v;
+
+	memcpy(&word, data, 8);
+	stops = ~word & SWAR_BYTES(0x80);
+	if (stops == 0)
+		return 0;
+	/* the bytes up to and including the first one without continuation */
+	keep = stops ^ (stops - 1);
+
+	/* squeeze the 7-bit groups together: 8 -> 14 -> 28 -> 56 bits */
+	v = word & keep & SWAR_BYTES(0x7f);
+	v = ((v & UINT64_C(0x7f007f007f007f00)) >> 1) |
+		(v & UINT64_C(0x007f007f007f007f));
+	v = ((v & UINT64_C(0x3fff00003fff0000)) >> 2) |
+		(v & UINT64_C(0x00003fff00003fff));
+	v = ((v & UINT64_C(0x0fffffff00000000)) >> 4) |
+		(v & UINT64_C(0x000000000fffffff));
+	*value = v;
+	return (unsigned) ((((keep >> 7) & SWAR_BYTES(1)) * SWAR_BYTES(1)) >> 56);
+}
+#endif
+
+/**
+ * Decode the next varint of a packed repeated field and advance past it.
+ * 32-bit types use the low 32 bits of `value`.
+ */
+static inline protobuf_c_boolean
+parse_packed_varint(size_t *rem, const uint8_t **at, uint64_t *value)
+{
+	unsigned s = 0;
+
+	if (**at < 0x80) {
+		*value = *(*at)++;
+		--*rem;
+		return TRUE;
+	}
+#if !defined(WORDS_BIGENDIAN)
+	if (*rem >= 8)
+		s = parse_varint_word(*at, value);
+	if (s == 0)
+#endif
+	{
+		s = scan_varint(*rem > 10 ? 10 : (unsigned) *rem, *at);
+		if (s == 0)
+			return FALSE;
+		*value = parse_uint64(s, *at);
+	}
+	*at += s;
+	*rem -= s;
+	return TRUE;
+}
+
+static protobuf_c_boolean
+parse_packed_repeated_member(ScannedMember *scanned_member,
+			     void *member,
+			     ProtobufCMessage *message)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	void *array = *(char **) member + siz * (*p_n);
+	const uint8_t *at = scanned_member->data + scanned_member->length_prefix_len;
+	size_t rem = scanned_member->len - scanned_member->length_prefix_len;
+	size_t count = 0;
+	uint64_t value;
+	unsigned i;
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+		count = (scanned_member->len - scanned_member->length_prefix_len) / 4;
+#if !defined(WORDS_BIGENDIAN)
+		goto no_unpacking_needed;
+#else
+		for (i = 0; i < count; i++) {
+			((uint32_t *) array)[i] = parse_fixed_uint32(at);
+			at += 4;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		count = (scanned_member->len - scanned_member->length_prefix_len) / 8;
+#if !defined(WORDS_BIGENDIAN)
+		goto no_unpacking_needed;
+#else
+		for (i = 0; i < count; i++) {
+			((uint64_t *) array)[i] = parse_fixed_uint64(at);
+			at += 8;
+		}
+		break;
+#endif
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+		while (rem > 0) {
+			if (!parse_packed_varint(&rem, &at, &value)) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int32 value");
+				return FALSE;
+			}
+			((int32_t *) array)[count++] = (int32_t) value;
+		}
+		break;
+	case PROTOBUF_C_TYPE_SINT32:
+		while (rem > 0) {
+			if (!parse_packed_varint(&rem, &at, &value)) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint32 value");
+				return FALSE;
+			}
+			((int32_t *) array)[count++] = unzigzag32((uint32_t) value);
+		}
+		break;
+	case PROTOBUF_C_TYPE_UINT32:
+		while (rem > 0) {
+			if (!parse_packed_varint(&rem, &at, &value)) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated enum or uint32 value");
+				return FALSE;
+			}
+			((uint32_t *) array)[count++] = (uint32_t) value;
+		}
+		break;
+
+	case PROTOBUF_C_TYPE_SINT64:
+		while (rem > 0) {
+			if (!parse_packed_varint(&rem, &at, &value)) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint64 value");
+				return FALSE;
+			}
+			((int64_t *) array)[count++] = unzigzag64(value);
+		}
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		while (rem > 0) {
+			if (!parse_packed_varint(&rem, &at, &value)) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int64/uint64 value");
+				return FALSE;
+			}
+			((int64_t *) array)[count++] = value;
+		}
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		count = rem;
+		for (i = 0; i < count; i++) {
+			if (at[i] > 1) {
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated boolean value");
+				return FALSE;
+			}
+			((protobuf_c_boolean *) array)[i] = at[i];
+		}
+		break;
+	default:
+		PROTOBUF_C__ASSERT_NOT_REACHED();
+	}
+	*p_n += count;
+	return TRUE;
+
+#if !defined(WORDS_BIGENDIAN)
+no_unpacking_needed:
+	memcpy(array, at, count * siz);
+	*p_n += count;
+	return TRUE;
+#endif
+}
+
+/*
+ * Packed varint fields with a length in this range are not counted while
+ * scanning: their array is allocated for the largest possible number of
+ * elements instead, and the data is read only once. Shorter fields are still
+ * in cache when parsed. The array holds one element per byte of the field, up
+ * to 8 times what is needed for 64-bit types, so the upper limit bounds the
+ * surplus at 512 KiB per field; with PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS it
+ * stays in the payload block for the life of the message.
+ */
+#define FUSED_PACKED_MIN_LEN	4096
+#define FUSED_PACKED_MAX_LEN	(64 << 10)
+
+static inline protobuf_c_boolean
+is_varint_type(ProtobufCType type)
+{
+	switch (type) {
+	case PROTOBUF_C_TYPE_ENUM:
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_UINT64:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static protobuf_c_boolean
+is_packable_type(ProtobufCType type)
+{
+	return
+		type != PROTOBUF_C_TYPE_STRING &&
+		type != PROTOBUF_C_TYPE_BYTES &&
+		type != PROTOBUF_C_TYPE_MESSAGE;
+}
+
+static protobuf_c_boolean
+parse_member(ScannedMember *scanned_member,
+	     ProtobufCMessage *message,
+	     ProtobufCAllocator *allocator,
+	     unsigned flags)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+	void *member;
+
+	if (field == NULL) {
+		ProtobufCMessageUnknownField *ufield =
+			message->unknown_fields +
+			(message->n_unknown_fields++);
+		ufield->tag = scanned_member->tag;
+		ufield->wire_type = scanned_member->wire_type;
+		ufield->len = scanned_member->len;
+		if (scanned_member->tag == 0 &&
+		    (flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES))
+		{
+			ufield->data = (uint8_t *) scanned_member->data;
+			return TRUE;
+		}
+		ufield->data = do_alloc(allocator, scanned_member->len);
+		if (ufield->data == NULL)
+			return FALSE;
+		memcpy(ufield->data, scanned_member->data, ufield->len);
+		return TRUE;
+	}
+	member = (char *) message + field->offset;
+	switch (field->label) {
+	case PROTOBUF_C_LABEL_REQUIRED:
+		return parse_required_member(scanned_member, member,
+					     allocator, flags, TRUE);
+	case PROTOBUF_C_LABEL_OPTIONAL:
+	case PROTOBUF_C_LABEL_NONE:
+		if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
+			return parse_oneof_member(scanned_member, member,
+						  message, allocator, flags);
+		} else {
+			return parse_optional_member(scanned_member, member,
+						     message, allocator, flags);
+		}
+	case PROTOBUF_C_LABEL_REPEATED:
+		if (scanned_member->wire_type ==
+		    PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+		    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+		     is_packable_type(field->type)))
+		{
+			return parse_packed_repeated_member(scanned_member,
+							    member, message);
+		} else {
+			return parse_repeated_member(scanned_member,
+						     member, message,
+						     allocator, flags);
+		}
+	}
+	PROTOBUF_C__ASSERT_NOT_REACHED();
+	return 0;
+}
+
+/**
+ * Set a non-repeated field to its default value.
+ */
+static void
+init_field_default(const ProtobufCFieldDescriptor *field, void *member)
+{
+	const void *dv = field->default_value;
+
+	if (dv == NULL) {
+		memset(member, 0, sizeof_elt_in_repeated_array(field->type));
+		return;
+	}
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_INT32:
+	case PROTOBUF_C_TYPE_SINT32:
+	case PROTOBUF_C_TYPE_SFIXED32:
+	case PROTOBUF_C_TYPE_UINT32:
+	case PROTOBUF_C_TYPE_FIXED32:
+	case PROTOBUF_C_TYPE_FLOAT:
+	case PROTOBUF_C_TYPE_ENUM:
+		memcpy(member, dv, 4);
+		break;
+	case PROTOBUF_C_TYPE_INT64:
+	case PROTOBUF_C_TYPE_SINT64:
+	case PROTOBUF_C_TYPE_SFIXED64:
+	case PROTOBUF_C_TYPE_UINT64:
+	case PROTOBUF_C_TYPE_FIXED64:
+	case PROTOBUF_C_TYPE_DOUBLE:
+		memcpy(member, dv, 8);
+		break;
+	case PROTOBUF_C_TYPE_BOOL:
+		memcpy(member, dv, sizeof(protobuf_c_boolean));
+		break;
+	case PROTOBUF_C_TYPE_BYTES:
+		memcpy(member, dv, sizeof(ProtobufCBinaryData));
+		break;
+
+	case PROTOBUF_C_TYPE_STRING:
+	case PROTOBUF_C_TYPE_MESSAGE:
+		/*
+		 * The next line essentially implements a cast
+		 * from const, which is totally unavoidable.
+		 */
+		*(const void **) member = dv;
+		break;
+	}
+}
+
+/**
+ * Initialise messages generated by old code.
+ *
+ * This function is used if desc->message_init == NULL (which occurs
+ * for old code, and which would be useful to support allocating
+ * descriptors dynamically).
+ */
+static void
+message_init_generic(const ProtobufCMessageDescriptor *desc,
+		     ProtobufCMessage *message)
+{
+	unsigned i;
+
+	memset(message, 0, desc->sizeof_message);
+	message->descriptor = desc;
+	for (i = 0; i < desc->n_fields; i++) {
+		if (desc->fields[i].default_value != NULL &&
+		    desc->fields[i].label != PROTOBUF_C_LABEL_REPEATED)
+		{
+			init_field_default(desc->fields + i,
+				STRUCT_MEMBER_P(message, desc->fields[i].offset));
+		}
+	}
+}
+
+/**
+ * Free what elements `from` to `to` (exclusive) of a repeated field own.
+ */
+static void
+free_repeated_elements(const ProtobufCFieldDescriptor *field,
+		       void *arr, size_t from, size_t to,
+		       ProtobufCAllocator *allocator,
+		       unsigned flags)
+{
+	/* Contiguous payloads go away with the message structure. */
+	protobuf_c_boolean free_payloads =
+		!(flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS);
+	size_t i;
+
+	switch (field->type) {
+	case PROTOBUF_C_TYPE_STRING:
+		if (free_payloads &&
+		    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS))
+		{
+			for (i = from; i < to; i++)
+				do_free(allocator, ((char **) arr)[i]);
+		}
+		break;
+	case PROTOBUF_C_TYPE_BYTES:
+		if (free_payloads &&
+		    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES))
+		{
+			for (i = from; i < to; i++)
+				do_free(allocator,
+					((ProtobufCBinaryData *) arr)[i].data);
+		}
+		break;
+	case PROTOBUF_C_TYPE_MESSAGE:
+		for (i = from; i < to; i++)
+			protobuf_c_message_free_unpacked_ex(
+				((ProtobufCMessage **) arr)[i],
+				allocator,
+				flags
+			);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Free what a field of an unpacked message owns, leaving the field itself
+ * untouched.
+ */
+static void
+free_field_contents(ProtobufCMessage *message,
+		    const ProtobufCFieldDescriptor *field,
+		    ProtobufCAllocator *allocator,
+		    unsigned flags)
+{
+	protobuf_c_boolean free_payloads =
+		!(flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS);
+
+	if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+		size_t n = STRUCT_MEMBER(size_t, message,
+					 field->quantifier_offset);
+		void *arr = STRUCT_MEMBER(void *, message, field->offset);
+
+		if (arr != NULL) {
+			free_repeated_elements(field, arr, 0, n,
+					       allocator, flags);
+			if (free_payloads)
+				do_free(allocator, arr);
+		}
+	} else if (field->type == PROTOBUF_C_TYPE_STRING) {
+		char *str = STRUCT_MEMBER(char *, message, field->offset);
+
+		if (str && str != field->default_value &&
+		    free_payloads &&
+		    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS))
+			do_free(allocator, str);
+	} else if (field->type == PROTOBUF_C_TYPE_BYTES) {
+		void *data = STRUCT_MEMBER(ProtobufCBinaryData, message,
+					   field->offset).data;
+		const ProtobufCBinaryData *default_bd;
+
+		default_bd = field->default_value;
+		if (data != NULL &&
+		    (default_bd == NULL ||
+		     default_bd->data != data) &&
+		    free_payloads &&
+		    !(flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES))
+		{
+			do_free(allocator, data);
+		}
+	} else if (field->type == PROTOBUF_C_TYPE_MESSAGE) {
+		ProtobufCMessage *sm;
+
+		sm = STRUCT_MEMBER(ProtobufCMessage *, message, field->offset);
+		if (sm && sm != field->default_value)
+			protobuf_c_message_free_unpacked_ex(sm, allocator,
+							    flags);
+	}
+}
+
+/**
+ * Free what a field owns and return it to the state `<type>_init()` leaves
+ * it in. For a oneof member, the oneof is left unset.
+ */
+static void
+reset_field(ProtobufCMessage *message,
+	    const ProtobufCFieldDescriptor *field,
+	    ProtobufCAllocator *allocator,
+	    unsigned flags)
+{
+	void *member = STRUCT_MEMBER_P(message, field->offset);
+
+	free_field_contents(message, field, allocator, flags);
+	if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+		STRUCT_MEMBER(size_t, message, field->quantifier_offset) = 0;
+		*(void **) member = NULL;
+	} else if (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
+		memset(member, 0, sizeof_elt_in_repeated_array(field->type));
+		STRUCT_MEMBER(uint32_t, message, field->quantifier_offset) = 0;
+	} else {
+		init_field_default(field, member);
+		if (field->quantifier_offset != 0)
+			STRUCT_MEMBER(protobuf_c_boolean, message,
+				      field->quantifier_offset) = FALSE;
+	}
+}
+
+/**
+ * Free the unknown fields of a message.
+ */
+static void
+free_unknown_fields(ProtobufCMessage *message,
+		    ProtobufCAllocator *allocator,
+		    unsigned flags)
+{
+	unsigned f;
+
+	if (!(flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS)) {
+		for (f = 0; f < message->n_unknown_fields; f++) {
+			/* raw runs may alias the input buffer */
+			if (message->unknown_fields[f].tag == 0 &&
+			    (flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES))
+				continue;
+			do_free(allocator, message->unknown_fields[f].data);
+		}
+		if (message->unknown_fields != NULL)
+			do_free(allocator, message->unknown_fields);
+	}
+	message->n_unknown_fields = 0;
+	message->unknown_fields = NULL;
+}
+
+/**@}*/
+
+/*
+ * ScannedMember slabs (an unpacking implementation detail). Before doing real
+ * unpacking, we first scan through the elements to see how many there are (for
+ * repeated fields), and which field to use (for non-repeated fields given
+ * twice).
+ *
+ * In order to avoid allocations for small messages, we keep a stack-allocated
+ * slab of ScannedMembers of size FIRST_SCANNED_MEMBER_SLAB_SIZE (16). After we
+ * fill that up, we allocate each slab twice as large as the previous one.
+ */
+#define FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2 4
+
+/*
+ * The number of slabs, including the stack-allocated ones; choose the number so
+ * that we would overflow if we needed a slab larger than provided.
+ */
+#define MAX_SCANNED_MEMBER_SLAB			\
+  (sizeof(unsigned int)*8 - 1			\
+   - BOUND_SIZEOF_SCANNED_MEMBER_LOG2		\
+   - FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)
+
+#define REQUIRED_FIELD_BITMAP_SET(index)	\
+	(required_fields_bitmap[(index)/8] |= (1UL<<((index)%8)))
+
+#define REQUIRED_FIELD_BITMAP_IS_SET(index)	\
+	(required_fields_bitmap[(index)/8] & (1UL<<((index)%8)))
+
+/**
+ * Allocate the structure for a message being unpacked, preceded by the hidden
+ * header if PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS is set.
+ */
+static ProtobufCMessage *
+alloc_unpacked_message(const ProtobufCMessageDescriptor *desc,
+		       ProtobufCAllocator *allocator,
+		       unsigned flags)
+{
+	uint8_t *rv;
+
+	if (!(flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS))
+		return do_alloc(allocator, desc->sizeof_message);
+
+	rv = do_alloc(allocator, CONTIGUOUS_HEADER_SIZE + desc->sizeof_message);
+	if (rv == NULL)
+		return NULL;
+	rv += CONTIGUOUS_HEADER_SIZE;
+	CONTIGUOUS_PAYLOAD(rv) = NULL;
+	return (ProtobufCMessage *) rv;
+}
+
+/**
+ * Allocate the structure for a message being unpacked and initialise it.
+ */
+static ProtobufCMessage *
+new_unpacked_message(const ProtobufCMessageDescriptor *desc,
+		     ProtobufCAllocator *allocator,
+		     unsigned flags)
+{
+	ProtobufCMessage *rv = alloc_unpacked_message(desc, allocator, flags);
+
+	if (rv == NULL)
+		return NULL;
+
+	/*
+	 * Generated code always defines "message_init". However, we provide a
+	 * fallback for (1) users of old protobuf-c generated-code that do not
+	 * provide the function, and (2) descriptors constructed from some other
+	 * source (most likely, direct construction from the .proto file).
+	 */
+	if (desc->message_init != NULL)
+		protobuf_c_message_init(desc, rv);
+	else
+		message_init_generic(desc, rv);
+	return rv;
+}
 
-			if (fields[i].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
-				if (*latter_case_p == 0) {
-					/* lookup correct oneof field */
-					int field_index =
-						int_range_lookup(
-							latter_msg->descriptor
-							->n_field_ranges,
-							latter_msg->descriptor
-							->field_ranges,
-							*earlier_case_p);
-					if (field_index < 0)
-						return FALSE;
-					field = latter_msg->descriptor->fields +
-						field_index;
-				} else {
-					/* Oneof is present in the latter message, move on */
-					continue;
-				}
-			} else {
-				field = &fields[i];
-			}
+/**
+ * Free a structure allocated by alloc_unpacked_message(), along with the
+ * payload arena of contiguous messages.
+ */
+static void
+free_unpacked_message(ProtobufCMessage *message,
+		      ProtobufCAllocator *allocator,
+		      unsigned flags)
+{
+	ProtobufCArena *payload;
+
+	if (!(flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS)) {
+		do_free(allocator, message);
+		return;
+	}
+	payload = CONTIGUOUS_PAYLOAD(message);
+	if (payload != NULL)
+		contiguous_payload_free(payload);
+	do_free(allocator, (uint8_t *) message - CONTIGUOUS_HEADER_SIZE);
+}
+
+/**
+ * Decide whether messages of this type can be unpacked in a single pass.
+ *
+ * The ScannedMember pass only exists so that repeated fields can be counted
+ * before their arrays are allocated. Without repeated fields, each member can
+ * be parsed as soon as it has been scanned.
+ */
+static protobuf_c_boolean
+can_unpack_in_single_pass(const ProtobufCMessageDescriptor *desc,
+			  unsigned flags)
+{
+	unsigned f;
+
+	/*
+	 * In-place string termination overwrites the tag of the next field,
+	 * which must have been scanned already.
+	 */
+	if (flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS)
+		return FALSE;
+	/* Sizing the payload block needs the whole message scanned first. */
+	if (flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS)
+		return FALSE;
+	for (f = 0; f < desc->n_fields; f++)
+		if (field_label(desc, f) == PROTOBUF_C_LABEL_REPEATED)
+			return FALSE;
+	return TRUE;
+}
+
+/**
+ * Make room for at least one more entry in `message->unknown_fields`.
+ */
+static protobuf_c_boolean
+grow_unknown_fields(ProtobufCMessage *message,
+		    ProtobufCAllocator *allocator,
+		    size_t *n_alloced)
+{
+	size_t new_alloced = *n_alloced == 0 ? 4 : *n_alloced * 2;
+	ProtobufCMessageUnknownField *new_fields;
+
+	new_fields = do_alloc(allocator,
+			      new_alloced * sizeof(ProtobufCMessageUnknownField));
+	if (new_fields == NULL)
+		return FALSE;
+	if (message->n_unknown_fields > 0)
+		memcpy(new_fields, message->unknown_fields,
+		       message->n_unknown_fields *
+		       sizeof(ProtobufCMessageUnknownField));
+	do_free(allocator, message->unknown_fields);
+	message->unknown_fields = new_fields;
+	*n_alloced = new_alloced;
+	return TRUE;
+}
+
+/**
+ * Turn a scanned unknown field into a raw run that also covers its tag, for
+ * PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN. The run is marked with tag 0, which
+ * never occurs on the wire.
+ */
+static inline void
+scanned_member_to_raw(ScannedMember *scanned_member, size_t tag_len)
+{
+	scanned_member->tag = 0;
+	scanned_member->data -= tag_len;
+	scanned_member->len += tag_len;
+	scanned_member->length_prefix_len = 0;
+}
+
+/**
+ * Store a pending raw run of unknown fields in `message->unknown_fields`.
+ */
+static protobuf_c_boolean
+flush_raw_unknown(ScannedMember *run,
+		  ProtobufCMessage *message,
+		  ProtobufCAllocator *allocator,
+		  unsigned flags,
+		  size_t *n_unknown_alloced)
+{
+	if (run->len == 0)
+		return TRUE;
+	if (message->n_unknown_fields == *n_unknown_alloced &&
+	    !grow_unknown_fields(message, allocator, n_unknown_alloced))
+		return FALSE;
+	if (!parse_member(run, message, allocator, flags))
+		return FALSE;
+	run->len = 0;
+	return TRUE;
+}
+
+/**
+ * Record in the bitmap that a scanned member's field is present.
+ *
+ * Normally only required fields are tracked. When reusing a message, every
+ * field is, so that the ones absent from the input can be reset afterwards;
+ * the member is also told whether it may reuse what its field holds from the
+ * previous decode, which is only the case for its first occurrence.
+ */
+static inline void
+note_scanned_field(ScannedMember *scanned_member,
+		   unsigned field_index,
+		   unsigned char *required_fields_bitmap,
+		   unsigned flags)
+{
+	const ProtobufCFieldDescriptor *field = scanned_member->field;
+
+	scanned_member->reuse = FALSE;
+	if (field == NULL)
+		return;
+	if (flags & UNPACK_FLAG_REUSE) {
+		scanned_member->reuse =
+			field->label == PROTOBUF_C_LABEL_REPEATED ||
+			!REQUIRED_FIELD_BITMAP_IS_SET(field_index);
+		REQUIRED_FIELD_BITMAP_SET(field_index);
+	} else if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+		REQUIRED_FIELD_BITMAP_SET(field_index);
+	}
+}
+
+/**
+ * Reset the non-repeated fields of a reused message that were absent from the
+ * input.
+ */
+static void
+reset_unseen_fields(ProtobufCMessage *message,
+		    const unsigned char *required_fields_bitmap,
+		    ProtobufCAllocator *allocator,
+		    unsigned flags)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	unsigned f;
+
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+		if (field->label == PROTOBUF_C_LABEL_REPEATED ||
+		    REQUIRED_FIELD_BITMAP_IS_SET(f))
+			continue;
+		if ((field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
+		    STRUCT_MEMBER(uint32_t, message, field->quantifier_offset) !=
+		    field->id)
+			continue;
+		reset_field(message, field, allocator, flags);
+	}
+}
+
+/**
+ * Storage of a repeated field left over from a previous decode.
+ *
+ * While the input is scanned, the message's own count holds the new number of
+ * elements, so the old array is kept aside here until it is resized.
+ */
+typedef struct {
+	size_t n;	/**< Number of elements holding reusable values. */
+	void *array;	/**< Array not given back to the message yet. */
+} RecycledArray;
+
+static void
+stash_repeated_fields(ProtobufCMessage *message, RecycledArray *recycled)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	unsigned f;
+
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+		size_t *n_ptr;
+		void **arr_ptr;
+
+		if (field->label != PROTOBUF_C_LABEL_REPEATED)
+			continue;
+		n_ptr = STRUCT_MEMBER_PTR(size_t, message,
+					  field->quantifier_offset);
+		arr_ptr = STRUCT_MEMBER_PTR(void *, message, field->offset);
+		recycled[f].n = *arr_ptr != NULL ? *n_ptr : 0;
+		recycled[f].array = *arr_ptr;
+		*n_ptr = 0;
+		*arr_ptr = NULL;
+	}
+}
+
+/**
+ * Turn a stashed array into one with room for `n` elements, reusing it if it
+ * is large enough. Afterwards `recycled->n` is the number of leading elements
+ * still holding old values for the parser to reuse; the others are zeroed.
+ */
+static protobuf_c_boolean
+recycle_repeated_array(const ProtobufCFieldDescriptor *field,
+		       RecycledArray *recycled,
+		       size_t n,
+		       void **array_out,
+		       ProtobufCAllocator *allocator,
+		       unsigned flags)
+{
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	void *arr = recycled->array;
+	uint8_t *new_arr;
+
+	recycled->array = NULL;
+	if (n <= recycled->n) {
+		free_repeated_elements(field, arr, n, recycled->n,
+				       allocator, flags);
+		recycled->n = n;
+		if (n == 0) {
+			do_free(allocator, arr);
+			arr = NULL;
+		}
+		*array_out = arr;
+		return TRUE;
+	}
+
+	new_arr = do_alloc(allocator, siz * n);
+	if (new_arr == NULL) {
+		free_repeated_elements(field, arr, 0, recycled->n,
+				       allocator, flags);
+		do_free(allocator, arr);
+		recycled->n = 0;
+		return FALSE;
+	}
+	if (recycled->n > 0)
+		memcpy(new_arr, arr, siz * recycled->n);
+	memset(new_arr + siz * recycled->n, 0, siz * (n - recycled->n));
+	do_free(allocator, arr);
+	*array_out = new_arr;
+	return TRUE;
+}
+
+/**
+ * Free the old values of a reused message's repeated fields that unpacking
+ * did not get to, leaving every count consistent with its array.
+ */
+static void
+release_recycled_arrays(ProtobufCMessage *message,
+			RecycledArray *recycled,
+			ProtobufCAllocator *allocator,
+			unsigned flags)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	unsigned f;
+
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+		size_t *n_ptr;
+		void *arr;
+
+		if (field->label != PROTOBUF_C_LABEL_REPEATED)
+			continue;
+		n_ptr = STRUCT_MEMBER_PTR(size_t, message,
+					  field->quantifier_offset);
+		arr = STRUCT_MEMBER(void *, message, field->offset);
+		if (recycled[f].array != NULL) {
+			free_repeated_elements(field, recycled[f].array,
+					       0, recycled[f].n,
+					       allocator, flags);
+			do_free(allocator, recycled[f].array);
+			recycled[f].array = NULL;
+		} else if (arr != NULL && *n_ptr < recycled[f].n) {
+			free_repeated_elements(field, arr,
+					       *n_ptr, recycled[f].n,
+					       allocator, flags);
+		}
+		if (arr == NULL)
+			*n_ptr = 0;
+	}
+}
+
+/**
+ * Unpack a message that has no repeated fields, parsing each member as soon
+ * as it has been scanned.
+ */
+static protobuf_c_boolean
+unpack_single_pass(const ProtobufCMessageDescriptor *desc,
+		   ProtobufCMessage *rv,
+		   ProtobufCAllocator *allocator,
+		   unsigned flags,
+		   size_t len, const uint8_t *data)
+{
+	size_t rem = len;
+	const uint8_t *at = data;
+	const ProtobufCFieldDescriptor *last_field = desc->fields + 0;
+	unsigned last_field_index = 0;
+	size_t n_unknown_alloced = 0;
+	ScannedMember raw_run;
+	unsigned f;
+	unsigned required_fields_bitmap_len;
+	unsigned char required_fields_bitmap_stack[16];
+	unsigned char *required_fields_bitmap = required_fields_bitmap_stack;
+	protobuf_c_boolean required_fields_bitmap_alloced = FALSE;
+	TYPE_DISPATCH_TABLE(handlers, parse);
+
+	required_fields_bitmap_len = (desc->n_fields + 7) / 8;
+	if (required_fields_bitmap_len > sizeof(required_fields_bitmap_stack)) {
+		required_fields_bitmap = do_alloc(allocator, required_fields_bitmap_len);
+		if (!required_fields_bitmap)
+			return FALSE;
+		required_fields_bitmap_alloced = TRUE;
+	}
+	memset(required_fields_bitmap, 0, required_fields_bitmap_len);
+	raw_run.len = 0;
+
+	while (rem > 0) {
+		uint32_t tag;
+		ProtobufCWireType wire_type;
+		ScannedMember tmp;
+		const ProtobufCFieldDescriptor *field;
+		void *member;
+		size_t used = scan_field_tag(desc, rem, at, &tag, &wire_type,
+					     &tmp.field, &last_field,
+					     &last_field_index);
+
+		if (used == 0) {
+			PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype at offset %u",
+						(unsigned) (at - data));
+			goto error_cleanup;
+		}
+		if (tmp.field == NULL &&
+		    !(flags & (PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN |
+			       PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN)) &&
+		    rv->n_unknown_fields == n_unknown_alloced &&
+		    !grow_unknown_fields(rv, allocator, &n_unknown_alloced))
+			goto error_cleanup;
+		note_scanned_field(&tmp, last_field_index,
+				   required_fields_bitmap, flags);
+
+		at += used;
+		rem -= used;
+		tmp.tag = tag;
+		tmp.wire_type = wire_type;
+		if (!scan_member_data(rem, at, data, &tmp))
+			goto error_cleanup;
+		if (tmp.field == NULL &&
+		    (flags & PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN))
+		{
+			at += tmp.len;
+			rem -= tmp.len;
+			continue;
+		}
+		if (tmp.field == NULL &&
+		    (flags & PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN))
+		{
+			/* extend the pending run up to the next known field */
+			scanned_member_to_raw(&tmp, used);
+			at -= used;
+			rem += used;
+			if (raw_run.len == 0)
+				raw_run = tmp;
+			else
+				raw_run.len += tmp.len;
+			at += tmp.len;
+			rem -= tmp.len;
+			continue;
+		}
+		if (!flush_raw_unknown(&raw_run, rv, allocator, flags,
+				       &n_unknown_alloced))
+			goto error_cleanup;
+
+		/*
+		 * Scalars that aren't repeated or in a oneof are parsed by the
+		 * handler for their type, as parse_optional_member() would.
+		 */
+		field = tmp.field;
+		if (field == NULL ||
+		    field->label == PROTOBUF_C_LABEL_REPEATED ||
+		    0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF))
+			goto parse_generic;
+		member = (char *) rv + field->offset;
+		TYPE_DISPATCH(handlers, parse, field->type);
+
+parse_enum:
+parse_int32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			goto parse_error;
+		*(int32_t *) member = parse_int32(tmp.len, tmp.data);
+		goto parse_set;
+parse_uint32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			goto parse_error;
+		*(uint32_t *) member = parse_uint32(tmp.len, tmp.data);
+		goto parse_set;
+parse_sint32:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			goto parse_error;
+		*(int32_t *) member = unzigzag32(parse_uint32(tmp.len, tmp.data));
+		goto parse_set;
+parse_sfixed32:
+parse_fixed32:
+parse_float:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_32BIT)
+			goto parse_error;
+		*(uint32_t *) member = parse_fixed_uint32(tmp.data);
+		goto parse_set;
+parse_int64:
+parse_uint64:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			goto parse_error;
+		*(uint64_t *) member = parse_uint64(tmp.len, tmp.data);
+		goto parse_set;
+parse_sint64:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
+			goto parse_error;
+		*(int64_t *) member = unzigzag64(parse_uint64(tmp.len, tmp.data));
+		goto parse_set;
+parse_sfixed64:
+parse_fixed64:
+parse_double:
+		if (wire_type != PROTOBUF_C_WIRE_TYPE_64BIT)
+			goto parse_error;
+		*(uint64_t *) member = parse_fixed_uint64(tmp.data);
+		goto parse_set;
+parse_bool:
+		*(protobuf_c_boolean *) member = parse_boolean(tmp.len, tmp.data);
+		goto parse_set;
+parse_string:
+parse_bytes:
+parse_message:
+parse_generic:
+		if (!parse_member(&tmp, rv, allocator, flags))
+			goto parse_error;
+		goto parse_done;
+parse_set:
+		if (field->label != PROTOBUF_C_LABEL_REQUIRED &&
+		    field->quantifier_offset != 0)
+			STRUCT_MEMBER(protobuf_c_boolean, rv,
+				      field->quantifier_offset) = TRUE;
+parse_done:
+		at += tmp.len;
+		rem -= tmp.len;
+		continue;
+parse_error:
+		PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
+					tmp.field ? tmp.field->name : "*unknown-field*",
+					desc->name);
+		goto error_cleanup;
+	}
+	if (!flush_raw_unknown(&raw_run, rv, allocator, flags,
+			       &n_unknown_alloced))
+		goto error_cleanup;
+
+	if (flags & UNPACK_FLAG_REUSE)
+		reset_unseen_fields(rv, required_fields_bitmap, allocator, flags);
+
+	/* check that all required fields have been set */
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+		if (field_label(desc, f) == PROTOBUF_C_LABEL_REQUIRED &&
+		    field->default_value == NULL &&
+		    !REQUIRED_FIELD_BITMAP_IS_SET(f))
+		{
+			PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
+						desc->name, field->name);
+			goto error_cleanup;
+		}
+	}
+
+	if (required_fields_bitmap_alloced)
+		do_free(allocator, required_fields_bitmap);
+	return TRUE;
+
+error_cleanup:
+	if (required_fields_bitmap_alloced)
+		do_free(allocator, required_fields_bitmap);
+	return FALSE;
+}
+
+/**
+ * Unpack a message in two passes: scan all members first, so that repeated
+ * fields can be counted and their arrays allocated, then parse them.
+ */
+static protobuf_c_boolean
+unpack_two_pass(const ProtobufCMessageDescriptor *desc,
+		ProtobufCMessage *rv,
+		ProtobufCAllocator *allocator,
+		unsigned flags,
+		size_t len, const uint8_t *data)
+{
+	size_t rem = len;
+	const uint8_t *at = data;
+	const ProtobufCFieldDescriptor *last_field = desc->fields + 0;
+	ScannedMember first_member_slab[1UL <<
+					FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2];
+
+	/*
+	 * scanned_member_slabs[i] is an array of arrays of ScannedMember.
+	 * The first slab (scanned_member_slabs[0] is just a pointer to
+	 * first_member_slab), above. All subsequent slabs will be allocated
+	 * using the allocator.
+	 */
+	ScannedMember *scanned_member_slabs[MAX_SCANNED_MEMBER_SLAB + 1];
+	unsigned which_slab = 0; /* the slab we are currently populating */
+	unsigned in_slab_index = 0; /* number of members in the slab */
+	size_t n_unknown = 0;
+	ScannedMember *raw_run = NULL; /* the last member, if a raw run */
+	size_t payload_size = 0;
+	ProtobufCAllocator *payload_allocator = allocator;
+	unsigned f;
+	unsigned j;
+	unsigned i_slab;
+	unsigned last_field_index = 0;
+	unsigned required_fields_bitmap_len;
+	unsigned char required_fields_bitmap_stack[16];
+	unsigned char *required_fields_bitmap = required_fields_bitmap_stack;
+	protobuf_c_boolean required_fields_bitmap_alloced = FALSE;
+	RecycledArray recycled_stack[16];
+	RecycledArray *recycled = NULL;
+
+	scanned_member_slabs[0] = first_member_slab;
+
+	required_fields_bitmap_len = (desc->n_fields + 7) / 8;
+	if (required_fields_bitmap_len > sizeof(required_fields_bitmap_stack)) {
+		required_fields_bitmap = do_alloc(allocator, required_fields_bitmap_len);
+		if (!required_fields_bitmap)
+			return FALSE;
+		required_fields_bitmap_alloced = TRUE;
+	}
+	memset(required_fields_bitmap, 0, required_fields_bitmap_len);
 
-			earlier_elem = STRUCT_MEMBER_P(earlier_msg, field->offset);
-			latter_elem = STRUCT_MEMBER_P(latter_msg, field->offset);
-			def_val = field->default_value;
+	if (flags & UNPACK_FLAG_REUSE) {
+		recycled = recycled_stack;
+		if (desc->n_fields > sizeof(recycled_stack) /
+				     sizeof(recycled_stack[0]))
+		{
+			recycled = do_alloc(allocator,
+					    desc->n_fields * sizeof(RecycledArray));
+			if (recycled == NULL)
+				goto error_cleanup;
+		}
+		stash_repeated_fields(rv, recycled);
+	}
 
-			switch (field->type) {
-			case PROTOBUF_C_TYPE_MESSAGE: {
-				ProtobufCMessage *em = *(ProtobufCMessage **) earlier_elem;
-				ProtobufCMessage *lm = *(ProtobufCMessage **) latter_elem;
-				if (em != NULL) {
-					if (lm != NULL) {
-						if (!merge_messages(em, lm, allocator))
-							return FALSE;
-						/* Already merged */
-						need_to_merge = FALSE;
-					} else {
-						/* Zero copy the message */
-						need_to_merge = TRUE;
-					}
-				}
-				break;
-			}
-			case PROTOBUF_C_TYPE_BYTES: {
-				uint8_t *e_data =
-					((ProtobufCBinaryData *) earlier_elem)->data;
-				uint8_t *l_data =
-					((ProtobufCBinaryData *) latter_elem)->data;
-				const ProtobufCBinaryData *d_bd =
-					(ProtobufCBinaryData *) def_val;
+	while (rem > 0) {
+		uint32_t tag;
+		ProtobufCWireType wire_type;
+		const ProtobufCFieldDescriptor *field;
+		ScannedMember tmp;
+		size_t used = scan_field_tag(desc, rem, at, &tag, &wire_type,
+					     &field, &last_field,
+					     &last_field_index);
 
-				need_to_merge =
-					(e_data != NULL &&
-					 (d_bd == NULL ||
-					  e_data != d_bd->data)) &&
-					(l_data == NULL ||
-					 (d_bd != NULL &&
-					  l_data == d_bd->data));
-				break;
+		if (used == 0) {
+			PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype at offset %u",
+						(unsigned) (at - data));
+			goto error_cleanup;
+		}
+		at += used;
+		rem -= used;
+		tmp.tag = tag;
+		tmp.wire_type = wire_type;
+		tmp.field = field;
+		note_scanned_field(&tmp, last_field_index,
+				   required_fields_bitmap, flags);
+		if (!scan_member_data(rem, at, data, &tmp))
+			goto error_cleanup;
+		if (field == NULL) {
+			/* validated by the scan, then dropped without a copy */
+			if (flags & PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN) {
+				at += tmp.len;
+				rem -= tmp.len;
+				continue;
 			}
-			case PROTOBUF_C_TYPE_STRING: {
-				char *e_str = *(char **) earlier_elem;
-				char *l_str = *(char **) latter_elem;
-				const char *d_str = def_val;
-
-				need_to_merge = e_str != d_str && l_str == d_str;
-				break;
+			if (flags & PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN) {
+				scanned_member_to_raw(&tmp, used);
+				at -= used;
+				rem += used;
 			}
-			default: {
-				/* Could be has field or case enum, the logic is
-				 * equivalent, since 0 (FALSE) means not set for
-				 * oneof */
-				need_to_merge = (*earlier_case_p != 0) &&
-						(*latter_case_p == 0);
-				break;
+			if (raw_run != NULL) {
+				/* adjacent to the previous unknown field */
+				if (flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS)
+					payload_size -= contiguous_member_size(raw_run, flags);
+				raw_run->len += tmp.len;
+				if (flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS)
+					payload_size += contiguous_member_size(raw_run, flags);
+				at += tmp.len;
+				rem -= tmp.len;
+				continue;
 			}
+			n_unknown++;
+		}
+		if (flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS)
+			payload_size += contiguous_member_size(&tmp, flags);
+
+		if (in_slab_index == (1UL <<
+			(which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)))
+		{
+			size_t size;
+
+			in_slab_index = 0;
+			if (which_slab == MAX_SCANNED_MEMBER_SLAB) {
+				PROTOBUF_C_UNPACK_ERROR("too many fields");
+				goto error_cleanup;
 			}
+			which_slab++;
+			size = sizeof(ScannedMember)
+				<< (which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2);
+			scanned_member_slabs[which_slab] = do_alloc(allocator, size);
+			if (scanned_member_slabs[which_slab] == NULL)
+				goto error_cleanup;
+		}
+		scanned_member_slabs[which_slab][in_slab_index++] = tmp;
+		raw_run = NULL;
+		if (field == NULL && (flags & PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN))
+			raw_run = &scanned_member_slabs[which_slab][in_slab_index - 1];
 
-			if (need_to_merge) {
-				size_t el_size =
-					sizeof_elt_in_repeated_array(field->type);
-				memcpy(latter_elem, earlier_elem, el_size);
-				/*
-				 * Reset the element from the old message to 0
-				 * to make sure earlier message deallocation
-				 * doesn't corrupt zero-copied data in the new
-				 * message, earlier message will be freed after
-				 * this function is called anyway
-				 */
-				memset(earlier_elem, 0, el_size);
+		if (field != NULL && field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t *n = STRUCT_MEMBER_PTR(size_t, rv,
+						      field->quantifier_offset);
+			if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
+			    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+			     is_packable_type(field->type)))
+			{
+				size_t count;
+				size_t packed_len = tmp.len - tmp.length_prefix_len;
 
-				if (field->quantifier_offset != 0) {
-					/* Set the has field or the case enum,
-					 * if applicable */
-					*latter_case_p = *earlier_case_p;
-					*earlier_case_p = 0;
+				if (packed_len >= FUSED_PACKED_MIN_LEN &&
+				    packed_len <= FUSED_PACKED_MAX_LEN &&
+				    is_varint_type(field->type))
+				{
+					/*
+					 * Every varint takes at least one
+					 * byte: allocate for that many and let
+					 * the parse count them, so that a large
+					 * array is only read once.
+					 */
+					count = packed_len;
+				} else if (!count_packed_elements(field->type,
+								  packed_len,
+								  tmp.data +
+								  tmp.length_prefix_len,
+								  &count))
+				{
+					PROTOBUF_C_UNPACK_ERROR("counting packed elements");
+					goto error_cleanup;
 				}
+				*n += count;
+			} else {
+				*n += 1;
 			}
 		}
+
+		at += tmp.len;
+		rem -= tmp.len;
 	}
-	return TRUE;
-}
 
-/**
- * Count packed elements.
- *
- * Given a raw slab of packed-repeated values, determine the number of
- * elements. This function detects certain kinds of errors but not
- * others; the remaining error checking is done by
- * parse_packed_repeated_member().
- */
-static protobuf_c_boolean
-count_packed_elements(ProtobufCType type,
-		      size_t len, const uint8_t *data, size_t *count_out)
-{
-	switch (type) {
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		if (len % 4 != 0) {
-			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 4 for fixed-length 32-bit types");
-			return FALSE;
+	/* size and allocate the payload block of a contiguous message */
+	if (flags & PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS) {
+		ProtobufCArena *payload;
+
+		for (f = 0; f < desc->n_fields; f++) {
+			const ProtobufCFieldDescriptor *field = desc->fields + f;
+			size_t n;
+
+			if (field_label(desc, f) != PROTOBUF_C_LABEL_REPEATED)
+				continue;
+			n = STRUCT_MEMBER(size_t, rv, field->quantifier_offset);
+			if (n != 0)
+				payload_size += ARENA_ALIGN(n *
+					sizeof_elt_in_repeated_array(field->type));
 		}
-		*count_out = len / 4;
-		return TRUE;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		if (len % 8 != 0) {
-			PROTOBUF_C_UNPACK_ERROR("length must be a multiple of 8 for fixed-length 64-bit types");
-			return FALSE;
+		if (n_unknown)
+			payload_size += ARENA_ALIGN(n_unknown *
+				sizeof(ProtobufCMessageUnknownField));
+		if (payload_size > 0) {
+			payload = contiguous_payload_new(allocator, payload_size);
+			if (payload == NULL)
+				goto error_cleanup;
+			CONTIGUOUS_PAYLOAD(rv) = payload;
+			payload_allocator = &payload->base;
 		}
-		*count_out = len / 8;
-		return TRUE;
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-	case PROTOBUF_C_TYPE_SINT32:
-	case PROTOBUF_C_TYPE_UINT32:
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_SINT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		*count_out = max_b128_numbers(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_BOOL:
-		*count_out = len;
-		return TRUE;
-	case PROTOBUF_C_TYPE_STRING:
-	case PROTOBUF_C_TYPE_BYTES:
-	case PROTOBUF_C_TYPE_MESSAGE:
-	default:
-		PROTOBUF_C_UNPACK_ERROR("bad protobuf-c type %u for packed-repeated", type);
-		return FALSE;
 	}
-}
 
-static inline uint32_t
-parse_uint32(unsigned len, const uint8_t *data)
-{
-	uint32_t rv = data[0] & 0x7f;
-	if (len > 1) {
-		rv |= ((uint32_t) (data[1] & 0x7f) << 7);
-		if (len > 2) {
-			rv |= ((uint32_t) (data[2] & 0x7f) << 14);
-			if (len > 3) {
-				rv |= ((uint32_t) (data[3] & 0x7f) << 21);
-				if (len > 4)
-					rv |= ((uint32_t) (data[4]) << 28);
+	/* allocate space for repeated fields, also check that all required fields have been set */
+#define CLEAR_REMAINING_N_PTRS()                                              \
+              for(f++;f < desc->n_fields; f++)                                \
+                {                                                             \
+                  field = desc->fields + f;                                   \
+                  if (field->label == PROTOBUF_C_LABEL_REPEATED)              \
+                    STRUCT_MEMBER (size_t, rv, field->quantifier_offset) = 0; \
+                }
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field;
+		ProtobufCLabel label = field_label(desc, f);
+
+		if (label != PROTOBUF_C_LABEL_REPEATED &&
+		    label != PROTOBUF_C_LABEL_REQUIRED)
+			continue;
+		field = desc->fields + f;
+		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+			size_t siz =
+			    sizeof_elt_in_repeated_array(field->type);
+			size_t *n_ptr =
+			    STRUCT_MEMBER_PTR(size_t, rv,
+					      field->quantifier_offset);
+			if (recycled != NULL) {
+				size_t n = *n_ptr;
+				void *a = NULL;
+				*n_ptr = 0;
+				if (!recycle_repeated_array(field, recycled + f,
+							    n, &a, allocator,
+							    flags))
+				{
+					CLEAR_REMAINING_N_PTRS();
+					goto error_cleanup;
+				}
+				STRUCT_MEMBER(void *, rv, field->offset) = a;
+			} else if (*n_ptr != 0) {
+				unsigned n = *n_ptr;
+				void *a;
+				*n_ptr = 0;
+				assert(rv->descriptor != NULL);
+				a = do_alloc(payload_allocator, siz * n);
+				if (!a) {
+					CLEAR_REMAINING_N_PTRS();
+					goto error_cleanup;
+				}
+				STRUCT_MEMBER(void *, rv, field->offset) = a;
+			}
+		} else if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+			if (field->default_value == NULL &&
+			    !REQUIRED_FIELD_BITMAP_IS_SET(f))
+			{
+				CLEAR_REMAINING_N_PTRS();
+				PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
+							desc->name, field->name);
+				goto error_cleanup;
+			}
+		}
+	}
+#undef CLEAR_REMAINING_N_PTRS
+
+	/* allocate space for unknown fields */
+	if (n_unknown) {
+		rv->unknown_fields = do_alloc(payload_allocator,
+					      n_unknown * sizeof(ProtobufCMessageUnknownField));
+		if (rv->unknown_fields == NULL)
+			goto error_cleanup;
+	}
+
+	/* do real parsing */
+	for (i_slab = 0; i_slab <= which_slab; i_slab++) {
+		unsigned max = (i_slab == which_slab) ?
+			in_slab_index : (1UL << (i_slab + 4));
+		ScannedMember *slab = scanned_member_slabs[i_slab];
+
+		for (j = 0; j < max; j++) {
+			if (!parse_member(slab + j, rv, payload_allocator,
+					  flags))
+			{
+				PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
+							slab->field ? slab->field->name : "*unknown-field*",
+					desc->name);
+				goto error_cleanup;
 			}
 		}
 	}
-	return rv;
+
+	if (flags & UNPACK_FLAG_REUSE)
+		reset_unseen_fields(rv, required_fields_bitmap, allocator, flags);
+
+	/* cleanup */
+	for (j = 1; j <= which_slab; j++)
+		do_free(allocator, scanned_member_slabs[j]);
+	if (required_fields_bitmap_alloced)
+		do_free(allocator, required_fields_bitmap);
+	if (recycled != NULL && recycled != recycled_stack)
+		do_free(allocator, recycled);
+	return TRUE;
+
+error_cleanup:
+	if (recycled != NULL) {
+		release_recycled_arrays(rv, recycled, allocator, flags);
+		if (recycled != recycled_stack)
+			do_free(allocator, recycled);
+	}
+	for (j = 1; j <= which_slab; j++)
+		do_free(allocator, scanned_member_slabs[j]);
+	if (required_fields_bitmap_alloced)
+		do_free(allocator, required_fields_bitmap);
+	return FALSE;
 }
 
-static inline uint32_t
-parse_int32(unsigned len, const uint8_t *data)
+/**
+ * Unpack members into an initialised message, or into a message being reused
+ * if UNPACK_FLAG_REUSE is set. On failure, the message is left in a state that
+ * can be freed.
+ */
+static protobuf_c_boolean
+unpack_onto(const ProtobufCMessageDescriptor *desc,
+	    ProtobufCMessage *rv,
+	    ProtobufCAllocator *allocator,
+	    unsigned flags,
+	    size_t len, const uint8_t *data)
 {
-	return parse_uint32(len, data);
+	if (can_unpack_in_single_pass(desc, flags))
+		return unpack_single_pass(desc, rv, allocator, flags, len, data);
+	return unpack_two_pass(desc, rv, allocator, flags, len, data);
 }
 
-static inline int32_t
-unzigzag32(uint32_t v)
+static protobuf_c_boolean
+unpack_reusing(ProtobufCMessage *message,
+	       ProtobufCAllocator *allocator,
+	       unsigned flags,
+	       size_t len, const uint8_t *data)
 {
-	if (v & 1)
-		return -(v >> 1) - 1;
-	else
-		return v >> 1;
+	free_unknown_fields(message, allocator, flags);
+	return unpack_onto(message->descriptor, message, allocator,
+			   flags | UNPACK_FLAG_REUSE, len, data);
 }
 
-static inline uint32_t
-parse_fixed_uint32(const uint8_t *data)
+ProtobufCMessage *
+protobuf_c_message_unpack(const ProtobufCMessageDescriptor *desc,
+			  ProtobufCAllocator *allocator,
+			  size_t len, const uint8_t *data)
 {
-#if !defined(WORDS_BIGENDIAN)
-	uint32_t t;
-	memcpy(&t, data, 4);
-	return t;
-#else
-	return data[0] |
-		((uint32_t) (data[1]) << 8) |
-		((uint32_t) (data[2]) << 16) |
-		((uint32_t) (data[3]) << 24);
-#endif
+	return protobuf_c_message_unpack_ex(desc, allocator, 0, len, data);
 }
 
-static uint64_t
-parse_uint64(unsigned len, const uint8_t *data)
+ProtobufCMessage *
+protobuf_c_message_unpack_ex(const ProtobufCMessageDescriptor *desc,
+			     ProtobufCAllocator *allocator,
+			     unsigned flags,
+			     size_t len, const uint8_t *data)
 {
-	unsigned shift, i;
-	uint64_t rv;
+	ProtobufCMessage *rv;
 
-	if (len < 5)
-		return parse_uint32(len, data);
-	rv = ((uint64_t) (data[0] & 0x7f)) |
-		((uint64_t) (data[1] & 0x7f) << 7) |
-		((uint64_t) (data[2] & 0x7f) << 14) |
-		((uint64_t) (data[3] & 0x7f) << 21);
-	shift = 28;
-	for (i = 4; i < len; i++) {
-		rv |= (((uint64_t) (data[i] & 0x7f)) << shift);
-		shift += 7;
+	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
+
+	/*
+	 * A string's terminating NUL would land on the first tag byte of a
+	 * raw unknown run that follows it.
+	 */
+	if ((flags & PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS) &&
+	    (flags & PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN))
+	{
+		PROTOBUF_C_UNPACK_ERROR("ALIAS_STRINGS can't be combined with RAW_UNKNOWN");
+		return NULL;
+	}
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+
+	/* An arena keeps payloads together already. */
+	if (allocator->free == &arena_free)
+		flags &= ~PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS;
+
+	rv = new_unpacked_message(desc, allocator, flags);
+	if (!rv)
+		return (NULL);
+
+	/*
+	 * A generated decoder gives up on anything unusual, including errors;
+	 * start again from a fresh message with the table-driven code then.
+	 * Whatever it had decoded is thrown away, so declined input costs a
+	 * second pass over the part read so far.
+	 */
+	if (flags == 0 && desc->codec != NULL && desc->codec->unpack != NULL) {
+		if (desc->codec->unpack(rv, allocator, len, data))
+			return rv;
+		protobuf_c_message_free_unpacked_ex(rv, allocator, flags);
+		rv = new_unpacked_message(desc, allocator, flags);
+		if (!rv)
+			return (NULL);
+	}
+
+	if (!unpack_onto(desc, rv, allocator, flags, len, data)) {
+		protobuf_c_message_free_unpacked_ex(rv, allocator, flags);
+		return NULL;
 	}
 	return rv;
 }
 
-static inline int64_t
-unzigzag64(uint64_t v)
+protobuf_c_boolean
+protobuf_c_message_unpack_into(ProtobufCMessage *message,
+			       ProtobufCAllocator *allocator,
+			       size_t len, const uint8_t *data)
 {
-	if (v & 1)
-		return -(v >> 1) - 1;
-	else
-		return v >> 1;
-}
+	ASSERT_IS_MESSAGE(message);
 
-static inline uint64_t
-parse_fixed_uint64(const uint8_t *data)
-{
-#if !defined(WORDS_BIGENDIAN)
-	uint64_t t;
-	memcpy(&t, data, 8);
-	return t;
-#else
-	return (uint64_t) parse_fixed_uint32(data) |
-		(((uint64_t) parse_fixed_uint32(data + 4)) << 32);
-#endif
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	return unpack_reusing(message, allocator, 0, len, data);
 }
 
-static protobuf_c_boolean
-parse_boolean(unsigned len, const uint8_t *data)
-{
-	unsigned i;
-	for (i = 0; i < len; i++)
-		if (data[i] & 0x7f)
-			return TRUE;
-	return FALSE;
-}
+/**
+ * \defgroup unpackstate protobuf_c_unpack_state_feed() implementation
+ *
+ * Routines mainly used by protobuf_c_unpack_state_feed(). Each message being
+ * unpacked has a frame on an explicit stack, so that decoding can stop at the
+ * end of any piece of input. Fields are parsed straight from the input by the
+ * parse_*() functions used by protobuf_c_message_unpack(); only a tag, value
+ * or length prefix cut off by the end of a piece is copied, to
+ * `state->pending`, and a string, bytes or unknown field, to `state->scratch`.
+ * When the length of a string or bytes field can be trusted, the scratch
+ * buffer is allocated to fit and handed over to the field. Nested messages and
+ * packed fields that are cut off are decoded as their contents arrive.
+ *
+ * Since the number of elements of a repeated field isn't known in advance,
+ * its array is grown as elements arrive.
+ *
+ * \ingroup internal
+ * @{
+ */
+
+/** Part of a field being read, in `ProtobufCUnpackState.step`. */
+enum {
+	UNPACK_STEP_TAG,	/**< Reading a tag. */
+	UNPACK_STEP_VALUE,	/**< Reading a varint, 32-bit or 64-bit value. */
+	UNPACK_STEP_LENGTH,	/**< Reading the length of a field. */
+	UNPACK_STEP_BYTES,	/**< Collecting a length-prefixed field. */
+	UNPACK_STEP_PACKED,	/**< Reading the elements of a packed field. */
+	UNPACK_STEP_PAYLOAD,	/**< Collecting a string or bytes field. */
+};
+
+/**
+ * Longest string or bytes field collected in storage of its own size before
+ * its contents arrive, when the length of the input isn't known.
+ */
+#define UNPACK_PAYLOAD_MAX_EARLY	65536
+
+struct ProtobufCUnpackFrame {
+	/** Message being unpacked. */
+	ProtobufCMessage			*message;
+	/** Input offset at which the message ends. */
+	size_t					end;
+	/** Field most recently looked up. */
+	const ProtobufCFieldDescriptor		*last_field;
+	/** Index of `last_field`. */
+	unsigned				last_field_index;
+	/** Number of entries allocated in `message->unknown_fields`. */
+	size_t					n_unknown_alloced;
+	/**
+	 * Number of elements allocated for each repeated field, followed by
+	 * the bitmap of required fields seen. Kept for reuse once the frame
+	 * is popped.
+	 */
+	size_t					*capacities;
+	/** Number of bytes allocated at `capacities`. */
+	size_t					block_size;
+};
+
+#define UNPACK_FRAME_REQUIRED(frame)	\
+	((unsigned char *) ((frame)->capacities + \
+			    (frame)->message->descriptor->n_fields))
 
+/**
+ * Start unpacking a message whose contents end at input offset `end`.
+ */
 static protobuf_c_boolean
-parse_required_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCAllocator *allocator,
-		      protobuf_c_boolean maybe_clear)
+unpack_state_push(ProtobufCUnpackState *state,
+		  ProtobufCMessage *message,
+		  size_t end)
 {
-	unsigned len = scanned_member->len;
-	const uint8_t *data = scanned_member->data;
-	ProtobufCWireType wire_type = scanned_member->wire_type;
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	ProtobufCAllocator *allocator = state->allocator;
+	ProtobufCUnpackFrame *frame;
+	size_t block_size;
+	unsigned f;
 
-	switch (scanned_member->field->type) {
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int32_t *) member = parse_int32(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_UINT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(uint32_t *) member = parse_uint32(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_SINT32:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int32_t *) member = unzigzag32(parse_uint32(len, data));
-		return TRUE;
-	case PROTOBUF_C_TYPE_SFIXED32:
-	case PROTOBUF_C_TYPE_FIXED32:
-	case PROTOBUF_C_TYPE_FLOAT:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_32BIT)
-			return FALSE;
-		*(uint32_t *) member = parse_fixed_uint32(data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(uint64_t *) member = parse_uint64(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_SINT64:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_VARINT)
-			return FALSE;
-		*(int64_t *) member = unzigzag64(parse_uint64(len, data));
-		return TRUE;
-	case PROTOBUF_C_TYPE_SFIXED64:
-	case PROTOBUF_C_TYPE_FIXED64:
-	case PROTOBUF_C_TYPE_DOUBLE:
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_64BIT)
-			return FALSE;
-		*(uint64_t *) member = parse_fixed_uint64(data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_BOOL:
-		*(protobuf_c_boolean *) member = parse_boolean(len, data);
-		return TRUE;
-	case PROTOBUF_C_TYPE_STRING: {
-		char **pstr = member;
-		unsigned pref_len = scanned_member->length_prefix_len;
+	if (state->n_frames == state->n_alloced) {
+		size_t new_alloced = state->n_alloced ? state->n_alloced * 2 : 8;
+		ProtobufCUnpackFrame *frames;
 
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
+		frames = do_alloc(allocator, new_alloced * sizeof(*frames));
+		if (frames == NULL)
 			return FALSE;
+		if (state->n_alloced != 0)
+			memcpy(frames, state->frames,
+			       state->n_alloced * sizeof(*frames));
+		memset(frames + state->n_alloced, 0,
+		       (new_alloced - state->n_alloced) * sizeof(*frames));
+		do_free(allocator, state->frames);
+		state->frames = frames;
+		state->n_alloced = new_alloced;
+	}
 
-		if (maybe_clear && *pstr != NULL) {
-			const char *def = scanned_member->field->default_value;
-			if (*pstr != NULL && *pstr != def)
-				do_free(allocator, *pstr);
-		}
-		*pstr = do_alloc(allocator, len - pref_len + 1);
-		if (*pstr == NULL)
+	frame = &state->frames[state->n_frames];
+	block_size = desc->n_fields * sizeof(size_t) + (desc->n_fields + 7) / 8;
+	if (block_size > frame->block_size) {
+		do_free(allocator, frame->capacities);
+		frame->block_size = 0;
+		frame->capacities = do_alloc(allocator, block_size);
+		if (frame->capacities == NULL)
 			return FALSE;
-		memcpy(*pstr, data + pref_len, len - pref_len);
-		(*pstr)[len - pref_len] = 0;
-		return TRUE;
+		frame->block_size = block_size;
 	}
-	case PROTOBUF_C_TYPE_BYTES: {
-		ProtobufCBinaryData *bd = member;
-		const ProtobufCBinaryData *def_bd;
-		unsigned pref_len = scanned_member->length_prefix_len;
+	frame->message = message;
+	frame->end = end;
+	frame->last_field = desc->fields + 0;
+	frame->last_field_index = 0;
+	frame->n_unknown_alloced = message->n_unknown_fields;
+	for (f = 0; f < desc->n_fields; f++)
+		if (desc->fields[f].label == PROTOBUF_C_LABEL_REPEATED)
+			frame->capacities[f] = STRUCT_MEMBER(size_t, message,
+				desc->fields[f].quantifier_offset);
+	if (desc->n_fields != 0)
+		memset(UNPACK_FRAME_REQUIRED(frame), 0, (desc->n_fields + 7) / 8);
+	state->n_frames++;
+	return TRUE;
+}
 
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
-			return FALSE;
+/**
+ * Finish the innermost message, checking that its required fields are set.
+ */
+static protobuf_c_boolean
+unpack_state_pop(ProtobufCUnpackState *state)
+{
+	ProtobufCUnpackFrame *frame = &state->frames[--state->n_frames];
+	const ProtobufCMessageDescriptor *desc = frame->message->descriptor;
+	const unsigned char *required_fields_bitmap =
+		UNPACK_FRAME_REQUIRED(frame);
+	unsigned f;
 
-		def_bd = scanned_member->field->default_value;
-		if (maybe_clear &&
-		    bd->data != NULL &&
-		    (def_bd == NULL || bd->data != def_bd->data))
+	for (f = 0; f < desc->n_fields; f++) {
+		const ProtobufCFieldDescriptor *field = desc->fields + f;
+
+		if (field_label(desc, f) == PROTOBUF_C_LABEL_REQUIRED &&
+		    field->default_value == NULL &&
+		    !REQUIRED_FIELD_BITMAP_IS_SET(f))
 		{
-			do_free(allocator, bd->data);
-		}
-		if (len - pref_len > 0) {
-			bd->data = do_alloc(allocator, len - pref_len);
-			if (bd->data == NULL)
-				return FALSE;
-			memcpy(bd->data, data + pref_len, len - pref_len);
-		} else {
-			bd->data = NULL;
+			PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
+						desc->name, field->name);
+			return FALSE;
 		}
-		bd->len = len - pref_len;
+	}
+	return TRUE;
+}
+
+/**
+ * Make room for `count` more elements in the repeated field being read.
+ */
+static protobuf_c_boolean
+unpack_state_reserve(ProtobufCUnpackState *state,
+		     ProtobufCUnpackFrame *frame,
+		     size_t count)
+{
+	const ProtobufCFieldDescriptor *field = state->field;
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, frame->message,
+					field->quantifier_offset);
+	void **p_array = STRUCT_MEMBER_PTR(void *, frame->message,
+					   field->offset);
+	size_t *capacity = &frame->capacities[frame->last_field_index];
+	size_t siz = sizeof_elt_in_repeated_array(field->type);
+	size_t new_capacity;
+	void *array;
+
+	if (*p_n + count <= *capacity)
 		return TRUE;
+	new_capacity = *capacity < 4 ? 8 : *capacity * 2;
+	if (new_capacity < *p_n + count)
+		new_capacity = *p_n + count;
+	array = do_alloc(state->allocator, siz * new_capacity);
+	if (array == NULL)
+		return FALSE;
+	if (*p_n != 0)
+		memcpy(array, *p_array, siz * *p_n);
+	do_free(state->allocator, *p_array);
+	*p_array = array;
+	*capacity = new_capacity;
+	return TRUE;
+}
+
+/**
+ * Store a complete field, other than a packed one, in the innermost message.
+ */
+static protobuf_c_boolean
+unpack_state_apply(ProtobufCUnpackState *state,
+		   ProtobufCUnpackFrame *frame,
+		   const uint8_t *data, size_t len)
+{
+	const ProtobufCFieldDescriptor *field = state->field;
+	ProtobufCMessage *message = frame->message;
+	unsigned char *required_fields_bitmap = UNPACK_FRAME_REQUIRED(frame);
+	ScannedMember tmp;
+
+	tmp.tag = state->tag;
+	tmp.wire_type = state->wire_type;
+	tmp.length_prefix_len = 0;
+	tmp.reuse = FALSE;
+	tmp.field = field;
+	tmp.len = len;
+	tmp.data = data;
+
+	if (field == NULL) {
+		if (message->n_unknown_fields == frame->n_unknown_alloced &&
+		    !grow_unknown_fields(message, state->allocator,
+					 &frame->n_unknown_alloced))
+			return FALSE;
+	} else if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+		if (!unpack_state_reserve(state, frame, 1))
+			return FALSE;
+	} else if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
+		REQUIRED_FIELD_BITMAP_SET(frame->last_field_index);
+	}
+	if (!parse_member(&tmp, message, state->allocator, 0)) {
+		PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
+					field ? field->name : "*unknown-field*",
+					message->descriptor->name);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Mark the field being read as present in the message of `frame` and return
+ * where its value goes: a new, zeroed element at the end of a repeated field,
+ * or else the member itself, whose old value the caller replaces.
+ */
+static void *
+unpack_state_claim(ProtobufCUnpackState *state, ProtobufCUnpackFrame *frame)
+{
+	const ProtobufCFieldDescriptor *field = state->field;
+	ProtobufCMessage *message = frame->message;
+	unsigned char *required_fields_bitmap = UNPACK_FRAME_REQUIRED(frame);
+	void *member = STRUCT_MEMBER_P(message, field->offset);
+
+	if (field->label == PROTOBUF_C_LABEL_REPEATED) {
+		size_t *p_n = STRUCT_MEMBER_PTR(size_t, message,
+						field->quantifier_offset);
+		size_t siz = sizeof_elt_in_repeated_array(field->type);
+		char *elt;
+
+		if (!unpack_state_reserve(state, frame, 1))
+			return NULL;
+		elt = *(char **) member + siz * (*p_n)++;
+		memset(elt, 0, siz);
+		return elt;
 	}
-	case PROTOBUF_C_TYPE_MESSAGE: {
-		ProtobufCMessage **pmessage = member;
-		ProtobufCMessage *subm;
-		const ProtobufCMessage *def_mess;
-		protobuf_c_boolean merge_successful = TRUE;
-		unsigned pref_len = scanned_member->length_prefix_len;
 
-		if (wire_type != PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED)
-			return FALSE;
+	if (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) {
+		uint32_t *oneof_case = STRUCT_MEMBER_PTR(uint32_t, message,
+						field->quantifier_offset);
 
-		def_mess = scanned_member->field->default_value;
-		subm = protobuf_c_message_unpack(scanned_member->field->descriptor,
-						 allocator,
-						 len - pref_len,
-						 data + pref_len);
+		if (*oneof_case != 0 && *oneof_case != field->id) {
+			int old_index = field_index_lookup(message->descriptor,
+							   *oneof_case);
 
-		if (maybe_clear &&
-		    *pmessage != NULL &&
-		    *pmessage != def_mess)
-		{
-			if (subm != NULL)
-				merge_successful = merge_messages(*pmessage, subm, allocator);
-			/* Delete the previous message */
-			protobuf_c_message_free_unpacked(*pmessage, allocator);
+			if (old_index < 0)
+				return NULL;
+			reset_field(message,
+				    message->descriptor->fields + old_index,
+				    state->allocator, 0);
 		}
-		*pmessage = subm;
-		if (subm == NULL || !merge_successful)
-			return FALSE;
-		return TRUE;
-	}
+		*oneof_case = field->id;
+	} else if (field->quantifier_offset != 0) {
+		STRUCT_MEMBER(protobuf_c_boolean, message,
+			      field->quantifier_offset) = TRUE;
 	}
-	return FALSE;
+	if (field->label == PROTOBUF_C_LABEL_REQUIRED)
+		REQUIRED_FIELD_BITMAP_SET(frame->last_field_index);
+	return member;
 }
 
+/**
+ * Start unpacking a nested message whose contents are cut off by the end of
+ * the input, in the field being read.
+ *
+ * Like merge_messages() does for a message field that occurs more than once,
+ * a field that already holds a message has the new one merged into it.
+ */
 static protobuf_c_boolean
-parse_oneof_member (ScannedMember *scanned_member,
-		    void *member,
-		    ProtobufCMessage *message,
-		    ProtobufCAllocator *allocator)
+unpack_state_begin_message(ProtobufCUnpackState *state,
+			   ProtobufCUnpackFrame *frame)
 {
-	uint32_t *oneof_case = STRUCT_MEMBER_PTR(uint32_t, message,
-					       scanned_member->field->quantifier_offset);
+	const ProtobufCFieldDescriptor *field = state->field;
+	ProtobufCMessage **member = unpack_state_claim(state, frame);
+	ProtobufCMessage *subm;
 
-	/* If we have already parsed a member of this oneof, free it. */
-	if (*oneof_case != 0) {
-		/* lookup field */
-		int field_index =
-			int_range_lookup(message->descriptor->n_field_ranges,
-					 message->descriptor->field_ranges,
-					 *oneof_case);
-		if (field_index < 0)
+	if (member == NULL)
+		return FALSE;
+	subm = *member;
+	if (subm == NULL || subm == field->default_value) {
+		subm = new_unpacked_message(field->descriptor,
+					    state->allocator, 0);
+		if (subm == NULL)
 			return FALSE;
-		const ProtobufCFieldDescriptor *old_field =
-			message->descriptor->fields + field_index;
-		size_t el_size = sizeof_elt_in_repeated_array(old_field->type);
+		*member = subm;
+	}
+	return unpack_state_push(state, subm, state->field_end);
+}
 
-		switch (old_field->type) {
-	        case PROTOBUF_C_TYPE_STRING: {
-			char **pstr = member;
-			const char *def = old_field->default_value;
-			if (*pstr != NULL && *pstr != def)
-				do_free(allocator, *pstr);
-			break;
-	        }
-		case PROTOBUF_C_TYPE_BYTES: {
-			ProtobufCBinaryData *bd = member;
-			const ProtobufCBinaryData *def_bd = old_field->default_value;
-			if (bd->data != NULL &&
-			   (def_bd == NULL || bd->data != def_bd->data))
-			{
-				do_free(allocator, bd->data);
-			}
-			break;
-	        }
-		case PROTOBUF_C_TYPE_MESSAGE: {
-			ProtobufCMessage **pmessage = member;
-			const ProtobufCMessage *def_mess = old_field->default_value;
-			if (*pmessage != NULL && *pmessage != def_mess)
-				protobuf_c_message_free_unpacked(*pmessage, allocator);
-			break;
-	        }
-		default:
-			break;
-		}
+/**
+ * Store the contents of a string or bytes field that were collected in the
+ * scratch buffer, which becomes the storage of the field.
+ */
+static protobuf_c_boolean
+unpack_state_adopt_payload(ProtobufCUnpackState *state,
+			   ProtobufCUnpackFrame *frame)
+{
+	const ProtobufCFieldDescriptor *field = state->field;
+	void *member = unpack_state_claim(state, frame);
+	uint8_t *data = state->scratch;
+	size_t len = state->scratch_len;
 
-		memset (member, 0, el_size);
-	}
-	if (!parse_required_member (scanned_member, member, allocator, TRUE))
+	if (member == NULL)
 		return FALSE;
+	state->scratch = NULL;
+	state->scratch_len = 0;
+	state->scratch_alloced = 0;
 
-	*oneof_case = scanned_member->tag;
+	if (field->type == PROTOBUF_C_TYPE_STRING) {
+		char **pstr = member;
+
+		if (*pstr != NULL && *pstr != field->default_value)
+			do_free(state->allocator, *pstr);
+		data[len] = 0;
+		*pstr = (char *) data;
+	} else {
+		ProtobufCBinaryData *bd = member;
+		const ProtobufCBinaryData *def_bd = field->default_value;
+
+		if (bd->data != NULL &&
+		    (def_bd == NULL || bd->data != def_bd->data))
+			do_free(state->allocator, bd->data);
+		bd->data = data;
+		bd->len = len;
+	}
 	return TRUE;
 }
 
-
+/**
+ * Read a varint of at most `max_len` bytes, which may continue one started in
+ * the previous piece of input, and which must end by input offset `end`.
+ *
+ * \param[out] value
+ *      Set to the bytes of the varint, or to NULL if the input ran out first.
+ * \return
+ *      FALSE if the varint is longer than `max_len` bytes or is cut off by
+ *      `end`.
+ */
 static protobuf_c_boolean
-parse_optional_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCMessage *message,
-		      ProtobufCAllocator *allocator)
+unpack_state_read_varint(ProtobufCUnpackState *state,
+			 const uint8_t **at, size_t *rem, size_t end,
+			 unsigned max_len,
+			 const uint8_t **value, size_t *value_len)
 {
-	if (!parse_required_member(scanned_member, member, allocator, TRUE))
-		return FALSE;
-	if (scanned_member->field->quantifier_offset != 0)
-		STRUCT_MEMBER(protobuf_c_boolean,
-			      message,
-			      scanned_member->field->quantifier_offset) = TRUE;
-	return TRUE;
+	/* what is left of this piece of input before `end` */
+	size_t avail = end - (state->len - *rem);
+
+	if (avail > *rem)
+		avail = *rem;
+	*value = NULL;
+	if (state->pending_len == 0) {
+		unsigned len = scan_varint(avail < max_len ?
+					   (unsigned) avail : max_len, *at);
+
+		if (len != 0) {
+			*value = *at;
+			*value_len = len;
+			*at += len;
+			*rem -= len;
+			return TRUE;
+		}
+		if (avail >= max_len)
+			return FALSE;
+	}
+	while (avail > 0) {
+		uint8_t b = *(*at)++;
+
+		--*rem;
+		--avail;
+		state->pending[state->pending_len++] = b;
+		if ((b & 0x80) == 0) {
+			*value = state->pending;
+			*value_len = state->pending_len;
+			state->pending_len = 0;
+			return TRUE;
+		}
+		if (state->pending_len == max_len)
+			return FALSE;
+	}
+	return state->len - *rem != end;
 }
 
-static protobuf_c_boolean
-parse_repeated_member(ScannedMember *scanned_member,
-		      void *member,
-		      ProtobufCMessage *message,
-		      ProtobufCAllocator *allocator)
+/**
+ * Read a value of `size` bytes, which may continue one started in the
+ * previous piece of input.
+ *
+ * \return
+ *      The bytes of the value, or NULL if the input ran out first.
+ */
+static const uint8_t *
+unpack_state_read_fixed(ProtobufCUnpackState *state,
+			const uint8_t **at, size_t *rem,
+			size_t size)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
-	size_t siz = sizeof_elt_in_repeated_array(field->type);
-	char *array = *(char **) member;
+	const uint8_t *rv = *at;
+	size_t n;
 
-	if (!parse_required_member(scanned_member, array + siz * (*p_n),
-				   allocator, FALSE))
+	if (state->pending_len == 0 && *rem >= size) {
+		*at += size;
+		*rem -= size;
+		return rv;
+	}
+	n = size - state->pending_len;
+	if (n > *rem)
+		n = *rem;
+	memcpy(state->pending + state->pending_len, *at, n);
+	state->pending_len += n;
+	*at += n;
+	*rem -= n;
+	if (state->pending_len < size)
+		return NULL;
+	state->pending_len = 0;
+	return state->pending;
+}
+
+static protobuf_c_boolean
+unpack_state_tag(ProtobufCUnpackState *state,
+		 ProtobufCUnpackFrame *frame,
+		 const uint8_t **at, size_t *rem)
+{
+	const uint8_t *value;
+	size_t len;
+	ProtobufCWireType wire_type;
+
+	if (!unpack_state_read_varint(state, at, rem, frame->end, 5,
+				      &value, &len) ||
+	    (value != NULL &&
+	     parse_tag_and_wiretype(len, value, &state->tag, &wire_type) != len))
 	{
+		PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype at offset %u",
+					(unsigned) (state->len - *rem));
+		return FALSE;
+	}
+	if (value == NULL)
+		return TRUE;
+
+	state->wire_type = wire_type;
+	state->field = lookup_scanned_field(frame->message->descriptor,
+					    state->tag, &frame->last_field,
+					    &frame->last_field_index);
+	switch (wire_type) {
+	case PROTOBUF_C_WIRE_TYPE_VARINT:
+	case PROTOBUF_C_WIRE_TYPE_64BIT:
+	case PROTOBUF_C_WIRE_TYPE_32BIT:
+		state->step = UNPACK_STEP_VALUE;
+		return TRUE;
+	case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED:
+		state->step = UNPACK_STEP_LENGTH;
+		return TRUE;
+	default:
+		PROTOBUF_C_UNPACK_ERROR("unsupported tag %u at offset %u",
+					wire_type,
+					(unsigned) (state->len - *rem));
 		return FALSE;
 	}
-	*p_n += 1;
-	return TRUE;
 }
 
-static unsigned
-scan_varint(unsigned len, const uint8_t *data)
+static protobuf_c_boolean
+unpack_state_value(ProtobufCUnpackState *state,
+		   ProtobufCUnpackFrame *frame,
+		   const uint8_t **at, size_t *rem)
 {
-	unsigned i;
-	if (len > 10)
-		len = 10;
-	for (i = 0; i < len; i++)
-		if ((data[i] & 0x80) == 0)
-			break;
-	if (i == len)
-		return 0;
-	return i + 1;
+	const uint8_t *value;
+	size_t len;
+
+	switch (state->wire_type) {
+	case PROTOBUF_C_WIRE_TYPE_VARINT:
+		if (!unpack_state_read_varint(state, at, rem, frame->end, 10,
+					      &value, &len))
+		{
+			PROTOBUF_C_UNPACK_ERROR("unterminated varint at offset %u",
+						(unsigned) (state->len - *rem));
+			return FALSE;
+		}
+		break;
+	case PROTOBUF_C_WIRE_TYPE_64BIT:
+		len = 8;
+		value = unpack_state_read_fixed(state, at, rem, len);
+		break;
+	default:
+		len = 4;
+		value = unpack_state_read_fixed(state, at, rem, len);
+		break;
+	}
+	if (value == NULL)
+		return TRUE;
+	state->step = UNPACK_STEP_TAG;
+	return unpack_state_apply(state, frame, value, len);
 }
 
+/**
+ * Collect the contents of a string, bytes or unknown field, and store the
+ * field once they are complete.
+ */
 static protobuf_c_boolean
-parse_packed_repeated_member(ScannedMember *scanned_member,
-			     void *member,
-			     ProtobufCMessage *message)
+unpack_state_bytes(ProtobufCUnpackState *state,
+		   ProtobufCUnpackFrame *frame,
+		   const uint8_t **at, size_t *rem)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	size_t *p_n = STRUCT_MEMBER_PTR(size_t, message, field->quantifier_offset);
-	size_t siz = sizeof_elt_in_repeated_array(field->type);
-	void *array = *(char **) member + siz * (*p_n);
-	const uint8_t *at = scanned_member->data + scanned_member->length_prefix_len;
-	size_t rem = scanned_member->len - scanned_member->length_prefix_len;
-	size_t count = 0;
-	unsigned i;
+	size_t need = state->field_end - (state->len - *rem);
+	size_t n = need < *rem ? need : *rem;
+
+	if (state->scratch_len + n > state->scratch_alloced) {
+		size_t new_alloced = state->scratch_alloced ?
+			state->scratch_alloced * 2 : 64;
+		uint8_t *scratch;
+
+		while (new_alloced < state->scratch_len + n)
+			new_alloced *= 2;
+		scratch = do_alloc(state->allocator, new_alloced);
+		if (scratch == NULL)
+			return FALSE;
+		if (state->scratch_len != 0)
+			memcpy(scratch, state->scratch, state->scratch_len);
+		do_free(state->allocator, state->scratch);
+		state->scratch = scratch;
+		state->scratch_alloced = new_alloced;
+	}
+	if (n != 0)
+		memcpy(state->scratch + state->scratch_len, *at, n);
+	state->scratch_len += n;
+	*at += n;
+	*rem -= n;
+	if (n < need)
+		return TRUE;
 
-	switch (field->type) {
+	if (state->step == UNPACK_STEP_PAYLOAD) {
+		state->step = UNPACK_STEP_TAG;
+		return unpack_state_adopt_payload(state, frame);
+	}
+	state->step = UNPACK_STEP_TAG;
+	n = state->scratch_len;
+	state->scratch_len = 0;
+	return unpack_state_apply(state, frame, state->scratch, n);
+}
+
+/**
+ * Return the length of the complete elements at the start of `len` bytes of a
+ * packed field.
+ */
+static size_t
+complete_packed_elements_len(ProtobufCType type,
+			     size_t len, const uint8_t *data)
+{
+	switch (type) {
 	case PROTOBUF_C_TYPE_SFIXED32:
 	case PROTOBUF_C_TYPE_FIXED32:
 	case PROTOBUF_C_TYPE_FLOAT:
-		count = (scanned_member->len - scanned_member->length_prefix_len) / 4;
-#if !defined(WORDS_BIGENDIAN)
-		goto no_unpacking_needed;
-#else
-		for (i = 0; i < count; i++) {
-			((uint32_t *) array)[i] = parse_fixed_uint32(at);
-			at += 4;
-		}
-		break;
-#endif
+		return len - len % 4;
 	case PROTOBUF_C_TYPE_SFIXED64:
 	case PROTOBUF_C_TYPE_FIXED64:
 	case PROTOBUF_C_TYPE_DOUBLE:
-		count = (scanned_member->len - scanned_member->length_prefix_len) / 8;
-#if !defined(WORDS_BIGENDIAN)
-		goto no_unpacking_needed;
-#else
-		for (i = 0; i < count; i++) {
-			((uint64_t *) array)[i] = parse_fixed_uint64(at);
-			at += 8;
-		}
-		break;
-#endif
-	case PROTOBUF_C_TYPE_ENUM:
-	case PROTOBUF_C_TYPE_INT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int32 value");
-				return FALSE;
-			}
-			((int32_t *) array)[count++] = parse_int32(s, at);
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_SINT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint32 value");
+		return len - len % 8;
+	default:
+		/* up to the last byte that ends a varint */
+		while (len > 0 && (data[len - 1] & 0x80) != 0)
+			len--;
+		return len;
+	}
+}
+
+/**
+ * Read the elements of a packed field. Those complete in the input are parsed
+ * together, as by protobuf_c_message_unpack(); an element cut off by the end
+ * of the input is completed in `state->pending` and parsed on its own.
+ */
+static protobuf_c_boolean
+unpack_state_packed(ProtobufCUnpackState *state,
+		    ProtobufCUnpackFrame *frame,
+		    const uint8_t **at, size_t *rem)
+{
+	const ProtobufCFieldDescriptor *field = state->field;
+	void *member = STRUCT_MEMBER_P(frame->message, field->offset);
+	size_t *p_n = STRUCT_MEMBER_PTR(size_t, frame->message,
+					field->quantifier_offset);
+	size_t *capacity = &frame->capacities[frame->last_field_index];
+	ScannedMember tmp;
+
+	tmp.tag = state->tag;
+	tmp.length_prefix_len = 0;
+	tmp.reuse = FALSE;
+	tmp.field = field;
+
+	while (state->len - *rem < state->field_end) {
+		size_t n = state->field_end - (state->len - *rem);
+		size_t count;
+
+		if (n > *rem)
+			n = *rem;
+		if (state->pending_len == 0)
+			n = complete_packed_elements_len(field->type, n, *at);
+		if (state->pending_len == 0 && n != 0) {
+			/* no element is shorter than a byte */
+			if (*capacity - *p_n < n &&
+			    (!count_packed_elements(field->type, n, *at,
+						    &count) ||
+			     !unpack_state_reserve(state, frame, count)))
 				return FALSE;
-			}
-			((int32_t *) array)[count++] = unzigzag32(parse_uint32(s, at));
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_UINT32:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated enum or uint32 value");
+			tmp.wire_type = PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+			tmp.len = n;
+			tmp.data = *at;
+			if (!parse_packed_repeated_member(&tmp, member,
+							  frame->message))
 				return FALSE;
-			}
-			((uint32_t *) array)[count++] = parse_uint32(s, at);
-			at += s;
-			rem -= s;
+			*at += n;
+			*rem -= n;
+			continue;
 		}
-		break;
 
-	case PROTOBUF_C_TYPE_SINT64:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated sint64 value");
-				return FALSE;
-			}
-			((int64_t *) array)[count++] = unzigzag64(parse_uint64(s, at));
-			at += s;
-			rem -= s;
+		switch (field->type) {
+		case PROTOBUF_C_TYPE_SFIXED32:
+		case PROTOBUF_C_TYPE_FIXED32:
+		case PROTOBUF_C_TYPE_FLOAT:
+			tmp.wire_type = PROTOBUF_C_WIRE_TYPE_32BIT;
+			tmp.len = 4;
+			break;
+		case PROTOBUF_C_TYPE_SFIXED64:
+		case PROTOBUF_C_TYPE_FIXED64:
+		case PROTOBUF_C_TYPE_DOUBLE:
+			tmp.wire_type = PROTOBUF_C_WIRE_TYPE_64BIT;
+			tmp.len = 8;
+			break;
+		default:
+			tmp.wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+			tmp.len = 0;
+			break;
 		}
-		break;
-	case PROTOBUF_C_TYPE_INT64:
-	case PROTOBUF_C_TYPE_UINT64:
-		while (rem > 0) {
-			unsigned s = scan_varint(rem, at);
-			if (s == 0) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated int64/uint64 value");
+		if (tmp.len != 0) {
+			/* what is left of the field must complete the element */
+			if (state->pending_len + (state->field_end -
+						  (state->len - *rem)) < tmp.len)
+			{
+				PROTOBUF_C_UNPACK_ERROR("packed-repeated element overruns its field");
 				return FALSE;
 			}
-			((int64_t *) array)[count++] = parse_uint64(s, at);
-			at += s;
-			rem -= s;
-		}
-		break;
-	case PROTOBUF_C_TYPE_BOOL:
-		count = rem;
-		for (i = 0; i < count; i++) {
-			if (at[i] > 1) {
-				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated boolean value");
+			tmp.data = unpack_state_read_fixed(state, at, rem,
+							   tmp.len);
+		} else {
+			if (!unpack_state_read_varint(state, at, rem,
+						      state->field_end, 10,
+						      &tmp.data, &tmp.len) ||
+			    (field->type == PROTOBUF_C_TYPE_BOOL &&
+			     tmp.data != NULL &&
+			     (tmp.len != 1 || tmp.data[0] > 1)))
+			{
+				PROTOBUF_C_UNPACK_ERROR("bad packed-repeated value");
 				return FALSE;
 			}
-			((protobuf_c_boolean *) array)[i] = at[i];
 		}
-		break;
-	default:
-		PROTOBUF_C__ASSERT_NOT_REACHED();
+		if (tmp.data == NULL)
+			return TRUE;
+		if (!unpack_state_reserve(state, frame, 1) ||
+		    !parse_repeated_member(&tmp, member, frame->message,
+					   state->allocator, 0))
+			return FALSE;
 	}
-	*p_n += count;
+	state->step = UNPACK_STEP_TAG;
 	return TRUE;
-
-#if !defined(WORDS_BIGENDIAN)
-no_unpacking_needed:
-	memcpy(array, at, count * siz);
-	*p_n += count;
-	return TRUE;
-#endif
-}
-
-static protobuf_c_boolean
-is_packable_type(ProtobufCType type)
-{
-	return
-		type != PROTOBUF_C_TYPE_STRING &&
-		type != PROTOBUF_C_TYPE_BYTES &&
-		type != PROTOBUF_C_TYPE_MESSAGE;
 }
 
 static protobuf_c_boolean
-parse_member(ScannedMember *scanned_member,
-	     ProtobufCMessage *message,
-	     ProtobufCAllocator *allocator)
+unpack_state_length(ProtobufCUnpackState *state,
+		    ProtobufCUnpackFrame *frame,
+		    const uint8_t **at, size_t *rem)
 {
-	const ProtobufCFieldDescriptor *field = scanned_member->field;
-	void *member;
+	const ProtobufCFieldDescriptor *field = state->field;
+	const uint8_t *prefix;
+	size_t prefix_len;
+	size_t pos;
+	uint32_t len;
 
-	if (field == NULL) {
-		ProtobufCMessageUnknownField *ufield =
-			message->unknown_fields +
-			(message->n_unknown_fields++);
-		ufield->tag = scanned_member->tag;
-		ufield->wire_type = scanned_member->wire_type;
-		ufield->len = scanned_member->len;
-		ufield->data = do_alloc(allocator, scanned_member->len);
-		if (ufield->data == NULL)
-			return FALSE;
-		memcpy(ufield->data, scanned_member->data, ufield->len);
+	if (!unpack_state_read_varint(state, at, rem, frame->end, 5,
+				      &prefix, &prefix_len))
+	{
+		PROTOBUF_C_UNPACK_ERROR("error parsing length for length-prefixed data");
+		return FALSE;
+	}
+	if (prefix == NULL)
 		return TRUE;
+	len = parse_uint32(prefix_len, prefix);
+	pos = state->len - *rem;
+	if (len > frame->end - pos) {
+		PROTOBUF_C_UNPACK_ERROR("data too short after length-prefix of %u",
+					len);
+		return FALSE;
 	}
-	member = (char *) message + field->offset;
-	switch (field->label) {
-	case PROTOBUF_C_LABEL_REQUIRED:
-		return parse_required_member(scanned_member, member,
-					     allocator, TRUE);
-	case PROTOBUF_C_LABEL_OPTIONAL:
-	case PROTOBUF_C_LABEL_NONE:
-		if (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF)) {
-			return parse_oneof_member(scanned_member, member,
-						  message, allocator);
-		} else {
-			return parse_optional_member(scanned_member, member,
-						     message, allocator);
+	state->field_end = pos + len;
+
+	if (field != NULL && field->label == PROTOBUF_C_LABEL_REPEATED &&
+	    ((field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
+	     is_packable_type(field->type)))
+	{
+		size_t count = 0;
+
+		/*
+		 * When all of the input is there, the length can be trusted
+		 * to size the array once, as protobuf_c_message_unpack() does.
+		 */
+		if (state->frames[0].end != (size_t) -1) {
+			if (!is_varint_type(field->type))
+				count = field->type == PROTOBUF_C_TYPE_BOOL ? len :
+					len / sizeof_elt_in_repeated_array(field->type);
+			else if (len >= FUSED_PACKED_MIN_LEN &&
+				 len <= FUSED_PACKED_MAX_LEN)
+				count = len;
 		}
-	case PROTOBUF_C_LABEL_REPEATED:
-		if (scanned_member->wire_type ==
-		    PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
-		    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
-		     is_packable_type(field->type)))
-		{
-			return parse_packed_repeated_member(scanned_member,
-							    member, message);
-		} else {
-			return parse_repeated_member(scanned_member,
-						     member, message,
-						     allocator);
+		if (count != 0 && !unpack_state_reserve(state, frame, count))
+			return FALSE;
+		state->step = UNPACK_STEP_PACKED;
+		return unpack_state_packed(state, frame, at, rem);
+	}
+
+	if (len <= *rem) {
+		/* the whole field is here */
+		const uint8_t *data = *at;
+
+		*at += len;
+		*rem -= len;
+		state->step = UNPACK_STEP_TAG;
+		if (field != NULL)
+			return unpack_state_apply(state, frame, data, len);
+		/* unknown fields keep their length prefix */
+		if (prefix + prefix_len == data)
+			return unpack_state_apply(state, frame, prefix,
+						  prefix_len + len);
+		*at -= len;
+		*rem += len;
+	} else if (field != NULL && field->type == PROTOBUF_C_TYPE_MESSAGE) {
+		state->step = UNPACK_STEP_TAG;
+		return unpack_state_begin_message(state, frame);
+	} else if (field != NULL &&
+		   (field->type == PROTOBUF_C_TYPE_STRING ||
+		    field->type == PROTOBUF_C_TYPE_BYTES) &&
+		   (state->frames[0].end != (size_t) -1 ||
+		    len <= UNPACK_PAYLOAD_MAX_EARLY))
+	{
+		/* room for the contents and a string's terminating NUL */
+		do_free(state->allocator, state->scratch);
+		state->scratch_len = 0;
+		state->scratch_alloced = 0;
+		state->scratch = do_alloc(state->allocator, (size_t) len + 1);
+		if (state->scratch == NULL)
+			return FALSE;
+		state->scratch_alloced = (size_t) len + 1;
+		state->step = UNPACK_STEP_PAYLOAD;
+		return unpack_state_bytes(state, frame, at, rem);
+	}
+
+	state->step = UNPACK_STEP_BYTES;
+	state->scratch_len = 0;
+	if (field == NULL) {
+		if (state->scratch_alloced < prefix_len) {
+			do_free(state->allocator, state->scratch);
+			state->scratch_alloced = 0;
+			state->scratch = do_alloc(state->allocator, 64);
+			if (state->scratch == NULL)
+				return FALSE;
+			state->scratch_alloced = 64;
 		}
+		memcpy(state->scratch, prefix, prefix_len);
+		state->scratch_len = prefix_len;
 	}
-	PROTOBUF_C__ASSERT_NOT_REACHED();
-	return 0;
+	return unpack_state_bytes(state, frame, at, rem);
 }
 
-/**
- * Initialise messages generated by old code.
- *
- * This function is used if desc->message_init == NULL (which occurs
- * for old code, and which would be useful to support allocating
- * descriptors dynamically).
- */
-static void
-message_init_generic(const ProtobufCMessageDescriptor *desc,
-		     ProtobufCMessage *message)
+/**@}*/
+
+protobuf_c_boolean
+protobuf_c_unpack_state_init(ProtobufCUnpackState *state,
+			     const ProtobufCMessageDescriptor *descriptor,
+			     ProtobufCAllocator *allocator)
 {
-	unsigned i;
+	ASSERT_IS_MESSAGE_DESCRIPTOR(descriptor);
 
-	memset(message, 0, desc->sizeof_message);
-	message->descriptor = desc;
-	for (i = 0; i < desc->n_fields; i++) {
-		if (desc->fields[i].default_value != NULL &&
-		    desc->fields[i].label != PROTOBUF_C_LABEL_REPEATED)
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	state->allocator = allocator;
+	state->frames = NULL;
+	state->n_frames = 0;
+	state->n_alloced = 0;
+	state->step = UNPACK_STEP_TAG;
+	state->pending_len = 0;
+	state->scratch = NULL;
+	state->scratch_len = 0;
+	state->scratch_alloced = 0;
+	state->len = 0;
+	state->failed = FALSE;
+
+	/* the outermost message ends wherever the input does */
+	state->message = new_unpacked_message(descriptor, allocator, 0);
+	if (state->message == NULL ||
+	    !unpack_state_push(state, state->message, (size_t) -1))
+	{
+		state->failed = TRUE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+protobuf_c_boolean
+protobuf_c_unpack_state_feed(ProtobufCUnpackState *state,
+			     size_t len, const uint8_t *data)
+{
+	const uint8_t *at = data;
+	size_t rem = len;
+
+	if (state->failed || state->n_frames == 0)
+		return FALSE;
+
+	/* the input offset of `at` is always state->len - rem */
+	state->len += len;
+	for (;;) {
+		ProtobufCUnpackFrame *frame = &state->frames[state->n_frames - 1];
+		protobuf_c_boolean ok;
+
+		/* the outermost message is closed by ..._finish() */
+		if (state->n_frames > 1 &&
+		    state->step == UNPACK_STEP_TAG &&
+		    state->pending_len == 0 &&
+		    state->len - rem >= frame->end)
 		{
-			void *field =
-				STRUCT_MEMBER_P(message, desc->fields[i].offset);
-			const void *dv = desc->fields[i].default_value;
-
-			switch (desc->fields[i].type) {
-			case PROTOBUF_C_TYPE_INT32:
-			case PROTOBUF_C_TYPE_SINT32:
-			case PROTOBUF_C_TYPE_SFIXED32:
-			case PROTOBUF_C_TYPE_UINT32:
-			case PROTOBUF_C_TYPE_FIXED32:
-			case PROTOBUF_C_TYPE_FLOAT:
-			case PROTOBUF_C_TYPE_ENUM:
-				memcpy(field, dv, 4);
+			if (state->len - rem > frame->end) {
+				PROTOBUF_C_UNPACK_ERROR("field overruns message '%s'",
+							frame->message->descriptor->name);
 				break;
-			case PROTOBUF_C_TYPE_INT64:
-			case PROTOBUF_C_TYPE_SINT64:
-			case PROTOBUF_C_TYPE_SFIXED64:
-			case PROTOBUF_C_TYPE_UINT64:
-			case PROTOBUF_C_TYPE_FIXED64:
-			case PROTOBUF_C_TYPE_DOUBLE:
-				memcpy(field, dv, 8);
-				break;
-			case PROTOBUF_C_TYPE_BOOL:
-				memcpy(field, dv, sizeof(protobuf_c_boolean));
-				break;
-			case PROTOBUF_C_TYPE_BYTES:
-				memcpy(field, dv, sizeof(ProtobufCBinaryData));
+			}
+			if (!unpack_state_pop(state))
 				break;
+			continue;
+		}
+		if (rem == 0)
+			return TRUE;
 
-			case PROTOBUF_C_TYPE_STRING:
-			case PROTOBUF_C_TYPE_MESSAGE:
-				/*
-				 * The next line essentially implements a cast
-				 * from const, which is totally unavoidable.
-				 */
-				*(const void **) field = dv;
-				break;
-			}
+		switch (state->step) {
+		case UNPACK_STEP_TAG:
+			ok = unpack_state_tag(state, frame, &at, &rem);
+			break;
+		case UNPACK_STEP_VALUE:
+			ok = unpack_state_value(state, frame, &at, &rem);
+			break;
+		case UNPACK_STEP_LENGTH:
+			ok = unpack_state_length(state, frame, &at, &rem);
+			break;
+		case UNPACK_STEP_BYTES:
+		case UNPACK_STEP_PAYLOAD:
+			ok = unpack_state_bytes(state, frame, &at, &rem);
+			break;
+		default:
+			ok = unpack_state_packed(state, frame, &at, &rem);
+			break;
 		}
+		if (!ok)
+			break;
 	}
+	state->failed = TRUE;
+	return FALSE;
 }
 
-/**@}*/
-
-/*
- * ScannedMember slabs (an unpacking implementation detail). Before doing real
- * unpacking, we first scan through the elements to see how many there are (for
- * repeated fields), and which field to use (for non-repeated fields given
- * twice).
- *
- * In order to avoid allocations for small messages, we keep a stack-allocated
- * slab of ScannedMembers of size FIRST_SCANNED_MEMBER_SLAB_SIZE (16). After we
- * fill that up, we allocate each slab twice as large as the previous one.
- */
-#define FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2 4
-
-/*
- * The number of slabs, including the stack-allocated ones; choose the number so
- * that we would overflow if we needed a slab larger than provided.
- */
-#define MAX_SCANNED_MEMBER_SLAB			\
-  (sizeof(unsigned int)*8 - 1			\
-   - BOUND_SIZEOF_SCANNED_MEMBER_LOG2		\
-   - FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)
-
-#define REQUIRED_FIELD_BITMAP_SET(index)	\
-	(required_fields_bitmap[(index)/8] |= (1UL<<((index)%8)))
-
-#define REQUIRED_FIELD_BITMAP_IS_SET(index)	\
-	(required_fields_bitmap[(index)/8] & (1UL<<((index)%8)))
-
 ProtobufCMessage *
-protobuf_c_message_unpack(const ProtobufCMessageDescriptor *desc,
-			  ProtobufCAllocator *allocator,
-			  size_t len, const uint8_t *data)
+protobuf_c_unpack_state_finish(ProtobufCUnpackState *state)
 {
 	ProtobufCMessage *rv;
-	size_t rem = len;
-	const uint8_t *at = data;
-	const ProtobufCFieldDescriptor *last_field = desc->fields + 0;
-	ScannedMember first_member_slab[1UL <<
-					FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2];
-
-	/*
-	 * scanned_member_slabs[i] is an array of arrays of ScannedMember.
-	 * The first slab (scanned_member_slabs[0] is just a pointer to
-	 * first_member_slab), above. All subsequent slabs will be allocated
-	 * using the allocator.
-	 */
-	ScannedMember *scanned_member_slabs[MAX_SCANNED_MEMBER_SLAB + 1];
-	unsigned which_slab = 0; /* the slab we are currently populating */
-	unsigned in_slab_index = 0; /* number of members in the slab */
-	size_t n_unknown = 0;
-	unsigned f;
-	unsigned j;
-	unsigned i_slab;
-	unsigned last_field_index = 0;
-	unsigned required_fields_bitmap_len;
-	unsigned char required_fields_bitmap_stack[16];
-	unsigned char *required_fields_bitmap = required_fields_bitmap_stack;
-	protobuf_c_boolean required_fields_bitmap_alloced = FALSE;
-
-	ASSERT_IS_MESSAGE_DESCRIPTOR(desc);
 
-	if (allocator == NULL)
-		allocator = &protobuf_c__allocator;
+	if (state->failed)
+		return NULL;
+	if (state->n_frames != 1 ||
+	    state->step != UNPACK_STEP_TAG ||
+	    state->pending_len != 0)
+	{
+		PROTOBUF_C_UNPACK_ERROR("message truncated at offset %u",
+					(unsigned) state->len);
+		state->failed = TRUE;
+		return NULL;
+	}
+	if (!unpack_state_pop(state)) {
+		state->failed = TRUE;
+		return NULL;
+	}
+	rv = state->message;
+	state->message = NULL;
+	return rv;
+}
 
-	rv = do_alloc(allocator, desc->sizeof_message);
-	if (!rv)
-		return (NULL);
-	scanned_member_slabs[0] = first_member_slab;
+void
+protobuf_c_unpack_state_clear(ProtobufCUnpackState *state)
+{
+	size_t i;
+
+	if (state->message != NULL)
+		protobuf_c_message_free_unpacked(state->message,
+						 state->allocator);
+	for (i = 0; i < state->n_alloced; i++)
+		do_free(state->allocator, state->frames[i].capacities);
+	do_free(state->allocator, state->frames);
+	do_free(state->allocator, state->scratch);
+	state->message = NULL;
+	state->frames = NULL;
+	state->n_frames = 0;
+	state->n_alloced = 0;
+	state->scratch = NULL;
+	state->scratch_len = 0;
+	state->scratch_alloced = 0;
+}
 
-	required_fields_bitmap_len = (desc->n_fields + 7) / 8;
-	if (required_fields_bitmap_len > sizeof(required_fields_bitmap_stack)) {
-		required_fields_bitmap = do_alloc(allocator, required_fields_bitmap_len);
-		if (!required_fields_bitmap) {
-			do_free(allocator, rv);
-			return (NULL);
-		}
-		required_fields_bitmap_alloced = TRUE;
+ProtobufCMessage *
+protobuf_c_message_unpack_iovec(const ProtobufCMessageDescriptor *desc,
+				ProtobufCAllocator *allocator,
+				size_t n_iov, const ProtobufCIoVec *iov)
+{
+	ProtobufCUnpackState state;
+	ProtobufCMessage *rv;
+	size_t len = 0;
+	size_t i;
+
+	/* a single segment needs no state */
+	while (n_iov > 0 && iov[n_iov - 1].len == 0)
+		n_iov--;
+	while (n_iov > 0 && iov[0].len == 0) {
+		iov++;
+		n_iov--;
 	}
-	memset(required_fields_bitmap, 0, required_fields_bitmap_len);
+	if (n_iov <= 1)
+		return protobuf_c_message_unpack(desc, allocator,
+						 n_iov ? iov[0].len : 0,
+						 n_iov ? iov[0].base : NULL);
+
+	for (i = 0; i < n_iov; i++)
+		len += iov[i].len;
+	if (protobuf_c_unpack_state_init(&state, desc, allocator)) {
+		/*
+		 * Knowing where the input ends lets lengths be checked up
+		 * front, and strings and bytes be read into their own storage.
+		 */
+		state.frames[0].end = len;
+		for (i = 0; i < n_iov; i++)
+			if (!protobuf_c_unpack_state_feed(&state, iov[i].len,
+							  iov[i].base))
+				break;
+	}
+	rv = protobuf_c_unpack_state_finish(&state);
+	protobuf_c_unpack_state_clear(&state);
+	return rv;
+}
 
-	/*
-	 * Generated code always defines "message_init". However, we provide a
-	 * fallback for (1) users of old protobuf-c generated-code that do not
-	 * provide the function, and (2) descriptors constructed from some other
-	 * source (most likely, direct construction from the .proto file).
-	 */
-	if (desc->message_init != NULL)
-		protobuf_c_message_init(desc, rv);
-	else
-		message_init_generic(desc, rv);
+/**
+ * \defgroup stream length-delimited message streams
+ *
+ * Routines used by `ProtobufCMessageReader` and `ProtobufCMessageWriter`.
+ *
+ * \ingroup internal
+ * @{
+ */
 
-	while (rem > 0) {
-		uint32_t tag;
-		ProtobufCWireType wire_type;
-		size_t used = parse_tag_and_wiretype(rem, at, &tag, &wire_type);
-		const ProtobufCFieldDescriptor *field;
-		ScannedMember tmp;
+/**
+ * Size of the buffer of a message writer, and initial size of the buffer of a
+ * message reader, which grows to hold larger records.
+ */
+#define MESSAGE_STREAM_BLOCK_SIZE	65536
+
+/**
+ * Largest record a message writer packs in memory as a whole when it doesn't
+ * fit in the buffer. Larger ones are streamed through the buffer, which saves
+ * memory but is about half as fast.
+ */
+#define MESSAGE_STREAM_MAX_PACKED	(16 << 20)
 
-		if (used == 0) {
-			PROTOBUF_C_UNPACK_ERROR("error parsing tag/wiretype at offset %u",
-						(unsigned) (at - data));
-			goto error_cleanup_during_scan;
-		}
-		/*
-		 * \todo Consider optimizing for field[1].id == tag, if field[1]
-		 * exists!
-		 */
-		if (last_field == NULL || last_field->id != tag) {
-			/* lookup field */
-			int field_index =
-			    int_range_lookup(desc->n_field_ranges,
-					     desc->field_ranges,
-					     tag);
-			if (field_index < 0) {
-				field = NULL;
-				n_unknown++;
+/**
+ * Read input until at least `need` bytes from the next record on are
+ * buffered.
+ *
+ * \retval TRUE
+ *      The bytes are buffered.
+ * \retval FALSE
+ *      The input ended first, or reading failed or memory ran out, in which
+ *      case `reader->failed` is set.
+ */
+static protobuf_c_boolean
+message_reader_fill(ProtobufCMessageReader *reader, size_t need)
+{
+	while (reader->len - reader->pos < need) {
+		size_t n;
+
+		if (reader->read == NULL || reader->eof)
+			return FALSE;
+		if (reader->len == reader->buf_alloced) {
+			if (reader->pos != 0) {
+				/* move the start of the record to the front */
+				reader->len -= reader->pos;
+				memmove(reader->buf, reader->buf + reader->pos,
+					reader->len);
+				reader->pos = 0;
 			} else {
-				field = desc->fields + field_index;
-				last_field = field;
-				last_field_index = field_index;
+				/* grow as input arrives, not to a declared length */
+				size_t new_alloced = reader->buf_alloced ?
+					reader->buf_alloced * 2 :
+					MESSAGE_STREAM_BLOCK_SIZE;
+				uint8_t *buf = do_alloc(reader->allocator,
+							new_alloced);
+
+				if (buf == NULL) {
+					reader->failed = TRUE;
+					return FALSE;
+				}
+				if (reader->len != 0)
+					memcpy(buf, reader->buf, reader->len);
+				do_free(reader->allocator, reader->buf);
+				reader->buf = buf;
+				reader->buf_alloced = new_alloced;
 			}
-		} else {
-			field = last_field;
+			reader->data = reader->buf;
+		}
+		n = reader->read(reader->buf_alloced - reader->len,
+				 reader->buf + reader->len,
+				 reader->closure_data);
+		if (n == 0) {
+			reader->eof = TRUE;
+			return FALSE;
 		}
+		if (n == (size_t) -1) {
+			PROTOBUF_C_UNPACK_ERROR("error reading record");
+			reader->failed = TRUE;
+			return FALSE;
+		}
+		reader->len += n;
+	}
+	return TRUE;
+}
 
-		if (field != NULL && field->label == PROTOBUF_C_LABEL_REQUIRED)
-			REQUIRED_FIELD_BITMAP_SET(last_field_index);
+/**
+ * Find the next record of a message stream and move past it.
+ *
+ * \param[out] len
+ *      Length of the record, without its length prefix.
+ * \return
+ *      The serialised message, or NULL at the end of the input or on error.
+ */
+static const uint8_t *
+message_reader_record(ProtobufCMessageReader *reader, size_t *len)
+{
+	const uint8_t *rv;
+	unsigned prefix_len = 0;
+	uint64_t val;
 
-		at += used;
-		rem -= used;
-		tmp.tag = tag;
-		tmp.wire_type = wire_type;
-		tmp.field = field;
-		tmp.data = at;
-		tmp.length_prefix_len = 0;
-
-		switch (wire_type) {
-		case PROTOBUF_C_WIRE_TYPE_VARINT: {
-			unsigned max_len = rem < 10 ? rem : 10;
-			unsigned i;
-
-			for (i = 0; i < max_len; i++)
-				if ((at[i] & 0x80) == 0)
-					break;
-			if (i == max_len) {
-				PROTOBUF_C_UNPACK_ERROR("unterminated varint at offset %u",
-							(unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = i + 1;
-			break;
-		}
-		case PROTOBUF_C_WIRE_TYPE_64BIT:
-			if (rem < 8) {
-				PROTOBUF_C_UNPACK_ERROR("too short after 64bit wiretype at offset %u",
-							(unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = 8;
-			break;
-		case PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED: {
-			size_t pref_len;
+	if (reader->failed || !message_reader_fill(reader, 1))
+		return NULL;
+	for (;;) {
+		size_t avail = reader->len - reader->pos;
 
-			tmp.len = scan_length_prefixed_data(rem, at, &pref_len);
-			if (tmp.len == 0) {
-				/* NOTE: scan_length_prefixed_data calls UNPACK_ERROR */
-				goto error_cleanup_during_scan;
-			}
-			tmp.length_prefix_len = pref_len;
+		prefix_len = scan_varint(avail < 10 ? (unsigned) avail : 10,
+					 reader->data + reader->pos);
+		if (prefix_len != 0 || avail >= 10 ||
+		    !message_reader_fill(reader, avail + 1))
 			break;
+	}
+	if (prefix_len == 0) {
+		PROTOBUF_C_UNPACK_ERROR("error parsing length of record");
+		reader->failed = TRUE;
+		return NULL;
+	}
+	val = parse_uint64(prefix_len, reader->data + reader->pos);
+	if (val > (size_t) -1 - prefix_len ||
+	    !message_reader_fill(reader, prefix_len + (size_t) val))
+	{
+		PROTOBUF_C_UNPACK_ERROR("record truncated");
+		reader->failed = TRUE;
+		return NULL;
+	}
+	rv = reader->data + reader->pos + prefix_len;
+	reader->pos += prefix_len + (size_t) val;
+	*len = (size_t) val;
+	return rv;
+}
+
+/**
+ * Write a record too large for the buffer of a message writer, once the
+ * buffer has been flushed.
+ */
+static protobuf_c_boolean
+message_writer_write_large(ProtobufCMessageWriter *writer,
+			   const ProtobufCMessage *message, size_t size)
+{
+	ProtobufCPackState state;
+	protobuf_c_boolean ok;
+
+	if (size <= MESSAGE_STREAM_MAX_PACKED) {
+		size_t len = uint64_size(size) + size;
+		uint8_t *data = do_alloc(writer->allocator, len);
+
+		if (data != NULL) {
+			uint64_pack(size, data);
+			protobuf_c_message_pack(message, data + len - size);
+			ok = writer->write(len, data, writer->closure_data);
+			do_free(writer->allocator, data);
+			if (!ok)
+				writer->failed = TRUE;
+			return ok;
 		}
-		case PROTOBUF_C_WIRE_TYPE_32BIT:
-			if (rem < 4) {
-				PROTOBUF_C_UNPACK_ERROR("too short after 32bit wiretype at offset %u",
-					      (unsigned) (at - data));
-				goto error_cleanup_during_scan;
-			}
-			tmp.len = 4;
+	}
+
+	writer->len = uint64_pack(size, writer->buf);
+	ok = protobuf_c_pack_state_init(&state, message, writer->allocator);
+	while (ok) {
+		writer->len += protobuf_c_pack_state_pack(&state,
+			writer->buf_alloced - writer->len,
+			writer->buf + writer->len);
+		if (state.failed || state.n_written == state.len)
 			break;
-		default:
-			PROTOBUF_C_UNPACK_ERROR("unsupported tag %u at offset %u",
-						wire_type, (unsigned) (at - data));
-			goto error_cleanup_during_scan;
-		}
+		ok = protobuf_c_message_writer_flush(writer);
+	}
+	protobuf_c_pack_state_clear(&state);
+	if (!ok || state.failed) {
+		writer->failed = TRUE;
+		return FALSE;
+	}
+	return TRUE;
+}
 
-		if (in_slab_index == (1UL <<
-			(which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2)))
-		{
-			size_t size;
+/**@}*/
 
-			in_slab_index = 0;
-			if (which_slab == MAX_SCANNED_MEMBER_SLAB) {
-				PROTOBUF_C_UNPACK_ERROR("too many fields");
-				goto error_cleanup_during_scan;
-			}
-			which_slab++;
-			size = sizeof(ScannedMember)
-				<< (which_slab + FIRST_SCANNED_MEMBER_SLAB_SIZE_LOG2);
-			scanned_member_slabs[which_slab] = do_alloc(allocator, size);
-			if (scanned_member_slabs[which_slab] == NULL)
-				goto error_cleanup_during_scan;
-		}
-		scanned_member_slabs[which_slab][in_slab_index++] = tmp;
+size_t
+protobuf_c_message_pack_delimited_to_buffer(const ProtobufCMessage *message,
+					    ProtobufCBuffer *buffer)
+{
+	uint8_t prefix[MAX_UINT64_ENCODED_SIZE];
+	size_t prefix_len;
 
-		if (field != NULL && field->label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t *n = STRUCT_MEMBER_PTR(size_t, rv,
-						      field->quantifier_offset);
-			if (wire_type == PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED &&
-			    (0 != (field->flags & PROTOBUF_C_FIELD_FLAG_PACKED) ||
-			     is_packable_type(field->type)))
-			{
-				size_t count;
-				if (!count_packed_elements(field->type,
-							   tmp.len -
-							   tmp.length_prefix_len,
-							   tmp.data +
-							   tmp.length_prefix_len,
-							   &count))
-				{
-					PROTOBUF_C_UNPACK_ERROR("counting packed elements");
-					goto error_cleanup_during_scan;
-				}
-				*n += count;
-			} else {
-				*n += 1;
-			}
-		}
+	prefix_len = uint64_pack(protobuf_c_message_get_packed_size(message),
+				 prefix);
+	buffer->append(buffer, prefix_len, prefix);
+	return prefix_len + protobuf_c_message_pack_to_buffer(message, buffer);
+}
 
-		at += tmp.len;
-		rem -= tmp.len;
-	}
+void
+protobuf_c_message_writer_init(ProtobufCMessageWriter *writer,
+			       ProtobufCWriteFunc write,
+			       void *closure_data,
+			       ProtobufCAllocator *allocator)
+{
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	writer->write = write;
+	writer->closure_data = closure_data;
+	writer->allocator = allocator;
+	writer->buf = NULL;
+	writer->len = 0;
+	writer->buf_alloced = 0;
+	writer->failed = FALSE;
+}
 
-	/* allocate space for repeated fields, also check that all required fields have been set */
-	for (f = 0; f < desc->n_fields; f++) {
-		const ProtobufCFieldDescriptor *field = desc->fields + f;
-		if (field->label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t siz =
-			    sizeof_elt_in_repeated_array(field->type);
-			size_t *n_ptr =
-			    STRUCT_MEMBER_PTR(size_t, rv,
-					      field->quantifier_offset);
-			if (*n_ptr != 0) {
-				unsigned n = *n_ptr;
-				void *a;
-				*n_ptr = 0;
-				assert(rv->descriptor != NULL);
-#define CLEAR_REMAINING_N_PTRS()                                              \
-              for(f++;f < desc->n_fields; f++)                                \
-                {                                                             \
-                  field = desc->fields + f;                                   \
-                  if (field->label == PROTOBUF_C_LABEL_REPEATED)              \
-                    STRUCT_MEMBER (size_t, rv, field->quantifier_offset) = 0; \
-                }
-				a = do_alloc(allocator, siz * n);
-				if (!a) {
-					CLEAR_REMAINING_N_PTRS();
-					goto error_cleanup;
-				}
-				STRUCT_MEMBER(void *, rv, field->offset) = a;
-			}
-		} else if (field->label == PROTOBUF_C_LABEL_REQUIRED) {
-			if (field->default_value == NULL &&
-			    !REQUIRED_FIELD_BITMAP_IS_SET(f))
-			{
-				CLEAR_REMAINING_N_PTRS();
-				PROTOBUF_C_UNPACK_ERROR("message '%s': missing required field '%s'",
-							desc->name, field->name);
-				goto error_cleanup;
+protobuf_c_boolean
+protobuf_c_message_writer_write(ProtobufCMessageWriter *writer,
+				const ProtobufCMessage *message)
+{
+	size_t size;
+
+	if (writer->failed)
+		return FALSE;
+	size = protobuf_c_message_get_packed_size(message);
+	if (writer->buf_alloced - writer->len < uint64_size(size) + size) {
+		if (!protobuf_c_message_writer_flush(writer))
+			return FALSE;
+		if (writer->buf == NULL) {
+			writer->buf = do_alloc(writer->allocator,
+					       MESSAGE_STREAM_BLOCK_SIZE);
+			if (writer->buf == NULL) {
+				writer->failed = TRUE;
+				return FALSE;
 			}
+			writer->buf_alloced = MESSAGE_STREAM_BLOCK_SIZE;
 		}
+		if (uint64_size(size) + size > writer->buf_alloced)
+			return message_writer_write_large(writer, message,
+							  size);
 	}
-#undef CLEAR_REMAINING_N_PTRS
+	writer->len += uint64_pack(size, writer->buf + writer->len);
+	writer->len += protobuf_c_message_pack(message,
+					       writer->buf + writer->len);
+	return TRUE;
+}
 
-	/* allocate space for unknown fields */
-	if (n_unknown) {
-		rv->unknown_fields = do_alloc(allocator,
-					      n_unknown * sizeof(ProtobufCMessageUnknownField));
-		if (rv->unknown_fields == NULL)
-			goto error_cleanup;
+protobuf_c_boolean
+protobuf_c_message_writer_flush(ProtobufCMessageWriter *writer)
+{
+	if (writer->failed)
+		return FALSE;
+	if (writer->len != 0) {
+		if (!writer->write(writer->len, writer->buf,
+				   writer->closure_data))
+		{
+			writer->failed = TRUE;
+			return FALSE;
+		}
+		writer->len = 0;
 	}
+	return TRUE;
+}
 
-	/* do real parsing */
-	for (i_slab = 0; i_slab <= which_slab; i_slab++) {
-		unsigned max = (i_slab == which_slab) ?
-			in_slab_index : (1UL << (i_slab + 4));
-		ScannedMember *slab = scanned_member_slabs[i_slab];
+void
+protobuf_c_message_writer_clear(ProtobufCMessageWriter *writer)
+{
+	do_free(writer->allocator, writer->buf);
+	writer->buf = NULL;
+	writer->len = 0;
+	writer->buf_alloced = 0;
+}
 
-		for (j = 0; j < max; j++) {
-			if (!parse_member(slab + j, rv, allocator)) {
-				PROTOBUF_C_UNPACK_ERROR("error parsing member %s of %s",
-							slab->field ? slab->field->name : "*unknown-field*",
-					desc->name);
-				goto error_cleanup;
-			}
-		}
-	}
+void
+protobuf_c_message_reader_init(ProtobufCMessageReader *reader,
+			       ProtobufCReadFunc read,
+			       void *closure_data,
+			       ProtobufCAllocator *allocator)
+{
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+	reader->read = read;
+	reader->closure_data = closure_data;
+	reader->allocator = allocator;
+	reader->data = NULL;
+	reader->pos = 0;
+	reader->len = 0;
+	reader->buf = NULL;
+	reader->buf_alloced = 0;
+	reader->eof = FALSE;
+	reader->failed = FALSE;
+}
 
-	/* cleanup */
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
+void
+protobuf_c_message_reader_init_memory(ProtobufCMessageReader *reader,
+				      size_t len, const uint8_t *data)
+{
+	protobuf_c_message_reader_init(reader, NULL, NULL, NULL);
+	reader->data = data;
+	reader->len = len;
+}
+
+ProtobufCMessage *
+protobuf_c_message_reader_next(ProtobufCMessageReader *reader,
+			       const ProtobufCMessageDescriptor *descriptor,
+			       ProtobufCAllocator *allocator)
+{
+	ProtobufCMessage *rv;
+	const uint8_t *data;
+	size_t len;
+
+	data = message_reader_record(reader, &len);
+	if (data == NULL)
+		return NULL;
+	rv = protobuf_c_message_unpack(descriptor, allocator, len, data);
+	if (rv == NULL)
+		reader->failed = TRUE;
 	return rv;
+}
 
-error_cleanup:
-	protobuf_c_message_free_unpacked(rv, allocator);
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
-	return NULL;
+protobuf_c_boolean
+protobuf_c_message_reader_next_into(ProtobufCMessageReader *reader,
+				    ProtobufCMessage *message,
+				    ProtobufCAllocator *allocator)
+{
+	const uint8_t *data;
+	size_t len;
 
-error_cleanup_during_scan:
-	do_free(allocator, rv);
-	for (j = 1; j <= which_slab; j++)
-		do_free(allocator, scanned_member_slabs[j]);
-	if (required_fields_bitmap_alloced)
-		do_free(allocator, required_fields_bitmap);
-	return NULL;
+	data = message_reader_record(reader, &len);
+	if (data == NULL)
+		return FALSE;
+	if (!protobuf_c_message_unpack_into(message, allocator, len, data)) {
+		reader->failed = TRUE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void
+protobuf_c_message_reader_clear(ProtobufCMessageReader *reader)
+{
+	do_free(reader->allocator, reader->buf);
+	reader->buf = NULL;
+	reader->buf_alloced = 0;
+	reader->data = NULL;
+	reader->pos = 0;
+	reader->len = 0;
 }
 
 void
 protobuf_c_message_free_unpacked(ProtobufCMessage *message,
 				 ProtobufCAllocator *allocator)
+{
+	protobuf_c_message_free_unpacked_ex(message, allocator, 0);
+}
+
+void
+protobuf_c_message_free_unpacked_ex(ProtobufCMessage *message,
+				    ProtobufCAllocator *allocator,
+				    unsigned flags)
 {
 	const ProtobufCMessageDescriptor *desc;
 	unsigned f;
@@ -3318,7 +7742,37 @@ protobuf_c_message_free_unpacked(ProtobufCMessage *message,
 
 	if (allocator == NULL)
 		allocator = &protobuf_c__allocator;
+
+	/* Arena memory is released by protobuf_c_arena_reset(). */
+	if (allocator->free == &arena_free)
+		return;
+
 	message->descriptor = NULL;
+	for (f = 0; f < desc->n_fields; f++) {
+		ProtobufCFieldHot tmp;
+
+		/* this also skips oneof members that are not selected */
+		if (hot_field_holds_memory(hot_field(desc, f, &tmp), message))
+			free_field_contents(message, desc->fields + f,
+					    allocator, flags);
+	}
+	free_unknown_fields(message, allocator, flags);
+
+	free_unpacked_message(message, allocator, flags);
+}
+
+void
+protobuf_c_message_clear(ProtobufCMessage *message,
+			 ProtobufCAllocator *allocator)
+{
+	const ProtobufCMessageDescriptor *desc = message->descriptor;
+	unsigned f;
+
+	ASSERT_IS_MESSAGE(message);
+
+	if (allocator == NULL)
+		allocator = &protobuf_c__allocator;
+
 	for (f = 0; f < desc->n_fields; f++) {
 		if (0 != (desc->fields[f].flags & PROTOBUF_C_FIELD_FLAG_ONEOF) &&
 		    desc->fields[f].id !=
@@ -3327,68 +7781,9 @@ protobuf_c_message_free_unpacked(ProtobufCMessage *message,
 			/* This is not the selected oneof, skip it */
 			continue;
 		}
-
-		if (desc->fields[f].label == PROTOBUF_C_LABEL_REPEATED) {
-			size_t n = STRUCT_MEMBER(size_t,
-						 message,
-						 desc->fields[f].quantifier_offset);
-			void *arr = STRUCT_MEMBER(void *,
-						  message,
-						  desc->fields[f].offset);
-
-			if (arr != NULL) {
-				if (desc->fields[f].type == PROTOBUF_C_TYPE_STRING) {
-					unsigned i;
-					for (i = 0; i < n; i++)
-						do_free(allocator, ((char **) arr)[i]);
-				} else if (desc->fields[f].type == PROTOBUF_C_TYPE_BYTES) {
-					unsigned i;
-					for (i = 0; i < n; i++)
-						do_free(allocator, ((ProtobufCBinaryData *) arr)[i].data);
-				} else if (desc->fields[f].type == PROTOBUF_C_TYPE_MESSAGE) {
-					unsigned i;
-					for (i = 0; i < n; i++)
-						protobuf_c_message_free_unpacked(
-							((ProtobufCMessage **) arr)[i],
-							allocator
-						);
-				}
-				do_free(allocator, arr);
-			}
-		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_STRING) {
-			char *str = STRUCT_MEMBER(char *, message,
-						  desc->fields[f].offset);
-
-			if (str && str != desc->fields[f].default_value)
-				do_free(allocator, str);
-		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_BYTES) {
-			void *data = STRUCT_MEMBER(ProtobufCBinaryData, message,
-						   desc->fields[f].offset).data;
-			const ProtobufCBinaryData *default_bd;
-
-			default_bd = desc->fields[f].default_value;
-			if (data != NULL &&
-			    (default_bd == NULL ||
-			     default_bd->data != data))
-			{
-				do_free(allocator, data);
-			}
-		} else if (desc->fields[f].type == PROTOBUF_C_TYPE_MESSAGE) {
-			ProtobufCMessage *sm;
-
-			sm = STRUCT_MEMBER(ProtobufCMessage *, message,
-					   desc->fields[f].offset);
-			if (sm && sm != desc->fields[f].default_value)
-				protobuf_c_message_free_unpacked(sm, allocator);
-		}
+		reset_field(message, desc->fields + f, allocator, 0);
 	}
-
-	for (f = 0; f < message->n_unknown_fields; f++)
-		do_free(allocator, message->unknown_fields[f].data);
-	if (message->unknown_fields != NULL)
-		do_free(allocator, message->unknown_fields);
-
-	do_free(allocator, message);
+	free_unknown_fields(message, allocator, 0);
 }
 
 void
@@ -3606,7 +8001,7 @@ const ProtobufCFieldDescriptor *
 protobuf_c_message_descriptor_get_field(const ProtobufCMessageDescriptor *desc,
 					unsigned value)
 {
-	int rv = int_range_lookup(desc->n_field_ranges,desc->field_ranges, value);
+	int rv = field_index_lookup(desc, value);
 	if (rv < 0)
 		return NULL;
 	return desc->fields + rv;
@@ -191,6 +191,10 @@ size_t foo__bar__baz_bah__pack_to_buffer
  *
  * The result of unpacking a message should be freed with
  * protobuf_c_message_free_unpacked().
+ *
+ * When many messages are unpacked and discarded in quick succession, a
+ * `ProtobufCArena` can be passed as the allocator. All of the memory used by
+ * the unpacked messages is then released at once with protobuf_c_arena_reset().
  */
 
 #ifndef PROTOBUF_C_H
@@ -228,6 +232,18 @@ PROTOBUF_C__BEGIN_DECLS
 # define PROTOBUF_C__DEPRECATED
 #endif
 
+/* Marks the small helpers of generated codecs, whatever the C dialect. */
+#if defined(__cplusplus) || \
+	(defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L)
+# define PROTOBUF_C__INLINE inline
+#elif defined(__GNUC__)
+# define PROTOBUF_C__INLINE __inline__
+#elif defined(_MSC_VER)
+# define PROTOBUF_C__INLINE __inline
+#else
+# define PROTOBUF_C__INLINE
+#endif
+
 #ifndef PROTOBUF_C__FORCE_ENUM_TO_BE_INT_SIZE
  #define PROTOBUF_C__FORCE_ENUM_TO_BE_INT_SIZE(enum_name) \
   , _##enum_name##_IS_INT_SIZE = INT_MAX
@@ -263,6 +279,60 @@ typedef enum {
 	PROTOBUF_C_FIELD_FLAG_ONEOF		= (1 << 2),
 } ProtobufCFieldFlag;
 
+/**
+ * Values for the `flags` argument of protobuf_c_message_unpack_ex() and
+ * protobuf_c_message_free_unpacked_ex().
+ */
+typedef enum {
+	/**
+	 * Make `bytes` fields point into the input buffer instead of copying
+	 * their payload. The input buffer must outlive the message.
+	 */
+	PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES	= (1 << 0),
+
+	/**
+	 * Make `string` fields point into the input buffer instead of copying
+	 * their payload. Each string is `NUL`-terminated in place by
+	 * overwriting the byte that follows it, so the input buffer must be
+	 * writable, must have at least one byte of room past its end, and must
+	 * outlive the message. It is no longer a valid serialised message
+	 * afterwards.
+	 */
+	PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS	= (1 << 1),
+
+	/**
+	 * Allocate the payloads of each message (strings, bytes, repeated
+	 * field arrays and unknown fields) together in a single block sized
+	 * while scanning the input, instead of one allocation per field. The
+	 * message must be freed with protobuf_c_message_free_unpacked_ex()
+	 * and this flag, and its payloads must not be freed or replaced
+	 * individually.
+	 */
+	PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS	= (1 << 2),
+
+	/**
+	 * Skip fields that are not in the message descriptor instead of
+	 * copying them into `unknown_fields`. They are still checked for
+	 * well-formedness, but are not allocated, copied or re-serialised.
+	 */
+	PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN	= (1 << 3),
+
+	/**
+	 * Keep unknown fields as raw runs of wire data: each run of unknown
+	 * fields not interrupted by a known one is stored as a single
+	 * `ProtobufCMessageUnknownField` with a `tag` of 0, holding the
+	 * fields' tags and values in their original order. Packing a message
+	 * re-emits each run with a single copy. Together with
+	 * `PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES` the runs point into the input
+	 * buffer instead of being copied.
+	 *
+	 * Can't be combined with `PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS`, whose
+	 * in-place terminators may overwrite the start of a run; unpacking
+	 * fails if both are given.
+	 */
+	PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN	= (1 << 4),
+} ProtobufCUnpackFlag;
+
 /**
  * Message field rules.
  *
@@ -340,36 +410,72 @@ typedef enum {
 } ProtobufCWireType;
 
 struct ProtobufCAllocator;
+struct ProtobufCArena;
+struct ProtobufCArenaBlock;
 struct ProtobufCBinaryData;
 struct ProtobufCBuffer;
+struct ProtobufCBufferDirect;
+struct ProtobufCBufferSegment;
+struct ProtobufCBufferSegmented;
 struct ProtobufCBufferSimple;
 struct ProtobufCEnumDescriptor;
 struct ProtobufCEnumValue;
 struct ProtobufCEnumValueIndex;
 struct ProtobufCFieldDescriptor;
+struct ProtobufCFieldHot;
+struct ProtobufCFieldTagIndex;
 struct ProtobufCIntRange;
+struct ProtobufCIoVec;
 struct ProtobufCMessage;
+struct ProtobufCMessageCodec;
 struct ProtobufCMessageDescriptor;
+struct ProtobufCMessageReader;
 struct ProtobufCMessageUnknownField;
+struct ProtobufCMessageWriter;
 struct ProtobufCMethodDescriptor;
+struct ProtobufCPackFrame;
+struct ProtobufCPackState;
+struct ProtobufCReverseBuffer;
+struct ProtobufCReverseBufferBlock;
 struct ProtobufCService;
 struct ProtobufCServiceDescriptor;
+struct ProtobufCSizeCache;
+struct ProtobufCUnpackFrame;
+struct ProtobufCUnpackState;
 
 typedef struct ProtobufCAllocator ProtobufCAllocator;
+typedef struct ProtobufCArena ProtobufCArena;
+typedef struct ProtobufCArenaBlock ProtobufCArenaBlock;
 typedef struct ProtobufCBinaryData ProtobufCBinaryData;
 typedef struct ProtobufCBuffer ProtobufCBuffer;
+typedef struct ProtobufCBufferDirect ProtobufCBufferDirect;
+typedef struct ProtobufCBufferSegment ProtobufCBufferSegment;
+typedef struct ProtobufCBufferSegmented ProtobufCBufferSegmented;
 typedef struct ProtobufCBufferSimple ProtobufCBufferSimple;
 typedef struct ProtobufCEnumDescriptor ProtobufCEnumDescriptor;
 typedef struct ProtobufCEnumValue ProtobufCEnumValue;
 typedef struct ProtobufCEnumValueIndex ProtobufCEnumValueIndex;
 typedef struct ProtobufCFieldDescriptor ProtobufCFieldDescriptor;
+typedef struct ProtobufCFieldHot ProtobufCFieldHot;
+typedef struct ProtobufCFieldTagIndex ProtobufCFieldTagIndex;
 typedef struct ProtobufCIntRange ProtobufCIntRange;
+typedef struct ProtobufCIoVec ProtobufCIoVec;
 typedef struct ProtobufCMessage ProtobufCMessage;
+typedef struct ProtobufCMessageCodec ProtobufCMessageCodec;
 typedef struct ProtobufCMessageDescriptor ProtobufCMessageDescriptor;
+typedef struct ProtobufCMessageReader ProtobufCMessageReader;
 typedef struct ProtobufCMessageUnknownField ProtobufCMessageUnknownField;
+typedef struct ProtobufCMessageWriter ProtobufCMessageWriter;
 typedef struct ProtobufCMethodDescriptor ProtobufCMethodDescriptor;
+typedef struct ProtobufCPackFrame ProtobufCPackFrame;
+typedef struct ProtobufCPackState ProtobufCPackState;
+typedef struct ProtobufCReverseBuffer ProtobufCReverseBuffer;
+typedef struct ProtobufCReverseBufferBlock ProtobufCReverseBufferBlock;
 typedef struct ProtobufCService ProtobufCService;
 typedef struct ProtobufCServiceDescriptor ProtobufCServiceDescriptor;
+typedef struct ProtobufCSizeCache ProtobufCSizeCache;
+typedef struct ProtobufCUnpackFrame ProtobufCUnpackFrame;
+typedef struct ProtobufCUnpackState ProtobufCUnpackState;
 
 /** Boolean type. */
 typedef int protobuf_c_boolean;
@@ -378,6 +484,22 @@ typedef void (*ProtobufCClosure)(const ProtobufCMessage *, void *closure_data);
 typedef void (*ProtobufCMessageInit)(ProtobufCMessage *);
 typedef void (*ProtobufCServiceDestroy)(ProtobufCService *);
 
+/**
+ * Read up to `len` bytes of input into `data` for a `ProtobufCMessageReader`.
+ * Returns the number of bytes read, 0 at the end of the input, or
+ * `(size_t) -1` on error, which sets the reader's `failed` flag.
+ */
+typedef size_t (*ProtobufCReadFunc)(size_t len, uint8_t *data,
+				    void *closure_data);
+
+/**
+ * Write all `len` bytes at `data` for a `ProtobufCMessageWriter`. Returns TRUE
+ * on success, or FALSE on error.
+ */
+typedef protobuf_c_boolean (*ProtobufCWriteFunc)(size_t len,
+						 const uint8_t *data,
+						 void *closure_data);
+
 /**
  * Structure for defining a custom memory allocator.
  */
@@ -392,6 +514,58 @@ struct ProtobufCAllocator {
 	void		*allocator_data;
 };
 
+/**
+ * Arena allocator "subclass" of `ProtobufCAllocator`.
+ *
+ * A `ProtobufCArena` hands out memory by bumping a pointer through a chain of
+ * large blocks. Its `free` method does nothing: all of the memory obtained
+ * from the arena is given back at once by protobuf_c_arena_reset() or
+ * protobuf_c_arena_destroy(). This makes unpacking a message a handful of
+ * block allocations instead of one allocation per field, and makes
+ * protobuf_c_message_free_unpacked() a no-op.
+ *
+ * The first block may be supplied by the caller, for instance from the stack,
+ * in which case small messages can be unpacked without touching the heap at
+ * all. Further blocks are obtained from a parent allocator.
+ *
+~~~{.c}
+uint8_t block[4096];
+ProtobufCArena arena;
+
+protobuf_c_arena_init(&arena, block, sizeof(block), NULL);
+for (;;) {
+        Foo__Bar__BazBah *msg;
+
+        msg = foo__bar__baz_bah__unpack(&arena.base, len, data);
+        ...
+        protobuf_c_arena_reset(&arena);
+}
+protobuf_c_arena_destroy(&arena);
+~~~
+ *
+ * \see protobuf_c_arena_init
+ * \see protobuf_c_arena_reset
+ * \see protobuf_c_arena_destroy
+ */
+struct ProtobufCArena {
+	/** "Base class". Pass `&arena.base` as the allocator. */
+	ProtobufCAllocator	base;
+	/** Allocator for additional blocks. May be NULL for the system allocator. */
+	ProtobufCAllocator	*parent;
+	/** Caller-supplied initial block. May be NULL. */
+	uint8_t			*initial_block;
+	/** Number of bytes in `initial_block`. */
+	size_t			initial_size;
+	/** Blocks obtained from `parent`, most recently allocated first. */
+	ProtobufCArenaBlock	*blocks;
+	/** Next free byte in the current block. */
+	uint8_t			*pos;
+	/** End of the current block. */
+	uint8_t			*end;
+	/** Size of the next block to request from `parent`. */
+	size_t			next_block_size;
+};
+
 /**
  * Structure for the protobuf `bytes` scalar type.
  *
@@ -446,6 +620,128 @@ struct ProtobufCBuffer {
 				  const uint8_t *data);
 };
 
+/**
+ * Contiguous-write "subclass" of `ProtobufCBuffer`.
+ *
+ * Appending costs an indirect call and a copy for every field. A buffer that
+ * can hand out contiguous space lets protobuf_c_message_pack_to_buffer()
+ * serialise fields straight into it instead: `reserve` returns room for at
+ * least `len` bytes, of which `commit` then consumes the first `len` bytes
+ * written. Such buffers are recognised by their `append` method, which must
+ * be protobuf_c_buffer_direct_append(). `ProtobufCBufferSimple` objects are
+ * written to directly as well.
+ *
+ * `reserve` may return NULL when it can't provide the room. The packer then
+ * appends the data in smaller pieces, and if even those don't fit, drops
+ * them and sets `failed`. Check `failed` after packing; the length
+ * protobuf_c_message_pack_to_buffer() returns is that of the whole message.
+ *
+~~~{.c}
+typedef struct {
+        ProtobufCBufferDirect base;
+        uint8_t *pos;
+        uint8_t *end;
+} BufferRing;
+
+static uint8_t *
+my_buffer_ring_reserve(ProtobufCBufferDirect *buffer, size_t len)
+{
+        BufferRing *ring = (BufferRing *) buffer;
+        ... // make room for len bytes at ring->pos
+        return ring->pos;
+}
+
+static void
+my_buffer_ring_commit(ProtobufCBufferDirect *buffer, size_t len)
+{
+        ((BufferRing *) buffer)->pos += len;
+}
+
+BufferRing ring = {
+        PROTOBUF_C_BUFFER_DIRECT_INIT(my_buffer_ring_reserve,
+                                      my_buffer_ring_commit),
+        ...
+};
+~~~
+ *
+ * \see PROTOBUF_C_BUFFER_DIRECT_INIT
+ */
+struct ProtobufCBufferDirect {
+	/** "Base class". `append` must be protobuf_c_buffer_direct_append(). */
+	ProtobufCBuffer	base;
+	/** Return room for at least `len` contiguous bytes, or NULL. */
+	uint8_t		*(*reserve)(ProtobufCBufferDirect *buffer,
+				    size_t len);
+	/** Consume the first `len` bytes of the room returned by `reserve`. */
+	void		(*commit)(ProtobufCBufferDirect *buffer,
+				  size_t len);
+	/**
+	 * Set when `reserve` returned NULL for bytes that had to be
+	 * appended, which were dropped: what was packed since the flag was
+	 * last cleared is incomplete. Never cleared by the library.
+	 */
+	protobuf_c_boolean	failed;
+};
+
+/**
+ * Segmented buffer "subclass" of `ProtobufCBuffer`.
+ *
+ * A `ProtobufCBufferSegmented` object stores data in a chain of segments.
+ * When the last segment is full, a new one is added instead of reallocating
+ * and copying everything stored so far, so large messages are serialised
+ * without copying them repeatedly or briefly needing twice their size. Fields
+ * are written straight into the segments, as for any `ProtobufCBufferDirect`.
+ *
+ * If `ref_threshold` is set, large strings and bytes are not copied at all:
+ * their segments point at the message's own memory, which must then stay
+ * unmodified until the buffer has been consumed. Nested messages holding such
+ * fields are sized before they are packed, unless
+ * protobuf_c_message_pack_to_buffer_cached() is used.
+ *
+ * The segments can be handed to writev() without copying, or the data can be
+ * copied into a single block:
+ *
+~~~{.c}
+ProtobufCBufferSegmented seg;
+ProtobufCIoVec iov[64];
+size_t n;
+
+protobuf_c_buffer_segmented_init(&seg, NULL);
+seg.ref_threshold = 1024;
+protobuf_c_message_pack_to_buffer(&msg.base, &seg.base.base);
+n = protobuf_c_buffer_segmented_get_iovec(&seg, iov, 64);
+if (n <= 64)
+        writev(fd, (struct iovec *) iov, n);
+protobuf_c_buffer_segmented_clear(&seg);
+~~~
+ *
+ * \see protobuf_c_buffer_segmented_init
+ * \see protobuf_c_buffer_segmented_get_iovec
+ * \see protobuf_c_buffer_segmented_flatten
+ * \see protobuf_c_buffer_segmented_clear
+ */
+struct ProtobufCBufferSegmented {
+	/** "Base class". Pass `&seg.base.base` as the buffer. */
+	ProtobufCBufferDirect	base;
+	/** Allocator to use. May be NULL to indicate the system allocator. */
+	ProtobufCAllocator	*allocator;
+	/** First segment. */
+	ProtobufCBufferSegment	*first;
+	/** Last segment, which is appended to. */
+	ProtobufCBufferSegment	*last;
+	/** Number of segments. */
+	size_t			n_segments;
+	/** Number of bytes stored in all segments. */
+	size_t			len;
+	/** Size of the next segment to allocate. */
+	size_t			next_segment_size;
+	/**
+	 * Strings, bytes and unknown fields of at least this many bytes are
+	 * referenced instead of copied. 0, the default, always copies.
+	 */
+	size_t			ref_threshold;
+};
+
 /**
  * Simple buffer "subclass" of `ProtobufCBuffer`.
  *
@@ -605,14 +901,62 @@ struct ProtobufCFieldDescriptor {
 	 */
 	uint32_t		flags;
 
-	/** Reserved for future use. */
-	unsigned		reserved_flags;
+	/**
+	 * The field's tag, shifted left by 3 and encoded as a varint, as it
+	 * appears on the wire with a wire type of 0. The first byte is in the
+	 * least significant 8 bits and the encoding is as many bytes long as
+	 * the value needs.
+	 *
+	 * 0 if the encoding takes more than 4 bytes, or if the descriptor
+	 * comes from an older protoc-c, in which case the tag is encoded from
+	 * `id` when needed.
+	 */
+	uint32_t		tag_bytes;
 	/** Reserved for future use. */
 	void			*reserved2;
 	/** Reserved for future use. */
 	void			*reserved3;
 };
 
+/**
+ * The members of a `ProtobufCFieldDescriptor` that the packing, unpacking and
+ * freeing loops read for every field, packed into 16 bytes. Walking these
+ * instead of the descriptors touches far fewer cache lines on messages with
+ * many fields, most of them unset.
+ */
+struct ProtobufCFieldHot {
+	/** Same as `ProtobufCFieldDescriptor::id`. */
+	uint32_t		id;
+	/** Same as `ProtobufCFieldDescriptor::offset`. */
+	uint32_t		offset;
+	/** Same as `ProtobufCFieldDescriptor::quantifier_offset`. */
+	uint32_t		quantifier_offset;
+	/** A `ProtobufCLabel`. */
+	uint8_t			label;
+	/** A `ProtobufCType`. */
+	uint8_t			type;
+	/** Same as `ProtobufCFieldDescriptor::flags`, which fits in 8 bits. */
+	uint8_t			flags;
+	/** Reserved for future use. */
+	uint8_t			reserved;
+};
+
+/**
+ * Open-addressing hash index from field ids to `fields`, generated for
+ * messages whose field ids do not form a single contiguous range.
+ *
+ * A field with id `tag` is found by probing slots `tag & mask`,
+ * `(tag + 1) & mask`, ... until the field or an empty slot is reached. Since
+ * the hash is the id itself, a contiguous run of ids is stored without
+ * collisions.
+ */
+struct ProtobufCFieldTagIndex {
+	/** Number of slots minus one. The number of slots is a power of 2. */
+	unsigned		mask;
+	/** 1 + the index in `fields` of the field in each slot, or 0. */
+	const uint16_t		*slots;
+};
+
 /**
  * Helper structure for optimizing int => index lookups in the case
  * where the keys are mostly consecutive values, as they presumably are for
@@ -631,6 +975,20 @@ struct ProtobufCIntRange {
 	 */
 };
 
+/**
+ * A run of bytes, such as a segment held by a `ProtobufCBufferSegmented` or
+ * one passed to protobuf_c_message_unpack_iovec().
+ *
+ * Laid out like the POSIX `struct iovec`, so that an array of them can be
+ * passed to writev().
+ */
+struct ProtobufCIoVec {
+	/** First byte. */
+	void		*base;
+	/** Number of bytes. */
+	size_t		len;
+};
+
 /**
  * An instance of a message.
  *
@@ -655,6 +1013,33 @@ struct ProtobufCMessage {
 	ProtobufCMessageUnknownField		*unknown_fields;
 };
 
+/**
+ * Functions specialised to one message type, generated by protoc-c.
+ *
+ * The decoder handles the common case only and may give up, in which case
+ * the table-driven code is used instead. Errors are reported by that code, so
+ * a decoder giving up on bad input needs no error handling of its own. The
+ * encoder and size function are only called for messages without unknown
+ * fields, and produce the same bytes as the table-driven code.
+ */
+struct ProtobufCMessageCodec {
+	/**
+	 * Unpack `len` bytes at `data` into `message`, which has just been
+	 * initialised, allocating with `allocator`. Returns FALSE if the input
+	 * holds anything it doesn't handle, such as an unknown or repeated
+	 * singular field, leaving `message` in a state that can be freed by
+	 * protobuf_c_message_free_unpacked().
+	 */
+	protobuf_c_boolean	(*unpack)(ProtobufCMessage *message,
+					  ProtobufCAllocator *allocator,
+					  size_t len, const uint8_t *data);
+	/** Return the packed size of `message`. */
+	size_t			(*get_packed_size)(const ProtobufCMessage *message);
+	/** Pack `message` to `out`, returning the number of bytes written. */
+	size_t			(*pack)(const ProtobufCMessage *message,
+					uint8_t *out);
+};
+
 /**
  * Describes a message.
  */
@@ -692,19 +1077,43 @@ struct ProtobufCMessageDescriptor {
 	/** Message initialisation function. */
 	ProtobufCMessageInit		message_init;
 
-	/** Reserved for future use. */
-	void				*reserved1;
-	/** Reserved for future use. */
-	void				*reserved2;
-	/** Reserved for future use. */
-	void				*reserved3;
+	/**
+	 * Hash index for looking up fields by id, used instead of
+	 * `field_ranges` if not NULL.
+	 */
+	const ProtobufCFieldTagIndex	*field_tag_index;
+	/**
+	 * Upper bound on the packed size of a message of this type, not
+	 * counting unknown fields, or NULL if there is none. Also available
+	 * to generated code as the `<TYPE>_MAX_PACKED_SIZE` macro.
+	 */
+	const size_t			*max_packed_size;
+	/**
+	 * Functions generated for this message type to use instead of the
+	 * table-driven code, or NULL. Generated for files with
+	 * `option optimize_for = SPEED`.
+	 */
+	const ProtobufCMessageCodec	*codec;
+	/**
+	 * The hot members of each field in `fields`, in the same order, or
+	 * NULL for a descriptor written by hand.
+	 *
+	 * This member made the descriptor larger than the reserved members
+	 * it replaced, so the headers no longer accept code generated before
+	 * 1.4.0 (see PROTOBUF_C_MIN_COMPILER_VERSION).
+	 */
+	const ProtobufCFieldHot		*hot_fields;
 };
 
 /**
  * An unknown message field.
+ *
+ * A `tag` of 0 marks a raw run of one or more complete fields, as stored by
+ * `PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN`: `data` then holds the encoded tags and
+ * values, and `wire_type` is unused.
  */
 struct ProtobufCMessageUnknownField {
-	/** The tag number. */
+	/** The tag number, or 0 for a raw run. */
 	uint32_t		tag;
 	/** The wire type of the field. */
 	ProtobufCWireType	wire_type;
@@ -726,6 +1135,52 @@ struct ProtobufCMethodDescriptor {
 	const ProtobufCMessageDescriptor	*output;
 };
 
+/**
+ * Chain of blocks that a message is serialised into back to front.
+ *
+ * protobuf_c_message_pack_to_reverse_buffer() writes the last byte of a
+ * message first. The length of every submessage is therefore known by the
+ * time its prefix is written, and a message tree is serialised in a single
+ * pass without being sized first. When the current block is full, a new one
+ * is obtained from `allocator` and the message continues in front of it.
+ *
+ * The first block may be supplied by the caller, for instance from the stack.
+ * protobuf_c_reverse_buffer_to_buffer() hands the bytes over in order.
+ *
+~~~{.c}
+uint8_t block[4096];
+ProtobufCReverseBuffer rb;
+
+protobuf_c_reverse_buffer_init(&rb, block, sizeof(block), NULL);
+if (protobuf_c_message_pack_to_reverse_buffer(&msg.base, &rb))
+        protobuf_c_reverse_buffer_to_buffer(&rb, &out.base);
+protobuf_c_reverse_buffer_clear(&rb);
+~~~
+ *
+ * \see protobuf_c_reverse_buffer_init
+ * \see protobuf_c_message_pack_to_reverse_buffer
+ * \see protobuf_c_reverse_buffer_to_buffer
+ * \see protobuf_c_reverse_buffer_clear
+ */
+struct ProtobufCReverseBuffer {
+	/** Allocator for additional blocks. May be NULL for the system allocator. */
+	ProtobufCAllocator		*allocator;
+	/** Caller-supplied initial block, filled first. May be NULL. */
+	uint8_t				*initial_block;
+	/** Number of bytes in `initial_block`. */
+	size_t				initial_size;
+	/** First byte of data in `initial_block` once other blocks are in use. */
+	uint8_t				*initial_pos;
+	/** Blocks obtained from `allocator`, front-most first. */
+	ProtobufCReverseBufferBlock	*blocks;
+	/** First byte of data in the front-most block. */
+	uint8_t				*pos;
+	/** Total number of bytes of data. */
+	size_t				len;
+	/** Size of the next block to request from `allocator`. */
+	size_t				next_block_size;
+};
+
 /**
  * Service.
  */
@@ -765,6 +1220,276 @@ struct ProtobufCServiceDescriptor {
 	const unsigned			*method_indices_by_name;
 };
 
+/**
+ * Packed sizes of a message and all of its submessages.
+ *
+ * Every submessage needs a length prefix, so serialising a message tree
+ * normally sizes each submessage again at every level of nesting. A
+ * `ProtobufCSizeCache` is filled once by
+ * protobuf_c_message_get_packed_size_cached() and then lets
+ * protobuf_c_message_pack_cached() and
+ * protobuf_c_message_pack_to_buffer_cached() write the prefixes directly,
+ * as often as needed, while the message is left unmodified.
+ *
+~~~{.c}
+ProtobufCSizeCache cache = PROTOBUF_C_SIZE_CACHE_INIT(NULL);
+size_t len = protobuf_c_message_get_packed_size_cached(&msg.base, &cache);
+uint8_t *buf = malloc(len);
+
+protobuf_c_message_pack_cached(&msg.base, &cache, buf);
+...
+protobuf_c_size_cache_clear(&cache);
+~~~
+ */
+struct ProtobufCSizeCache {
+	/** Number of valid entries in `sizes`. */
+	size_t			n_sizes;
+	/** Number of entries allocated in `sizes`. */
+	size_t			n_alloced;
+	/** Packed sizes of the message and its submessages, in pre-order. */
+	size_t			*sizes;
+	/** Allocator to use. May be NULL to indicate the system allocator. */
+	ProtobufCAllocator	*allocator;
+};
+
+/**
+ * State of a message being serialised a piece at a time.
+ *
+ * protobuf_c_pack_state_pack() fills a caller buffer of any size with the
+ * next bytes of the serialised message and returns; the next call carries on
+ * where it left off, in the middle of a nested message, a packed array or a
+ * long string if need be. A message can thus be streamed through a small
+ * fixed buffer, for instance to a non-blocking socket, without ever being
+ * serialised in memory as a whole. Only the sizes of its submessages are
+ * computed up front.
+ *
+~~~{.c}
+ProtobufCPackState state;
+uint8_t buf[1024];
+
+if (!protobuf_c_pack_state_init(&state, &msg.base, NULL))
+        ...
+while (state.n_written < state.len) {
+        size_t n = protobuf_c_pack_state_pack(&state, sizeof(buf), buf);
+        ... // send n bytes of buf, waiting for the socket as needed
+}
+protobuf_c_pack_state_clear(&state);
+~~~
+ *
+ * The message must not be modified until all of it has been packed.
+ *
+ * \see protobuf_c_pack_state_init
+ * \see protobuf_c_pack_state_pack
+ * \see protobuf_c_pack_state_clear
+ */
+struct ProtobufCPackState {
+	/** Allocator to use. May be NULL to indicate the system allocator. */
+	ProtobufCAllocator	*allocator;
+	/** Packed sizes of the message and its submessages. */
+	ProtobufCSizeCache	cache;
+	/** Index of the next entry of `cache` to use. */
+	size_t			next_size;
+	/** Messages being packed, outermost first. */
+	ProtobufCPackFrame	*frames;
+	/** Number of entries in use in `frames`. */
+	size_t			n_frames;
+	/** Number of entries allocated in `frames`. */
+	size_t			n_alloced;
+	/** Encoded bytes waiting to be output. */
+	uint8_t			pending[64];
+	/** Number of bytes in `pending`. */
+	size_t			pending_len;
+	/** Number of bytes of `pending` already output. */
+	size_t			pending_pos;
+	/** Field contents waiting to be output after `pending`. */
+	const uint8_t		*data;
+	/** Number of bytes left at `data`. */
+	size_t			data_len;
+	/** Size of the serialised message. */
+	size_t			len;
+	/** Number of bytes output so far. */
+	size_t			n_written;
+	/** Set if memory ran out, in which case the output is incomplete. */
+	protobuf_c_boolean	failed;
+};
+
+/**
+ * State of a message being unpacked from input that arrives in pieces.
+ *
+ * protobuf_c_unpack_state_feed() decodes whatever input it is given and
+ * returns; a tag, value or length prefix cut off at the end of a piece is
+ * completed by the next one, and nested messages and packed fields are
+ * decoded as their contents arrive. Input can thus be decoded as it is read
+ * from a socket, in pieces of any size, rather than once all of it has been
+ * collected.
+ *
+~~~{.c}
+ProtobufCUnpackState state;
+ProtobufCMessage *msg;
+uint8_t buf[4096];
+ssize_t n;
+
+if (!protobuf_c_unpack_state_init(&state, &foo_bar_descriptor, NULL))
+        ...
+while ((n = read(fd, buf, sizeof(buf))) > 0)
+        if (!protobuf_c_unpack_state_feed(&state, n, buf))
+                ... // malformed input
+msg = protobuf_c_unpack_state_finish(&state);
+protobuf_c_unpack_state_clear(&state);
+~~~
+ *
+ * \see protobuf_c_unpack_state_init
+ * \see protobuf_c_unpack_state_feed
+ * \see protobuf_c_unpack_state_finish
+ * \see protobuf_c_unpack_state_clear
+ */
+struct ProtobufCUnpackState {
+	/** Allocator used for the message and the state's bookkeeping. */
+	ProtobufCAllocator	*allocator;
+	/** Message being unpacked, until protobuf_c_unpack_state_finish(). */
+	ProtobufCMessage	*message;
+	/** Messages being unpacked, outermost first. */
+	ProtobufCUnpackFrame	*frames;
+	/** Number of entries in use in `frames`. */
+	size_t			n_frames;
+	/** Number of entries allocated in `frames`. */
+	size_t			n_alloced;
+	/** Part of the field being read. */
+	unsigned		step;
+	/** Tag of the field being read. */
+	uint32_t		tag;
+	/** Wire type of the field being read. */
+	uint8_t			wire_type;
+	/** Descriptor of the field being read, or NULL if it is unknown. */
+	const ProtobufCFieldDescriptor *field;
+	/** Input offset at which the contents of the field being read end. */
+	size_t			field_end;
+	/** Start of a tag, value or length prefix cut off by the input. */
+	uint8_t			pending[16];
+	/** Number of bytes in `pending`. */
+	size_t			pending_len;
+	/** Start of a string, bytes or unknown field cut off by the input. */
+	uint8_t			*scratch;
+	/** Number of bytes in `scratch`. */
+	size_t			scratch_len;
+	/** Number of bytes allocated at `scratch`. */
+	size_t			scratch_alloced;
+	/** Number of bytes of input received so far. */
+	size_t			len;
+	/** Set if the input was malformed or memory ran out. */
+	protobuf_c_boolean	failed;
+};
+
+/**
+ * Reader of a stream of messages, each preceded by its length as a varint.
+ *
+ * The stream is read either from a memory region, in which case records are
+ * unpacked where they are, or through a `ProtobufCReadFunc`, in which case
+ * input is read into a buffer in large blocks and each record is unpacked
+ * from there. The buffer grows to hold the largest record, as the input of
+ * that record arrives.
+ *
+~~~{.c}
+static size_t
+read_fd(size_t len, uint8_t *data, void *closure_data)
+{
+        ssize_t n = read(*(int *) closure_data, data, len);
+        return n >= 0 ? (size_t) n : (size_t) -1;
+}
+
+ProtobufCMessageReader reader;
+ProtobufCMessage *msg;
+
+protobuf_c_message_reader_init(&reader, read_fd, &fd, NULL);
+while ((msg = protobuf_c_message_reader_next(&reader, &foo_bar_descriptor,
+                                             NULL)) != NULL) {
+        ...
+        protobuf_c_message_free_unpacked(msg, NULL);
+}
+if (reader.failed)
+        ... // read error, or truncated or malformed record
+protobuf_c_message_reader_clear(&reader);
+~~~
+ *
+ * Each record may be unpacked with a different allocator. Passing an arena
+ * that is reset between records, or unpacking every record into the same
+ * message with protobuf_c_message_reader_next_into(), avoids most of the
+ * allocations per record.
+ *
+ * \see protobuf_c_message_reader_init
+ * \see protobuf_c_message_reader_init_memory
+ * \see protobuf_c_message_reader_next
+ * \see protobuf_c_message_reader_next_into
+ * \see protobuf_c_message_reader_clear
+ */
+struct ProtobufCMessageReader {
+	/** Function that reads more input, or NULL for a memory region. */
+	ProtobufCReadFunc	read;
+	/** Passed to `read`. */
+	void			*closure_data;
+	/** Allocator for `buf`. */
+	ProtobufCAllocator	*allocator;
+	/** The input read so far, or the memory region. */
+	const uint8_t		*data;
+	/** Offset in `data` of the next record. */
+	size_t			pos;
+	/** Number of bytes at `data`. */
+	size_t			len;
+	/** Buffer input is read into. */
+	uint8_t			*buf;
+	/** Number of bytes allocated at `buf`. */
+	size_t			buf_alloced;
+	/** Set once `read` has reported the end of the input. */
+	protobuf_c_boolean	eof;
+	/**
+	 * Set if `read` failed, a record was malformed or truncated, or memory
+	 * ran out.
+	 */
+	protobuf_c_boolean	failed;
+};
+
+/**
+ * Writer of a stream of messages, each preceded by its length as a varint.
+ *
+ * Records are packed into a buffer, which is passed to a `ProtobufCWriteFunc`
+ * when full, so that small records are written in large blocks. A record
+ * larger than the buffer is packed on its own and written directly, or, past
+ * 16 MiB, streamed through the buffer with a `ProtobufCPackState`.
+ *
+~~~{.c}
+ProtobufCMessageWriter writer;
+
+protobuf_c_message_writer_init(&writer, write_fd, &fd, NULL);
+for (...)
+        if (!protobuf_c_message_writer_write(&writer, &msg.base))
+                ...
+if (!protobuf_c_message_writer_flush(&writer))
+        ...
+protobuf_c_message_writer_clear(&writer);
+~~~
+ *
+ * \see protobuf_c_message_writer_init
+ * \see protobuf_c_message_writer_write
+ * \see protobuf_c_message_writer_flush
+ * \see protobuf_c_message_writer_clear
+ */
+struct ProtobufCMessageWriter {
+	/** Function that writes the buffered output. */
+	ProtobufCWriteFunc	write;
+	/** Passed to `write`. */
+	void			*closure_data;
+	/** Allocator for `buf`. */
+	ProtobufCAllocator	*allocator;
+	/** Output not yet written. */
+	uint8_t			*buf;
+	/** Number of bytes in `buf`. */
+	size_t			len;
+	/** Number of bytes allocated at `buf`. */
+	size_t			buf_alloced;
+	/** Set if `write` failed or memory ran out. */
+	protobuf_c_boolean	failed;
+};
+
 /**
  * Get the version of the protobuf-c library. Note that this is the version of
  * the library linked against, not the version of the headers compiled against.
@@ -790,19 +1515,19 @@ protobuf_c_version_number(void);
  * The version of the protobuf-c headers, represented as a string using the same
  * format as protobuf_c_version().
  */
-#define PROTOBUF_C_VERSION		"1.3.1"
+#define PROTOBUF_C_VERSION		"1.4.0"
 
 /**
  * The version of the protobuf-c headers, represented as an integer using the
  * same format as protobuf_c_version_number().
  */
-#define PROTOBUF_C_VERSION_NUMBER	1003001
+#define PROTOBUF_C_VERSION_NUMBER	1004000
 
 /**
  * The minimum protoc-c version which works with the current version of the
  * protobuf-c headers.
  */
-#define PROTOBUF_C_MIN_COMPILER_VERSION	1000000
+#define PROTOBUF_C_MIN_COMPILER_VERSION	1004000
 
 /**
  * Look up a `ProtobufCEnumValue` from a `ProtobufCEnumDescriptor` by name.
@@ -934,64 +1659,637 @@ protobuf_c_message_pack_to_buffer(
 	ProtobufCBuffer *buffer);
 
 /**
- * Unpack a serialised message into an in-memory representation.
+ * Serialise a message back to front into a pre-allocated buffer.
  *
- * \param descriptor
- *      The message descriptor.
- * \param allocator
- *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
- *      specify the default allocator.
+ * The message is written in a single pass, ending at `out + len`. Like
+ * snprintf(), the full packed size is returned even if `out` is too small,
+ * in which case the contents of `out` are unspecified.
+ *
+ * \param message
+ *      The message object to serialise.
  * \param len
- *      Length in bytes of the serialised message.
- * \param data
- *      Pointer to the serialised message.
+ *      Number of bytes in `out`.
+ * \param[out] out
+ *      Buffer to store the bytes of the serialised message. If the returned
+ *      size `n` is not greater than `len`, the message starts at
+ *      `out + len - n`.
  * \return
- *      An unpacked message object.
- * \retval NULL
- *      If an error occurred during unpacking.
+ *      Number of bytes in the serialised message.
  */
 PROTOBUF_C__API
-ProtobufCMessage *
-protobuf_c_message_unpack(
-	const ProtobufCMessageDescriptor *descriptor,
-	ProtobufCAllocator *allocator,
+size_t
+protobuf_c_message_pack_reverse(
+	const ProtobufCMessage *message,
 	size_t len,
-	const uint8_t *data);
+	uint8_t *out);
 
 /**
- * Free an unpacked message object.
+ * Serialise a message back to front into a `ProtobufCReverseBuffer`.
  *
- * This function should be used to deallocate the memory used by a call to
- * protobuf_c_message_unpack().
+ * The message is placed in front of any data already held by `rb`, so
+ * messages packed one after the other end up in reverse order.
  *
  * \param message
- *      The message object to free. May be NULL.
- * \param allocator
- *      `ProtobufCAllocator` to use for memory deallocation. May be NULL to
- *      specify the default allocator.
+ *      The message object to serialise.
+ * \param rb
+ *      The reverse buffer object.
+ * \return
+ *      TRUE on success. FALSE if a block could not be allocated, in which case
+ *      `rb` is left as it was before the call.
  */
 PROTOBUF_C__API
-void
-protobuf_c_message_free_unpacked(
-	ProtobufCMessage *message,
-	ProtobufCAllocator *allocator);
+protobuf_c_boolean
+protobuf_c_message_pack_to_reverse_buffer(
+	const ProtobufCMessage *message,
+	ProtobufCReverseBuffer *rb);
 
 /**
- * Check the validity of a message object.
+ * Prepare to serialise a message a piece at a time.
  *
- * Makes sure all required fields (`PROTOBUF_C_LABEL_REQUIRED`) are present.
- * Recursively checks nested messages.
+ * The sizes of the message and its submessages are computed; nothing is
+ * packed yet. `state->len` is set to the size of the serialised message.
  *
- * \retval TRUE
- *      Message is valid.
- * \retval FALSE
- *      Message is invalid.
+ * \param state
+ *      The pack state object to initialise.
+ * \param message
+ *      The message object to serialise.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the state's bookkeeping. May be NULL to
+ *      specify the default allocator.
+ * \return
+ *      TRUE on success. FALSE if memory ran out; `state` must still be passed
+ *      to protobuf_c_pack_state_clear().
  */
 PROTOBUF_C__API
 protobuf_c_boolean
-protobuf_c_message_check(const ProtobufCMessage *);
+protobuf_c_pack_state_init(
+	ProtobufCPackState *state,
+	const ProtobufCMessage *message,
+	ProtobufCAllocator *allocator);
 
-/** Message initialiser. */
+/**
+ * Serialise the next part of a message.
+ *
+ * \param state
+ *      Pack state set up by protobuf_c_pack_state_init().
+ * \param len
+ *      Number of bytes available in `out`.
+ * \param[out] out
+ *      Buffer to store the next bytes of the serialised message.
+ * \return
+ *      Number of bytes stored in `out`. This is less than `len` only once the
+ *      whole message has been packed, or if `state->failed` is set.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_pack_state_pack(
+	ProtobufCPackState *state,
+	size_t len,
+	uint8_t *out);
+
+/**
+ * Free the memory held by a `ProtobufCPackState`.
+ *
+ * \param state
+ *      The pack state object to clear.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_pack_state_clear(ProtobufCPackState *state);
+
+/**
+ * Initialise a `ProtobufCSizeCache` object.
+ */
+#define PROTOBUF_C_SIZE_CACHE_INIT(allocator) { 0, 0, NULL, (allocator) }
+
+/**
+ * Determine the number of bytes required to store the serialised message,
+ * recording the size of every submessage in `cache`.
+ *
+ * Any sizes previously held by `cache` are replaced. If `cache` cannot grow,
+ * it is left empty and the cached pack functions behave like their uncached
+ * counterparts; the returned size is correct either way.
+ *
+ * \param message
+ *      The message object to serialise.
+ * \param cache
+ *      The size cache to fill.
+ * \return
+ *      Number of bytes.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_get_packed_size_cached(
+	const ProtobufCMessage *message,
+	ProtobufCSizeCache *cache);
+
+/**
+ * Serialise a message into a pre-allocated buffer using the sizes recorded by
+ * protobuf_c_message_get_packed_size_cached().
+ *
+ * The message must not have been modified since `cache` was filled.
+ *
+ * \param message
+ *      The message object to serialise.
+ * \param cache
+ *      Sizes recorded for `message`.
+ * \param[out] out
+ *      Buffer to store the bytes of the serialised message. It must have room
+ *      for the size returned by protobuf_c_message_get_packed_size_cached().
+ * \return
+ *      Number of bytes stored in `out`.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_pack_cached(
+	const ProtobufCMessage *message,
+	const ProtobufCSizeCache *cache,
+	uint8_t *out);
+
+/**
+ * Serialise a message to a virtual buffer using the sizes recorded by
+ * protobuf_c_message_get_packed_size_cached().
+ *
+ * Submessages are passed straight to the virtual buffer instead of being
+ * serialised into a temporary buffer first. The message must not have been
+ * modified since `cache` was filled.
+ *
+ * \param message
+ *      The message object to serialise.
+ * \param cache
+ *      Sizes recorded for `message`.
+ * \param buffer
+ *      The virtual buffer object.
+ * \return
+ *      Number of bytes passed to the virtual buffer.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_pack_to_buffer_cached(
+	const ProtobufCMessage *message,
+	const ProtobufCSizeCache *cache,
+	ProtobufCBuffer *buffer);
+
+/**
+ * Free the memory held by a `ProtobufCSizeCache`. The cache is left empty and
+ * may be filled again.
+ *
+ * \param cache
+ *      The size cache to clear.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_size_cache_clear(ProtobufCSizeCache *cache);
+
+/**
+ * Unpack a serialised message into an in-memory representation.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Free an unpacked message object.
+ *
+ * This function should be used to deallocate the memory used by a call to
+ * protobuf_c_message_unpack().
+ *
+ * \param message
+ *      The message object to free. May be NULL.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory deallocation. May be NULL to
+ *      specify the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_free_unpacked(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Unpack a serialised message, with extra options.
+ *
+ * This is protobuf_c_message_unpack() with a set of `ProtobufCUnpackFlag`
+ * values controlling how the message is built. The flags apply to nested
+ * messages as well. A message unpacked with any of these flags must be freed
+ * with protobuf_c_message_free_unpacked_ex() and the same flags.
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      Bitwise OR of `ProtobufCUnpackFlag` values.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_ex(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	unsigned flags,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Unpack a serialised message held in several segments, such as those of a
+ * ring buffer or returned by protobuf_c_buffer_segmented_get_iovec().
+ *
+ * The segments are decoded where they are, as by
+ * protobuf_c_unpack_state_feed(); only a string, bytes or unknown field that
+ * straddles two segments is copied, straight into storage of its own size for
+ * a string or bytes field. The message must be freed with
+ * protobuf_c_message_free_unpacked().
+ *
+ * \param descriptor
+ *      The message descriptor.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation. May be NULL to
+ *      specify the default allocator.
+ * \param n_iov
+ *      Number of segments in `iov`.
+ * \param iov
+ *      The segments of the serialised message, in order.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      If an error occurred during unpacking.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_unpack_iovec(
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator,
+	size_t n_iov,
+	const ProtobufCIoVec *iov);
+
+/**
+ * Free a message object unpacked by protobuf_c_message_unpack_ex().
+ *
+ * Payloads that alias the input buffer according to `flags` are left alone,
+ * and payloads unpacked with `PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS` are released
+ * together with their message.
+ *
+ * \param message
+ *      The message object to free. May be NULL.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory deallocation. May be NULL to
+ *      specify the default allocator.
+ * \param flags
+ *      The flags that were passed to protobuf_c_message_unpack_ex().
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_free_unpacked_ex(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator,
+	unsigned flags);
+
+/**
+ * Unpack a serialised message into an existing message object, reusing its
+ * storage.
+ *
+ * `message` must either have been initialised with `<type>_init()` or hold
+ * the result of an earlier protobuf_c_message_unpack() or
+ * protobuf_c_message_unpack_into() with the same allocator. Strings, `bytes`
+ * fields, repeated field arrays and nested messages it already holds are
+ * overwritten in place when they are large enough for the new values, and
+ * reallocated otherwise; fields absent from the input are reset to their
+ * defaults. This avoids most allocations when the same message type is
+ * decoded over and over.
+ *
+ * Only what the message currently holds can be reused, so the storage kept
+ * for a field is bounded by the largest value it held most recently.
+ *
+ * \param message
+ *      The message object to unpack into.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for memory allocation and deallocation.
+ *      May be NULL to specify the default allocator.
+ * \param len
+ *      Length in bytes of the serialised message.
+ * \param data
+ *      Pointer to the serialised message.
+ * \retval TRUE
+ *      The message was unpacked.
+ * \retval FALSE
+ *      An error occurred. The message holds a partial result that can still
+ *      be passed to protobuf_c_message_clear() or unpacked into again.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_unpack_into(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Prepare to unpack a message from input that arrives in pieces.
+ *
+ * \param state
+ *      The unpack state object to initialise.
+ * \param descriptor
+ *      The message descriptor of the message to unpack.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the message and the state's
+ *      bookkeeping. May be NULL to specify the default allocator.
+ * \return
+ *      TRUE on success. FALSE if memory ran out; `state` must still be passed
+ *      to protobuf_c_unpack_state_clear().
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_unpack_state_init(
+	ProtobufCUnpackState *state,
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Unpack the next piece of a serialised message.
+ *
+ * \param state
+ *      Unpack state set up by protobuf_c_unpack_state_init().
+ * \param len
+ *      Length in bytes of the piece.
+ * \param data
+ *      The next bytes of the serialised message. They are not referred to
+ *      once the function returns.
+ * \return
+ *      TRUE on success. FALSE if the input is malformed or memory ran out, in
+ *      which case `state->failed` is set and further input is ignored.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_unpack_state_feed(
+	ProtobufCUnpackState *state,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Complete a message once all of its input has been fed.
+ *
+ * \param state
+ *      Unpack state set up by protobuf_c_unpack_state_init().
+ * \return
+ *      The unpacked message, to be freed by the caller with
+ *      protobuf_c_message_free_unpacked() and the allocator given to
+ *      protobuf_c_unpack_state_init(). NULL if the input was malformed or
+ *      truncated, or a required field is missing.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_unpack_state_finish(ProtobufCUnpackState *state);
+
+/**
+ * Free the memory held by a `ProtobufCUnpackState`, including the message
+ * being unpacked if protobuf_c_unpack_state_finish() has not returned it.
+ *
+ * \param state
+ *      The unpack state object to clear.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_unpack_state_clear(ProtobufCUnpackState *state);
+
+/**
+ * Serialise a message preceded by its length as a varint, appending to a
+ * `ProtobufCBuffer`.
+ *
+ * \param message
+ *      The message object to serialise.
+ * \param buffer
+ *      Virtual buffer to append data to.
+ * \return
+ *      Number of bytes appended to `buffer`.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_message_pack_delimited_to_buffer(
+	const ProtobufCMessage *message,
+	ProtobufCBuffer *buffer);
+
+/**
+ * Set up a writer of length-delimited messages.
+ *
+ * \param writer
+ *      The writer object to initialise.
+ * \param write
+ *      Function that writes the output.
+ * \param closure_data
+ *      Passed to `write`.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the writer's buffer. May be NULL to
+ *      specify the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_writer_init(
+	ProtobufCMessageWriter *writer,
+	ProtobufCWriteFunc write,
+	void *closure_data,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Write a message preceded by its length. The output may stay buffered until
+ * protobuf_c_message_writer_flush() is called.
+ *
+ * \param writer
+ *      Writer set up by protobuf_c_message_writer_init().
+ * \param message
+ *      The message object to write.
+ * \return
+ *      TRUE on success. FALSE if writing failed or memory ran out, in which
+ *      case `writer->failed` is set and further messages are not written.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_writer_write(
+	ProtobufCMessageWriter *writer,
+	const ProtobufCMessage *message);
+
+/**
+ * Write out everything buffered by a `ProtobufCMessageWriter`.
+ *
+ * \param writer
+ *      Writer set up by protobuf_c_message_writer_init().
+ * \return
+ *      TRUE on success. FALSE if writing failed.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_writer_flush(ProtobufCMessageWriter *writer);
+
+/**
+ * Free the buffer of a `ProtobufCMessageWriter`. Output that has not been
+ * flushed is discarded.
+ *
+ * \param writer
+ *      The writer object to clear.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_writer_clear(ProtobufCMessageWriter *writer);
+
+/**
+ * Set up a reader of length-delimited messages from input read in blocks.
+ *
+ * \param reader
+ *      The reader object to initialise.
+ * \param read
+ *      Function that reads the input.
+ * \param closure_data
+ *      Passed to `read`.
+ * \param allocator
+ *      `ProtobufCAllocator` to use for the reader's buffer. May be NULL to
+ *      specify the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_reader_init(
+	ProtobufCMessageReader *reader,
+	ProtobufCReadFunc read,
+	void *closure_data,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Set up a reader of length-delimited messages from a memory region. The
+ * region must stay valid while the reader is in use.
+ *
+ * \param reader
+ *      The reader object to initialise.
+ * \param len
+ *      Length in bytes of the region.
+ * \param data
+ *      The records, one after the other.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_reader_init_memory(
+	ProtobufCMessageReader *reader,
+	size_t len,
+	const uint8_t *data);
+
+/**
+ * Read and unpack the next message.
+ *
+ * \param reader
+ *      Reader set up by protobuf_c_message_reader_init() or
+ *      protobuf_c_message_reader_init_memory().
+ * \param descriptor
+ *      The message descriptor of the records.
+ * \param allocator
+ *      `ProtobufCAllocator` to unpack the message with. May be NULL to specify
+ *      the default allocator.
+ * \return
+ *      An unpacked message object.
+ * \retval NULL
+ *      At the end of the input, or if an error occurred, in which case
+ *      `reader->failed` is set.
+ */
+PROTOBUF_C__API
+ProtobufCMessage *
+protobuf_c_message_reader_next(
+	ProtobufCMessageReader *reader,
+	const ProtobufCMessageDescriptor *descriptor,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Read the next message and unpack it into an existing message object, as
+ * protobuf_c_message_unpack_into() does.
+ *
+ * \param reader
+ *      Reader set up by protobuf_c_message_reader_init() or
+ *      protobuf_c_message_reader_init_memory().
+ * \param message
+ *      The message object to unpack into.
+ * \param allocator
+ *      `ProtobufCAllocator` the message's contents are allocated with. May be
+ *      NULL to specify the default allocator.
+ * \retval TRUE
+ *      The message was unpacked.
+ * \retval FALSE
+ *      At the end of the input, or if an error occurred, in which case
+ *      `reader->failed` is set.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_reader_next_into(
+	ProtobufCMessageReader *reader,
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Free the buffer of a `ProtobufCMessageReader`.
+ *
+ * \param reader
+ *      The reader object to clear.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_reader_clear(ProtobufCMessageReader *reader);
+
+/**
+ * Free everything a message object holds and reset its fields to their
+ * defaults, without freeing the object itself.
+ *
+ * This releases the storage kept by protobuf_c_message_unpack_into(). The
+ * message can be unpacked into again afterwards.
+ *
+ * \param message
+ *      The message object to clear.
+ * \param allocator
+ *      `ProtobufCAllocator` the message's contents were allocated with. May be
+ *      NULL to specify the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_message_clear(
+	ProtobufCMessage *message,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Check the validity of a message object.
+ *
+ * Makes sure all required fields (`PROTOBUF_C_LABEL_REQUIRED`) are present.
+ * Recursively checks nested messages.
+ *
+ * \retval TRUE
+ *      Message is valid.
+ * \retval FALSE
+ *      Message is invalid.
+ */
+PROTOBUF_C__API
+protobuf_c_boolean
+protobuf_c_message_check(const ProtobufCMessage *);
+
+/** Message initialiser. */
 #define PROTOBUF_C_MESSAGE_INIT(descriptor) { descriptor, 0, NULL }
 
 /**
@@ -1037,6 +2335,17 @@ protobuf_c_service_descriptor_get_method_by_name(
 	const ProtobufCServiceDescriptor *desc,
 	const char *name);
 
+/**
+ * Initialise the `ProtobufCBufferDirect` part of an object.
+ */
+#define PROTOBUF_C_BUFFER_DIRECT_INIT(reserve, commit)                  \
+{                                                                       \
+	{ protobuf_c_buffer_direct_append },                            \
+	(reserve),                                                      \
+	(commit),                                                       \
+	0                                                               \
+}
+
 /**
  * Initialise a `ProtobufCBufferSimple` object.
  */
@@ -1083,6 +2392,190 @@ protobuf_c_buffer_simple_append(
 	size_t len,
 	const unsigned char *data);
 
+/**
+ * The `append` method for `ProtobufCBufferDirect`.
+ *
+ * Copies the data into the room returned by the buffer's `reserve` method and
+ * commits it. The data is dropped if `reserve` fails.
+ *
+ * \param buffer
+ *      The buffer object to append to. Must actually be a
+ *      `ProtobufCBufferDirect` object.
+ * \param len
+ *      Number of bytes in `data`.
+ * \param data
+ *      Data to append.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_buffer_direct_append(
+	ProtobufCBuffer *buffer,
+	size_t len,
+	const unsigned char *data);
+
+/**
+ * Initialise a `ProtobufCBufferSegmented` object.
+ *
+ * \param buffer
+ *      The segmented buffer object to initialise.
+ * \param allocator
+ *      `ProtobufCAllocator` used to obtain segments. May be NULL to specify
+ *      the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_buffer_segmented_init(
+	ProtobufCBufferSegmented *buffer,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Describe the segments of a `ProtobufCBufferSegmented`, in order.
+ *
+ * \param buffer
+ *      The segmented buffer object.
+ * \param[out] iov
+ *      Array to fill. May be NULL if `n_iov` is 0.
+ * \param n_iov
+ *      Number of elements in `iov`.
+ * \return
+ *      Number of segments. If this is greater than `n_iov`, only the first
+ *      `n_iov` segments were described.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_buffer_segmented_get_iovec(
+	const ProtobufCBufferSegmented *buffer,
+	ProtobufCIoVec *iov,
+	size_t n_iov);
+
+/**
+ * Copy the data stored in a `ProtobufCBufferSegmented` into a single block.
+ *
+ * \param buffer
+ *      The segmented buffer object.
+ * \param[out] out
+ *      Block to copy to. It must have room for `buffer->len` bytes.
+ * \return
+ *      Number of bytes copied.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_buffer_segmented_flatten(
+	const ProtobufCBufferSegmented *buffer,
+	uint8_t *out);
+
+/**
+ * Free the segments of a `ProtobufCBufferSegmented`. The buffer is left empty
+ * and may be appended to again.
+ *
+ * \param buffer
+ *      The segmented buffer object to clear.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_buffer_segmented_clear(ProtobufCBufferSegmented *buffer);
+
+/**
+ * Initialise a `ProtobufCArena` object.
+ *
+ * \param arena
+ *      The arena object to initialise.
+ * \param initial_block
+ *      Memory to hand out before any block is requested from `parent`. It
+ *      must stay valid for the lifetime of the arena. May be NULL.
+ * \param initial_size
+ *      Number of bytes in `initial_block`.
+ * \param parent
+ *      `ProtobufCAllocator` used to obtain further blocks. May be NULL to
+ *      specify the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_arena_init(
+	ProtobufCArena *arena,
+	void *initial_block,
+	size_t initial_size,
+	ProtobufCAllocator *parent);
+
+/**
+ * Invalidate everything allocated from an arena so that its memory can be
+ * reused.
+ *
+ * The block allocations are currently carved from is kept for subsequent
+ * allocations, or the initial block is used again if it is still that block;
+ * all other blocks are returned to the parent allocator.
+ *
+ * \param arena
+ *      The arena object to reset.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_arena_reset(ProtobufCArena *arena);
+
+/**
+ * Return all blocks held by an arena to its parent allocator.
+ *
+ * Everything allocated from the arena is invalidated. The arena is left in
+ * the same state as after protobuf_c_arena_init() and may be used again.
+ *
+ * \param arena
+ *      The arena object to destroy.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_arena_destroy(ProtobufCArena *arena);
+
+/**
+ * Initialise a `ProtobufCReverseBuffer` object.
+ *
+ * \param rb
+ *      The reverse buffer object to initialise.
+ * \param initial_block
+ *      Memory to fill before any block is requested from `allocator`. It
+ *      must stay valid for the lifetime of the reverse buffer. May be NULL.
+ * \param initial_size
+ *      Number of bytes in `initial_block`.
+ * \param allocator
+ *      `ProtobufCAllocator` used to obtain further blocks. May be NULL to
+ *      specify the default allocator.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_reverse_buffer_init(
+	ProtobufCReverseBuffer *rb,
+	void *initial_block,
+	size_t initial_size,
+	ProtobufCAllocator *allocator);
+
+/**
+ * Pass the data held by a `ProtobufCReverseBuffer` to a virtual buffer, front
+ * to back.
+ *
+ * \param rb
+ *      The reverse buffer object.
+ * \param buffer
+ *      The virtual buffer object.
+ * \return
+ *      Number of bytes passed to the virtual buffer.
+ */
+PROTOBUF_C__API
+size_t
+protobuf_c_reverse_buffer_to_buffer(
+	const ProtobufCReverseBuffer *rb,
+	ProtobufCBuffer *buffer);
+
+/**
+ * Discard the data held by a `ProtobufCReverseBuffer` and return all blocks
+ * to its allocator. The reverse buffer is left in the same state as after
+ * protobuf_c_reverse_buffer_init() and may be used again.
+ *
+ * \param rb
+ *      The reverse buffer object to clear.
+ */
+PROTOBUF_C__API
+void
+protobuf_c_reverse_buffer_clear(ProtobufCReverseBuffer *rb);
+
 PROTOBUF_C__API
 void
 protobuf_c_service_generated_init(
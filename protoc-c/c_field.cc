@@ -101,30 +101,65 @@ static bool is_packable_type(FieldDescriptor::Type type)
     //TYPE_MESSAGE
 }
 
-void FieldGenerator::GenerateDescriptorInitializerGeneric(io::Printer* printer,
-							  bool optional_uses_has,
-							  const string &type_macro,
-							  const string &descriptor_addr) const
+void FieldGenerator::GetDescriptorVariables(bool optional_uses_has,
+					    std::map<string, string> *variables) const
 {
-  std::map<string, string> variables;
-  variables["TYPE"] = type_macro;
-  variables["classname"] = ToLower(PkgName() + "_" + CamelToLower(FieldScope(descriptor_)->name())) + "_t";
-  variables["name"] = FieldName(descriptor_);
-  variables["proto_name"] = descriptor_->name();
-  variables["descriptor_addr"] = descriptor_addr;
-  variables["value"] = SimpleItoa(descriptor_->number());
+  std::map<string, string> &vars = *variables;
+  vars["classname"] = ToLower(PkgName() + "_" + CamelToLower(FieldScope(descriptor_)->name())) + "_t";
+  vars["name"] = FieldName(descriptor_);
+  vars["proto_name"] = descriptor_->name();
+  vars["value"] = SimpleItoa(descriptor_->number());
   const OneofDescriptor *oneof = descriptor_->containing_oneof();
   if (oneof != NULL)
-    variables["oneofname"] = FullNameToLower(oneof->name());
+    vars["oneofname"] = FullNameToLower(oneof->name());
 
   if (FieldSyntax(descriptor_) == 3 &&
     descriptor_->label() == FieldDescriptor::LABEL_OPTIONAL) {
-    variables["LABEL"] = "NONE";
+    vars["LABEL"] = "NONE";
     optional_uses_has = false;
   } else {
-    variables["LABEL"] = CamelToUpper(GetLabelName(descriptor_->label()));
+    vars["LABEL"] = CamelToUpper(GetLabelName(descriptor_->label()));
   }
 
+  vars["quantifier_offset"] = "0";
+  switch (descriptor_->label()) {
+    case FieldDescriptor::LABEL_REQUIRED:
+      break;
+    case FieldDescriptor::LABEL_OPTIONAL:
+      if (oneof != NULL)
+        vars["quantifier_offset"] = "offsetof(" + vars["classname"] + ", " + vars["oneofname"] + "_case)";
+      else if (optional_uses_has)
+        vars["quantifier_offset"] = "offsetof(" + vars["classname"] + ", has_" + vars["name"] + ")";
+      break;
+    case FieldDescriptor::LABEL_REPEATED:
+      vars["quantifier_offset"] = "offsetof(" + vars["classname"] + ", n_" + vars["name"] + ")";
+      break;
+  }
+
+  vars["flags"] = "0";
+
+  if (descriptor_->label() == FieldDescriptor::LABEL_REPEATED
+   && is_packable_type (descriptor_->type())
+   && descriptor_->options().packed())
+    vars["flags"] += " | PROTOBUF_C_FIELD_FLAG_PACKED";
+
+  if (descriptor_->options().deprecated())
+    vars["flags"] += " | PROTOBUF_C_FIELD_FLAG_DEPRECATED";
+
+  if (oneof != NULL)
+    vars["flags"] += " | PROTOBUF_C_FIELD_FLAG_ONEOF";
+}
+
+void FieldGenerator::GenerateDescriptorInitializerGeneric(io::Printer* printer,
+							  bool optional_uses_has,
+							  const string &type_macro,
+							  const string &descriptor_addr) const
+{
+  std::map<string, string> variables;
+  GetDescriptorVariables(optional_uses_has, &variables);
+  variables["TYPE"] = type_macro;
+  variables["descriptor_addr"] = descriptor_addr;
+
   if (descriptor_->has_default_value()) {
     variables["default_value"] = string("&")
                    + ToLower(PkgName() + "_" + CamelToLower(FieldScope(descriptor_)->name()))
@@ -137,18 +172,19 @@ void FieldGenerator::GenerateDescriptorInitializerGeneric(io::Printer* printer,
     variables["default_value"] = "NULL";
   }
 
-  variables["flags"] = "0";
-
-  if (descriptor_->label() == FieldDescriptor::LABEL_REPEATED
-   && is_packable_type (descriptor_->type())
-   && descriptor_->options().packed())
-    variables["flags"] += " | PROTOBUF_C_FIELD_FLAG_PACKED";
-
-  if (descriptor_->options().deprecated())
-    variables["flags"] += " | PROTOBUF_C_FIELD_FLAG_DEPRECATED";
-
-  if (oneof != NULL)
-    variables["flags"] += " | PROTOBUF_C_FIELD_FLAG_ONEOF";
+  // the tag as encoded on the wire, less the wire type; tags taking 5 bytes
+  // don't fit and are encoded by the runtime instead
+  uint32 key = (uint32) descriptor_->number() << 3;
+  uint32 tag_bytes = 0;
+  if (key < (1u << 28)) {
+    int shift = 0;
+    for (; key >= 0x80; key >>= 7, shift += 8)
+      tag_bytes |= (0x80 | (key & 0x7f)) << shift;
+    tag_bytes |= key << shift;
+  }
+  char tag_buf[16];
+  snprintf(tag_buf, sizeof(tag_buf), "0x%x", (unsigned) tag_bytes);
+  variables["tag_bytes"] = tag_buf;
 
   printer->Print("{\n");
   if (descriptor_->file()->options().has_optimize_for() &&
@@ -162,31 +198,32 @@ void FieldGenerator::GenerateDescriptorInitializerGeneric(io::Printer* printer,
     "  $value$,\n"
     "  PROTOBUF_C_LABEL_$LABEL$,\n"
     "  PROTOBUF_C_TYPE_$TYPE$,\n");
-  switch (descriptor_->label()) {
-    case FieldDescriptor::LABEL_REQUIRED:
-      printer->Print(variables, "  0,   /* quantifier_offset */\n");
-      break;
-    case FieldDescriptor::LABEL_OPTIONAL:
-      if (oneof != NULL) {
-        printer->Print(variables, "  offsetof($classname$, $oneofname$_case),\n");
-      } else if (optional_uses_has) {
-	printer->Print(variables, "  offsetof($classname$, has_$name$),\n");
-      } else {
-	printer->Print(variables, "  0,   /* quantifier_offset */\n");
-      }
-      break;
-    case FieldDescriptor::LABEL_REPEATED:
-      printer->Print(variables, "  offsetof($classname$, n_$name$),\n");
-      break;
-  }
+  if (variables["quantifier_offset"] == "0")
+    printer->Print(variables, "  0,   /* quantifier_offset */\n");
+  else
+    printer->Print(variables, "  $quantifier_offset$,\n");
   printer->Print(variables, "  offsetof($classname$, $name$),\n");
   printer->Print(variables, "  $descriptor_addr$,\n");
   printer->Print(variables, "  $default_value$,\n");
   printer->Print(variables, "  $flags$,             /* flags */\n");
-  printer->Print(variables, "  0,NULL,NULL    /* reserved1,reserved2, etc */\n");
+  printer->Print(variables, "  $tag_bytes$,NULL,NULL    /* tag_bytes,reserved2,reserved3 */\n");
   printer->Print("},\n");
 }
 
+void FieldGenerator::GenerateHotFieldInitializer(io::Printer* printer) const
+{
+  std::map<string, string> variables;
+  // only strings and messages go without a has_ member, whatever the
+  // subclass (see GenerateDescriptorInitializer())
+  GetDescriptorVariables(descriptor_->type() != FieldDescriptor::TYPE_STRING &&
+                         descriptor_->type() != FieldDescriptor::TYPE_MESSAGE,
+                         &variables);
+  variables["TYPE"] = ToUpper(descriptor_->type_name());
+  printer->Print(variables,
+    "  { $value$, offsetof($classname$, $name$), $quantifier_offset$,"
+    " PROTOBUF_C_LABEL_$LABEL$, PROTOBUF_C_TYPE_$TYPE$, $flags$, 0 },\n");
+}
+
 FieldGeneratorMap::FieldGeneratorMap(const Descriptor* descriptor)
   : descriptor_(descriptor),
     field_generators_(
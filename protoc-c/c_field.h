@@ -63,6 +63,7 @@
 #ifndef GOOGLE_PROTOBUF_COMPILER_C_FIELD_H__
 #define GOOGLE_PROTOBUF_COMPILER_C_FIELD_H__
 
+#include <map>
 #include <memory>
 #include <google/protobuf/stubs/common.h>
 #include <google/protobuf/descriptor.h>
@@ -89,6 +90,9 @@ class FieldGenerator {
   // Generate a static initializer for this field.
   virtual void GenerateDescriptorInitializer(io::Printer* printer) const = 0;
 
+  // Generate the entry for this field in the message's ProtobufCFieldHot table.
+  void GenerateHotFieldInitializer(io::Printer* printer) const;
+
   virtual void GenerateDefaultValueDeclarations(io::Printer* printer) const { }
   virtual void GenerateDefaultValueImplementations(io::Printer* printer) const { }
   virtual string GetDefaultValue() const = 0;
@@ -105,6 +109,10 @@ class FieldGenerator {
   const FieldDescriptor *descriptor_;
 
  private:
+  // Variables shared by the descriptor and the hot table entry.
+  void GetDescriptorVariables(bool optional_uses_has,
+                              std::map<string, string> *variables) const;
+
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(FieldGenerator);
 };
 
@@ -61,6 +61,8 @@
 
 // Modified to implement C code by Dave Benson.
 
+#include <set>
+
 #include <protoc-c/c_file.h>
 #include <protoc-c/c_enum.h>
 #include <protoc-c/c_service.h>
@@ -80,6 +82,596 @@ namespace c {
 
 // ===================================================================
 
+// Static functions shared by the generated decoders and encoders (see
+// MessageGenerator::GenerateCodec()).  Only those a file uses are written out,
+// so that they don't trigger unused-function warnings.  A helper comes after
+// the helpers it calls.
+static const struct {
+  const char *name;
+  const char *code;
+} codec_helpers[] = {
+  { "varint",
+    "/* Unrolled, and without bounds checks if there are 10 bytes left. */\n"
+    "static const uint8_t *\n"
+    "pbc_read_varint(const uint8_t *at, const uint8_t *end, uint64_t *value)\n"
+    "{\n"
+    "  uint64_t v;\n"
+    "  unsigned i;\n"
+    "\n"
+    "  if (end - at >= 10) {\n"
+    "    /* each byte also cancels the continuation bit of the one before */\n"
+    "    v = at[0];\n"
+    "    if (at[0] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 1;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[1] - 1) << 7;\n"
+    "    if (at[1] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 2;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[2] - 1) << 14;\n"
+    "    if (at[2] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 3;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[3] - 1) << 21;\n"
+    "    if (at[3] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 4;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[4] - 1) << 28;\n"
+    "    if (at[4] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 5;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[5] - 1) << 35;\n"
+    "    if (at[5] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 6;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[6] - 1) << 42;\n"
+    "    if (at[6] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 7;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[7] - 1) << 49;\n"
+    "    if (at[7] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 8;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[8] - 1) << 56;\n"
+    "    if (at[8] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 9;\n"
+    "    }\n"
+    "    v += ((uint64_t) at[9] - 1) << 63;\n"
+    "    if (at[9] < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at + 10;\n"
+    "    }\n"
+    "    return NULL;\n"
+    "  }\n"
+    "  v = 0;\n"
+    "  for (i = 0; i < 10 && at < end; i++) {\n"
+    "    v |= (uint64_t) (*at & 0x7f) << (7 * i);\n"
+    "    if (*at++ < 0x80) {\n"
+    "      *value = v;\n"
+    "      return at;\n"
+    "    }\n"
+    "  }\n"
+    "  return NULL;\n"
+    "}\n\n" },
+  { "bool",
+    "static const uint8_t *\n"
+    "pbc_read_bool(const uint8_t *at, const uint8_t *end, uint64_t *value)\n"
+    "{\n"
+    "  unsigned bits = 0;\n"
+    "  unsigned i;\n"
+    "\n"
+    "  for (i = 0; i < 10 && at < end; i++) {\n"
+    "    bits |= *at & 0x7f;\n"
+    "    if (*at++ < 0x80) {\n"
+    "      *value = bits != 0;\n"
+    "      return at;\n"
+    "    }\n"
+    "  }\n"
+    "  return NULL;\n"
+    "}\n\n" },
+  { "fixed32",
+    "static const uint8_t *\n"
+    "pbc_read_fixed32(const uint8_t *at, const uint8_t *end, uint64_t *value)\n"
+    "{\n"
+    "  if (end - at < 4)\n"
+    "    return NULL;\n"
+    "  *value = (uint32_t) at[0] | (uint32_t) at[1] << 8 |\n"
+    "           (uint32_t) at[2] << 16 | (uint32_t) at[3] << 24;\n"
+    "  return at + 4;\n"
+    "}\n\n" },
+  { "fixed64",
+    "static const uint8_t *\n"
+    "pbc_read_fixed64(const uint8_t *at, const uint8_t *end, uint64_t *value)\n"
+    "{\n"
+    "  if (end - at < 8)\n"
+    "    return NULL;\n"
+    "  *value = (uint64_t) at[0] | (uint64_t) at[1] << 8 |\n"
+    "           (uint64_t) at[2] << 16 | (uint64_t) at[3] << 24 |\n"
+    "           (uint64_t) at[4] << 32 | (uint64_t) at[5] << 40 |\n"
+    "           (uint64_t) at[6] << 48 | (uint64_t) at[7] << 56;\n"
+    "  return at + 8;\n"
+    "}\n\n" },
+  { "length",
+    "static const uint8_t *\n"
+    "pbc_read_length(const uint8_t *at, const uint8_t *end, size_t *len)\n"
+    "{\n"
+    "  uint64_t v;\n"
+    "\n"
+    "  if ((at = pbc_read_varint(at, end, &v)) == NULL ||\n"
+    "      v > (uint64_t) (end - at))\n"
+    "    return NULL;\n"
+    "  *len = (size_t) v;\n"
+    "  return at;\n"
+    "}\n\n" },
+  { "zigzag32",
+    "static int32_t\n"
+    "pbc_zigzag32(uint64_t v)\n"
+    "{\n"
+    "  uint32_t u = (uint32_t) v;\n"
+    "  return (int32_t) ((u >> 1) ^ (0u - (u & 1)));\n"
+    "}\n\n" },
+  { "zigzag64",
+    "static int64_t\n"
+    "pbc_zigzag64(uint64_t v)\n"
+    "{\n"
+    "  return (int64_t) ((v >> 1) ^ (0u - (v & 1)));\n"
+    "}\n\n" },
+  { "float",
+    "static float\n"
+    "pbc_float(uint64_t v)\n"
+    "{\n"
+    "  union { uint32_t i; float f; } u;\n"
+    "  u.i = (uint32_t) v;\n"
+    "  return u.f;\n"
+    "}\n\n" },
+  { "double",
+    "static double\n"
+    "pbc_double(uint64_t v)\n"
+    "{\n"
+    "  union { uint64_t i; double f; } u;\n"
+    "  u.i = v;\n"
+    "  return u.f;\n"
+    "}\n\n" },
+  { "count_varints",
+    "/* Count the bytes without a continuation bit, eight at a time. */\n"
+    "static size_t\n"
+    "pbc_count_varints(const uint8_t *at, size_t len)\n"
+    "{\n"
+    "  size_t n = 0;\n"
+    "  uint64_t word;\n"
+    "\n"
+    "  for (; len >= 8; len -= 8, at += 8) {\n"
+    "    memcpy(&word, at, 8);\n"
+    "    word = (~word & 0x8080808080808080ull) >> 7;\n"
+    "    n += (size_t) ((word * 0x0101010101010101ull) >> 56);\n"
+    "  }\n"
+    "  while (len-- != 0)\n"
+    "    n += *at++ < 0x80;\n"
+    "  return n;\n"
+    "}\n\n" },
+  { "little_endian",
+    "static protobuf_c_boolean\n"
+    "pbc_little_endian(void)\n"
+    "{\n"
+    "  static const uint16_t one = 1;\n"
+    "  return *(const uint8_t *) &one;\n"
+    "}\n\n" },
+  { "string",
+    "static char *\n"
+    "pbc_read_string(ProtobufCAllocator *allocator, const uint8_t *at, size_t len)\n"
+    "{\n"
+    "  char *s = (char *) allocator->alloc(allocator->allocator_data, len + 1);\n"
+    "\n"
+    "  if (s != NULL) {\n"
+    "    memcpy(s, at, len);\n"
+    "    s[len] = 0;\n"
+    "  }\n"
+    "  return s;\n"
+    "}\n\n" },
+  { "bytes",
+    "static protobuf_c_boolean\n"
+    "pbc_read_bytes(ProtobufCAllocator *allocator, ProtobufCBinaryData *bd,\n"
+    "               const uint8_t *at, size_t len)\n"
+    "{\n"
+    "  bd->data = NULL;\n"
+    "  bd->len = 0;\n"
+    "  if (len == 0)\n"
+    "    return 1;\n"
+    "  bd->data = (uint8_t *) allocator->alloc(allocator->allocator_data, len);\n"
+    "  if (bd->data == NULL)\n"
+    "    return 0;\n"
+    "  memcpy(bd->data, at, len);\n"
+    "  bd->len = len;\n"
+    "  return 1;\n"
+    "}\n\n" },
+  { "reserve",
+    "/* Make room for `extra` more elements in a repeated field's array. */\n"
+    "static protobuf_c_boolean\n"
+    "pbc_reserve(ProtobufCAllocator *allocator, void **array, size_t n,\n"
+    "            size_t *alloced, size_t extra, size_t size)\n"
+    "{\n"
+    "  size_t want = n + extra;\n"
+    "  void *a;\n"
+    "\n"
+    "  if (want <= *alloced)\n"
+    "    return 1;\n"
+    "  if (want < *alloced * 2)\n"
+    "    want = *alloced * 2;\n"
+    "  if (want < 4)\n"
+    "    want = 4;\n"
+    "  if (want > (size_t) -1 / size)\n"
+    "    return 0;\n"
+    "  a = allocator->alloc(allocator->allocator_data, want * size);\n"
+    "  if (a == NULL)\n"
+    "    return 0;\n"
+    "  if (n != 0)\n"
+    "    memcpy(a, *array, n * size);\n"
+    "  if (*array != NULL)\n"
+    "    allocator->free(allocator->allocator_data, *array);\n"
+    "  *array = a;\n"
+    "  *alloced = want;\n"
+    "  return 1;\n"
+    "}\n\n" },
+  { "varint32_size",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_varint32_size(uint32_t v)\n"
+    "{\n"
+    "  if (v < (1u << 7))\n"
+    "    return 1;\n"
+    "  if (v < (1u << 14))\n"
+    "    return 2;\n"
+    "  if (v < (1u << 21))\n"
+    "    return 3;\n"
+    "  if (v < (1u << 28))\n"
+    "    return 4;\n"
+    "  return 5;\n"
+    "}\n\n" },
+  { "varint_size",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_varint_size(uint64_t v)\n"
+    "{\n"
+    "  uint32_t hi = (uint32_t) (v >> 32);\n"
+    "\n"
+    "  if (hi == 0)\n"
+    "    return pbc_varint32_size((uint32_t) v);\n"
+    "  if (hi < (1u << 3))\n"
+    "    return 5;\n"
+    "  if (hi < (1u << 10))\n"
+    "    return 6;\n"
+    "  if (hi < (1u << 17))\n"
+    "    return 7;\n"
+    "  if (hi < (1u << 24))\n"
+    "    return 8;\n"
+    "  if (hi < (1u << 31))\n"
+    "    return 9;\n"
+    "  return 10;\n"
+    "}\n\n" },
+  { "int32_size",
+    "/* Negative values are sign-extended to ten bytes. */\n"
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_int32_size(int32_t v)\n"
+    "{\n"
+    "  return v < 0 ? 10 : pbc_varint32_size((uint32_t) v);\n"
+    "}\n\n" },
+  { "write_varint32",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_write_varint32(uint32_t v, uint8_t *out)\n"
+    "{\n"
+    "  size_t n = 0;\n"
+    "\n"
+    "  if (v >= 0x80) {\n"
+    "    out[n++] = (uint8_t) (v | 0x80);\n"
+    "    v >>= 7;\n"
+    "    if (v >= 0x80) {\n"
+    "      out[n++] = (uint8_t) (v | 0x80);\n"
+    "      v >>= 7;\n"
+    "      if (v >= 0x80) {\n"
+    "        out[n++] = (uint8_t) (v | 0x80);\n"
+    "        v >>= 7;\n"
+    "        if (v >= 0x80) {\n"
+    "          out[n++] = (uint8_t) (v | 0x80);\n"
+    "          v >>= 7;\n"
+    "        }\n"
+    "      }\n"
+    "    }\n"
+    "  }\n"
+    "  out[n++] = (uint8_t) v;\n"
+    "  return n;\n"
+    "}\n\n" },
+  { "write_varint",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_write_varint(uint64_t v, uint8_t *out)\n"
+    "{\n"
+    "  size_t n = 0;\n"
+    "\n"
+    "  if (v >> 32 == 0)\n"
+    "    return pbc_write_varint32((uint32_t) v, out);\n"
+    "  while (v >= 0x80) {\n"
+    "    out[n++] = (uint8_t) (v | 0x80);\n"
+    "    v >>= 7;\n"
+    "  }\n"
+    "  out[n++] = (uint8_t) v;\n"
+    "  return n;\n"
+    "}\n\n" },
+  { "write_int32",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_write_int32(int32_t v, uint8_t *out)\n"
+    "{\n"
+    "  uint32_t u = (uint32_t) v;\n"
+    "\n"
+    "  if (v >= 0)\n"
+    "    return pbc_write_varint32(u, out);\n"
+    "  out[0] = (uint8_t) (u | 0x80);\n"
+    "  out[1] = (uint8_t) ((u >> 7) | 0x80);\n"
+    "  out[2] = (uint8_t) ((u >> 14) | 0x80);\n"
+    "  out[3] = (uint8_t) ((u >> 21) | 0x80);\n"
+    "  out[4] = (uint8_t) ((u >> 28) | 0xf0);\n"
+    "  out[5] = out[6] = out[7] = out[8] = 0xff;\n"
+    "  out[9] = 0x01;\n"
+    "  return 10;\n"
+    "}\n\n" },
+  { "write_fixed32",
+    "static PROTOBUF_C__INLINE void\n"
+    "pbc_write_fixed32(uint32_t v, uint8_t *out)\n"
+    "{\n"
+    "  out[0] = (uint8_t) v;\n"
+    "  out[1] = (uint8_t) (v >> 8);\n"
+    "  out[2] = (uint8_t) (v >> 16);\n"
+    "  out[3] = (uint8_t) (v >> 24);\n"
+    "}\n\n" },
+  { "write_fixed64",
+    "static PROTOBUF_C__INLINE void\n"
+    "pbc_write_fixed64(uint64_t v, uint8_t *out)\n"
+    "{\n"
+    "  pbc_write_fixed32((uint32_t) v, out);\n"
+    "  pbc_write_fixed32((uint32_t) (v >> 32), out + 4);\n"
+    "}\n\n" },
+  { "to_zigzag32",
+    "static PROTOBUF_C__INLINE uint32_t\n"
+    "pbc_to_zigzag32(int32_t v)\n"
+    "{\n"
+    "  return ((uint32_t) v << 1) ^ (0u - ((uint32_t) v >> 31));\n"
+    "}\n\n" },
+  { "to_zigzag64",
+    "static PROTOBUF_C__INLINE uint64_t\n"
+    "pbc_to_zigzag64(int64_t v)\n"
+    "{\n"
+    "  return ((uint64_t) v << 1) ^ (0u - ((uint64_t) v >> 63));\n"
+    "}\n\n" },
+  { "float_bits",
+    "static PROTOBUF_C__INLINE uint32_t\n"
+    "pbc_float_bits(float f)\n"
+    "{\n"
+    "  union { uint32_t i; float f; } u;\n"
+    "  u.f = f;\n"
+    "  return u.i;\n"
+    "}\n\n" },
+  { "double_bits",
+    "static PROTOBUF_C__INLINE uint64_t\n"
+    "pbc_double_bits(double f)\n"
+    "{\n"
+    "  union { uint64_t i; double f; } u;\n"
+    "  u.f = f;\n"
+    "  return u.i;\n"
+    "}\n\n" },
+  { "string_size",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_string_size(const char *s)\n"
+    "{\n"
+    "  size_t len = s != NULL ? strlen(s) : 0;\n"
+    "  return pbc_varint_size(len) + len;\n"
+    "}\n\n" },
+  { "write_string",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_write_string(const char *s, uint8_t *out)\n"
+    "{\n"
+    "  size_t len = s != NULL ? strlen(s) : 0;\n"
+    "  size_t n = pbc_write_varint(len, out);\n"
+    "\n"
+    "  if (len != 0)\n"
+    "    memcpy(out + n, s, len);\n"
+    "  return n + len;\n"
+    "}\n\n" },
+  { "write_bytes",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_write_bytes(const ProtobufCBinaryData *bd, uint8_t *out)\n"
+    "{\n"
+    "  size_t n = pbc_write_varint(bd->len, out);\n"
+    "\n"
+    "  if (bd->len != 0)\n"
+    "    memcpy(out + n, bd->data, bd->len);\n"
+    "  return n + bd->len;\n"
+    "}\n\n" },
+  { "message_size",
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_message_size(const ProtobufCMessage *sub)\n"
+    "{\n"
+    "  size_t len = sub != NULL ? protobuf_c_message_get_packed_size(sub) : 0;\n"
+    "  return pbc_varint_size(len) + len;\n"
+    "}\n\n" },
+  { "write_message",
+    "/* Packed after a one-byte gap, and moved if its length needs more. */\n"
+    "static PROTOBUF_C__INLINE size_t\n"
+    "pbc_write_message(const ProtobufCMessage *sub, uint8_t *out)\n"
+    "{\n"
+    "  size_t len, n;\n"
+    "\n"
+    "  if (sub == NULL) {\n"
+    "    out[0] = 0;\n"
+    "    return 1;\n"
+    "  }\n"
+    "  len = protobuf_c_message_pack(sub, out + 1);\n"
+    "  n = pbc_varint_size(len);\n"
+    "  if (n != 1)\n"
+    "    memmove(out + n, out + 1, len);\n"
+    "  pbc_write_varint(len, out);\n"
+    "  return n + len;\n"
+    "}\n\n" },
+};
+
+static void CollectCodecHelpers(const Descriptor* descriptor,
+                                std::set<string>* used) {
+  for (int i = 0; i < descriptor->nested_type_count(); i++) {
+    CollectCodecHelpers(descriptor->nested_type(i), used);
+  }
+  if (!HasCodec(descriptor))
+    return;
+
+  used->insert("varint");
+  for (int i = 0; i < descriptor->field_count(); i++) {
+    const FieldDescriptor* field = descriptor->field(i);
+    bool repeated = field->label() == FieldDescriptor::LABEL_REPEATED;
+    if (repeated)
+      used->insert("reserve");
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_SINT32:
+        used->insert("zigzag32");
+        break;
+      case FieldDescriptor::TYPE_SINT64:
+        used->insert("zigzag64");
+        break;
+      case FieldDescriptor::TYPE_BOOL:
+        used->insert("bool");
+        break;
+      case FieldDescriptor::TYPE_FLOAT:
+        used->insert("float");
+        // fall through
+      case FieldDescriptor::TYPE_FIXED32:
+      case FieldDescriptor::TYPE_SFIXED32:
+        used->insert("fixed32");
+        break;
+      case FieldDescriptor::TYPE_DOUBLE:
+        used->insert("double");
+        // fall through
+      case FieldDescriptor::TYPE_FIXED64:
+      case FieldDescriptor::TYPE_SFIXED64:
+        used->insert("fixed64");
+        break;
+      case FieldDescriptor::TYPE_STRING:
+        used->insert("string");
+        break;
+      case FieldDescriptor::TYPE_BYTES:
+        used->insert("bytes");
+        break;
+      default:
+        break;
+    }
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_STRING:
+      case FieldDescriptor::TYPE_BYTES:
+      case FieldDescriptor::TYPE_MESSAGE:
+        used->insert("length");
+        break;
+      case FieldDescriptor::TYPE_FLOAT:
+      case FieldDescriptor::TYPE_FIXED32:
+      case FieldDescriptor::TYPE_SFIXED32:
+      case FieldDescriptor::TYPE_DOUBLE:
+      case FieldDescriptor::TYPE_FIXED64:
+      case FieldDescriptor::TYPE_SFIXED64:
+        // packed elements of a fixed size are counted from the length,
+        // and copied as they are on little-endian hosts
+        if (repeated) {
+          used->insert("length");
+          used->insert("little_endian");
+        }
+        break;
+      case FieldDescriptor::TYPE_BOOL:
+        // packed elements are single bytes
+        if (repeated)
+          used->insert("length");
+        break;
+      default:
+        // other packed elements are counted by their last bytes
+        if (repeated) {
+          used->insert("length");
+          used->insert("count_varints");
+        }
+        break;
+    }
+
+    // the encoder and size function
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_INT32:
+      case FieldDescriptor::TYPE_ENUM:
+        used->insert("int32_size");
+        used->insert("write_int32");
+        break;
+      case FieldDescriptor::TYPE_SINT32:
+        used->insert("to_zigzag32");
+        // fall through
+      case FieldDescriptor::TYPE_UINT32:
+        used->insert("varint32_size");
+        used->insert("write_varint32");
+        break;
+      case FieldDescriptor::TYPE_SINT64:
+        used->insert("to_zigzag64");
+        used->insert("varint_size");
+        used->insert("write_varint");
+        break;
+      case FieldDescriptor::TYPE_FLOAT:
+        used->insert("float_bits");
+        // fall through
+      case FieldDescriptor::TYPE_FIXED32:
+      case FieldDescriptor::TYPE_SFIXED32:
+        used->insert("write_fixed32");
+        break;
+      case FieldDescriptor::TYPE_DOUBLE:
+        used->insert("double_bits");
+        // fall through
+      case FieldDescriptor::TYPE_FIXED64:
+      case FieldDescriptor::TYPE_SFIXED64:
+        used->insert("write_fixed32");
+        used->insert("write_fixed64");
+        break;
+      case FieldDescriptor::TYPE_BOOL:
+        break;
+      case FieldDescriptor::TYPE_STRING:
+        used->insert("string_size");
+        used->insert("write_string");
+        used->insert("varint_size");
+        used->insert("write_varint");
+        break;
+      case FieldDescriptor::TYPE_BYTES:
+        used->insert("write_bytes");
+        used->insert("varint_size");
+        used->insert("write_varint");
+        break;
+      case FieldDescriptor::TYPE_MESSAGE:
+        used->insert("message_size");
+        used->insert("write_message");
+        used->insert("varint_size");
+        used->insert("write_varint");
+        break;
+      default:
+        used->insert("varint_size");
+        used->insert("write_varint");
+        break;
+    }
+    if (repeated && field->options().packed()) {
+      // the length of the packed elements
+      used->insert("varint_size");
+      used->insert("write_varint");
+    }
+  }
+
+  // helpers called by other helpers
+  if (used->count("varint_size") || used->count("int32_size"))
+    used->insert("varint32_size");
+  if (used->count("write_varint") || used->count("write_int32"))
+    used->insert("write_varint32");
+}
+
+// ===================================================================
+
 FileGenerator::FileGenerator(const FileDescriptor* file,
                              const string& dllexport_decl)
   : file_(file),
@@ -120,12 +712,9 @@ FileGenerator::~FileGenerator() {}
 void FileGenerator::GenerateHeader(io::Printer* printer) {
   string filename_identifier = FilenameIdentifier(file_->name());
 
-  int min_header_version = 1000000;
-#if defined(HAVE_PROTO3)
-  if (file_->syntax() == FileDescriptor::SYNTAX_PROTO3) {
-    min_header_version = 1003000;
-  }
-#endif
+  // Message descriptors carry a hot field table since 1.4.0, in place of
+  // the reserved members older headers declare.
+  int min_header_version = 1004000;
 
   // Generate top of header.
   printer->Print(
@@ -160,6 +749,9 @@ void FileGenerator::GenerateHeader(io::Printer* printer) {
     "protoc_version", SimpleItoa(PROTOBUF_C_VERSION_NUMBER));
 
   for (int i = 0; i < file_->dependency_count(); i++) {
+    // protobuf-c.proto only declares options for protoc-c itself
+    if (file_->dependency(i)->name() == "protobuf-c/protobuf-c.proto")
+      continue;
     printer->Print(
 	  "#include \"$pbc_file_prefix$$dependency$$pbc_file_postfix$.h\"\n",
       "pbc_file_prefix", PBC_FILE_PREFIX,
@@ -289,6 +881,21 @@ void FileGenerator::GenerateSource(io::Printer* printer) {
   }
 #endif
 
+  std::set<string> codec_helpers_used;
+  for (int i = 0; i < file_->message_type_count(); i++) {
+    CollectCodecHelpers(file_->message_type(i), &codec_helpers_used);
+  }
+  if (!codec_helpers_used.empty()) {
+    printer->Print("#include <string.h>\n"
+                   "\n"
+                   "/* --- codec helpers --- */\n"
+                   "\n");
+    for (size_t i = 0; i < sizeof(codec_helpers) / sizeof(codec_helpers[0]); i++) {
+      if (codec_helpers_used.count(codec_helpers[i].name))
+        printer->Print(codec_helpers[i].code);
+    }
+  }
+
   for (int i = 0; i < file_->message_type_count(); i++) {
     message_generators_[i]->GenerateHelperFunctionDefinitions(printer, false);
   }
@@ -60,6 +60,7 @@
 
 // Modified to implement C code by Dave Benson.
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <set>
@@ -68,6 +69,8 @@
 
 #include <protoc-c/c_helpers.h>
 #include <google/protobuf/stubs/common.h>
+#include <google/protobuf/unknown_field_set.h>
+#include <google/protobuf/descriptor.pb.h>
 
 namespace google {
 namespace protobuf {
@@ -567,6 +570,198 @@ string CEscape(const string& src) {
   return string(dest.get(), len);
 }
 
+// Extension number of (pb_c_field) in protobuf-c/protobuf-c.proto.
+static const int kPbcFieldOptions = 1053;
+
+// Packed sizes above this are treated as unbounded, which also keeps the
+// arithmetic below from overflowing.
+static const uint64 kMaxPackedSizeLimit = 0xffffffffu;
+
+bool GetFieldOption(const FieldDescriptor* field, int number, uint64* value) {
+  // protoc-c is not linked against code generated from protobuf-c.proto, so
+  // the extension shows up among the unknown fields of the options.
+  const FieldOptions& options = field->options();
+  const UnknownFieldSet& unknown =
+    options.GetReflection()->GetUnknownFields(options);
+  bool found = false;
+
+  for (int i = 0; i < unknown.field_count(); i++) {
+    const UnknownField& ext = unknown.field(i);
+    UnknownFieldSet pb_c_field;
+
+    if (ext.number() != kPbcFieldOptions ||
+        ext.type() != UnknownField::TYPE_LENGTH_DELIMITED ||
+        !pb_c_field.ParseFromString(ext.length_delimited()))
+      continue;
+    for (int j = 0; j < pb_c_field.field_count(); j++) {
+      const UnknownField& opt = pb_c_field.field(j);
+      if (opt.number() == number && opt.type() == UnknownField::TYPE_VARINT) {
+        *value = opt.varint();
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+static uint64 VarintSize(uint64 value) {
+  uint64 size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+static bool GetMaxPackedSize(const Descriptor* descriptor,
+                             std::set<const Descriptor*>* active,
+                             uint64* size);
+
+// Largest encoding of a single value of the field, without its tag.
+static bool GetMaxValueSize(const FieldDescriptor* field,
+                            std::set<const Descriptor*>* active,
+                            uint64* size) {
+  uint64 len;
+
+  switch (field->type()) {
+  case FieldDescriptor::TYPE_SINT32:
+  case FieldDescriptor::TYPE_UINT32:
+    *size = 5;
+    return true;
+  case FieldDescriptor::TYPE_INT32:
+  case FieldDescriptor::TYPE_ENUM:
+    // negative values are sign-extended to 64 bits
+  case FieldDescriptor::TYPE_INT64:
+  case FieldDescriptor::TYPE_SINT64:
+  case FieldDescriptor::TYPE_UINT64:
+    *size = 10;
+    return true;
+  case FieldDescriptor::TYPE_FIXED32:
+  case FieldDescriptor::TYPE_SFIXED32:
+  case FieldDescriptor::TYPE_FLOAT:
+    *size = 4;
+    return true;
+  case FieldDescriptor::TYPE_FIXED64:
+  case FieldDescriptor::TYPE_SFIXED64:
+  case FieldDescriptor::TYPE_DOUBLE:
+    *size = 8;
+    return true;
+  case FieldDescriptor::TYPE_BOOL:
+    *size = 1;
+    return true;
+  case FieldDescriptor::TYPE_STRING:
+  case FieldDescriptor::TYPE_BYTES:
+    if (!GetFieldOption(field, kPbcFieldMaxLength, &len) ||
+        len > kMaxPackedSizeLimit)
+      return false;
+    *size = VarintSize(len) + len;
+    return true;
+  case FieldDescriptor::TYPE_MESSAGE:
+    if (!GetMaxPackedSize(field->message_type(), active, &len))
+      return false;
+    *size = VarintSize(len) + len;
+    return true;
+  default:
+    // groups are not supported
+    return false;
+  }
+}
+
+// Largest encoding of the field, tags included.
+static bool GetMaxFieldSize(const FieldDescriptor* field,
+                            std::set<const Descriptor*>* active,
+                            uint64* size) {
+  uint64 tag_size = VarintSize((uint64) field->number() << 3);
+  uint64 value_size;
+  uint64 count;
+
+  if (!GetMaxValueSize(field, active, &value_size))
+    return false;
+  if (field->label() != FieldDescriptor::LABEL_REPEATED) {
+    *size = tag_size + value_size;
+    return true;
+  }
+  if (!GetFieldOption(field, kPbcFieldMaxCount, &count))
+    return false;
+  if (count == 0) {
+    *size = 0;
+    return true;
+  }
+  if (field->is_packable() && field->options().packed()) {
+    if (value_size > kMaxPackedSizeLimit / count)
+      return false;
+    *size = tag_size + VarintSize(count * value_size) + count * value_size;
+  } else {
+    if (tag_size + value_size > kMaxPackedSizeLimit / count)
+      return false;
+    *size = count * (tag_size + value_size);
+  }
+  return true;
+}
+
+static bool GetMaxPackedSize(const Descriptor* descriptor,
+                             std::set<const Descriptor*>* active,
+                             uint64* size) {
+  uint64 total = 0;
+
+  if (!active->insert(descriptor).second)
+    return false;  // recursive message
+  for (int i = 0; i < descriptor->field_count(); i++) {
+    const FieldDescriptor* field = descriptor->field(i);
+    const OneofDescriptor* oneof = field->containing_oneof();
+    uint64 field_size;
+
+    if (oneof != NULL) {
+      // only one member of a oneof is packed: count the largest, once
+      if (oneof->field(0) != field)
+        continue;
+      field_size = 0;
+      for (int j = 0; j < oneof->field_count(); j++) {
+        uint64 member_size;
+        if (!GetMaxFieldSize(oneof->field(j), active, &member_size)) {
+          active->erase(descriptor);
+          return false;
+        }
+        field_size = std::max(field_size, member_size);
+      }
+    } else if (!GetMaxFieldSize(field, active, &field_size)) {
+      active->erase(descriptor);
+      return false;
+    }
+    total += field_size;
+    if (total > kMaxPackedSizeLimit) {
+      active->erase(descriptor);
+      return false;
+    }
+  }
+  active->erase(descriptor);
+  *size = total;
+  return true;
+}
+
+bool GetMaxPackedSize(const Descriptor* descriptor, uint64* size) {
+  std::set<const Descriptor*> active;
+  return GetMaxPackedSize(descriptor, &active, size);
+}
+
+bool HasCodec(const Descriptor* descriptor) {
+  const FileOptions& options = descriptor->file()->options();
+  if (!options.has_optimize_for() ||
+      options.optimize_for() != FileOptions_OptimizeMode_SPEED)
+    return false;
+  if (descriptor->field_count() == 0)
+    return false;
+  int n_required = 0;
+  for (int i = 0; i < descriptor->field_count(); i++) {
+    const FieldDescriptor* field = descriptor->field(i);
+    if (field->type() == FieldDescriptor::TYPE_GROUP)
+      return false;
+    if (field->label() == FieldDescriptor::LABEL_REQUIRED)
+      n_required++;
+  }
+  return n_required <= 64;
+}
+
 }  // namespace c
 }  // namespace compiler
 }  // namespace protobuf
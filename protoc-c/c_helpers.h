@@ -168,6 +168,26 @@ string GlobalBuildDescriptorsName(const string& filename);
 string GetLabelName(FieldDescriptor::Label label);
 
 
+// Look up an option of the (pb_c_field) extension declared in
+// protobuf-c/protobuf-c.proto, e.g. kPbcFieldMaxLength.  Returns false if the
+// field does not set it.
+bool GetFieldOption(const FieldDescriptor* field, int number, uint64* value);
+
+// Field numbers within ProtobufCFieldOptions.
+const int kPbcFieldMaxLength = 2;
+const int kPbcFieldMaxCount = 3;
+
+// Compute the largest number of bytes a message of this type can pack to,
+// not counting unknown fields.  Returns false if there is no such bound: the
+// message, or one it contains, has a string, bytes or repeated field without
+// a max_length or max_count option, or is recursive.
+bool GetMaxPackedSize(const Descriptor* descriptor, uint64* size);
+
+// Return true if a ProtobufCMessageCodec is generated for the message: its
+// file sets optimize_for = SPEED, and it has at least one field, no group
+// fields and at most 64 required fields.
+bool HasCodec(const Descriptor* descriptor);
+
 // write IntRanges entries for a bunch of sorted values.
 // returns the number of ranges there are to bsearch.
 unsigned WriteIntRanges(io::Printer* printer, int n_values, const int *values, const string &name);
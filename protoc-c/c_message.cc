@@ -65,6 +65,7 @@
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <vector>
 #include <protoc-c/c_message.h>
 #include <protoc-c/c_enum.h>
 #include <protoc-c/c_extension.h>
@@ -279,6 +280,13 @@ GenerateStructDefinition(io::Printer* printer) {
   printer->Print(vars, "#define $ucclassname$_DEL(m) free(*m);*m=NULL\n");
 #endif
 
+  // bounded messages can be packed into a fixed-size buffer
+  uint64 max_packed_size;
+  if (GetMaxPackedSize(descriptor_, &max_packed_size)) {
+    vars["max_packed_size"] = SimpleItoa(max_packed_size);
+    printer->Print(vars, "#define $ucclassname$_MAX_PACKED_SIZE $max_packed_size$\n");
+  }
+
   printer->Print(vars, "#define $ucclassname$_TYPE_NAME ((char*)$lcclassname$_descriptor.name)\n\n\n");
 }
 
@@ -307,6 +315,8 @@ GenerateHelperFunctionDeclarations(io::Printer* printer, bool is_submessage)
 		 "size_t $lcclassname$_pack_to_buffer(const $classname$   *message, ProtobufCBuffer *buffer);\n"
 		 "$classname$ *$lcclassname$_unpack(ProtobufCAllocator  *allocator, size_t len, const uint8_t *data);\n"
 		 "void   $lcclassname$_free_unpacked($classname$ *message, ProtobufCAllocator *allocator);\n"
+		 "protobuf_c_boolean $lcclassname$_unpack_into($classname$ *message, ProtobufCAllocator *allocator, size_t len, const uint8_t *data);\n"
+		 "void   $lcclassname$_clear($classname$ *message, ProtobufCAllocator *allocator);\n"
 		);
   }
 }
@@ -410,10 +420,806 @@ GenerateHelperFunctionDefinitions(io::Printer* printer, bool is_submessage)
 		 "  assert(message->base.descriptor == &$lcclassname$_descriptor);\n"
 		 "  protobuf_c_message_free_unpacked ((ProtobufCMessage*)message, allocator);\n"
 		 "}\n\n"
+		 "protobuf_c_boolean $lcclassname$_unpack_into($classname$_t *message, ProtobufCAllocator *allocator, size_t len, const uint8_t *data)\n"
+		 "{\n"
+		 "  assert(message->base.descriptor == &$lcclassname$_descriptor);\n"
+		 "  return protobuf_c_message_unpack_into ((ProtobufCMessage*)message, allocator, len, data);\n"
+		 "}\n\n"
+		 "void $lcclassname$_clear($classname$_t *message, ProtobufCAllocator *allocator)\n"
+		 "{\n"
+		 "  assert(message->base.descriptor == &$lcclassname$_descriptor);\n"
+		 "  protobuf_c_message_clear ((ProtobufCMessage*)message, allocator);\n"
+		 "}\n\n"
 		);
   }
 }
 
+// The statements writing a field's tag, which is a constant of the schema.
+static string TagWriteCode(uint32 number, int wire_type, int *size) {
+  uint64 v = (uint64) number << 3 | wire_type;
+  string bytes;
+  int n = 0;
+  do {
+    char buf[8];
+    snprintf(buf, sizeof(buf), "\\x%02x",
+             (unsigned) ((v & 0x7f) | (v >= 0x80 ? 0x80 : 0)));
+    bytes += buf;
+    v >>= 7;
+    n++;
+  } while (v != 0);
+  *size = n;
+  if (n == 1)
+    return "*at++ = 0" + bytes.substr(1) + ";\n";
+  return "memcpy(at, \"" + bytes + "\", " + SimpleItoa(n) + ");\n"
+         "at += " + SimpleItoa(n) + ";\n";
+}
+
+// How the generated encoder writes one value `value` of a field's type:
+// the expression giving its size, or its constant size in `fixed_size`,
+// and the statements writing it at `at`.
+static void ValueWriteCode(const FieldDescriptor *field, const string &value,
+                           string *size, int *fixed_size, string *write) {
+  string varint;
+  *fixed_size = 0;
+  switch (field->type()) {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_ENUM:
+      *size = "pbc_int32_size(" + value + ")";
+      *write = "at += pbc_write_int32(" + value + ", at);\n";
+      return;
+    case FieldDescriptor::TYPE_UINT32:
+      *size = "pbc_varint32_size(" + value + ")";
+      *write = "at += pbc_write_varint32(" + value + ", at);\n";
+      return;
+    case FieldDescriptor::TYPE_SINT32:
+      *size = "pbc_varint32_size(pbc_to_zigzag32(" + value + "))";
+      *write = "at += pbc_write_varint32(pbc_to_zigzag32(" + value + "), at);\n";
+      return;
+    case FieldDescriptor::TYPE_INT64:
+      varint = "(uint64_t) " + value;
+      break;
+    case FieldDescriptor::TYPE_UINT64:
+      varint = value;
+      break;
+    case FieldDescriptor::TYPE_SINT64:
+      varint = "pbc_to_zigzag64(" + value + ")";
+      break;
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_SFIXED32:
+    case FieldDescriptor::TYPE_FLOAT:
+      *fixed_size = 4;
+      if (field->type() == FieldDescriptor::TYPE_FLOAT)
+        *write = "pbc_write_fixed32(pbc_float_bits(" + value + "), at);\n";
+      else if (field->type() == FieldDescriptor::TYPE_SFIXED32)
+        *write = "pbc_write_fixed32((uint32_t) " + value + ", at);\n";
+      else
+        *write = "pbc_write_fixed32(" + value + ", at);\n";
+      *write += "at += 4;\n";
+      return;
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+    case FieldDescriptor::TYPE_DOUBLE:
+      *fixed_size = 8;
+      if (field->type() == FieldDescriptor::TYPE_DOUBLE)
+        *write = "pbc_write_fixed64(pbc_double_bits(" + value + "), at);\n";
+      else if (field->type() == FieldDescriptor::TYPE_SFIXED64)
+        *write = "pbc_write_fixed64((uint64_t) " + value + ", at);\n";
+      else
+        *write = "pbc_write_fixed64(" + value + ", at);\n";
+      *write += "at += 8;\n";
+      return;
+    case FieldDescriptor::TYPE_BOOL:
+      *fixed_size = 1;
+      *write = "*at++ = " + value + " ? 1 : 0;\n";
+      return;
+    case FieldDescriptor::TYPE_STRING:
+      *size = "pbc_string_size(" + value + ")";
+      *write = "at += pbc_write_string(" + value + ", at);\n";
+      return;
+    case FieldDescriptor::TYPE_BYTES:
+      *size = "pbc_varint_size(" + value + ".len) + " + value + ".len";
+      *write = "at += pbc_write_bytes(&" + value + ", at);\n";
+      return;
+    case FieldDescriptor::TYPE_MESSAGE:
+      *size = "pbc_message_size((const ProtobufCMessage *) " + value + ")";
+      *write = "at += pbc_write_message((const ProtobufCMessage *) " + value + ", at);\n";
+      return;
+    default:
+      break;
+  }
+  *size = "pbc_varint_size(" + varint + ")";
+  *write = "at += pbc_write_varint(" + varint + ", at);\n";
+}
+
+// Write a decoder specialised to this message, used by
+// protobuf_c_message_unpack() through the descriptor's codec.  It decodes
+// fields straight into the structure, and gives up on anything the
+// table-driven code handles differently: unknown fields, a singular string,
+// bytes or message field occurring twice, or a second member of a oneof.
+// Malformed input makes it give up too, leaving the table-driven code to
+// report the error.
+void MessageGenerator::GenerateCodec(io::Printer* printer) {
+  std::map<string, string> vars;
+  vars["classname"] = PkgClassNameToLower();
+  vars["lcclassname"] = PkgClassNameToLower();
+
+  const FieldDescriptor **sorted_fields = new const FieldDescriptor *[descriptor_->field_count()];
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    sorted_fields[i] = descriptor_->field(i);
+  }
+  qsort (sorted_fields, descriptor_->field_count(),
+       sizeof (const FieldDescriptor *),
+       compare_pfields_by_number);
+
+  bool need_len = false, need_stop = false, need_array = false;
+  int n_required = 0;
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    const FieldDescriptor *field = sorted_fields[i];
+    bool packable = field->type() != FieldDescriptor::TYPE_STRING
+                 && field->type() != FieldDescriptor::TYPE_BYTES
+                 && field->type() != FieldDescriptor::TYPE_MESSAGE;
+    if (!packable)
+      need_len = true;
+    if (field->label() == FieldDescriptor::LABEL_REPEATED) {
+      need_array = true;
+      if (packable)
+        need_len = need_stop = true;
+    }
+    if (field->label() == FieldDescriptor::LABEL_REQUIRED)
+      n_required++;
+  }
+
+  printer->Print(vars,
+      "static protobuf_c_boolean\n"
+      "$lcclassname$_decode(ProtobufCMessage *message,\n"
+      "    ProtobufCAllocator *allocator, size_t len, const uint8_t *data)\n"
+      "{\n");
+  printer->Indent();
+  printer->Print(vars,
+      "$classname$_t *m = ($classname$_t *) message;\n"
+      "const uint8_t *at = data;\n"
+      "const uint8_t *end = data + len;\n");
+  if (need_stop)
+    printer->Print("const uint8_t *stop;\n"
+                   "size_t i;\n");
+  printer->Print("uint32_t tag;\n"
+                 "uint64_t v;\n");
+  if (need_len)
+    printer->Print("size_t n;\n");
+  if (need_array)
+    printer->Print("void *a;\n");
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    const FieldDescriptor *field = sorted_fields[i];
+    if (field->label() == FieldDescriptor::LABEL_REPEATED)
+      printer->Print("size_t $name$_alloced = 0;\n",
+                     "name", FieldName(field));
+  }
+  if (n_required > 0)
+    printer->Print("uint64_t required = 0;\n");
+  // only strings, bytes, submessages and repeated fields allocate
+  if (!need_len && !need_array)
+    printer->Print("\n"
+                   "(void) allocator;\n");
+  printer->Print("\n"
+                 "while (at < end) {\n"
+                 "  if (*at < 0x80) {\n"
+                 "    tag = *at++;\n"
+                 "  } else {\n"
+                 "    at = pbc_read_varint(at, end, &v);\n"
+                 "    if (at == NULL || v > 0xffffffffu)\n"
+                 "      return 0;\n"
+                 "    tag = (uint32_t) v;\n"
+                 "  }\n"
+                 "  switch (tag) {\n");
+  printer->Indent();
+
+  int required_bit = 0;
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    const FieldDescriptor *field = sorted_fields[i];
+    const OneofDescriptor *oneof = field->containing_oneof();
+    std::map<string, string> fvars;
+    uint32 number = field->number();
+    int wire_type = 0;
+    fvars["name"] = FieldName(field);
+    fvars["proto_name"] = field->name();
+    fvars["number"] = SimpleItoa(field->number());
+    if (oneof != NULL)
+      fvars["oneofname"] = FullNameToLower(oneof->name());
+
+    // reading a scalar value into v, and converting it to the member's type
+    string read, value;
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_INT32:
+      case FieldDescriptor::TYPE_SFIXED32:
+      case FieldDescriptor::TYPE_ENUM:
+        value = "(int32_t) v";
+        break;
+      case FieldDescriptor::TYPE_UINT32:
+      case FieldDescriptor::TYPE_FIXED32:
+        value = "(uint32_t) v";
+        break;
+      case FieldDescriptor::TYPE_INT64:
+      case FieldDescriptor::TYPE_SFIXED64:
+        value = "(int64_t) v";
+        break;
+      case FieldDescriptor::TYPE_UINT64:
+      case FieldDescriptor::TYPE_FIXED64:
+        value = "v";
+        break;
+      case FieldDescriptor::TYPE_SINT32: value = "pbc_zigzag32(v)"; break;
+      case FieldDescriptor::TYPE_SINT64: value = "pbc_zigzag64(v)"; break;
+      case FieldDescriptor::TYPE_FLOAT:  value = "pbc_float(v)"; break;
+      case FieldDescriptor::TYPE_DOUBLE: value = "pbc_double(v)"; break;
+      case FieldDescriptor::TYPE_BOOL:   value = "(protobuf_c_boolean) v"; break;
+      default: break;
+    }
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_FLOAT:
+      case FieldDescriptor::TYPE_FIXED32:
+      case FieldDescriptor::TYPE_SFIXED32:
+        read = "pbc_read_fixed32";
+        wire_type = 5;
+        break;
+      case FieldDescriptor::TYPE_DOUBLE:
+      case FieldDescriptor::TYPE_FIXED64:
+      case FieldDescriptor::TYPE_SFIXED64:
+        read = "pbc_read_fixed64";
+        wire_type = 1;
+        break;
+      case FieldDescriptor::TYPE_BOOL:
+        read = "pbc_read_bool";
+        break;
+      case FieldDescriptor::TYPE_STRING:
+      case FieldDescriptor::TYPE_BYTES:
+      case FieldDescriptor::TYPE_MESSAGE:
+        wire_type = 2;
+        break;
+      default:
+        read = "pbc_read_varint";
+        break;
+    }
+    fvars["read"] = read;
+    fvars["value"] = value;
+    fvars["tag"] = SimpleItoa(number << 3 | wire_type) + "u";
+    fvars["packed_tag"] = SimpleItoa(number << 3 | 2) + "u";
+    if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+      string full_name = field->message_type()->full_name();
+      string classname = full_name.substr(0, full_name.find("."));
+      fvars["type"] = ToLower(classname + string("_") + CamelToLower(field->message_type()->name()));
+    }
+
+    // what the table-driven code would do differently for a field seen
+    // before, and what marks a field as set
+    string seen, mark;
+    if (field->label() == FieldDescriptor::LABEL_REQUIRED) {
+      fvars["bit"] = SimpleItoa((uint64) 1 << required_bit++) + "ull";
+      if (field->type() == FieldDescriptor::TYPE_STRING ||
+          field->type() == FieldDescriptor::TYPE_BYTES ||
+          field->type() == FieldDescriptor::TYPE_MESSAGE)
+        seen = "(required & $bit$) != 0";
+      mark = "required |= $bit$;\n";
+    } else if (oneof != NULL) {
+      seen = "m->$oneofname$_case != 0";
+      mark = "m->$oneofname$_case = $number$;\n";
+    } else if (field->label() == FieldDescriptor::LABEL_OPTIONAL) {
+      bool has = FieldSyntax(field) == 2;
+      switch (field->type()) {
+        case FieldDescriptor::TYPE_STRING:
+          if (field->has_default_value())
+            fvars["init"] = field_generators_.get(field).GetDefaultValue();
+          else if (has)
+            fvars["init"] = "NULL";
+          else
+            fvars["init"] = "(char *) protobuf_c_empty_string";
+          seen = "m->$name$ != $init$";
+          break;
+        case FieldDescriptor::TYPE_BYTES:
+          seen = has ? "m->has_$name$" : "m->$name$.data != NULL";
+          break;
+        case FieldDescriptor::TYPE_MESSAGE:
+          seen = "m->$name$ != NULL";
+          break;
+        default:
+          break;
+      }
+      if (has && field->type() != FieldDescriptor::TYPE_STRING &&
+          field->type() != FieldDescriptor::TYPE_MESSAGE)
+        mark = "m->has_$name$ = 1;\n";
+    }
+
+    if (field->label() == FieldDescriptor::LABEL_REPEATED) {
+      string grow =
+          "if (m->n_$name$ == $name$_alloced) {\n"
+          "  a = m->$name$;\n"
+          "  if (!pbc_reserve(allocator, &a, m->n_$name$, &$name$_alloced,\n"
+          "                   1, sizeof *m->$name$))\n"
+          "    return 0;\n"
+          "  m->$name$ = a;\n"
+          "}\n";
+      switch (field->type()) {
+        case FieldDescriptor::TYPE_STRING:
+          printer->Print(fvars, "case $tag$:  /* $proto_name$ */\n");
+          printer->Indent();
+          printer->Print(fvars,
+              "if ((at = pbc_read_length(at, end, &n)) == NULL)\n"
+              "  return 0;\n");
+          printer->Print(fvars, grow.c_str());
+          printer->Print(fvars,
+              "if ((m->$name$[m->n_$name$] = pbc_read_string(allocator, at, n)) == NULL)\n"
+              "  return 0;\n"
+              "m->n_$name$++;\n"
+              "at += n;\n"
+              "break;\n");
+          printer->Outdent();
+          break;
+        case FieldDescriptor::TYPE_BYTES:
+          printer->Print(fvars, "case $tag$:  /* $proto_name$ */\n");
+          printer->Indent();
+          printer->Print(fvars,
+              "if ((at = pbc_read_length(at, end, &n)) == NULL)\n"
+              "  return 0;\n");
+          printer->Print(fvars, grow.c_str());
+          printer->Print(fvars,
+              "if (!pbc_read_bytes(allocator, &m->$name$[m->n_$name$], at, n))\n"
+              "  return 0;\n"
+              "m->n_$name$++;\n"
+              "at += n;\n"
+              "break;\n");
+          printer->Outdent();
+          break;
+        case FieldDescriptor::TYPE_MESSAGE:
+          printer->Print(fvars, "case $tag$:  /* $proto_name$ */\n");
+          printer->Indent();
+          printer->Print(fvars,
+              "if ((at = pbc_read_length(at, end, &n)) == NULL)\n"
+              "  return 0;\n");
+          printer->Print(fvars, grow.c_str());
+          printer->Print(fvars,
+              "m->$name$[m->n_$name$] = ($type$_t *)\n"
+              "  protobuf_c_message_unpack(&$type$_descriptor, allocator, n, at);\n"
+              "if (m->$name$[m->n_$name$] == NULL)\n"
+              "  return 0;\n"
+              "m->n_$name$++;\n"
+              "at += n;\n"
+              "break;\n");
+          printer->Outdent();
+          break;
+        default:
+          // both the packed and the unpacked encoding are accepted
+          printer->Print(fvars, "case $tag$:  /* $proto_name$ */\n");
+          printer->Indent();
+          printer->Print(fvars,
+              "if ((at = $read$(at, end, &v)) == NULL)\n"
+              "  return 0;\n");
+          printer->Print(fvars, grow.c_str());
+          printer->Print(fvars,
+              "m->$name$[m->n_$name$++] = $value$;\n"
+              "break;\n");
+          printer->Outdent();
+          printer->Print(fvars, "case $packed_tag$:  /* $proto_name$, packed */\n");
+          printer->Indent();
+          printer->Print(fvars,
+              "if ((at = pbc_read_length(at, end, &n)) == NULL)\n"
+              "  return 0;\n");
+          if (wire_type == 5)
+            fvars["count"] = "n / 4";
+          else if (wire_type == 1)
+            fvars["count"] = "n / 8";
+          else if (field->type() == FieldDescriptor::TYPE_BOOL)
+            fvars["count"] = "n";
+          else
+            fvars["count"] = "pbc_count_varints(at, n)";
+          if (wire_type != 0) {
+            fvars["size"] = wire_type == 5 ? "4" : "8";
+            printer->Print(fvars,
+                "if (n % $size$ != 0)\n"
+                "  return 0;\n");
+          }
+          printer->Print(fvars,
+              "a = m->$name$;\n"
+              "if (!pbc_reserve(allocator, &a, m->n_$name$, &$name$_alloced,\n"
+              "                 $count$, sizeof *m->$name$))\n"
+              "  return 0;\n"
+              "m->$name$ = a;\n");
+          if (wire_type != 0)
+            printer->Print(fvars,
+                "if (pbc_little_endian() && n != 0) {\n"
+                "  memcpy(m->$name$ + m->n_$name$, at, n);\n"
+                "  m->n_$name$ += n / $size$;\n"
+                "  at += n;\n"
+                "  break;\n"
+                "}\n");
+          // the count is kept in a local while decoding: the elements
+          // need no freeing, so it can be left behind on failure
+          if (field->type() == FieldDescriptor::TYPE_BOOL)
+            // like the table-driven code, only accept one-byte values
+            printer->Print(fvars,
+                "i = m->n_$name$;\n"
+                "for (stop = at + n; at < stop; at++) {\n"
+                "  if (*at > 1)\n"
+                "    return 0;\n"
+                "  m->$name$[i++] = *at;\n"
+                "}\n"
+                "m->n_$name$ = i;\n"
+                "break;\n");
+          else
+            printer->Print(fvars,
+                "i = m->n_$name$;\n"
+                "for (stop = at + n; at < stop; ) {\n"
+                "  if ((at = $read$(at, stop, &v)) == NULL)\n"
+                "    return 0;\n"
+                "  m->$name$[i++] = $value$;\n"
+                "}\n"
+                "m->n_$name$ = i;\n"
+                "break;\n");
+          printer->Outdent();
+          break;
+      }
+      continue;
+    }
+
+    printer->Print(fvars, "case $tag$:  /* $proto_name$ */\n");
+    printer->Indent();
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_STRING:
+        printer->Print(fvars, ("if ((at = pbc_read_length(at, end, &n)) == NULL || " + seen + ")\n"
+            "  return 0;\n").c_str());
+        printer->Print(fvars,
+            "if ((m->$name$ = pbc_read_string(allocator, at, n)) == NULL)\n"
+            "  return 0;\n"
+            "at += n;\n");
+        break;
+      case FieldDescriptor::TYPE_BYTES:
+        printer->Print(fvars, ("if ((at = pbc_read_length(at, end, &n)) == NULL || " + seen + ")\n"
+            "  return 0;\n").c_str());
+        printer->Print(fvars,
+            "if (!pbc_read_bytes(allocator, &m->$name$, at, n))\n"
+            "  return 0;\n"
+            "at += n;\n");
+        break;
+      case FieldDescriptor::TYPE_MESSAGE:
+        printer->Print(fvars, ("if ((at = pbc_read_length(at, end, &n)) == NULL || " + seen + ")\n"
+            "  return 0;\n").c_str());
+        printer->Print(fvars,
+            "m->$name$ = ($type$_t *)\n"
+            "  protobuf_c_message_unpack(&$type$_descriptor, allocator, n, at);\n"
+            "if (m->$name$ == NULL)\n"
+            "  return 0;\n"
+            "at += n;\n");
+        break;
+      default:
+        if (oneof != NULL)
+          printer->Print(fvars, ("if ((at = $read$(at, end, &v)) == NULL || " + seen + ")\n"
+              "  return 0;\n").c_str());
+        else
+          printer->Print(fvars,
+              "if ((at = $read$(at, end, &v)) == NULL)\n"
+              "  return 0;\n");
+        printer->Print(fvars, "m->$name$ = $value$;\n");
+        break;
+    }
+    printer->Print(fvars, mark.c_str());
+    printer->Print("break;\n");
+    printer->Outdent();
+  }
+
+  printer->Print("default:\n"
+                 "  return 0;\n");
+  printer->Outdent();
+  printer->Print("  }\n"
+                 "}\n");
+  if (n_required > 0) {
+    vars["all_required"] = SimpleItoa(n_required == 64 ? ~(uint64) 0
+                                      : ((uint64) 1 << n_required) - 1) + "ull";
+    printer->Print(vars, "return required == $all_required$;\n");
+  } else {
+    printer->Print("return 1;\n");
+  }
+  printer->Outdent();
+  printer->Print("}\n");
+
+  GenerateEncoder(printer, sorted_fields);
+  delete [] sorted_fields;
+
+  printer->Print(vars,
+      "static const ProtobufCMessageCodec $lcclassname$_codec = {\n"
+      "  $lcclassname$_decode,\n"
+      "  $lcclassname$_encoded_size,\n"
+      "  $lcclassname$_encode\n"
+      "};\n");
+}
+
+// Write the size function and the encoder used by
+// protobuf_c_message_get_packed_size() and protobuf_c_message_pack() through
+// the descriptor's codec.  They give the same bytes as the table-driven code:
+// fields in number order, each checked for presence as it would be there.
+// Tags are written as constants, and required fields of a fixed size add up
+// to a constant size.
+void MessageGenerator::GenerateEncoder(io::Printer* printer,
+                                       const FieldDescriptor **sorted_fields) {
+  std::map<string, string> vars;
+  vars["classname"] = PkgClassNameToLower();
+  vars["lcclassname"] = PkgClassNameToLower();
+
+  struct EncodedField {
+    const FieldDescriptor *field;
+    string name;
+    string present;     // condition for writing a singular field
+    string tag;         // statements writing the tag
+    int tag_size;
+    string size;        // size of a value, if not constant
+    int fixed_size;     // constant size of a value, or 0
+    string write;       // statements writing a value
+    bool packed;
+  };
+  std::vector<EncodedField> fields(descriptor_->field_count());
+  int const_size = 0;
+  bool size_constant = true;
+  bool size_i = false, size_n = false, encode_i = false, encode_n = false;
+  bool encode_varints = false;
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    const FieldDescriptor *field = sorted_fields[i];
+    const OneofDescriptor *oneof = field->containing_oneof();
+    EncodedField &ef = fields[i];
+    bool repeated = field->label() == FieldDescriptor::LABEL_REPEATED;
+    int wire_type = 0;
+
+    ef.field = field;
+    ef.name = FieldName(field);
+    ValueWriteCode(field, repeated ? "m->" + ef.name + "[i]" : "m->" + ef.name,
+                   &ef.size, &ef.fixed_size, &ef.write);
+    switch (field->type()) {
+      case FieldDescriptor::TYPE_FIXED32:
+      case FieldDescriptor::TYPE_SFIXED32:
+      case FieldDescriptor::TYPE_FLOAT:
+        wire_type = 5;
+        break;
+      case FieldDescriptor::TYPE_FIXED64:
+      case FieldDescriptor::TYPE_SFIXED64:
+      case FieldDescriptor::TYPE_DOUBLE:
+        wire_type = 1;
+        break;
+      case FieldDescriptor::TYPE_STRING:
+      case FieldDescriptor::TYPE_BYTES:
+      case FieldDescriptor::TYPE_MESSAGE:
+        wire_type = 2;
+        break;
+      default:
+        break;
+    }
+    ef.packed = repeated && wire_type != 2 && field->options().packed();
+    ef.tag = TagWriteCode(field->number(), ef.packed ? 2 : wire_type,
+                          &ef.tag_size);
+
+    // string and message pointers are left out when NULL or the default
+    string pointer_set;
+    if (field->type() == FieldDescriptor::TYPE_STRING) {
+      pointer_set = " && m->" + ef.name + " != NULL";
+      if (field->has_default_value())
+        pointer_set += " && m->" + ef.name + " != " +
+                       field_generators_.get(field).GetDefaultValue();
+      else if (FieldSyntax(field) == 3)
+        pointer_set += " && m->" + ef.name + " != protobuf_c_empty_string";
+    } else if (field->type() == FieldDescriptor::TYPE_MESSAGE) {
+      pointer_set = " && m->" + ef.name + " != NULL";
+    }
+    if (repeated || field->label() == FieldDescriptor::LABEL_REQUIRED) {
+      // always written
+    } else if (oneof != NULL) {
+      ef.present = "m->" + FullNameToLower(oneof->name()) + "_case == " +
+                   SimpleItoa(field->number()) + pointer_set;
+    } else if (FieldSyntax(field) == 3) {
+      // proto3 fields are left out when zero or empty
+      switch (field->type()) {
+        case FieldDescriptor::TYPE_STRING:
+          ef.present = "m->" + ef.name + " != NULL && m->" + ef.name + "[0] != 0";
+          break;
+        case FieldDescriptor::TYPE_BYTES:
+          ef.present = "m->" + ef.name + ".len != 0";
+          break;
+        case FieldDescriptor::TYPE_MESSAGE:
+          ef.present = "m->" + ef.name + " != NULL";
+          break;
+        default:
+          ef.present = "m->" + ef.name + " != 0";
+          break;
+      }
+    } else if (!pointer_set.empty()) {
+      ef.present = pointer_set.substr(4);
+    } else {
+      ef.present = "m->has_" + ef.name;
+    }
+
+    if (repeated) {
+      encode_i = true;
+      if (ef.packed) {
+        encode_n = true;
+        if (ef.fixed_size == 0)
+          size_i = size_n = encode_varints = true;
+      } else if (ef.fixed_size == 0) {
+        size_i = true;
+      }
+    }
+    if (field->label() == FieldDescriptor::LABEL_REQUIRED &&
+        ef.fixed_size != 0)
+      const_size += ef.tag_size + ef.fixed_size;
+    else
+      size_constant = false;
+  }
+
+  // the size function
+  printer->Print(vars,
+      "static size_t\n"
+      "$lcclassname$_encoded_size(const ProtobufCMessage *message)\n"
+      "{\n");
+  printer->Indent();
+  vars["const_size"] = SimpleItoa(const_size);
+  if (size_constant) {
+    printer->Print(vars,
+        "(void) message;\n"
+        "return $const_size$;\n");
+  } else {
+    printer->Print(vars,
+        "const $classname$_t *m = (const $classname$_t *) message;\n"
+        "size_t rv = $const_size$;\n");
+    if (size_i)
+      printer->Print("size_t i;\n");
+    if (size_n)
+      printer->Print("size_t n;\n");
+    printer->Print("\n");
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      const EncodedField &ef = fields[i];
+      std::map<string, string> fvars;
+      fvars["name"] = ef.name;
+      fvars["present"] = ef.present;
+      fvars["size"] = ef.size;
+      fvars["tag_size"] = SimpleItoa(ef.tag_size);
+      fvars["fixed_size"] = SimpleItoa(ef.fixed_size);
+      fvars["total_size"] = SimpleItoa(ef.tag_size + ef.fixed_size);
+      if (ef.field->label() == FieldDescriptor::LABEL_REPEATED) {
+        if (ef.packed && ef.fixed_size == 1) {
+          printer->Print(fvars,
+              "if (m->n_$name$ != 0)\n"
+              "  rv += $tag_size$ + pbc_varint_size(m->n_$name$) + m->n_$name$;\n");
+        } else if (ef.packed && ef.fixed_size != 0) {
+          printer->Print(fvars,
+              "if (m->n_$name$ != 0)\n"
+              "  rv += $tag_size$ + pbc_varint_size(m->n_$name$ * $fixed_size$) +\n"
+              "        m->n_$name$ * $fixed_size$;\n");
+        } else if (ef.packed) {
+          printer->Print(fvars,
+              "if (m->n_$name$ != 0) {\n"
+              "  n = 0;\n"
+              "  for (i = 0; i < m->n_$name$; i++)\n"
+              "    n += $size$;\n"
+              "  rv += $tag_size$ + pbc_varint_size(n) + n;\n"
+              "}\n");
+        } else if (ef.fixed_size != 0) {
+          printer->Print(fvars, "rv += m->n_$name$ * $total_size$;\n");
+        } else {
+          if (ef.tag_size == 1)
+            printer->Print(fvars, "rv += m->n_$name$;\n");
+          else
+            printer->Print(fvars, "rv += m->n_$name$ * $tag_size$;\n");
+          printer->Print(fvars,
+              "for (i = 0; i < m->n_$name$; i++)\n"
+              "  rv += $size$;\n");
+        }
+      } else if (ef.present.empty()) {
+        if (ef.fixed_size == 0)
+          printer->Print(fvars, "rv += $tag_size$ + $size$;\n");
+      } else if (ef.fixed_size != 0) {
+        printer->Print(fvars,
+            "if ($present$)\n"
+            "  rv += $total_size$;\n");
+      } else {
+        printer->Print(fvars,
+            "if ($present$)\n"
+            "  rv += $tag_size$ + $size$;\n");
+      }
+    }
+    printer->Print("return rv;\n");
+  }
+  printer->Outdent();
+  printer->Print("}\n");
+
+  // the encoder
+  printer->Print(vars,
+      "static size_t\n"
+      "$lcclassname$_encode(const ProtobufCMessage *message, uint8_t *out)\n"
+      "{\n");
+  printer->Indent();
+  printer->Print(vars,
+      "const $classname$_t *m = (const $classname$_t *) message;\n"
+      "uint8_t *at = out;\n");
+  if (encode_i)
+    printer->Print("size_t i;\n");
+  if (encode_n)
+    printer->Print("size_t n;\n");
+  if (encode_varints)
+    printer->Print("uint8_t *length_at;\n"
+                   "size_t len;\n");
+  printer->Print("\n");
+  for (int i = 0; i < descriptor_->field_count(); i++) {
+    const EncodedField &ef = fields[i];
+    std::map<string, string> fvars;
+    fvars["name"] = ef.name;
+    fvars["present"] = ef.present;
+    fvars["size"] = ef.size;
+    fvars["fixed_size"] = SimpleItoa(ef.fixed_size);
+    if (ef.field->label() != FieldDescriptor::LABEL_REPEATED) {
+      if (!ef.present.empty()) {
+        printer->Print(fvars, "if ($present$) {\n");
+        printer->Indent();
+      }
+      printer->Print(ef.tag.c_str());
+      printer->Print(ef.write.c_str());
+      if (!ef.present.empty()) {
+        printer->Outdent();
+        printer->Print("}\n");
+      }
+    } else if (!ef.packed) {
+      printer->Print(fvars, "for (i = 0; i < m->n_$name$; i++) {\n");
+      printer->Indent();
+      printer->Print(ef.tag.c_str());
+      printer->Print(ef.write.c_str());
+      printer->Outdent();
+      printer->Print("}\n");
+    } else {
+      printer->Print(fvars, "if (m->n_$name$ != 0) {\n");
+      printer->Indent();
+      printer->Print(ef.tag.c_str());
+      if (ef.fixed_size == 1) {
+        printer->Print(fvars,
+            "at += pbc_write_varint(m->n_$name$, at);\n"
+            "for (i = 0; i < m->n_$name$; i++)\n"
+            "  *at++ = m->$name$[i] ? 1 : 0;\n");
+      } else if (ef.fixed_size != 0) {
+        // copied as they are on little-endian hosts
+        printer->Print(fvars,
+            "n = m->n_$name$ * $fixed_size$;\n"
+            "at += pbc_write_varint(n, at);\n"
+            "if (pbc_little_endian()) {\n"
+            "  memcpy(at, m->$name$, n);\n"
+            "  at += n;\n"
+            "} else {\n"
+            "  for (i = 0; i < m->n_$name$; i++) {\n");
+        printer->Indent();
+        printer->Indent();
+        printer->Print(ef.write.c_str());
+        printer->Outdent();
+        printer->Outdent();
+        printer->Print("  }\n"
+                       "}\n");
+      } else {
+        // written in one pass, after room for the length they would have
+        // at one byte each, and moved if that turns out too short
+        printer->Print(fvars,
+            "length_at = at;\n"
+            "n = pbc_varint_size(m->n_$name$);\n"
+            "at += n;\n"
+            "for (i = 0; i < m->n_$name$; i++) {\n");
+        printer->Indent();
+        printer->Print(ef.write.c_str());
+        printer->Outdent();
+        printer->Print(
+            "}\n"
+            "len = (size_t) (at - length_at) - n;\n"
+            "if (pbc_varint_size(len) != n) {\n"
+            "  memmove(length_at + n + 1, length_at + n, len);\n"
+            "  at++;\n"
+            "}\n"
+            "pbc_write_varint(len, length_at);\n");
+      }
+      printer->Outdent();
+      printer->Print("}\n");
+    }
+  }
+  printer->Print("return (size_t) (at - out);\n");
+  printer->Outdent();
+  printer->Print("}\n");
+}
+
 void MessageGenerator::
 GenerateMessageDescriptor(io::Printer* printer) {
     std::map<string, string> vars;
@@ -513,6 +1319,7 @@ GenerateMessageDescriptor(io::Printer* printer) {
       }
     }
 
+    vars["hot_fields"] = "NULL";
     if ( descriptor_->field_count() ) {
   printer->Print(vars,
 	"static const ProtobufCFieldDescriptor $lcclassname$_field_descriptors[$n_fields$] = {\n");
@@ -530,6 +1337,12 @@ GenerateMessageDescriptor(io::Printer* printer) {
   }
   printer->Outdent();
   printer->Print(vars, "};\n");
+  printer->Print(vars,
+	"static const ProtobufCFieldHot $lcclassname$_hot_fields[$n_fields$] = {\n");
+  for (int i = 0; i < descriptor_->field_count(); i++)
+    field_generators_.get(sorted_fields[i]).GenerateHotFieldInitializer(printer);
+  printer->Print(vars, "};\n");
+  vars["hot_fields"] = vars["lcclassname"] + "_hot_fields";
 
   if (!optimize_code_size) {
     NameIndex *field_indices = new NameIndex [descriptor_->field_count()];
@@ -557,6 +1370,39 @@ GenerateMessageDescriptor(io::Printer* printer) {
   int n_ranges = WriteIntRanges(printer,
 				descriptor_->field_count(), values,
 				vars["lcclassname"] + "_number_ranges");
+
+  // with several ranges, also index the fields by tag in a hash table,
+  // hashing each tag to itself (see ProtobufCFieldTagIndex)
+  vars["field_tag_index"] = "NULL";
+  if (n_ranges > 1 && descriptor_->field_count() < 65535) {
+    unsigned n_slots = 8;
+    while (n_slots < 2 * (unsigned) descriptor_->field_count())
+      n_slots *= 2;
+    std::vector<int> slots(n_slots, 0);
+    for (int i = 0; i < descriptor_->field_count(); i++) {
+      unsigned pos = (unsigned) values[i] & (n_slots - 1);
+      while (slots[pos] != 0)
+        pos = (pos + 1) & (n_slots - 1);
+      slots[pos] = i + 1;
+    }
+    vars["n_slots"] = SimpleItoa(n_slots);
+    vars["mask"] = SimpleItoa(n_slots - 1);
+    printer->Print(vars, "static const uint16_t $lcclassname$_field_tag_index_slots[$n_slots$] =\n"
+                         "{\n");
+    for (unsigned i = 0; i < n_slots; i += 16) {
+      string line = " ";
+      for (unsigned j = i; j < i + 16 && j < n_slots; j++)
+        line += " " + SimpleItoa(slots[j]) + ",";
+      printer->Print("$line$\n", "line", line);
+    }
+    printer->Print("};\n");
+    printer->Print(vars, "static const ProtobufCFieldTagIndex $lcclassname$_field_tag_index =\n"
+                         "{\n"
+                         "  $mask$,\n"
+                         "  $lcclassname$_field_tag_index_slots\n"
+                         "};\n");
+    vars["field_tag_index"] = "&" + vars["lcclassname"] + "_field_tag_index";
+  }
   delete [] values;
   delete [] sorted_fields;
 
@@ -566,12 +1412,30 @@ GenerateMessageDescriptor(io::Printer* printer) {
        * initialization list. Furthermore it is an extension of GCC only but
        * not a standard. */
       vars["n_ranges"] = "0";
+      vars["field_tag_index"] = "NULL";
   printer->Print(vars,
         "#define $lcclassname$_field_descriptors NULL\n"
         "#define $lcclassname$_field_indices_by_name NULL\n"
         "#define $lcclassname$_number_ranges NULL\n");
     }
 
+  vars["codec"] = "NULL";
+  if (HasCodec(descriptor_)) {
+    GenerateCodec(printer);
+    vars["codec"] = "&" + vars["lcclassname"] + "_codec";
+  }
+
+  // a pointer, so that NULL (unbounded) is also what a reserved member of
+  // descriptors generated before there was a bound reads as
+  vars["max_packed_size"] = "NULL";
+  uint64 max_packed_size;
+  if (GetMaxPackedSize(descriptor_, &max_packed_size)) {
+    vars["max_packed_size_value"] = SimpleItoa(max_packed_size);
+    printer->Print(vars,
+        "static const size_t $lcclassname$_max_packed_size = $max_packed_size_value$;\n");
+    vars["max_packed_size"] = "&" + vars["lcclassname"] + "_max_packed_size";
+  }
+
   printer->Print(vars,
       "const ProtobufCMessageDescriptor $lcclassname$_descriptor = {\n"
       "  PROTOBUF_C__MESSAGE_DESCRIPTOR_MAGIC,\n");
@@ -598,7 +1462,10 @@ GenerateMessageDescriptor(io::Printer* printer) {
       "  $n_ranges$,"
       "  $lcclassname$_number_ranges,\n"
       "  (ProtobufCMessageInit) $init_func$,\n"
-      "  NULL,NULL,NULL    /* reserved[123] */\n"
+      "  $field_tag_index$,\n"
+      "  $max_packed_size$,\n"
+      "  $codec$,\n"
+      "  $hot_fields$\n"
       "};\n");
 }
 
@@ -124,6 +124,12 @@ class MessageGenerator {
 
  private:
 
+  // Generate the decoder, encoder and size function used for
+  // optimize_for = SPEED.
+  void GenerateCodec(io::Printer* printer);
+  void GenerateEncoder(io::Printer* printer,
+                       const FieldDescriptor **sorted_fields);
+
   string GetDefaultValueC(const FieldDescriptor *fd);
 
   const Descriptor* descriptor_;
@@ -0,0 +1,2014 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "t/test-bounded.h"
+#include "t/test-speed.h"
+
+/*
+ * Tests that build against the names this protoc-c generates (`foo_mess_t`,
+ * `FOO_MESS_INIT`, `foo_mess_descriptor`).
+ */
+
+#define N_ELEMENTS(arr)   (sizeof(arr)/sizeof((arr)[0]))
+
+static struct alloc_data {
+  uint32_t alloc_count;
+  int32_t allocs_left;
+} test_allocator_data;
+
+static void *test_alloc(void *allocator_data, size_t size)
+{
+  struct alloc_data *ad = allocator_data;
+  void *rv = NULL;
+  if (ad->allocs_left-- > 0)
+      rv = malloc (size);
+  if (rv)
+    ad->alloc_count++;
+  return rv;
+}
+
+static void test_free (void *allocator_data, void *data)
+{
+  struct alloc_data *ad = allocator_data;
+  free (data);
+  if (data)
+    ad->alloc_count--;
+}
+
+static ProtobufCAllocator test_allocator = {
+  .alloc = test_alloc,
+  .free = test_free,
+  .allocator_data = &test_allocator_data,
+};
+
+/* a ProtobufCBufferDirect with a fixed capacity */
+typedef struct {
+  ProtobufCBufferDirect base;
+  uint8_t data[64];
+  size_t len;
+  size_t reserved;
+} TestBufferFixed;
+
+static uint8_t *
+test_buffer_fixed_reserve (ProtobufCBufferDirect *buffer, size_t len)
+{
+  TestBufferFixed *fixed = (TestBufferFixed *) buffer;
+  if (len > sizeof (fixed->data) - fixed->len)
+    return NULL;
+  fixed->reserved = len;
+  return fixed->data + fixed->len;
+}
+
+static void
+test_buffer_fixed_commit (ProtobufCBufferDirect *buffer, size_t len)
+{
+  TestBufferFixed *fixed = (TestBufferFixed *) buffer;
+  /* fields are packed into exactly the room they reserve */
+  assert (len == fixed->reserved);
+  fixed->reserved = 0;
+  fixed->len += len;
+}
+
+/* a ProtobufCBufferDirect growing a malloc()ed array */
+typedef struct {
+  ProtobufCBufferDirect base;
+  uint8_t *data;
+  size_t len;
+  size_t alloced;
+  size_t reserved;
+  unsigned n_reserves;
+} TestBufferDirect;
+
+static uint8_t *
+test_buffer_direct_reserve (ProtobufCBufferDirect *buffer, size_t len)
+{
+  TestBufferDirect *direct = (TestBufferDirect *) buffer;
+  if (direct->len + len > direct->alloced)
+    {
+      direct->alloced = (direct->len + len) * 2;
+      direct->data = realloc (direct->data, direct->alloced);
+      assert (direct->data != NULL);
+    }
+  direct->reserved = len;
+  direct->n_reserves++;
+  return direct->data + direct->len;
+}
+
+static void
+test_buffer_direct_commit (ProtobufCBufferDirect *buffer, size_t len)
+{
+  TestBufferDirect *direct = (TestBufferDirect *) buffer;
+  /* fields are packed into exactly the room they reserve */
+  assert (len == direct->reserved);
+  direct->reserved = 0;
+  direct->len += len;
+}
+
+/* rv is unpacked message */
+static void *
+test_compare_pack_methods (ProtobufCMessage *message,
+                           size_t *packed_len_out,
+                           uint8_t **packed_out)
+{
+  unsigned char scratch[16];
+  ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  ProtobufCBufferSimple cbs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  ProtobufCBufferSimple rbs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+  ProtobufCSizeCache cache = PROTOBUF_C_SIZE_CACHE_INIT (NULL);
+  ProtobufCReverseBuffer rb;
+  TestBufferDirect direct = {
+    PROTOBUF_C_BUFFER_DIRECT_INIT (test_buffer_direct_reserve,
+                                   test_buffer_direct_commit),
+    NULL, 0, 0, 0, 0
+  };
+  ProtobufCBufferSegmented seg;
+  ProtobufCPackState state;
+  uint8_t rscratch[16];
+  size_t off;
+  size_t siz1 = protobuf_c_message_get_packed_size (message);
+  size_t siz2;
+  size_t siz3 = protobuf_c_message_pack_to_buffer (message, &bs.base);
+  void *packed1 = malloc (siz1);
+  void *packed2 = malloc (siz1);
+  void *rv;
+  assert (packed1 != NULL);
+  assert (packed2 != NULL);
+  assert (siz1 == siz3);
+  siz2 = protobuf_c_message_pack (message, packed1);
+  assert (siz1 == siz2);
+  assert (bs.len == siz1);
+  assert (memcmp (bs.data, packed1, siz1) == 0);
+  assert (protobuf_c_message_get_packed_size_cached (message, &cache) == siz1);
+  assert (protobuf_c_message_pack_cached (message, &cache, packed2) == siz1);
+  assert (memcmp (packed2, packed1, siz1) == 0);
+  assert (protobuf_c_message_pack_to_buffer_cached (message, &cache, &cbs.base) == siz1);
+  assert (cbs.len == siz1);
+  assert (memcmp (cbs.data, packed1, siz1) == 0);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&cbs);
+  protobuf_c_size_cache_clear (&cache);
+  memset (packed2, 0, siz1);
+  assert (protobuf_c_message_pack_reverse (message, siz1, packed2) == siz1);
+  assert (memcmp (packed2, packed1, siz1) == 0);
+  protobuf_c_reverse_buffer_init (&rb, rscratch, sizeof (rscratch), NULL);
+  assert (protobuf_c_message_pack_to_reverse_buffer (message, &rb));
+  assert (protobuf_c_reverse_buffer_to_buffer (&rb, &rbs.base) == siz1);
+  assert (rbs.len == siz1);
+  assert (memcmp (rbs.data, packed1, siz1) == 0);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&rbs);
+  protobuf_c_reverse_buffer_clear (&rb);
+  assert (protobuf_c_message_pack_to_buffer (message, &direct.base.base) == siz1);
+  assert (!direct.base.failed);
+  assert (direct.len == siz1);
+  assert (siz1 == 0 || memcmp (direct.data, packed1, siz1) == 0);
+  free (direct.data);
+  memset (packed2, 0, siz1);
+  protobuf_c_buffer_segmented_init (&seg, NULL);
+  assert (protobuf_c_message_pack_to_buffer (message, &seg.base.base) == siz1);
+  assert (seg.len == siz1);
+  assert (protobuf_c_buffer_segmented_flatten (&seg, packed2) == siz1);
+  assert (memcmp (packed2, packed1, siz1) == 0);
+  protobuf_c_buffer_segmented_clear (&seg);
+  memset (packed2, 0, siz1);
+  assert (protobuf_c_pack_state_init (&state, message, NULL));
+  assert (state.len == siz1);
+  for (off = 0; off < siz1; )
+    off += protobuf_c_pack_state_pack (&state, siz1 - off < 7 ? siz1 - off : 7,
+                                       (uint8_t *) packed2 + off);
+  assert (protobuf_c_pack_state_pack (&state, sizeof (rscratch), rscratch) == 0);
+  assert (!state.failed && state.n_written == siz1);
+  assert (memcmp (packed2, packed1, siz1) == 0);
+  protobuf_c_pack_state_clear (&state);
+  free (packed2);
+  rv = protobuf_c_message_unpack (message->descriptor, NULL, siz1, packed1);
+  assert (rv != NULL);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+  *packed_len_out = siz1;
+  *packed_out = packed1;
+  return rv;
+}
+
+static void
+test_generated_decoder (void)
+{
+  static int64_t trail[] = { -1, 0, INT64_MAX };
+  static int32_t ints[] = { -1, 300 };
+  static float floats[] = { 1.5f, -2.25f, 0.0f };
+  static protobuf_c_boolean bools[] = { 1, 0, 1 };
+  static char *strings[] = { "a", "", "bcd" };
+  static int64_t fixed[] = { INT64_MIN, 7 };
+  static uint8_t bytes[] = "some bytes";
+  /* name appears twice */
+  static const uint8_t dup_name[] = { 0x08, 0x54, 0x12, 0x01, 'a',
+                                      0x12, 0x01, 'b' };
+  /* id is missing */
+  static const uint8_t no_id[] = { 0x12, 0x01, 'a' };
+  /* field 20 is not in the .proto */
+  static const uint8_t unknown[] = { 0x08, 0x54, 0x12, 0x01, 'a',
+                                     0xa0, 0x01, 0x05 };
+  const ProtobufCMessageCodec *codec = foo_speed_mess_descriptor.codec;
+  foo_speed_point_t point = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[2];
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  foo_speed_mess_t decoded;
+  foo_speed_mess_t *mess2;
+  uint8_t *packed, *repacked;
+  size_t len;
+  unsigned i;
+
+  /* only files optimized for speed get a generated decoder */
+  assert (codec != NULL && codec->unpack != NULL);
+  assert (foo_speed_point_descriptor.codec != NULL);
+  assert (foo_bounded_point_descriptor.codec == NULL);
+
+  point.x = -5;
+  point.n_trail = N_ELEMENTS (trail);
+  point.trail = trail;
+  points[0] = &point;
+  points[1] = &point;
+  mess.id = 42;
+  mess.name = "name";
+  mess.has_o_int64 = 1;
+  mess.o_int64 = -1;
+  mess.has_o_uint32 = 1;
+  mess.o_uint32 = UINT32_MAX;
+  mess.has_o_fixed32 = 1;
+  mess.o_fixed32 = 0xdeadbeef;
+  mess.has_o_double = 1;
+  mess.o_double = 2.5;
+  mess.has_o_bool = 1;
+  mess.o_bool = 1;
+  mess.has_o_enum = 1;
+  mess.o_enum = SPEED_ENUM_SPEED_ENUM_BIG;
+  mess.has_o_bytes = 1;
+  mess.o_bytes.len = sizeof (bytes);
+  mess.o_bytes.data = bytes;
+  mess.o_point = &point;
+  mess.n_r_int32 = N_ELEMENTS (ints);
+  mess.r_int32 = ints;
+  mess.n_r_float = N_ELEMENTS (floats);
+  mess.r_float = floats;
+  mess.n_r_bool = N_ELEMENTS (bools);
+  mess.r_bool = bools;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.n_r_bytes = 1;
+  mess.r_bytes = &mess.o_bytes;
+  mess.n_r_point = N_ELEMENTS (points);
+  mess.r_point = points;
+  mess.choice_case = FOO_SPEED_MESS_CHOICE_C_POINT;
+  mess.c_point = &point;
+  mess.n_r_sfixed64 = N_ELEMENTS (fixed);
+  mess.r_sfixed64 = fixed;
+  len = foo_speed_mess_get_packed_size (&mess);
+  packed = malloc (len);
+  assert (foo_speed_mess_pack (&mess, packed) == len);
+
+  /* the generated decoder handles every field by itself */
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  foo_speed_mess_init (&decoded);
+  assert (codec->unpack (&decoded.base, &test_allocator, len, packed));
+  assert (decoded.id == 42);
+  assert (strcmp (decoded.name, "name") == 0);
+  assert (decoded.o_enum == SPEED_ENUM_SPEED_ENUM_BIG);
+  assert (decoded.o_point->n_trail == N_ELEMENTS (trail));
+  assert (decoded.o_point->trail[2] == INT64_MAX);
+  assert (strcmp (decoded.o_point->label, "none") == 0);
+  assert (decoded.n_r_bool == N_ELEMENTS (bools));
+  for (i = 0; i < N_ELEMENTS (bools); i++)
+    assert (decoded.r_bool[i] == bools[i]);
+  assert (decoded.n_r_string == N_ELEMENTS (strings));
+  for (i = 0; i < N_ELEMENTS (strings); i++)
+    assert (strcmp (decoded.r_string[i], strings[i]) == 0);
+  assert (decoded.choice_case == FOO_SPEED_MESS_CHOICE_C_POINT);
+  assert (decoded.r_sfixed64[0] == INT64_MIN);
+  repacked = malloc (len);
+  assert (foo_speed_mess_pack (&decoded, repacked) == len);
+  assert (memcmp (packed, repacked, len) == 0);
+  foo_speed_mess_clear (&decoded, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* the usual entry point gives the same result */
+  mess2 = foo_speed_mess_unpack (NULL, len, packed);
+  assert (mess2 != NULL);
+  assert (foo_speed_mess_pack (mess2, repacked) == len);
+  assert (memcmp (packed, repacked, len) == 0);
+  foo_speed_mess_free_unpacked (mess2, NULL);
+
+  /* anything unusual is left to the table-driven code */
+  foo_speed_mess_init (&decoded);
+  assert (!codec->unpack (&decoded.base, &test_allocator,
+                          sizeof (dup_name), dup_name));
+  foo_speed_mess_clear (&decoded, &test_allocator);
+  mess2 = foo_speed_mess_unpack (NULL, sizeof (dup_name), dup_name);
+  assert (mess2 != NULL && strcmp (mess2->name, "b") == 0);
+  foo_speed_mess_free_unpacked (mess2, NULL);
+
+  foo_speed_mess_init (&decoded);
+  assert (!codec->unpack (&decoded.base, &test_allocator,
+                          sizeof (no_id), no_id));
+  foo_speed_mess_clear (&decoded, &test_allocator);
+  assert (foo_speed_mess_unpack (NULL, sizeof (no_id), no_id) == NULL);
+
+  foo_speed_mess_init (&decoded);
+  assert (!codec->unpack (&decoded.base, &test_allocator,
+                          sizeof (unknown), unknown));
+  foo_speed_mess_clear (&decoded, &test_allocator);
+  assert (test_allocator_data.alloc_count == 0);
+  mess2 = foo_speed_mess_unpack (NULL, sizeof (unknown), unknown);
+  assert (mess2 != NULL && mess2->base.n_unknown_fields == 1);
+  assert (mess2->id == 42);
+  foo_speed_mess_free_unpacked (mess2, NULL);
+
+  free (repacked);
+  free (packed);
+}
+
+static void
+test_generated_encoder (void)
+{
+  static int64_t trail[] = { INT64_MIN, -1, 0, 1, INT64_MAX };
+  static int32_t ints[] = { INT32_MIN, -1, 0, 127, 128 };
+  static float floats[] = { 1.5f, -0.0f };
+  static protobuf_c_boolean bools[] = { 1, 0, 1 };
+  static char *strings[] = { "", "a" };
+  static int64_t fixed[] = { INT64_MIN, -1 };
+  /* field 20 is not in the .proto */
+  static const uint8_t unknown[] = { 0x08, 0x54, 0x12, 0x01, 'a',
+                                     0xa0, 0x01, 0x05 };
+  static char label[] = "none";
+  static char long_name[200];
+  const ProtobufCMessageCodec *codec = foo_speed_mess_descriptor.codec;
+  foo_speed_point_t point = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[2];
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  foo_speed_mess_t *mess2;
+  uint8_t *packed;
+  uint8_t repacked[sizeof (unknown)];
+  size_t len;
+
+  assert (codec->get_packed_size != NULL && codec->pack != NULL);
+  assert (foo_bounded_point_descriptor.codec == NULL);
+
+  /* a required string left NULL is packed as an empty one */
+  mess2 = test_compare_pack_methods ((ProtobufCMessage *) &mess, &len, &packed);
+  assert (len == 4);
+  foo_speed_mess_free_unpacked (mess2, NULL);
+  free (packed);
+
+  /* every kind of field, next to what the table-driven code packs */
+  memset (long_name, 'n', sizeof (long_name) - 1);
+  point.x = INT32_MIN;
+  point.n_trail = N_ELEMENTS (trail);
+  point.trail = trail;
+  point.label = label;
+  points[0] = &point;
+  points[1] = &point;
+  mess.id = -1;
+  mess.name = long_name;
+  mess.has_o_int64 = 1;
+  mess.o_int64 = INT64_MIN;
+  mess.has_o_uint32 = 1;
+  mess.o_uint32 = UINT32_MAX;
+  mess.has_o_fixed32 = 1;
+  mess.has_o_double = 1;
+  mess.o_double = -0.0;
+  mess.has_o_bool = 1;
+  mess.has_o_enum = 1;
+  mess.o_enum = SPEED_ENUM_SPEED_ENUM_BIG;
+  mess.has_o_bytes = 1;
+  mess.o_point = &point;
+  mess.n_r_int32 = N_ELEMENTS (ints);
+  mess.r_int32 = ints;
+  mess.n_r_float = N_ELEMENTS (floats);
+  mess.r_float = floats;
+  mess.n_r_bool = N_ELEMENTS (bools);
+  mess.r_bool = bools;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.n_r_bytes = 1;
+  mess.r_bytes = &mess.o_bytes;
+  mess.n_r_point = N_ELEMENTS (points);
+  mess.r_point = points;
+  mess.choice_case = FOO_SPEED_MESS_CHOICE_C_POINT;
+  mess.c_point = &point;
+  mess.n_r_sfixed64 = N_ELEMENTS (fixed);
+  mess.r_sfixed64 = fixed;
+  mess2 = test_compare_pack_methods ((ProtobufCMessage *) &mess, &len, &packed);
+  assert (mess2->id == -1);
+  assert (strcmp (mess2->name, long_name) == 0);
+  assert (strcmp (mess2->o_point->label, "none") == 0);
+  assert (mess2->r_int32[0] == INT32_MIN);
+  assert (mess2->r_sfixed64[1] == -1);
+  assert (codec->get_packed_size (&mess2->base) == len);
+  foo_speed_mess_free_unpacked (mess2, NULL);
+  free (packed);
+
+  /* unknown fields are left to the table-driven code */
+  mess2 = foo_speed_mess_unpack (NULL, sizeof (unknown), unknown);
+  assert (mess2 != NULL && mess2->base.n_unknown_fields == 1);
+  assert (foo_speed_mess_get_packed_size (mess2) == sizeof (unknown));
+  assert (foo_speed_mess_pack (mess2, repacked) == sizeof (unknown));
+  assert (memcmp (repacked, unknown, sizeof (unknown)) == 0);
+  foo_speed_mess_free_unpacked (mess2, NULL);
+}
+
+static void
+test_field_tag_bytes (void)
+{
+  /* field 1 with its tag padded to 3 bytes */
+  static const uint8_t padded[] = { 0x88, 0x80, 0x00, 0x0a };
+  foo_speed_long_tags_t tags = FOO_SPEED_LONG_TAGS_INIT;
+  foo_speed_long_tags_t *tags2;
+  foo_speed_point_t *point;
+  uint8_t *packed;
+  size_t len;
+
+  assert (foo_speed_mess_descriptor.fields[0].tag_bytes == 0x08);
+  assert (foo_speed_mess_descriptor.fields[4].tag_bytes == 0x28);
+  assert (foo_speed_mess_descriptor.fields[19].tag_bytes == 0x7d80);
+  assert (foo_speed_long_tags_descriptor.fields[0].tag_bytes == 0x7ffffff8);
+  assert (foo_speed_long_tags_descriptor.fields[1].tag_bytes == 0);
+
+  /* misses the precomputed bytes, but is still a valid tag */
+  point = foo_speed_point_unpack (NULL, sizeof (padded), padded);
+  assert (point != NULL && point->x == 5);
+  foo_speed_point_free_unpacked (point, NULL);
+
+  /* a 5 byte tag is encoded from the field's id */
+  tags.has_four_bytes = 1;
+  tags.four_bytes = 1;
+  tags.has_five_bytes = 1;
+  tags.five_bytes = 2;
+  tags2 = test_compare_pack_methods (&tags.base, &len, &packed);
+  assert (len == 4 + 1 + 5 + 1);
+  assert (tags2->has_four_bytes && tags2->four_bytes == 1);
+  assert (tags2->has_five_bytes && tags2->five_bytes == 2);
+  foo_speed_long_tags_free_unpacked (tags2, NULL);
+  free (packed);
+}
+
+static void
+check_hot_fields (const ProtobufCMessageDescriptor *desc)
+{
+  unsigned i;
+
+  assert (desc->hot_fields != NULL);
+  for (i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *field = desc->fields + i;
+      const ProtobufCFieldHot *hot = desc->hot_fields + i;
+      assert (hot->id == field->id);
+      assert (hot->offset == field->offset);
+      assert (hot->label == field->label);
+      assert (hot->type == field->type);
+      assert (hot->flags == field->flags);
+      if (field->label == PROTOBUF_C_LABEL_REPEATED
+       || (field->flags & PROTOBUF_C_FIELD_FLAG_ONEOF) != 0
+       || (field->label == PROTOBUF_C_LABEL_OPTIONAL
+        && field->type != PROTOBUF_C_TYPE_STRING
+        && field->type != PROTOBUF_C_TYPE_MESSAGE))
+        assert (hot->quantifier_offset == field->quantifier_offset);
+    }
+}
+
+static void
+test_field_hot_table (void)
+{
+  check_hot_fields (&foo_speed_point_descriptor);
+  check_hot_fields (&foo_speed_mess_descriptor);
+  check_hot_fields (&foo_speed_long_tags_descriptor);
+  check_hot_fields (&foo_bounded_point_descriptor);
+  check_hot_fields (&foo_bounded_reading_descriptor);
+}
+
+static void
+test_max_packed_size (void)
+{
+  static char sensor[17];
+  static uint8_t blob[200];
+  static int32_t samples[32];
+  static uint64_t counters[3];
+  foo_bounded_point_t points[5];
+  foo_bounded_point_t *path[4];
+  foo_bounded_reading_t reading = FOO_BOUNDED_READING_INIT;
+  foo_speed_long_tags_t tags = FOO_SPEED_LONG_TAGS_INIT;
+  uint8_t *packed;
+  size_t len;
+  unsigned i;
+
+  /* messages without strings, bytes or repeated fields are always bounded */
+  tags.has_four_bytes = 1;
+  tags.four_bytes = -1;
+  tags.has_five_bytes = 1;
+  tags.five_bytes = INT32_MIN;
+  assert (*foo_speed_long_tags_descriptor.max_packed_size == 29);
+  assert (foo_speed_long_tags_get_packed_size (&tags) == 29);
+  assert (*foo_bounded_empty_descriptor.max_packed_size == 0);
+  assert (foo_speed_mess_descriptor.max_packed_size == NULL);
+  assert (foo_unbounded_reading_descriptor.max_packed_size == NULL);
+
+  /* every field at its largest encoding reaches the bound exactly */
+  for (i = 0; i < 5; i++)
+    {
+      foo_bounded_point_init (&points[i]);
+      points[i].x = INT32_MIN;
+      points[i].y = INT32_MIN;
+      points[i].has_z = 1;
+      points[i].z = -1;
+    }
+  assert (*foo_bounded_point_descriptor.max_packed_size == 23);
+  assert (FOO_BOUNDED_POINT_MAX_PACKED_SIZE == 23);
+  assert (foo_bounded_point_get_packed_size (&points[0]) == 23);
+
+  memset (sensor, 'x', 16);
+  reading.sensor = sensor;
+  for (i = 0; i < 32; i++)
+    samples[i] = INT32_MIN;
+  reading.n_samples = 32;
+  reading.samples = samples;
+  for (i = 0; i < 4; i++)
+    path[i] = &points[i];
+  reading.n_path = 4;
+  reading.path = path;
+  reading.has_blob = 1;
+  reading.blob.len = sizeof (blob);
+  reading.blob.data = blob;
+  reading.value_case = FOO_BOUNDED_READING_VALUE_V_POINT;
+  reading.v_point = &points[4];
+  for (i = 0; i < 3; i++)
+    counters[i] = UINT64_MAX;
+  reading.n_counters = 3;
+  reading.counters = counters;
+
+  assert (*foo_bounded_reading_descriptor.max_packed_size == 545);
+  len = foo_bounded_reading_get_packed_size (&reading);
+  assert (len == 545);
+  packed = malloc (FOO_BOUNDED_READING_MAX_PACKED_SIZE);
+  assert (foo_bounded_reading_pack (&reading, packed) == len);
+  free (packed);
+}
+
+static void
+test_raw_unknown_alias_strings (void)
+{
+  /* id = 1, name = "ab", then field 20, which is not in the .proto */
+  static const uint8_t packed[] = { 0x08, 0x02, 0x12, 0x02, 'a', 'b',
+                                    0xa0, 0x01, 0x05 };
+  uint8_t data[sizeof (packed) + 1];
+  ProtobufCMessage *msg;
+  foo_speed_mess_t *mess;
+
+  /* the NUL after "ab" would overwrite the tag of the raw run */
+  memcpy (data, packed, sizeof (packed));
+  msg = protobuf_c_message_unpack_ex (&foo_speed_mess_descriptor, NULL,
+                                      PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS |
+                                      PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN,
+                                      sizeof (packed), data);
+  assert (msg == NULL);
+  assert (memcmp (data, packed, sizeof (packed)) == 0);
+
+  msg = protobuf_c_message_unpack_ex (&foo_speed_mess_descriptor, NULL,
+                                      PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN,
+                                      sizeof (packed), data);
+  assert (msg != NULL);
+  mess = (foo_speed_mess_t *) msg;
+  assert (strcmp (mess->name, "ab") == 0);
+  assert (msg->n_unknown_fields == 1);
+  assert (msg->unknown_fields[0].tag == 0);
+  assert (msg->unknown_fields[0].len == 3);
+  assert (memcmp (msg->unknown_fields[0].data, packed + 6, 3) == 0);
+  protobuf_c_message_free_unpacked_ex (msg, NULL,
+                                       PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN);
+}
+
+static void
+test_buffer_direct_failure (void)
+{
+  static uint8_t blob[40];
+  static char *strings[] = { "abc", "" };
+  static int32_t ints[] = { -1, 1 };
+  TestBufferFixed fixed = {
+    PROTOBUF_C_BUFFER_DIRECT_INIT (test_buffer_fixed_reserve,
+                                   test_buffer_fixed_commit),
+    { 0 }, 0, 0
+  };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  uint8_t packed[sizeof (fixed.data) * 2];
+  size_t len;
+
+  mess.id = -3;
+  mess.name = "name";
+  mess.has_o_fixed32 = 1;
+  mess.o_fixed32 = 7;
+  mess.n_r_int32 = N_ELEMENTS (ints);
+  mess.r_int32 = ints;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+
+  /* a buffer of exactly the packed size holds the message */
+  len = foo_speed_mess_pack (&mess, packed);
+  assert (len <= sizeof (fixed.data));
+  memset (fixed.data, 0, sizeof (fixed.data));
+  fixed.len = sizeof (fixed.data) - len;
+  assert (protobuf_c_message_pack_to_buffer (&mess.base,
+                                             &fixed.base.base) == len);
+  assert (!fixed.base.failed);
+  assert (fixed.len == sizeof (fixed.data));
+  assert (memcmp (fixed.data + sizeof (fixed.data) - len, packed, len) == 0);
+
+  /* one that runs out of room says so */
+  mess.has_o_bytes = 1;
+  mess.o_bytes.len = sizeof (blob);
+  mess.o_bytes.data = blob;
+  len = foo_speed_mess_pack (&mess, packed);
+  assert (len > sizeof (fixed.data));
+  fixed.len = 0;
+  assert (protobuf_c_message_pack_to_buffer (&mess.base,
+                                             &fixed.base.base) == len);
+  assert (fixed.base.failed);
+  assert (fixed.len < len);
+}
+
+static void
+test_unpack_state_truncated_packed (void)
+{
+  /* r_int32 (field 11) ends in the middle of the varint d8 a9 */
+  static const uint8_t cut_varint[] = {
+    0x08, 0x0a, 0x12, 0x02, 'n', 'm',
+    0x5a, 0x08, 0x08, 0x06, 0x1a, 0x04, 0x02, 0x03, 0xd8, 0xa9,
+    0x04, 0x58
+  };
+  /* r_float (field 12) holds one and a half floats */
+  static const uint8_t cut_float[] = {
+    0x08, 0x0a, 0x12, 0x02, 'n', 'm',
+    0x62, 0x06, 0x00, 0x00, 0x80, 0x3f, 0x00, 0x00,
+    0x08, 0x01
+  };
+  static const struct {
+    size_t len;
+    const uint8_t *data;
+  } inputs[] = {
+    { sizeof (cut_varint), cut_varint },
+    { sizeof (cut_float), cut_float },
+  };
+  static const size_t chunk_sizes[] = { 1, 2, 4, 8, 64 };
+  ProtobufCUnpackState state;
+  unsigned i, j;
+
+  for (j = 0; j < N_ELEMENTS (inputs); j++)
+    {
+      assert (foo_speed_mess_unpack (NULL, inputs[j].len,
+                                     inputs[j].data) == NULL);
+      for (i = 0; i < N_ELEMENTS (chunk_sizes); i++)
+        {
+          protobuf_c_boolean ok = 1;
+          size_t off, n;
+
+          assert (protobuf_c_unpack_state_init (&state,
+                                                &foo_speed_mess_descriptor,
+                                                NULL));
+          for (off = 0; ok && off < inputs[j].len; off += n)
+            {
+              n = inputs[j].len - off;
+              if (n > chunk_sizes[i])
+                n = chunk_sizes[i];
+              ok = protobuf_c_unpack_state_feed (&state, n,
+                                                 inputs[j].data + off);
+            }
+          assert (!ok || protobuf_c_unpack_state_finish (&state) == NULL);
+          assert (state.failed);
+          protobuf_c_unpack_state_clear (&state);
+        }
+    }
+}
+
+static void
+test_unpack_huge_length_prefix (void)
+{
+  /* sensor (field 1) claims 2^32 - 1 bytes, which 32-bit sums wrap around */
+  static const uint8_t packed[] = {
+    0x0a, 0xff, 0xff, 0xff, 0xff, 0x0f, 'a', 'b'
+  };
+
+  assert (foo_unbounded_reading_unpack (NULL, sizeof (packed), packed) == NULL);
+}
+
+static void
+test_merge_absent_oneof (void)
+{
+  /* last (field 1) twice, neither with the value oneof set */
+  static const uint8_t packed[] = {
+    0x0a, 0x03, 0x0a, 0x01, 'a',
+    0x0a, 0x03, 0x0a, 0x01, 'b'
+  };
+  foo_bounded_history_t *history;
+
+  history = foo_bounded_history_unpack (NULL, sizeof (packed), packed);
+  assert (history != NULL);
+  assert (history->last != NULL);
+  assert (strcmp (history->last->sensor, "b") == 0);
+  assert (history->last->value_case == FOO_BOUNDED_READING_VALUE_NOT_SET);
+  foo_bounded_history_free_unpacked (history, NULL);
+}
+
+typedef struct
+{
+  const uint8_t *data;
+  size_t len;
+} FailingSource;
+
+/* ProtobufCReadFunc that fails once its input is used up */
+static size_t
+read_then_fail (size_t len, uint8_t *data, void *closure_data)
+{
+  FailingSource *source = closure_data;
+
+  if (source->len == 0)
+    return (size_t) -1;
+  if (len > source->len)
+    len = source->len;
+  memcpy (data, source->data, len);
+  source->data += len;
+  source->len -= len;
+  return len;
+}
+
+static void
+test_message_reader_read_error (void)
+{
+  /* two records of one BoundedPoint each, x = 1 and y = 2 */
+  static const uint8_t records[] = {
+    0x04, 0x08, 0x02, 0x10, 0x04,
+    0x04, 0x08, 0x02, 0x10, 0x04
+  };
+  ProtobufCMessageReader reader;
+  FailingSource source;
+  ProtobufCMessage *msg;
+
+  /* an error between records */
+  source.data = records;
+  source.len = 5;
+  protobuf_c_message_reader_init (&reader, read_then_fail, &source, NULL);
+  msg = protobuf_c_message_reader_next (&reader,
+                                        &foo_bounded_point_descriptor, NULL);
+  assert (msg != NULL && !reader.failed);
+  assert (((foo_bounded_point_t *) msg)->y == 2);
+  protobuf_c_message_free_unpacked (msg, NULL);
+  assert (protobuf_c_message_reader_next (&reader,
+                                          &foo_bounded_point_descriptor,
+                                          NULL) == NULL);
+  assert (reader.failed && reader.pos <= reader.len);
+  protobuf_c_message_reader_clear (&reader);
+
+  /* an error partway through a record */
+  source.data = records;
+  source.len = 8;
+  protobuf_c_message_reader_init (&reader, read_then_fail, &source, NULL);
+  msg = protobuf_c_message_reader_next (&reader,
+                                        &foo_bounded_point_descriptor, NULL);
+  assert (msg != NULL);
+  protobuf_c_message_free_unpacked (msg, NULL);
+  assert (protobuf_c_message_reader_next (&reader,
+                                          &foo_bounded_point_descriptor,
+                                          NULL) == NULL);
+  assert (reader.failed && reader.pos <= reader.len);
+  protobuf_c_message_reader_clear (&reader);
+}
+
+static char *alloc_strings[] = { "first", "second", "third" };
+static uint8_t alloc_bytes[] = "some bytes";
+
+/* a message with strings, bytes, repeated strings and a submessage */
+static uint8_t *
+pack_alloc_mess (size_t *len_out)
+{
+  foo_speed_point_t point = FOO_SPEED_POINT_INIT;
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  uint8_t *packed;
+
+  point.x = 3;
+  point.label = "a label";
+  mess.id = 7;
+  mess.name = "some string";
+  mess.has_o_bytes = 1;
+  mess.o_bytes.len = sizeof (alloc_bytes);
+  mess.o_bytes.data = alloc_bytes;
+  mess.o_point = &point;
+  mess.n_r_string = N_ELEMENTS (alloc_strings);
+  mess.r_string = alloc_strings;
+  *len_out = foo_speed_mess_get_packed_size (&mess);
+  packed = malloc (*len_out);
+  assert (packed != NULL);
+  assert (foo_speed_mess_pack (&mess, packed) == *len_out);
+  return packed;
+}
+
+static void
+check_alloc_mess (const foo_speed_mess_t *mess)
+{
+  unsigned i;
+
+  assert (mess->id == 7);
+  assert (strcmp (mess->name, "some string") == 0);
+  assert (mess->has_o_bytes);
+  assert (mess->o_bytes.len == sizeof (alloc_bytes));
+  assert (memcmp (mess->o_bytes.data, alloc_bytes, sizeof (alloc_bytes)) == 0);
+  assert (mess->o_point != NULL && mess->o_point->x == 3);
+  assert (strcmp (mess->o_point->label, "a label") == 0);
+  assert (mess->n_r_string == N_ELEMENTS (alloc_strings));
+  for (i = 0; i < mess->n_r_string; i++)
+    assert (strcmp (mess->r_string[i], alloc_strings[i]) == 0);
+}
+
+static void
+test_alloc_arena (void)
+{
+  uint8_t block[64];
+  uint8_t big_block[256];
+  ProtobufCArena arena;
+  foo_speed_mess_t *mess;
+  uint8_t *packed, *p;
+  size_t len;
+  unsigned round;
+
+  packed = pack_alloc_mess (&len);
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  protobuf_c_arena_init (&arena, block, sizeof (block), &test_allocator);
+  for (round = 0; round < 3; round++)
+    {
+      mess = foo_speed_mess_unpack (&arena.base, len, packed);
+      assert (mess != NULL);
+      check_alloc_mess (mess);
+      foo_speed_mess_free_unpacked (mess, &arena.base);
+      protobuf_c_arena_reset (&arena);
+      /* only the block kept for reuse remains */
+      assert (test_allocator_data.alloc_count <= 1);
+    }
+  protobuf_c_arena_destroy (&arena);
+  assert (0 == test_allocator_data.alloc_count);
+
+  /* a large request gets a block of its own, which a reset drops */
+  protobuf_c_arena_init (&arena, big_block, sizeof (big_block),
+                         &test_allocator);
+  p = arena.base.alloc (arena.base.allocator_data, 2000);
+  assert (p != NULL);
+  assert (p < big_block || p >= big_block + sizeof (big_block));
+  assert (test_allocator_data.alloc_count == 1);
+  protobuf_c_arena_reset (&arena);
+  assert (test_allocator_data.alloc_count == 0);
+  p = arena.base.alloc (arena.base.allocator_data, 16);
+  assert (p >= big_block && p + 16 <= big_block + sizeof (big_block));
+  protobuf_c_arena_destroy (&arena);
+  assert (0 == test_allocator_data.alloc_count);
+
+  /* a failing parent allocator makes unpack fail cleanly */
+  test_allocator_data.allocs_left = 0;
+  protobuf_c_arena_init (&arena, NULL, 0, &test_allocator);
+  assert (foo_speed_mess_unpack (&arena.base, len, packed) == NULL);
+  protobuf_c_arena_destroy (&arena);
+  assert (0 == test_allocator_data.alloc_count);
+  free (packed);
+}
+
+static void
+test_alloc_alias_input (void)
+{
+  const unsigned flags = PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES |
+                         PROTOBUF_C_UNPACK_FLAG_ALIAS_STRINGS;
+  foo_speed_mess_t *mess;
+  uint8_t *packed, *input;
+  size_t len;
+  unsigned i;
+
+  /* in-place NUL termination needs one spare byte past the end */
+  packed = pack_alloc_mess (&len);
+  input = malloc (len + 1);
+  assert (input != NULL);
+  memcpy (input, packed, len);
+
+  /* bytes alone point into the input, strings are still copied */
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  mess = (foo_speed_mess_t *)
+    protobuf_c_message_unpack_ex (&foo_speed_mess_descriptor, &test_allocator,
+                                  PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES,
+                                  len, input);
+  assert (mess != NULL);
+  check_alloc_mess (mess);
+  assert (mess->o_bytes.data > input && mess->o_bytes.data < input + len);
+  assert ((uint8_t *) mess->name < input ||
+          (uint8_t *) mess->name >= input + len);
+  assert (memcmp (input, packed, len) == 0);
+  protobuf_c_message_free_unpacked_ex (&mess->base, &test_allocator,
+                                       PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES);
+  assert (0 == test_allocator_data.alloc_count);
+
+  /* with strings too, the input is only written to terminate them */
+  mess = (foo_speed_mess_t *)
+    protobuf_c_message_unpack_ex (&foo_speed_mess_descriptor, &test_allocator,
+                                  flags, len, input);
+  assert (mess != NULL);
+  check_alloc_mess (mess);
+  assert ((uint8_t *) mess->name > input);
+  assert ((uint8_t *) mess->name < input + len);
+  assert (mess->o_bytes.data > input && mess->o_bytes.data < input + len);
+  for (i = 0; i < mess->n_r_string; i++)
+    assert ((uint8_t *) mess->r_string[i] > input &&
+            (uint8_t *) mess->r_string[i] < input + len);
+  assert ((uint8_t *) mess->o_point->label > input &&
+          (uint8_t *) mess->o_point->label < input + len);
+  protobuf_c_message_free_unpacked_ex (&mess->base, &test_allocator, flags);
+  assert (0 == test_allocator_data.alloc_count);
+
+  free (input);
+  free (packed);
+}
+
+/* messages without repeated members are unpacked in a single pass;
+   make sure the unknown-field array grows past its initial size */
+static void
+test_unknown_fields_many (void)
+{
+  foo_bounded_empty_t mess = FOO_BOUNDED_EMPTY_INIT;
+  foo_bounded_empty_t *mess2;
+  ProtobufCMessageUnknownField fields[9];
+  size_t len;
+  uint8_t *data;
+  unsigned i;
+
+  for (i = 0; i < N_ELEMENTS (fields); i++)
+    {
+      fields[i].tag = 1000 + i;
+      fields[i].wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+      fields[i].len = 1;
+      fields[i].data = (uint8_t *) "\5";
+    }
+  mess.base.n_unknown_fields = N_ELEMENTS (fields);
+  mess.base.unknown_fields = fields;
+
+  mess2 = test_compare_pack_methods (&mess.base, &len, &data);
+  assert (mess2->base.n_unknown_fields == N_ELEMENTS (fields));
+  for (i = 0; i < N_ELEMENTS (fields); i++)
+    {
+      assert (mess2->base.unknown_fields[i].tag == 1000 + i);
+      assert (mess2->base.unknown_fields[i].len == 1);
+      assert (mess2->base.unknown_fields[i].data[0] == 5);
+    }
+  free (data);
+  foo_bounded_empty_free_unpacked (mess2, NULL);
+}
+
+static void
+test_alloc_contiguous (void)
+{
+  const unsigned flags = PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS;
+  foo_speed_mess_t *mess;
+  uint8_t *packed;
+  size_t len;
+  int good_allocs;
+
+  packed = pack_alloc_mess (&len);
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  mess = (foo_speed_mess_t *)
+    protobuf_c_message_unpack_ex (&foo_speed_mess_descriptor, &test_allocator,
+                                  flags, len, packed);
+  assert (mess != NULL);
+  /* structure and payload block of each of the two messages */
+  assert (test_allocator_data.alloc_count <= 4);
+  check_alloc_mess (mess);
+  protobuf_c_message_free_unpacked_ex (&mess->base, &test_allocator, flags);
+  assert (0 == test_allocator_data.alloc_count);
+
+  /* running out of memory at any point frees what was allocated */
+  for (good_allocs = 0; good_allocs < 4; good_allocs++)
+    {
+      test_allocator_data.allocs_left = good_allocs;
+      mess = (foo_speed_mess_t *)
+        protobuf_c_message_unpack_ex (&foo_speed_mess_descriptor,
+                                      &test_allocator, flags, len, packed);
+      if (mess != NULL)
+        check_alloc_mess (mess);
+      protobuf_c_message_free_unpacked_ex ((ProtobufCMessage *) mess,
+                                           &test_allocator, flags);
+      assert (0 == test_allocator_data.alloc_count);
+    }
+  free (packed);
+}
+
+static void
+test_alloc_unpack_into (void)
+{
+  foo_speed_mess_t mess;
+  foo_speed_mess_t bare = FOO_SPEED_MESS_INIT;
+  foo_speed_point_t *point;
+  char **r_string;
+  char *name;
+  uint32_t alloc_count;
+  uint8_t *packed, *packed2;
+  size_t len, len2;
+  unsigned round;
+
+  packed = pack_alloc_mess (&len);
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = INT32_MAX;
+  foo_speed_mess_init (&mess);
+  assert (foo_speed_mess_unpack_into (&mess, &test_allocator, len, packed));
+  check_alloc_mess (&mess);
+  alloc_count = test_allocator_data.alloc_count;
+  name = mess.name;
+  r_string = mess.r_string;
+  point = mess.o_point;
+  for (round = 0; round < 3; round++)
+    {
+      /* everything is reused; only scratch space comes and goes */
+      assert (foo_speed_mess_unpack_into (&mess, &test_allocator,
+                                          len, packed));
+      assert (test_allocator_data.alloc_count == alloc_count);
+      assert (mess.name == name);
+      assert (mess.r_string == r_string);
+      assert (mess.o_point == point);
+      check_alloc_mess (&mess);
+    }
+
+  /* fields missing from the input are reset */
+  bare.id = 7;
+  bare.name = "some string";
+  len2 = foo_speed_mess_get_packed_size (&bare);
+  packed2 = malloc (len2);
+  assert (foo_speed_mess_pack (&bare, packed2) == len2);
+  assert (foo_speed_mess_unpack_into (&mess, &test_allocator, len2, packed2));
+  assert (mess.n_r_string == 0 && mess.r_string == NULL);
+  assert (!mess.has_o_bytes);
+  assert (mess.o_point == NULL);
+  assert (strcmp (mess.name, "some string") == 0);
+
+  foo_speed_mess_clear (&mess, &test_allocator);
+  assert (0 == test_allocator_data.alloc_count);
+  assert (mess.name == NULL || mess.name[0] == '\0');
+  free (packed2);
+  free (packed);
+}
+
+static void
+test_unknown_fields_discard (void)
+{
+  foo_bounded_empty_t mess = FOO_BOUNDED_EMPTY_INIT;
+  ProtobufCMessage *mess2;
+  ProtobufCMessageUnknownField fields[3];
+  const unsigned flags = PROTOBUF_C_UNPACK_FLAG_DISCARD_UNKNOWN;
+  size_t len;
+  uint8_t *data;
+  unsigned i;
+
+  for (i = 0; i < N_ELEMENTS (fields); i++)
+    {
+      fields[i].tag = 2000 + i;
+      fields[i].wire_type = PROTOBUF_C_WIRE_TYPE_LENGTH_PREFIXED;
+      fields[i].len = 4;
+      fields[i].data = (uint8_t *) "\3abc";
+    }
+  mess.base.n_unknown_fields = N_ELEMENTS (fields);
+  mess.base.unknown_fields = fields;
+  /* room for x = 1 (field 1) of a foo_speed_point_t in front */
+  len = foo_bounded_empty_get_packed_size (&mess);
+  data = malloc (len + 2);
+  data[0] = 0x08;
+  data[1] = 0x02;
+  assert (foo_bounded_empty_pack (&mess, data + 2) == len);
+
+  /* only the message itself is allocated, single and two-pass alike */
+  test_allocator_data.alloc_count = 0;
+  test_allocator_data.allocs_left = 1;
+  mess2 = protobuf_c_message_unpack_ex (&foo_bounded_empty_descriptor,
+                                        &test_allocator, flags, len, data + 2);
+  assert (mess2 != NULL);
+  assert (mess2->n_unknown_fields == 0 && mess2->unknown_fields == NULL);
+  protobuf_c_message_free_unpacked_ex (mess2, &test_allocator, flags);
+  assert (test_allocator_data.alloc_count == 0);
+
+  test_allocator_data.allocs_left = 1;
+  mess2 = protobuf_c_message_unpack_ex (&foo_speed_point_descriptor,
+                                        &test_allocator, flags, len + 2, data);
+  assert (mess2 != NULL);
+  assert (mess2->n_unknown_fields == 0);
+  assert (((foo_speed_point_t *) mess2)->x == 1);
+  assert (protobuf_c_message_get_packed_size (mess2) == 2);
+  protobuf_c_message_free_unpacked_ex (mess2, &test_allocator, flags);
+  assert (test_allocator_data.alloc_count == 0);
+
+  /* malformed unknown fields are still rejected */
+  assert (protobuf_c_message_unpack_ex (&foo_bounded_empty_descriptor, NULL,
+                                        flags, len - 1, data + 2) == NULL);
+  assert (protobuf_c_message_unpack_ex (&foo_speed_point_descriptor, NULL,
+                                        flags, len + 1, data) == NULL);
+  free (data);
+}
+
+static void
+test_unknown_fields_raw (void)
+{
+  foo_bounded_empty_t mess = FOO_BOUNDED_EMPTY_INIT;
+  ProtobufCMessage *mess2;
+  ProtobufCMessageUnknownField fields[3];
+  const unsigned flags = PROTOBUF_C_UNPACK_FLAG_RAW_UNKNOWN;
+  size_t len;
+  uint8_t *data, *data2;
+  unsigned i;
+
+  for (i = 0; i < N_ELEMENTS (fields); i++)
+    {
+      fields[i].tag = 3000 + i;
+      fields[i].wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+      fields[i].len = 1;
+      fields[i].data = (uint8_t *) "\7";
+    }
+  mess.base.n_unknown_fields = N_ELEMENTS (fields);
+  mess.base.unknown_fields = fields;
+  len = foo_bounded_empty_get_packed_size (&mess);
+  data = malloc (len);
+  data2 = malloc (len);
+  assert (foo_bounded_empty_pack (&mess, data) == len);
+
+  /* all fields end up in one run, which packs back unchanged */
+  mess2 = protobuf_c_message_unpack_ex (&foo_bounded_empty_descriptor,
+                                        NULL, flags, len, data);
+  assert (mess2 != NULL);
+  assert (mess2->n_unknown_fields == 1);
+  assert (mess2->unknown_fields[0].tag == 0);
+  assert (mess2->unknown_fields[0].len == len);
+  assert (protobuf_c_message_get_packed_size (mess2) == len);
+  assert (protobuf_c_message_pack (mess2, data2) == len);
+  assert (memcmp (data, data2, len) == 0);
+  protobuf_c_message_free_unpacked_ex (mess2, NULL, flags);
+
+  /* aliased, the run is the input itself */
+  mess2 = protobuf_c_message_unpack_ex (&foo_bounded_empty_descriptor, NULL,
+                                        flags | PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES,
+                                        len, data);
+  assert (mess2 != NULL);
+  assert (mess2->n_unknown_fields == 1);
+  assert (mess2->unknown_fields[0].data == data);
+  protobuf_c_message_free_unpacked_ex (mess2, NULL,
+                                       flags | PROTOBUF_C_UNPACK_FLAG_ALIAS_BYTES);
+  free (data);
+  free (data2);
+}
+
+static void
+check_field_lookups (const ProtobufCMessageDescriptor *desc)
+{
+  unsigned i;
+
+  for (i = 0; i < desc->n_fields; i++)
+    {
+      const ProtobufCFieldDescriptor *f = desc->fields + i;
+
+      assert (protobuf_c_message_descriptor_get_field (desc, f->id) == f);
+      assert (protobuf_c_message_descriptor_get_field_by_name (desc, f->name)
+              == f);
+      /* ids between fields are not found */
+      if (i + 1 < desc->n_fields && f[1].id > f->id + 1)
+        assert (protobuf_c_message_descriptor_get_field (desc, f->id + 1)
+                == NULL);
+    }
+  assert (protobuf_c_message_descriptor_get_field (desc, 0) == NULL);
+  if (desc->n_fields > 0)
+    assert (protobuf_c_message_descriptor_get_field (desc,
+              desc->fields[desc->n_fields - 1].id + 1) == NULL);
+}
+
+static void
+test_field_tag_index (void)
+{
+  /* counters (300), blob (4), sensor (1), v_double (5), samples (2) */
+  static const uint8_t shuffled[] = {
+    0xe0, 0x12, 0x09,
+    0x22, 0x02, 'x', 'y',
+    0x0a, 0x01, 's',
+    0x29, 0, 0, 0, 0, 0, 0, 0xf0, 0x3f,
+    0x12, 0x02, 0x03, 0x04
+  };
+  foo_bounded_reading_t *reading;
+
+  /* several field ranges, looked up through the field tag index */
+  assert (foo_speed_mess_descriptor.field_tag_index != NULL);
+  assert (foo_bounded_reading_descriptor.field_tag_index != NULL);
+  check_field_lookups (&foo_speed_mess_descriptor);
+  check_field_lookups (&foo_bounded_reading_descriptor);
+  check_field_lookups (&foo_speed_point_descriptor);
+  check_field_lookups (&foo_speed_long_tags_descriptor);
+  check_field_lookups (&foo_bounded_empty_descriptor);
+
+  /* fields out of order miss the predicted next field */
+  reading = foo_bounded_reading_unpack (NULL, sizeof (shuffled), shuffled);
+  assert (reading != NULL);
+  assert (reading->n_counters == 1 && reading->counters[0] == 9);
+  assert (reading->has_blob && reading->blob.len == 2);
+  assert (strcmp (reading->sensor, "s") == 0);
+  assert (reading->value_case == FOO_BOUNDED_READING_VALUE_V_DOUBLE);
+  assert (reading->v_double == 1.0);
+  assert (reading->n_samples == 2);
+  assert (reading->samples[0] == -2 && reading->samples[1] == 2);
+  foo_bounded_reading_free_unpacked (reading, NULL);
+}
+
+static void
+test_packed_varints (size_t n, uint64_t *values, int32_t *values32)
+{
+  foo_packed_varints_t mess = FOO_PACKED_VARINTS_INIT;
+  foo_packed_varints_t *mess2;
+  size_t len;
+  uint8_t *data;
+  unsigned i;
+
+  mess.n_r_uint64 = n;
+  mess.r_uint64 = values;
+  mess.n_r_int32 = n;
+  mess.r_int32 = values32;
+  mess2 = test_compare_pack_methods (&mess.base, &len, &data);
+  assert (mess2->n_r_uint64 == n);
+  assert (mess2->n_r_int32 == n);
+  for (i = 0; i < n; i++)
+    {
+      assert (mess2->r_uint64[i] == values[i]);
+      assert (mess2->r_int32[i] == values32[i]);
+    }
+  free (data);
+  foo_packed_varints_free_unpacked (mess2, NULL);
+}
+
+/* varints of every length, at every offset relative to the end of the data,
+   and arrays long enough to be decoded without being counted first */
+static void
+test_packed_repeated_varint_lengths (void)
+{
+  static uint64_t values[2048];
+  static int32_t values32[2048];
+  unsigned i, n;
+
+  for (i = 0; i < N_ELEMENTS (values); i++)
+    {
+      unsigned bits = (i * 7) % 70;
+      values[i] = bits >= 64 ? UINT64_MAX - i : (((uint64_t) 1 << bits) - 1) ^ i;
+      values32[i] = (int32_t) values[i];
+    }
+  for (n = 0; n <= 64; n++)
+    test_packed_varints (n, values, values32);
+  test_packed_varints (N_ELEMENTS (values), values, values32);
+}
+
+/* packed varint fields on either side of the lengths that are decoded
+   without being counted first */
+static void
+test_packed_varints_fused (void)
+{
+  /* one-byte varints, so the field is as long as the element count */
+  static const size_t lengths[] = { 4095, 4096, 65536, 65537 };
+  foo_packed_varints_t mess = FOO_PACKED_VARINTS_INIT;
+  foo_packed_varints_t *mess2;
+  ProtobufCIoVec iov[2];
+  uint64_t *values;
+  int32_t *values32;
+  uint8_t *packed;
+  size_t len, n;
+  unsigned i, k;
+
+  values = malloc (65537 * sizeof (*values));
+  values32 = malloc (65537 * sizeof (*values32));
+  for (i = 0; i < 65537; i++)
+    {
+      values[i] = i % 128;
+      values32[i] = (int32_t) (i % 128);
+    }
+  for (k = 0; k < N_ELEMENTS (lengths); k++)
+    {
+      n = lengths[k];
+      mess.n_r_uint64 = n;
+      mess.r_uint64 = values;
+      mess.n_r_int32 = n;
+      mess.r_int32 = values32;
+      len = foo_packed_varints_get_packed_size (&mess);
+      assert (len == 2 * (n + 1 + (n < 16384 ? 2 : 3)));
+      packed = malloc (len);
+      assert (foo_packed_varints_pack (&mess, packed) == len);
+
+      /* in one piece, with a contiguous payload, and in two pieces */
+      for (i = 0; i < 3; i++)
+        {
+          const unsigned flags =
+            i == 1 ? PROTOBUF_C_UNPACK_FLAG_CONTIGUOUS : 0;
+
+          if (i < 2)
+            mess2 = (foo_packed_varints_t *)
+              protobuf_c_message_unpack_ex (&foo_packed_varints_descriptor,
+                                            NULL, flags, len, packed);
+          else
+            {
+              iov[0].base = packed;
+              iov[0].len = len / 2;
+              iov[1].base = packed + len / 2;
+              iov[1].len = len - len / 2;
+              mess2 = (foo_packed_varints_t *)
+                protobuf_c_message_unpack_iovec (
+                  &foo_packed_varints_descriptor, NULL, 2, iov);
+            }
+          assert (mess2 != NULL);
+          assert (mess2->n_r_uint64 == n && mess2->n_r_int32 == n);
+          assert (memcmp (mess2->r_uint64, values,
+                          n * sizeof (*values)) == 0);
+          assert (memcmp (mess2->r_int32, values32,
+                          n * sizeof (*values32)) == 0);
+          protobuf_c_message_free_unpacked_ex (&mess2->base, NULL, flags);
+        }
+      free (packed);
+    }
+
+  /* ten-byte varints take a tenth of the array sized for the field */
+  for (i = 0; i < 6000; i++)
+    values[i] = UINT64_MAX - i;
+  mess.n_r_uint64 = 6000;
+  mess.n_r_int32 = 0;
+  mess2 = test_compare_pack_methods (&mess.base, &len, &packed);
+  assert (mess2->n_r_uint64 == 6000);
+  assert (memcmp (mess2->r_uint64, values, 6000 * sizeof (*values)) == 0);
+  foo_packed_varints_free_unpacked (mess2, NULL);
+  free (packed);
+
+  free (values);
+  free (values32);
+}
+
+static void
+test_cached_packed_sizes (void)
+{
+  static char big[300];
+  foo_speed_point_t point0 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t point1 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[3] = { &point0, &point1, &point0 };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  ProtobufCSizeCache cache = PROTOBUF_C_SIZE_CACHE_INIT (NULL);
+  uint8_t scratch[16];
+  uint8_t *packed, *packed2;
+  size_t len;
+  unsigned i;
+
+  /* a submessage long enough to need a two-byte length prefix */
+  memset (big, 'b', sizeof (big) - 1);
+  point0.label = big;
+  point1.x = 42;
+  mess.name = "cached";
+  mess.o_point = &point1;
+  mess.n_r_point = 3;
+  mess.r_point = points;
+  mess.choice_case = FOO_SPEED_MESS_CHOICE_C_POINT;
+  mess.c_point = &point0;
+
+  len = foo_speed_mess_get_packed_size (&mess);
+  packed = malloc (len);
+  packed2 = malloc (len);
+  assert (foo_speed_mess_pack (&mess, packed) == len);
+
+  /* the message itself and each of its 5 submessages */
+  assert (protobuf_c_message_get_packed_size_cached (&mess.base,
+                                                     &cache) == len);
+  assert (cache.n_sizes == 6);
+  assert (cache.sizes[0] == len);
+
+  /* size once, pack many times */
+  for (i = 0; i < 2; i++)
+    {
+      ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+
+      memset (packed2, 0, len);
+      assert (protobuf_c_message_pack_cached (&mess.base, &cache,
+                                              packed2) == len);
+      assert (memcmp (packed, packed2, len) == 0);
+
+      assert (protobuf_c_message_pack_to_buffer_cached (&mess.base, &cache,
+                                                        &bs.base) == len);
+      assert (bs.len == len);
+      assert (memcmp (packed, bs.data, len) == 0);
+      PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+    }
+
+  /* an empty cache packs like the uncached functions */
+  protobuf_c_size_cache_clear (&cache);
+  assert (cache.n_sizes == 0 && cache.sizes == NULL);
+  memset (packed2, 0, len);
+  assert (protobuf_c_message_pack_cached (&mess.base, &cache, packed2) == len);
+  assert (memcmp (packed, packed2, len) == 0);
+
+  free (packed);
+  free (packed2);
+}
+
+static void
+test_pack_reverse (void)
+{
+  static char big[300];
+  foo_speed_point_t point0 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t point1 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[2] = { &point0, &point1 };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  foo_bounded_point_t req = FOO_BOUNDED_POINT_INIT;
+  ProtobufCReverseBuffer rb;
+  uint8_t scratch[16];
+  uint8_t *packed, *packed2;
+  size_t len, req_len;
+
+  /* a submessage long enough to need a two-byte length prefix */
+  memset (big, 'b', sizeof (big) - 1);
+  point0.label = big;
+  point1.x = 42;
+  mess.name = "reversed";
+  mess.n_r_point = 2;
+  mess.r_point = points;
+  req.x = 1000;
+  req.y = -1000;
+
+  len = foo_speed_mess_get_packed_size (&mess);
+  packed = malloc (len);
+  packed2 = malloc (len + 8);
+  assert (foo_speed_mess_pack (&mess, packed) == len);
+
+  /* the message ends at the end of the buffer */
+  assert (protobuf_c_message_pack_reverse (&mess.base, len + 8,
+                                           packed2) == len);
+  assert (memcmp (packed, packed2 + 8, len) == 0);
+
+  /* a buffer that is too small still yields the full size */
+  assert (protobuf_c_message_pack_reverse (&mess.base, len - 1,
+                                           packed2) == len);
+  assert (protobuf_c_message_pack_reverse (&mess.base, 0, NULL) == len);
+
+  /* messages are prepended, across as many blocks as needed */
+  protobuf_c_reverse_buffer_init (&rb, scratch, sizeof (scratch), NULL);
+  assert (protobuf_c_message_pack_to_reverse_buffer (&mess.base, &rb));
+  assert (protobuf_c_message_pack_to_reverse_buffer (&req.base, &rb));
+  req_len = foo_bounded_point_get_packed_size (&req);
+  assert (rb.len == req_len + len);
+  {
+    ProtobufCBufferSimple bs = PROTOBUF_C_BUFFER_SIMPLE_INIT (scratch);
+
+    assert (protobuf_c_reverse_buffer_to_buffer (&rb, &bs.base) == rb.len);
+    assert (bs.len == rb.len);
+    assert (memcmp (bs.data + req_len, packed, len) == 0);
+    PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&bs);
+  }
+  protobuf_c_reverse_buffer_clear (&rb);
+  assert (rb.len == 0 && rb.blocks == NULL);
+
+  free (packed);
+  free (packed2);
+}
+
+static void
+test_buffer_direct (void)
+{
+  static int64_t trail[] = { -1, 0, INT64_MAX };
+  static float floats[] = { 1.5f, -2.25f };
+  static char *strings[] = { "a", "", "bcd" };
+  static uint8_t blob[1000];
+  ProtobufCMessageUnknownField unknown;
+  TestBufferDirect direct = {
+    PROTOBUF_C_BUFFER_DIRECT_INIT (test_buffer_direct_reserve,
+                                   test_buffer_direct_commit),
+    NULL, 0, 0, 0, 0
+  };
+  foo_speed_point_t point = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[1] = { &point };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  uint8_t *packed;
+  size_t len;
+
+  point.x = -5;
+  point.n_trail = N_ELEMENTS (trail);
+  point.trail = trail;
+  mess.id = 42;
+  mess.name = "name";
+  mess.has_o_fixed32 = 1;
+  mess.o_fixed32 = 0xdeadbeef;
+  mess.has_o_bytes = 1;
+  mess.o_bytes.len = sizeof (blob);
+  mess.o_bytes.data = blob;
+  mess.o_point = &point;
+  mess.n_r_float = N_ELEMENTS (floats);
+  mess.r_float = floats;
+  mess.n_r_string = N_ELEMENTS (strings);
+  mess.r_string = strings;
+  mess.n_r_point = 1;
+  mess.r_point = points;
+  unknown.tag = 5000;
+  unknown.wire_type = PROTOBUF_C_WIRE_TYPE_VARINT;
+  unknown.len = 1;
+  unknown.data = (uint8_t *) "\7";
+  mess.base.n_unknown_fields = 1;
+  mess.base.unknown_fields = &unknown;
+
+  len = foo_speed_mess_get_packed_size (&mess);
+  packed = malloc (len);
+  assert (foo_speed_mess_pack (&mess, packed) == len);
+
+  /* every field is packed straight into room reserved for it */
+  assert (protobuf_c_message_pack_to_buffer (&mess.base,
+                                             &direct.base.base) == len);
+  assert (!direct.base.failed);
+  assert (direct.len == len);
+  assert (direct.n_reserves > 1);
+  assert (memcmp (direct.data, packed, len) == 0);
+  free (direct.data);
+  free (packed);
+}
+
+static void
+test_segmented_buffer (void)
+{
+  static uint8_t big[10000];
+  static char *after[] = { "after the bytes" };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  ProtobufCBufferSegmented seg;
+  ProtobufCIoVec iov[8];
+  uint8_t *packed, *flat;
+  size_t len, n, off, i;
+  unsigned referenced;
+
+  for (i = 0; i < sizeof (big); i++)
+    big[i] = i;
+  mess.id = 1;
+  mess.name = "before the bytes";
+  mess.has_o_bytes = 1;
+  mess.o_bytes.len = sizeof (big);
+  mess.o_bytes.data = big;
+  mess.n_r_string = 1;
+  mess.r_string = after;
+
+  len = foo_speed_mess_get_packed_size (&mess);
+  packed = malloc (len);
+  assert (foo_speed_mess_pack (&mess, packed) == len);
+
+  /* the large field doesn't fit the first segment and gets its own */
+  protobuf_c_buffer_segmented_init (&seg, NULL);
+  assert (protobuf_c_message_pack_to_buffer (&mess.base,
+                                             &seg.base.base) == len);
+  assert (seg.len == len);
+  n = protobuf_c_buffer_segmented_get_iovec (&seg, NULL, 0);
+  assert (n == seg.n_segments);
+  assert (n > 1 && n <= 8);
+
+  /* the segments hold the packed message in order */
+  assert (protobuf_c_buffer_segmented_get_iovec (&seg, iov, 8) == n);
+  off = 0;
+  for (i = 0; i < n; i++)
+    {
+      assert (memcmp (packed + off, iov[i].base, iov[i].len) == 0);
+      off += iov[i].len;
+    }
+  assert (off == len);
+
+  protobuf_c_buffer_segmented_clear (&seg);
+  assert (seg.len == 0 && seg.n_segments == 0);
+
+  /* above the threshold, the bytes are referenced rather than copied */
+  seg.ref_threshold = 1000;
+  assert (protobuf_c_message_pack_to_buffer (&mess.base,
+                                             &seg.base.base) == len);
+  assert (seg.len == len);
+  n = protobuf_c_buffer_segmented_get_iovec (&seg, iov, 8);
+  assert (n <= 8);
+  off = 0;
+  referenced = 0;
+  for (i = 0; i < n; i++)
+    {
+      if (iov[i].base == big && iov[i].len == sizeof (big))
+        referenced++;
+      assert (memcmp (packed + off, iov[i].base, iov[i].len) == 0);
+      off += iov[i].len;
+    }
+  assert (referenced == 1);
+  assert (off == len);
+
+  /* flattening copies the referenced bytes back in place */
+  flat = malloc (len);
+  assert (protobuf_c_buffer_segmented_flatten (&seg, flat) == len);
+  assert (memcmp (flat, packed, len) == 0);
+  protobuf_c_buffer_segmented_clear (&seg);
+  free (flat);
+  free (packed);
+}
+
+static void
+test_pack_state (void)
+{
+  static const size_t chunk_sizes[] = { 1, 7, 64, 100000 };
+  static char label[301];
+  static int32_t values[100];
+  static int64_t trail[100];
+  foo_speed_point_t point0 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t point1 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[2] = { &point0, &point1 };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  ProtobufCPackState state;
+  uint8_t *packed, *packed2;
+  size_t len, off, n;
+  unsigned i;
+
+  memset (label, 'x', sizeof (label) - 1);
+  for (i = 0; i < 100; i++)
+    {
+      values[i] = (int32_t) (i * 100000) - 5000000;
+      trail[i] = (int64_t) i * -123456789;
+    }
+  point0.label = label;
+  point0.n_trail = 100;
+  point0.trail = trail;
+  point1.x = 42;
+  mess.id = 1;
+  mess.name = "pack state";
+  mess.n_r_point = 2;
+  mess.r_point = points;
+  mess.n_r_int32 = 100;
+  mess.r_int32 = values;
+
+  len = foo_speed_mess_get_packed_size (&mess);
+  packed = malloc (len);
+  packed2 = malloc (len);
+  assert (foo_speed_mess_pack (&mess, packed) == len);
+
+  /* strings, repeated fields and submessages resume where they stopped */
+  for (i = 0; i < N_ELEMENTS (chunk_sizes); i++)
+    {
+      memset (packed2, 0, len);
+      assert (protobuf_c_pack_state_init (&state, &mess.base, NULL));
+      assert (state.len == len);
+      off = 0;
+      do
+        {
+          n = len - off < chunk_sizes[i] ? len - off : chunk_sizes[i];
+          n = protobuf_c_pack_state_pack (&state, n, packed2 + off);
+          off += n;
+        }
+      while (n != 0);
+      assert (off == len);
+      assert (!state.failed && state.n_written == len);
+      assert (memcmp (packed, packed2, len) == 0);
+      protobuf_c_pack_state_clear (&state);
+    }
+
+  free (packed);
+  free (packed2);
+}
+
+static void
+test_unpack_state (void)
+{
+  static const size_t chunk_sizes[] = { 1, 7, 64, 100000 };
+  static uint8_t big[300];
+  static int64_t trail[100];
+  static float floats[3] = { 1.5f, -2.25f, 1e30f };
+  static char *strings[1] = { "a string" };
+  static uint64_t wide[100];
+  static int32_t narrow[3] = { -1, 0, INT32_MAX };
+  foo_speed_point_t point0 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t point1 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[2] = { &point0, &point1 };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  foo_packed_varints_t varints = FOO_PACKED_VARINTS_INIT;
+  ProtobufCMessage *messages[2];
+  ProtobufCUnpackState state;
+  ProtobufCMessage *msg;
+  uint8_t *packed, *packed2;
+  size_t len, off, n;
+  unsigned i, j;
+
+  for (i = 0; i < 100; i++)
+    {
+      trail[i] = (int64_t) i * 100000 - 5000000;
+      wide[i] = (uint64_t) 1 << (i % 64);
+    }
+  point0.label = "first point";
+  point0.n_trail = 100;
+  point0.trail = trail;
+  point1.x = 42;
+  mess.id = 1;
+  mess.name = "unpack state";
+  mess.has_o_bytes = 1;
+  mess.o_bytes.len = sizeof (big);
+  mess.o_bytes.data = big;
+  mess.n_r_point = 2;
+  mess.r_point = points;
+  mess.n_r_string = 1;
+  mess.r_string = strings;
+  mess.n_r_float = 3;
+  mess.r_float = floats;
+  varints.n_r_uint64 = 100;
+  varints.r_uint64 = wide;
+  varints.n_r_int32 = 3;
+  varints.r_int32 = narrow;
+  messages[0] = &mess.base;
+  messages[1] = &varints.base;
+
+  for (j = 0; j < 2; j++)
+    {
+      len = protobuf_c_message_get_packed_size (messages[j]);
+      packed = malloc (len);
+      packed2 = malloc (len);
+      assert (protobuf_c_message_pack (messages[j], packed) == len);
+
+      /* fields cut off anywhere are completed by the next piece */
+      for (i = 0; i < N_ELEMENTS (chunk_sizes); i++)
+        {
+          assert (protobuf_c_unpack_state_init (&state,
+                                                messages[j]->descriptor,
+                                                NULL));
+          for (off = 0; off < len; off += n)
+            {
+              n = len - off < chunk_sizes[i] ? len - off : chunk_sizes[i];
+              assert (protobuf_c_unpack_state_feed (&state, n, packed + off));
+            }
+          assert (state.len == len);
+          msg = protobuf_c_unpack_state_finish (&state);
+          assert (msg != NULL);
+          protobuf_c_unpack_state_clear (&state);
+          assert (protobuf_c_message_pack (msg, packed2) == len);
+          assert (memcmp (packed, packed2, len) == 0);
+          protobuf_c_message_free_unpacked (msg, NULL);
+        }
+
+      /* a message cut off in the middle of a field is rejected */
+      assert (protobuf_c_unpack_state_init (&state, messages[j]->descriptor,
+                                            NULL));
+      assert (protobuf_c_unpack_state_feed (&state, len - 1, packed));
+      assert (protobuf_c_unpack_state_finish (&state) == NULL);
+      assert (state.failed);
+      protobuf_c_unpack_state_clear (&state);
+
+      free (packed);
+      free (packed2);
+    }
+}
+
+static void
+test_unpack_iovec (void)
+{
+  static uint8_t big[300];
+  static int64_t trail[100];
+  static char *strings[1] = { "a string" };
+  static uint64_t wide[100];
+  foo_speed_point_t point0 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t point1 = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[2] = { &point0, &point1 };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  foo_packed_varints_t varints = FOO_PACKED_VARINTS_INIT;
+  ProtobufCMessage *messages[2];
+  ProtobufCBufferSegmented seg;
+  ProtobufCIoVec iov[16];
+  ProtobufCMessage *msg;
+  uint8_t *packed, *packed2;
+  size_t len, off, n;
+  unsigned i, j;
+
+  for (i = 0; i < 100; i++)
+    {
+      trail[i] = (int64_t) i * 100000 - 5000000;
+      wide[i] = (uint64_t) 1 << (i % 64);
+    }
+  point0.label = "first point";
+  point0.n_trail = 100;
+  point0.trail = trail;
+  point1.x = 42;
+  mess.id = 1;
+  mess.name = "unpack iovec";
+  mess.has_o_bytes = 1;
+  mess.o_bytes.len = sizeof (big);
+  mess.o_bytes.data = big;
+  mess.n_r_point = 2;
+  mess.r_point = points;
+  mess.n_r_string = 1;
+  mess.r_string = strings;
+  varints.n_r_uint64 = 100;
+  varints.r_uint64 = wide;
+  messages[0] = &mess.base;
+  messages[1] = &varints.base;
+
+  for (j = 0; j < 2; j++)
+    {
+      len = protobuf_c_message_get_packed_size (messages[j]);
+      packed = malloc (len);
+      packed2 = malloc (len);
+      assert (protobuf_c_message_pack (messages[j], packed) == len);
+
+      /* a cut anywhere, with an empty segment in between */
+      for (off = 0; off <= len; off++)
+        {
+          iov[0].len = off;
+          iov[0].base = packed;
+          iov[1].len = 0;
+          iov[1].base = NULL;
+          iov[2].len = len - off;
+          iov[2].base = packed + off;
+          msg = protobuf_c_message_unpack_iovec (messages[j]->descriptor,
+                                                 NULL, 3, iov);
+          assert (msg != NULL);
+          assert (protobuf_c_message_pack (msg, packed2) == len);
+          assert (memcmp (packed, packed2, len) == 0);
+          protobuf_c_message_free_unpacked (msg, NULL);
+
+          /* and with the last byte missing */
+          if (off < len)
+            {
+              iov[2].len--;
+              assert (protobuf_c_message_unpack_iovec (messages[j]->descriptor,
+                                                       NULL, 3, iov) == NULL);
+            }
+        }
+
+      /* the segments of a buffer, some of them referencing the message */
+      protobuf_c_buffer_segmented_init (&seg, NULL);
+      seg.ref_threshold = 100;
+      assert (protobuf_c_message_pack_to_buffer (messages[j], &seg.base.base)
+              == len);
+      n = protobuf_c_buffer_segmented_get_iovec (&seg, iov, 16);
+      assert (n <= 16);
+      msg = protobuf_c_message_unpack_iovec (messages[j]->descriptor,
+                                             NULL, n, iov);
+      assert (msg != NULL);
+      assert (protobuf_c_message_pack (msg, packed2) == len);
+      assert (memcmp (packed, packed2, len) == 0);
+      protobuf_c_message_free_unpacked (msg, NULL);
+      protobuf_c_buffer_segmented_clear (&seg);
+
+      free (packed);
+      free (packed2);
+    }
+}
+
+/* ProtobufCWriteFunc appending to a ProtobufCBufferSimple */
+static protobuf_c_boolean
+write_to_simple (size_t len, const uint8_t *data, void *closure_data)
+{
+  ProtobufCBufferSimple *simple = closure_data;
+
+  simple->base.append (&simple->base, len, data);
+  return 1;
+}
+
+typedef struct
+{
+  const uint8_t *data;
+  size_t len;
+} TrickleSource;
+
+/* ProtobufCReadFunc returning at most 3 bytes at a time */
+static size_t
+read_trickle (size_t len, uint8_t *data, void *closure_data)
+{
+  TrickleSource *source = closure_data;
+
+  if (len > source->len)
+    len = source->len;
+  if (len > 3)
+    len = 3;
+  memcpy (data, source->data, len);
+  source->data += len;
+  source->len -= len;
+  return len;
+}
+
+static void
+test_message_stream (void)
+{
+  static char big[100001];
+  foo_speed_point_t point = FOO_SPEED_POINT_INIT;
+  foo_speed_point_t *points[1] = { &point };
+  foo_speed_mess_t mess = FOO_SPEED_MESS_INIT;
+  foo_speed_mess_t into = FOO_SPEED_MESS_INIT;
+  uint8_t pad[16];
+  ProtobufCBufferSimple expected = PROTOBUF_C_BUFFER_SIMPLE_INIT (pad);
+  ProtobufCBufferSimple written = PROTOBUF_C_BUFFER_SIMPLE_INIT (pad);
+  ProtobufCMessageWriter writer;
+  ProtobufCMessageReader reader;
+  TrickleSource source;
+  ProtobufCMessage *msg;
+  uint8_t *packed;
+  size_t len, total = 0;
+  unsigned i;
+
+  /* the fifth record is larger than the writer's buffer */
+  memset (big, 'x', sizeof (big) - 1);
+  point.label = big;
+  mess.id = 1;
+  mess.name = "a string";
+  protobuf_c_message_writer_init (&writer, write_to_simple, &written, NULL);
+  for (i = 0; i < 8; i++)
+    {
+      mess.n_r_point = i == 4;
+      mess.r_point = points;
+      total += protobuf_c_message_pack_delimited_to_buffer (&mess.base,
+                                                            &expected.base);
+      assert (protobuf_c_message_writer_write (&writer, &mess.base));
+    }
+  assert (protobuf_c_message_writer_flush (&writer));
+  protobuf_c_message_writer_clear (&writer);
+  assert (total == expected.len);
+  assert (written.len == expected.len);
+  assert (memcmp (written.data, expected.data, expected.len) == 0);
+
+  /* records read a few bytes at a time */
+  source.data = expected.data;
+  source.len = expected.len;
+  protobuf_c_message_reader_init (&reader, read_trickle, &source, NULL);
+  packed = malloc (expected.len);
+  for (i = 0; (msg = protobuf_c_message_reader_next (&reader,
+                                                     &foo_speed_mess_descriptor,
+                                                     NULL)) != NULL; i++)
+    {
+      mess.n_r_point = i == 4;
+      len = protobuf_c_message_pack (msg, packed);
+      assert (len == foo_speed_mess_get_packed_size (&mess));
+      protobuf_c_message_free_unpacked (msg, NULL);
+    }
+  assert (i == 8 && !reader.failed);
+  protobuf_c_message_reader_clear (&reader);
+
+  /* the same records unpacked into one message, from memory */
+  protobuf_c_message_reader_init_memory (&reader, expected.len, expected.data);
+  for (i = 0; protobuf_c_message_reader_next_into (&reader, &into.base, NULL);
+       i++)
+    assert (into.n_r_point == (i == 4));
+  assert (i == 8 && !reader.failed);
+  protobuf_c_message_clear (&into.base, NULL);
+  protobuf_c_message_reader_clear (&reader);
+
+  /* a truncated last record is an error */
+  protobuf_c_message_reader_init_memory (&reader, expected.len - 1,
+                                         expected.data);
+  for (i = 0; (msg = protobuf_c_message_reader_next (&reader,
+                                                     &foo_speed_mess_descriptor,
+                                                     NULL)) != NULL; i++)
+    protobuf_c_message_free_unpacked (msg, NULL);
+  assert (i == 7 && reader.failed);
+  protobuf_c_message_reader_clear (&reader);
+
+  free (packed);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&expected);
+  PROTOBUF_C_BUFFER_SIMPLE_CLEAR (&written);
+}
+
+/* === simple testing framework === */
+
+typedef void (*TestFunc) (void);
+
+typedef struct {
+  const char *name;
+  TestFunc func;
+} Test;
+
+static Test tests[] =
+{
+  { "test generated decoder", test_generated_decoder },
+  { "test generated encoder", test_generated_encoder },
+  { "test field tag bytes", test_field_tag_bytes },
+  { "test field hot table", test_field_hot_table },
+  { "test maximum packed size", test_max_packed_size },
+  { "test raw unknown fields with aliased strings", test_raw_unknown_alias_strings },
+  { "test direct buffer failure", test_buffer_direct_failure },
+  { "test unpack state with a truncated packed field", test_unpack_state_truncated_packed },
+  { "test unpack with a huge length prefix", test_unpack_huge_length_prefix },
+  { "test merge with an absent oneof", test_merge_absent_oneof },
+  { "test message reader read error", test_message_reader_read_error },
+  { "test arena allocator", test_alloc_arena },
+  { "test unpack aliasing the input", test_alloc_alias_input },
+  { "test many unknown fields", test_unknown_fields_many },
+  { "test contiguous payload allocation", test_alloc_contiguous },
+  { "test unpack into a reused message", test_alloc_unpack_into },
+  { "test discarding unknown fields", test_unknown_fields_discard },
+  { "test raw unknown field runs", test_unknown_fields_raw },
+  { "test field tag index", test_field_tag_index },
+  { "test packed repeated varint lengths", test_packed_repeated_varint_lengths },
+  { "test packed varints decoded in one pass", test_packed_varints_fused },
+  { "test cached packed sizes", test_cached_packed_sizes },
+  { "test reverse packing", test_pack_reverse },
+  { "test direct buffer", test_buffer_direct },
+  { "test segmented buffer", test_segmented_buffer },
+  { "test pack state", test_pack_state },
+  { "test unpack state", test_unpack_state },
+  { "test unpack iovec", test_unpack_iovec },
+  { "test message stream", test_message_stream },
+};
+#define n_tests (sizeof(tests)/sizeof(Test))
+
+int main ()
+{
+  unsigned i;
+  for (i = 0; i < n_tests; i++)
+    {
+      fprintf (stderr, "Test: %s... ", tests[i].name);
+      tests[i].func ();
+      fprintf (stderr, " done.\n");
+    }
+  return 0;
+}